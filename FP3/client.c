@@ -1,12 +1,30 @@
 #include "common.h"
+#include <poll.h>
 
 // Global variables
 char username[MAX_USERNAME];
 int nm_socket = -1;
 static char nm_host_ip[INET_ADDRSTRLEN] = "127.0.0.1";
 static int nm_host_port = PORT_NM;
+static NmAddrList nm_addrs;   // the NM above, NM_ADDRS and the standbys it names
+static int home_socket = -1;  // connection to that NM; nm_socket is where the next request goes
+
+// Namespace shards (OP_SHARD_MAP from the NM above, cached for the session): a path's
+// requests go to the Name Server of shard_of(path); listings and searches ask them all
+typedef struct {
+    NmAddrList addrs;
+    int sock;
+} ClientShard;
+static ClientShard shards[MAX_NM_SHARDS];
+static int shard_count = 1;
+static int home_shard = 0;
 
 // Function prototypes
+static void nm_check_connection();
+static void load_shard_map();
+static void nm_use_shard(int shard);
+static void nm_route(const char* path);
+static int view_shard(const char* pattern);
 void connect_to_nm();
 void register_with_nm();
 void handle_view_command(char* command);
@@ -22,12 +40,19 @@ void handle_remaccess_command(char* command);
 void handle_exec_command(char* command);
 void handle_undo_command(char* command);
 int connect_to_ss(const char* ss_ip, int ss_port);
+static int renew_sentence_lock(const char* ss_ip, int ss_port, const char* filename, int sentence_number);
 
 // Bonus command handlers (prototypes)
 void handle_createfolder_command(char* command);
 void handle_viewfolder_command(char* command);
 void handle_move_command(char* command);
 void handle_recents_command();
+void handle_search_command(char* command);
+void handle_cluster_command();
+void handle_migrate_command(char* command);
+void handle_drain_command(char* command, int on);
+void handle_batch_command(char* command);
+void handle_pipe_command(char* command);
 void handle_reqaccess_command(char* command);
 void handle_viewrequests_command(char* command);
 void handle_approve_command(char* command);
@@ -50,6 +75,8 @@ int main(int argc, char* argv[]) {
         nm_host_port = atoi(argv[2]);
         if (nm_host_port <= 0) nm_host_port = PORT_NM;
     }
+    nm_addrs_add(&nm_addrs, nm_host_ip, nm_host_port);
+    nm_addrs_parse(&nm_addrs, getenv("NM_ADDRS"));
     
     // Get username
     printf("Enter your username: ");
@@ -65,11 +92,12 @@ int main(int argc, char* argv[]) {
     // Connect and register with Name Server
     connect_to_nm();
     register_with_nm();
+    load_shard_map();
     
     printf("\nName Server: %s:%d\n", nm_host_ip, nm_host_port);
     printf("\nAvailable commands:\n");
-    printf("  VIEW [-a] [-l] [-al]\n");
-    printf("  READ <filename>\n");
+    printf("  VIEW [-a] [-l] [-al] [prefix|glob]\n");
+    printf("  READ [-r] <filename>\n");
     printf("  CREATE <filename>\n");
     printf("  CREATEFOLDER <folder>\n");
     printf("  WRITE <filename> <sentence_number>\n");
@@ -88,6 +116,13 @@ int main(int argc, char* argv[]) {
     printf("  APPROVE [-W] <filename> <username>\n");
     printf("  DENY <filename> <username>\n");
     printf("  RECENTS\n");
+    printf("  SEARCH <words>\n");
+    printf("  CLUSTER\n");
+    printf("  MIGRATE <filename> <ss_id>\n");
+    printf("  DRAIN <ss_id>\n");
+    printf("  UNDRAIN <ss_id>\n");
+    printf("  BATCH <localfile>\n");
+    printf("  PIPE <localfile>\n");
     printf("  CHECKPOINT <filename> <tag>\n");
     printf("  VIEWCHECKPOINT <filename> <tag>\n");
     printf("  LISTCHECKPOINTS <filename>\n");
@@ -110,6 +145,7 @@ int main(int argc, char* argv[]) {
         if (strlen(command) == 0) {
             continue;
         }
+        nm_check_connection();
         
         // Tokenize first word for precise matching
         char cmd_copy[MAX_COMMAND]; strncpy(cmd_copy, command, sizeof(cmd_copy)-1); cmd_copy[sizeof(cmd_copy)-1]='\0';
@@ -151,6 +187,20 @@ int main(int argc, char* argv[]) {
             handle_deny_command(command);
         } else if (strcasecmp(first, "RECENTS") == 0) {
             handle_recents_command();
+        } else if (strcasecmp(first, "SEARCH") == 0) {
+            handle_search_command(command);
+        } else if (strcasecmp(first, "CLUSTER") == 0) {
+            handle_cluster_command();
+        } else if (strcasecmp(first, "MIGRATE") == 0) {
+            handle_migrate_command(command);
+        } else if (strcasecmp(first, "DRAIN") == 0) {
+            handle_drain_command(command, 1);
+        } else if (strcasecmp(first, "UNDRAIN") == 0) {
+            handle_drain_command(command, 0);
+        } else if (strcasecmp(first, "BATCH") == 0) {
+            handle_batch_command(command);
+        } else if (strcasecmp(first, "PIPE") == 0) {
+            handle_pipe_command(command);
         } else if (strcasecmp(first, "CHECKPOINT") == 0) {
             handle_checkpoint_command(command);
         } else if (strcasecmp(first, "VIEWCHECKPOINT") == 0) {
@@ -173,35 +223,55 @@ int main(int argc, char* argv[]) {
         }
     }
     
-    if (nm_socket >= 0) {
-        close(nm_socket);
+    if (home_socket >= 0) {
+        close(home_socket);
+    }
+    for (int i = 0; i < shard_count; i++) {
+        if (i != home_shard && shards[i].sock >= 0) close(shards[i].sock);
     }
     
     return 0;
 }
 
 void connect_to_nm() {
-    nm_socket = create_socket();
+    nm_socket = nm_connect(&nm_addrs, 0);
     if (nm_socket < 0) {
-        fprintf(stderr, "Failed to create socket\n");
-        exit(EXIT_FAILURE);
-    }
-    
-    struct sockaddr_in nm_addr;
-    nm_addr.sin_family = AF_INET;
-    nm_addr.sin_port = htons(nm_host_port);
-    inet_pton(AF_INET, nm_host_ip, &nm_addr.sin_addr);
-    
-    if (connect(nm_socket, (struct sockaddr*)&nm_addr, sizeof(nm_addr)) < 0) {
         perror("Failed to connect to Name Server");
         fprintf(stderr, "Make sure the Name Server is running.\n");
         exit(EXIT_FAILURE);
     }
+    strcpy(nm_host_ip, nm_addrs.addrs[nm_addrs.current].ip);
+    nm_host_port = nm_addrs.addrs[nm_addrs.current].port;
+    home_socket = nm_socket;
     
     printf("Connected to Name Server.\n");
 }
 
-void register_with_nm() {
+// Before each command: if the NM has closed the connection (it stopped, or a standby is
+// taking over from it), connect to the first one on the list that answers and register again
+static void nm_check_connection() {
+    nm_socket = home_socket;
+    if (nm_socket >= 0) {
+        struct pollfd p = { nm_socket, POLLIN, 0 };
+        char c;
+        if (poll(&p, 1, 0) == 0 || recv(nm_socket, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0) return;
+        close(nm_socket);
+        nm_socket = -1;
+    }
+    printf("Lost the Name Server connection, reconnecting...\n");
+    nm_socket = home_socket = nm_connect(&nm_addrs, get_env_int("NM_RECONNECT_SEC", 15));
+    if (nm_socket < 0) {
+        fprintf(stderr, "No Name Server is answering.\n");
+        return;
+    }
+    strcpy(nm_host_ip, nm_addrs.addrs[nm_addrs.current].ip);
+    nm_host_port = nm_addrs.addrs[nm_addrs.current].port;
+    register_with_nm();
+    printf("Reconnected to Name Server %s:%d.\n", nm_host_ip, nm_host_port);
+}
+
+// Register over sock, adding the standbys the NM names to addrs
+static void register_on(int sock, NmAddrList* addrs) {
     Message msg;
     memset(&msg, 0, sizeof(Message));
     
@@ -210,24 +280,102 @@ void register_with_nm() {
     // For now, advertise placeholder client ports; NM doesn't open connections back to client in this design
     sprintf(msg.data, "%s %d %d", "0.0.0.0", PORT_CLIENT_BASE, PORT_CLIENT_BASE + 1);
     
-    if (send_message(nm_socket, &msg) < 0) {
+    if (send_message(sock, &msg) < 0) {
         fprintf(stderr, "Failed to send registration\n");
         exit(EXIT_FAILURE);
     }
     
-    if (receive_message(nm_socket, &msg) < 0) {
+    if (receive_message(sock, &msg) < 0) {
         fprintf(stderr, "Failed to receive registration response\n");
         exit(EXIT_FAILURE);
     }
     
     if (msg.error_code == ERR_SUCCESS) {
-        printf("Successfully registered with Name Server.\n");
+        nm_addrs_parse(addrs, msg.data);   // standbys to fall back on
     } else {
         fprintf(stderr, "Registration failed: %s\n", msg.error_msg);
         exit(EXIT_FAILURE);
     }
 }
 
+void register_with_nm() {
+    register_on(nm_socket, &nm_addrs);
+    printf("Successfully registered with Name Server.\n");
+}
+
+// Fetch the shard map once per session and register with every shard's Name Server up
+// front, so each one knows this user (ADDACCESS looks grantees up where the file lives).
+// An NM without shards (or without OP_SHARD_MAP) leaves the client talking to it alone.
+static void load_shard_map() {
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.op_code = OP_SHARD_MAP;
+    strcpy(msg.username, username);
+    if (send_message(nm_socket, &msg) < 0 || receive_message(nm_socket, &msg) <= 0 || msg.error_code != ERR_SUCCESS) return;
+    int n = 0, self = 0, used = 0;
+    if (sscanf(msg.data, "%d %d %n", &n, &self, &used) < 2 || n < 2) return;
+    NmAddrList list[MAX_NM_SHARDS];
+    if (shard_list_parse(list, msg.data + used) != n || self < 0 || self >= n) {
+        fprintf(stderr, "Ignoring a malformed shard map: %s\n", msg.data);
+        return;
+    }
+    shard_count = n;
+    home_shard = self;
+    for (int i = 0; i < n; i++) { shards[i].addrs = list[i]; shards[i].sock = -1; }
+    shards[home_shard].sock = home_socket;
+    for (int i = 0; i < n; i++) nm_use_shard(i);
+    nm_socket = home_socket;
+    printf("Namespace has %d shards; this Name Server is shard %d.\n", n, home_shard);
+}
+
+// Point nm_socket at a shard's Name Server, connecting and registering on first use or
+// after it went away
+static void nm_use_shard(int shard) {
+    if (shard_count <= 1 || shard == home_shard) { nm_socket = home_socket; return; }
+    ClientShard* sh = &shards[shard];
+    if (sh->sock >= 0) {
+        struct pollfd p = { sh->sock, POLLIN, 0 };
+        char c;
+        if (poll(&p, 1, 0) == 0 || recv(sh->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0) { nm_socket = sh->sock; return; }
+        close(sh->sock);
+    }
+    sh->sock = nm_connect(&sh->addrs, get_env_int("NM_RECONNECT_SEC", 15));
+    if (sh->sock >= 0) register_on(sh->sock, &sh->addrs);
+    else fprintf(stderr, "The Name Server of shard %d is not answering.\n", shard);
+    nm_socket = sh->sock;
+}
+
+// Send the next request to the shard that owns path
+static void nm_route(const char* path) {
+    nm_use_shard(shard_of(path, shard_count));
+}
+
+// The one shard a VIEW pattern can match in, or -1 when every shard must be asked: the
+// first path component has to be spelled out (no glob) and followed by a '/'
+static int view_shard(const char* pattern) {
+    const char* slash = strchr(pattern, '/');
+    if (shard_count <= 1) return home_shard;
+    if (slash == NULL || strcspn(pattern, "*?[") < (size_t)(slash - pattern)) return -1;
+    return shard_of(pattern, shard_count);
+}
+
+// Print a VIEW/VIEWFOLDER listing, asking for the next page while the NM marks it partial
+static void list_all_pages(Message* msg, const char* what) {
+    Message req = *msg;
+    while (1) {
+        send_message(nm_socket, msg);
+        if (receive_message(nm_socket, msg) <= 0) { print_error(ERR_CONNECTION_FAILED, what); return; }
+        if (msg->error_code != ERR_SUCCESS) { print_error(msg->error_code, what); return; }
+        printf("%s", msg->data);
+        if (!(msg->flags & FLAG_LIST_MORE)) return;
+        // Same request again, resuming after the cursor the NM handed back
+        char cursor[MAX_FILENAME];
+        strcpy(cursor, msg->filename);
+        *msg = req;
+        strcpy(msg->data, cursor);
+    }
+}
+
 void handle_view_command(char* command) {
     Message msg;
     memset(&msg, 0, sizeof(Message));
@@ -249,7 +397,10 @@ void handle_view_command(char* command) {
         token = strtok_r(NULL, " \t", &saveptr);
     }
     while (token != NULL) {
-        if (token[0] == '-') {
+        if (token[0] != '-') {
+            // Name prefix or glob, e.g. VIEW docs/ or VIEW docs/*.txt
+            strncpy(msg.filename, token, sizeof(msg.filename) - 1);
+        } else {
             for (size_t i = 1; token[i] != '\0'; i++) {
                 if (token[i] == 'a' || token[i] == 'A') {
                     msg.flags |= 1; // -a flag
@@ -262,20 +413,70 @@ void handle_view_command(char* command) {
         token = strtok_r(NULL, " \t", &saveptr);
     }
     
-    send_message(nm_socket, &msg);
-    receive_message(nm_socket, &msg);
+    int only = view_shard(msg.filename);
+    for (int i = 0; i < shard_count; i++) {
+        if (only >= 0 && i != only) continue;
+        Message req = msg;
+        nm_use_shard(i);
+        list_all_pages(&req, "VIEW");
+    }
+}
+
+// Fetch the whole file as a RawReadHeader and the raw bytes after it, with no Message size limit
+static void read_raw_from_ss(const char* ss_ip, int ss_port, const char* filename) {
+    int ss_sock = connect_to_ss(ss_ip, ss_port);
+    if (ss_sock < 0) {
+        fprintf(stderr, "Failed to connect to storage server\n");
+        return;
+    }
     
-    if (msg.error_code == ERR_SUCCESS) {
-        printf("%s", msg.data);
-    } else {
-        print_error(msg.error_code, "VIEW");
+    Message msg;
+    memset(&msg, 0, sizeof(Message));
+    msg.op_code = OP_READ;
+    msg.flags = FLAG_READ_RAW;
+    strcpy(msg.username, username);
+    strcpy(msg.filename, filename);
+    
+    send_message(ss_sock, &msg);
+    RawReadHeader hdr;
+    if (recv_all(ss_sock, &hdr, sizeof(hdr)) != 0) {
+        fprintf(stderr, "Failed to receive file from storage server\n");
+        close(ss_sock);
+        return;
+    }
+    
+    if (hdr.error_code != ERR_SUCCESS) {
+        print_error(hdr.error_code, "READ");
+        close(ss_sock);
+        return;
     }
+    
+    char buf[65536];
+    long long remaining = hdr.size;
+    while (remaining > 0) {
+        size_t chunk = remaining < (long long)sizeof(buf) ? (size_t)remaining : sizeof(buf);
+        ssize_t n = recv(ss_sock, buf, chunk, 0);
+        if (n <= 0) {
+            fprintf(stderr, "\nConnection closed before the whole file was received\n");
+            break;
+        }
+        fwrite(buf, 1, (size_t)n, stdout);
+        remaining -= n;
+    }
+    printf("\n");
+    
+    close(ss_sock);
 }
 
+// READ <file> asks for the content in one Message and switches to a raw read only when
+// the file fills it; READ -r <file> always reads raw
 void handle_read_command(char* command) {
     char filename[MAX_FILENAME];
-    if (sscanf(command, "READ %s", filename) != 1) {
-        printf("Usage: READ <filename>\n");
+    int raw = 0;
+    if (sscanf(command, "READ -r %s", filename) == 1) {
+        raw = 1;
+    } else if (sscanf(command, "READ %s", filename) != 1 || strcmp(filename, "-r") == 0) {
+        printf("Usage: READ [-r] <filename>\n");
         return;
     }
     
@@ -286,6 +487,7 @@ void handle_read_command(char* command) {
     strcpy(msg.username, username);
     strcpy(msg.filename, filename);
     
+    nm_route(msg.filename);
     send_message(nm_socket, &msg);
     receive_message(nm_socket, &msg);
     
@@ -302,6 +504,11 @@ void handle_read_command(char* command) {
     int ss_port;
     sscanf(msg.data, "%s %d", ss_ip, &ss_port);
     
+    if (raw) {
+        read_raw_from_ss(ss_ip, ss_port, filename);
+        return;
+    }
+    
     int ss_sock = connect_to_ss(ss_ip, ss_port);
     if (ss_sock < 0) {
         fprintf(stderr, "Failed to connect to storage server\n");
@@ -316,14 +523,18 @@ void handle_read_command(char* command) {
     
     send_message(ss_sock, &msg);
     receive_message(ss_sock, &msg);
+    close(ss_sock);
     
-    if (msg.error_code == ERR_SUCCESS) {
-        printf("%s\n", msg.data);
-    } else {
+    if (msg.error_code != ERR_SUCCESS) {
         print_error(msg.error_code, "READ");
+        return;
     }
-    
-    close(ss_sock);
+    // A full Message may have been cut short: fetch the whole file instead
+    if (strlen(msg.data) >= sizeof(msg.data) - 1) {
+        read_raw_from_ss(ss_ip, ss_port, filename);
+        return;
+    }
+    printf("%s\n", msg.data);
 }
 
 void handle_create_command(char* command) {
@@ -340,6 +551,7 @@ void handle_create_command(char* command) {
     strcpy(msg.username, username);
     strcpy(msg.filename, filename);
     
+    nm_route(msg.filename);
     send_message(nm_socket, &msg);
     receive_message(nm_socket, &msg);
     
@@ -371,6 +583,7 @@ void handle_write_command(char* command) {
     strcpy(msg.filename, filename);
     msg.sentence_number = sentence_number;
     
+    nm_route(msg.filename);
     send_message(nm_socket, &msg);
     receive_message(nm_socket, &msg);
     
@@ -414,8 +627,9 @@ void handle_write_command(char* command) {
     }
     
     printf("Sentence %d locked successfully!\n", sentence_number);
+    time_t last_renewal = time(NULL);
     
-    // Phase 2: Collect write operations
+    // Phase 2: Collect write operations (renewing the lock lease while the user types)
     char write_data[MAX_CONTENT] = "";
     char line[MAX_COMMAND];
     
@@ -432,6 +646,14 @@ void handle_write_command(char* command) {
         
         line[strcspn(line, "\n")] = 0;
         
+        if (time(NULL) - last_renewal >= LOCK_RENEW_INTERVAL_SEC) {
+            if (renew_sentence_lock(ss_ip, ss_port, filename, sentence_number) == 0) {
+                last_renewal = time(NULL);
+            } else {
+                fprintf(stderr, "Warning: failed to renew the lock on sentence %d\n", sentence_number);
+            }
+        }
+        
         if (strcmp(line, "ETIRW") == 0) {
             break;
         }
@@ -518,6 +740,7 @@ void handle_delete_command(char* command) {
     strcpy(msg.username, username);
     strcpy(msg.filename, filename);
     
+    nm_route(msg.filename);
     send_message(nm_socket, &msg);
     receive_message(nm_socket, &msg);
     
@@ -542,6 +765,7 @@ void handle_info_command(char* command) {
     strcpy(msg.username, username);
     strcpy(msg.filename, filename);
     
+    nm_route(msg.filename);
     send_message(nm_socket, &msg);
     receive_message(nm_socket, &msg);
     
@@ -557,8 +781,8 @@ void handle_info_command(char* command) {
 
 void handle_help_command() {
     printf("\nAvailable commands:\n");
-    printf("  VIEW [-a] [-l] [-al]\n");
-    printf("  READ <filename>\n");
+    printf("  VIEW [-a] [-l] [-al] [prefix|glob]\n");
+    printf("  READ [-r] <filename>\n");
     printf("  CREATE <filename>\n");
     printf("  CREATEFOLDER <folder>\n");
     printf("  WRITE <filename> <sentence_number>\n");
@@ -577,6 +801,13 @@ void handle_help_command() {
     printf("  APPROVE [-W] <filename> <username>\n");
     printf("  DENY <filename> <username>\n");
     printf("  RECENTS\n");
+    printf("  SEARCH <words>\n");
+    printf("  CLUSTER\n");
+    printf("  MIGRATE <filename> <ss_id>\n");
+    printf("  DRAIN <ss_id>\n");
+    printf("  UNDRAIN <ss_id>\n");
+    printf("  BATCH <localfile>\n");
+    printf("  PIPE <localfile>\n");
     printf("  CHECKPOINT <filename> <tag>\n");
     printf("  VIEWCHECKPOINT <filename> <tag>\n");
     printf("  LISTCHECKPOINTS <filename>\n");
@@ -599,6 +830,7 @@ void handle_stream_command(char* command) {
     strcpy(msg.username, username);
     strcpy(msg.filename, filename);
     
+    nm_route(msg.filename);
     send_message(nm_socket, &msg);
     receive_message(nm_socket, &msg);
     
@@ -693,6 +925,7 @@ void handle_addaccess_command(char* command) {
     strcpy(msg.data, target_user);
     msg.flags = (strcmp(flag, "-W") == 0) ? 1 : 0;
     
+    nm_route(msg.filename);
     send_message(nm_socket, &msg);
     receive_message(nm_socket, &msg);
     
@@ -722,6 +955,7 @@ void handle_remaccess_command(char* command) {
     strcpy(msg.filename, filename);
     strcpy(msg.data, target_user);
     
+    nm_route(msg.filename);
     send_message(nm_socket, &msg);
     receive_message(nm_socket, &msg);
     
@@ -748,12 +982,38 @@ void handle_exec_command(char* command) {
     msg.op_code = OP_EXEC;
     strcpy(msg.username, username);
     strcpy(msg.filename, filename);
+    msg.flags = FLAG_EXEC_STREAM;
     
+    nm_route(msg.filename);
     send_message(nm_socket, &msg);
-    receive_message(nm_socket, &msg);
+    // Output frames arrive as the script produces them; return credit every half window
+    int consumed = 0;
+    while (1) {
+        if (receive_message(nm_socket, &msg) <= 0) {
+            print_error(ERR_CONNECTION_FAILED, "EXEC");
+            return;
+        }
+        if (msg.error_code != ERR_SUCCESS || !(msg.flags & FLAG_EXEC_MORE)) break;
+        int n = msg.data_size;
+        if (n < 0 || n > (int)sizeof(msg.data)) n = 0;
+        FILE* out = (msg.flags & FLAG_EXEC_STDERR) ? stderr : stdout;
+        fwrite(msg.data, 1, n, out);
+        fflush(out);
+        if (++consumed >= EXEC_STREAM_WINDOW / 2) {
+            Message ack;
+            memset(&ack, 0, sizeof(ack));
+            ack.op_code = OP_EXEC;
+            ack.flags = FLAG_EXEC_ACK;
+            ack.sentence_number = consumed;
+            strcpy(ack.username, username);
+            send_message(nm_socket, &ack);
+            consumed = 0;
+        }
+    }
     
     if (msg.error_code == ERR_SUCCESS) {
         printf("%s", msg.data);
+        if (msg.sentence_number > 0) printf("[exit status %d]\n", msg.sentence_number);
     } else {
         print_error(msg.error_code, "EXEC");
         if (msg.error_msg[0] != '\0') {
@@ -776,6 +1036,7 @@ void handle_undo_command(char* command) {
     strcpy(msg.username, username);
     strcpy(msg.filename, filename);
     
+    nm_route(msg.filename);
     send_message(nm_socket, &msg);
     receive_message(nm_socket, &msg);
     
@@ -838,6 +1099,22 @@ int connect_to_ss(const char* ss_ip, int ss_port) {
     return sock;
 }
 
+// Re-send LOCK for a sentence we already hold; the SS treats it as a lease renewal
+static int renew_sentence_lock(const char* ss_ip, int ss_port, const char* filename, int sentence_number) {
+    int ss_sock = connect_to_ss(ss_ip, ss_port);
+    if (ss_sock < 0) return -1;
+    Message msg;
+    memset(&msg, 0, sizeof(Message));
+    msg.op_code = OP_LOCK_SENTENCE;
+    strcpy(msg.username, username);
+    strcpy(msg.filename, filename);
+    msg.sentence_number = sentence_number;
+    send_message(ss_sock, &msg);
+    int rc = receive_message(ss_sock, &msg);
+    close(ss_sock);
+    return (rc > 0 && msg.error_code == ERR_SUCCESS) ? 0 : -1;
+}
+
 // === Bonus command implementations ===
 void handle_createfolder_command(char* command) {
     char folder[MAX_FILENAME];
@@ -846,6 +1123,7 @@ void handle_createfolder_command(char* command) {
     }
     Message msg; memset(&msg,0,sizeof(msg));
     msg.op_code = OP_CREATEFOLDER; strcpy(msg.username, username); strncpy(msg.filename, folder, sizeof(msg.filename)-1);
+    nm_route(msg.filename);
     send_message(nm_socket, &msg); receive_message(nm_socket, &msg);
     if (msg.error_code == ERR_SUCCESS) printf("%s\n", msg.data[0]?msg.data:"Folder Created Successfully!\n"); else print_error(msg.error_code, "CREATEFOLDER");
 }
@@ -854,22 +1132,248 @@ void handle_viewfolder_command(char* command) {
     char folder[MAX_FILENAME];
     if (sscanf(command, "VIEWFOLDER %255s", folder) != 1) { printf("Usage: VIEWFOLDER <folder>\n"); return; }
     Message msg; memset(&msg,0,sizeof(msg)); msg.op_code=OP_VIEWFOLDER; strcpy(msg.username, username); strncpy(msg.filename, folder, sizeof(msg.filename)-1);
-    send_message(nm_socket,&msg); receive_message(nm_socket,&msg);
-    if (msg.error_code==ERR_SUCCESS) printf("%s", msg.data); else print_error(msg.error_code, "VIEWFOLDER");
+    nm_route(msg.filename);
+    list_all_pages(&msg, "VIEWFOLDER");
 }
 
 void handle_move_command(char* command) {
     char filename[MAX_FILENAME], folder[MAX_FILENAME];
     if (sscanf(command, "MOVE %255s %255s", filename, folder) != 2) { printf("Usage: MOVE <filename> <folder>\n"); return; }
     Message msg; memset(&msg,0,sizeof(msg)); msg.op_code=OP_MOVE; strcpy(msg.username, username); strncpy(msg.filename, filename, sizeof(msg.filename)-1); strncpy(msg.data, folder, sizeof(msg.data)-1);
+    nm_route(msg.filename);
     send_message(nm_socket,&msg); receive_message(nm_socket,&msg);
     if (msg.error_code==ERR_SUCCESS) printf("%s\n", msg.data); else print_error(msg.error_code, "MOVE");
 }
 
 void handle_recents_command() {
-    Message msg; memset(&msg,0,sizeof(msg)); msg.op_code=OP_RECENTS; strcpy(msg.username, username);
+    for (int i = 0; i < shard_count; i++) {
+        Message msg; memset(&msg,0,sizeof(msg)); msg.op_code=OP_RECENTS; strcpy(msg.username, username);
+        nm_use_shard(i);
+        send_message(nm_socket,&msg); receive_message(nm_socket,&msg);
+        if (msg.error_code==ERR_SUCCESS) printf("%s", msg.data); else print_error(msg.error_code, "RECENTS");
+    }
+}
+
+void handle_search_command(char* command) {
+    const char* words = command;
+    while (*words == ' ' || *words == '\t') words++;
+    while (*words && *words != ' ' && *words != '\t') words++;   // the SEARCH verb
+    while (*words == ' ' || *words == '\t') words++;
+    if (*words == '\0') { printf("Usage: SEARCH <words>\n"); return; }
+    // Each shard ranks the files it owns
+    for (int i = 0; i < shard_count; i++) {
+        Message msg; memset(&msg,0,sizeof(msg)); msg.op_code=OP_SEARCH; strcpy(msg.username, username);
+        strncpy(msg.data, words, sizeof(msg.data)-1);
+        nm_use_shard(i);
+        send_message(nm_socket,&msg); receive_message(nm_socket,&msg);
+        if (shard_count > 1) printf("Shard %d: ", i);
+        if (msg.error_code==ERR_SUCCESS) printf("%s", msg.data); else print_error(msg.error_code, "SEARCH");
+    }
+}
+
+// Every shard places its own files, so each has its own view of the storage servers
+void handle_cluster_command() {
+    for (int i = 0; i < shard_count; i++) {
+        Message msg; memset(&msg,0,sizeof(msg)); msg.op_code=OP_CLUSTER; strcpy(msg.username, username);
+        nm_use_shard(i);
+        send_message(nm_socket,&msg); receive_message(nm_socket,&msg);
+        if (shard_count > 1) printf("Shard %d:\n", i);
+        if (msg.error_code==ERR_SUCCESS) printf("%s", msg.data); else print_error(msg.error_code, "CLUSTER");
+    }
+}
+
+void handle_migrate_command(char* command) {
+    char filename[MAX_FILENAME]; int target;
+    if (sscanf(command, "%*s %255s %d", filename, &target) != 2) { printf("Usage: MIGRATE <filename> <ss_id>\n"); return; }
+    Message msg; memset(&msg,0,sizeof(msg)); msg.op_code=OP_MIGRATE; strcpy(msg.username, username); strcpy(msg.filename, filename);
+    snprintf(msg.data, sizeof(msg.data), "%d", target);
+    nm_route(msg.filename);
     send_message(nm_socket,&msg); receive_message(nm_socket,&msg);
-    if (msg.error_code==ERR_SUCCESS) printf("%s", msg.data); else print_error(msg.error_code, "RECENTS");
+    if (msg.error_code==ERR_SUCCESS) printf("%s\n", msg.data); else print_error(msg.error_code, "MIGRATE");
+}
+
+void handle_drain_command(char* command, int on) {
+    int id;
+    if (sscanf(command, "%*s %d", &id) != 1) { printf("Usage: %s <ss_id>\n", on ? "DRAIN" : "UNDRAIN"); return; }
+    // Each shard moves its own files off the server
+    for (int i = 0; i < shard_count; i++) {
+        Message msg; memset(&msg,0,sizeof(msg)); msg.op_code=OP_DRAIN; strcpy(msg.username, username);
+        snprintf(msg.data, sizeof(msg.data), "%d %d", id, on);
+        nm_use_shard(i);
+        send_message(nm_socket,&msg); receive_message(nm_socket,&msg);
+        if (msg.error_code==ERR_SUCCESS) printf("%s\n", msg.data); else print_error(msg.error_code, on ? "DRAIN" : "UNDRAIN");
+    }
+}
+
+// The shard a batch line's file belongs to (ADDACCESS names it after the -R/-W flag)
+static int batch_line_shard(const char* line) {
+    char verb[16] = "", a1[MAX_FILENAME] = "", a2[MAX_FILENAME] = "";
+    sscanf(line, "%15s %255s %255s", verb, a1, a2);
+    return shard_of(strcasecmp(verb, "ADDACCESS") == 0 ? a2 : a1, shard_count);
+}
+
+// Send the CREATE/DELETE/ADDACCESS/REMACCESS lines of a local file to the NM, BATCH_MAX_ITEMS
+// at a time; with shards, a run of lines for one shard at a time, so they still apply in order
+static int send_batch(Message* msg, int first_item, int shard) {
+    nm_use_shard(shard);
+    send_message(nm_socket, msg);
+    if (receive_message(nm_socket, msg) <= 0) { print_error(ERR_CONNECTION_FAILED, "BATCH"); return -1; }
+    if (msg->error_code != ERR_SUCCESS) { print_error(msg->error_code, "BATCH"); return -1; }
+    int failed = 0;
+    char* save = NULL;
+    for (char* line = strtok_r(msg->data, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        int i, code, off = 0;
+        if (sscanf(line, "%d %d %n", &i, &code, &off) < 2) continue;
+        if (code != ERR_SUCCESS) { printf("  item %d: error %d: %s\n", first_item + i + 1, code, line + off); failed++; }
+    }
+    return failed;
+}
+
+void handle_batch_command(char* command) {
+    char path[MAX_PATH];
+    if (sscanf(command, "%*s %511s", path) != 1) { printf("Usage: BATCH <localfile>\n"); return; }
+    FILE* fp = fopen(path, "r");
+    if (!fp) { printf("Cannot open %s\n", path); return; }
+    Message msg; memset(&msg,0,sizeof(msg)); msg.op_code=OP_BATCH; strcpy(msg.username, username);
+    size_t used = 0; int items = 0, sent = 0, failed = 0, shard = 0;
+    char line[MAX_PATH + MAX_FILENAME];
+    while (fgets(line, sizeof(line), fp)) {
+        trim_whitespace(line);
+        if (line[0] == '\0' || line[0] == '#') continue;
+        size_t len = strlen(line);
+        int line_shard = batch_line_shard(line);
+        if (items > 0 && (items == BATCH_MAX_ITEMS || used + len + 2 > sizeof(msg.data) || line_shard != shard)) {
+            int r = send_batch(&msg, sent, shard);
+            if (r < 0) { fclose(fp); return; }
+            failed += r; sent += items;
+            memset(&msg,0,sizeof(msg)); msg.op_code=OP_BATCH; strcpy(msg.username, username);
+            used = 0; items = 0;
+        }
+        memcpy(msg.data + used, line, len);
+        used += len;
+        msg.data[used++] = '\n';
+        items++;
+        shard = line_shard;
+    }
+    fclose(fp);
+    if (items > 0) {
+        int r = send_batch(&msg, sent, shard);
+        if (r < 0) return;
+        failed += r; sent += items;
+    }
+    printf("Batch done: %d items, %d failed\n", sent, failed);
+}
+
+// Build the NM request for a PIPE line; only commands answered by the NM alone qualify
+static int pipe_request(const char* line, Message* msg) {
+    char verb[16] = "", arg[MAX_FILENAME] = "";
+    if (sscanf(line, "%15s %255s", verb, arg) < 1) return -1;
+    memset(msg, 0, sizeof(Message));
+    strcpy(msg->username, username);
+    if (strcasecmp(verb, "INFO") == 0 && arg[0]) {
+        msg->op_code = OP_INFO;
+        strcpy(msg->filename, arg);
+    } else if (strcasecmp(verb, "VIEWFOLDER") == 0 && arg[0]) {
+        msg->op_code = OP_VIEWFOLDER;
+        strcpy(msg->filename, arg);
+    } else if (strcasecmp(verb, "VIEW") == 0) {
+        msg->op_code = OP_VIEW;
+        char copy[MAX_PATH], *save = NULL;
+        strncpy(copy, line, sizeof(copy) - 1); copy[sizeof(copy) - 1] = '\0';
+        strtok_r(copy, " \t", &save);
+        for (char* tok = strtok_r(NULL, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save)) {
+            if (tok[0] != '-') { strncpy(msg->filename, tok, sizeof(msg->filename) - 1); continue; }
+            if (strpbrk(tok, "aA")) msg->flags |= 1; // -a
+            if (strpbrk(tok, "lL")) msg->flags |= 2; // -l
+        }
+    } else if (strcasecmp(verb, "LIST") == 0) {
+        msg->op_code = OP_LIST;
+    } else if (strcasecmp(verb, "RECENTS") == 0) {
+        msg->op_code = OP_RECENTS;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// The shard a PIPE request goes to: its file's, or this NM's for LIST, RECENTS and a VIEW
+// that is not confined to one shard (which then lists that shard only)
+static int pipe_shard(const Message* msg) {
+    if (msg->op_code == OP_INFO || msg->op_code == OP_VIEWFOLDER) return shard_of(msg->filename, shard_count);
+    if (msg->op_code == OP_VIEW && view_shard(msg->filename) >= 0) return view_shard(msg->filename);
+    return home_shard;
+}
+
+// Run the INFO/VIEW/VIEWFOLDER/LIST/RECENTS lines of a local file with up to PIPELINE_DEPTH
+// requests outstanding on the NM connection; replies come back in any order and are
+// printed in file order. With shards, each shard's lines are pipelined in turn.
+void handle_pipe_command(char* command) {
+    char path[MAX_PATH];
+    if (sscanf(command, "%*s %511s", path) != 1) { printf("Usage: PIPE <localfile>\n"); return; }
+    FILE* fp = fopen(path, "r");
+    if (!fp) { printf("Cannot open %s\n", path); return; }
+    char** lines = NULL; int n = 0, cap = 0;
+    char line[MAX_PATH];
+    while (fgets(line, sizeof(line), fp)) {
+        trim_whitespace(line);
+        if (line[0] == '\0' || line[0] == '#') continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            char** grown = realloc(lines, cap * sizeof(char*));
+            if (!grown) break;
+            lines = grown;
+        }
+        lines[n++] = strdup(line);
+    }
+    fclose(fp);
+
+    Message* replies = calloc(n > 0 ? n : 1, sizeof(Message));
+    char* done = calloc(n > 0 ? n : 1, 1);
+    if (!replies || !done) { printf("Out of memory\n"); n = 0; }
+    int next = 0, outstanding = 0, received = 0, printed = 0, failed = 0, shard = 0;
+    Message msg;
+    nm_use_shard(shard);
+    while (printed < n) {
+        // Keep the window full, then take whichever reply arrives
+        while (next < n && outstanding < PIPELINE_DEPTH) {
+            if (pipe_request(lines[next], &msg) != 0) {
+                replies[next].error_code = ERR_INVALID_COMMAND;
+                done[next++] = 1;
+                continue;
+            }
+            if (pipe_shard(&msg) != shard) { next++; continue; }   // another shard's pass
+            msg.request_id = next + 1;
+            if (send_message(nm_socket, &msg) < 0) break;
+            next++; outstanding++;
+        }
+        if (outstanding > 0) {
+            if (receive_message(nm_socket, &msg) <= 0) break;
+            int i = msg.request_id - 1;
+            if (i >= 0 && i < n && !done[i]) { replies[i] = msg; done[i] = 1; outstanding--; received++; }
+        } else if (next < n) {
+            break; // send failed
+        } else if (shard + 1 < shard_count) {
+            nm_use_shard(++shard);   // this shard's lines are answered; start the next one's
+            next = 0;
+        }
+        while (printed < n && done[printed]) {
+            Message* r = &replies[printed];
+            printf("[%s]\n", lines[printed]);
+            if (r->error_code == ERR_SUCCESS) {
+                printf("%s", r->data);
+                if (r->data[0] && r->data[strlen(r->data) - 1] != '\n') printf("\n");
+                if (r->flags & FLAG_LIST_MORE) printf("(first page only; run the command on its own for the rest)\n");
+            } else {
+                print_error(r->error_code, lines[printed]);
+                failed++;
+            }
+            printed++;
+        }
+    }
+    if (printed < n) print_error(ERR_CONNECTION_FAILED, "PIPE");
+    printf("Pipe done: %d requests, %d failed\n", printed, failed);
+    for (int i = 0; i < n; i++) free(lines[i]);
+    free(lines); free(replies); free(done);
 }
 
 void handle_reqaccess_command(char* command) {
@@ -879,6 +1383,7 @@ void handle_reqaccess_command(char* command) {
     if (hasFlag != 2 || (strcmp(flagstr, "-R")!=0 && strcmp(flagstr, "-W")!=0)) { printf("Usage: REQACCESS -R/-W <filename>\n"); return; }
     Message msg; memset(&msg,0,sizeof(msg)); msg.op_code=OP_REQACCESS; strcpy(msg.username, username); strncpy(msg.filename, filename, sizeof(msg.filename)-1);
     if (strcmp(flagstr, "-W") == 0) msg.flags |= 1; // reuse bit 1 for write request
+    nm_route(msg.filename);
     send_message(nm_socket,&msg); receive_message(nm_socket,&msg);
     if (msg.error_code==ERR_SUCCESS) printf("%s\n", msg.data); else print_error(msg.error_code, "REQACCESS");
 }
@@ -886,6 +1391,7 @@ void handle_reqaccess_command(char* command) {
 void handle_viewrequests_command(char* command) {
     char filename[MAX_FILENAME]; if (sscanf(command, "VIEWREQUESTS %255s", filename)!=1){ printf("Usage: VIEWREQUESTS <filename>\n"); return; }
     Message msg; memset(&msg,0,sizeof(msg)); msg.op_code=OP_VIEWREQUESTS; strcpy(msg.username, username); strncpy(msg.filename, filename, sizeof(msg.filename)-1);
+    nm_route(msg.filename);
     send_message(nm_socket,&msg); receive_message(nm_socket,&msg);
     if (msg.error_code==ERR_SUCCESS) printf("%s", msg.data); else print_error(msg.error_code, "VIEWREQUESTS");
 }
@@ -906,6 +1412,7 @@ void handle_approve_command(char* command) {
     }
     Message msg; memset(&msg,0,sizeof(msg)); msg.op_code=OP_APPROVE; strcpy(msg.username, username); strncpy(msg.filename, filename, sizeof(msg.filename)-1); strncpy(msg.data, user, sizeof(msg.data)-1);
     if (writeOverride) msg.flags |= 1;
+    nm_route(msg.filename);
     send_message(nm_socket,&msg); receive_message(nm_socket,&msg);
     if (msg.error_code==ERR_SUCCESS) printf("%s\n", msg.data); else print_error(msg.error_code, "APPROVE");
 }
@@ -914,6 +1421,7 @@ void handle_deny_command(char* command) {
     char filename[MAX_FILENAME], user[MAX_USERNAME];
     if (sscanf(command, "DENY %255s %63s", filename, user) != 2) { printf("Usage: DENY <filename> <username>\n"); return; }
     Message msg; memset(&msg,0,sizeof(msg)); msg.op_code=OP_DENY; strcpy(msg.username, username); strncpy(msg.filename, filename, sizeof(msg.filename)-1); strncpy(msg.data, user, sizeof(msg.data)-1);
+    nm_route(msg.filename);
     send_message(nm_socket,&msg); receive_message(nm_socket,&msg);
     if (msg.error_code==ERR_SUCCESS) printf("%s\n", msg.data); else print_error(msg.error_code, "DENY");
 }
@@ -922,6 +1430,7 @@ void handle_deny_command(char* command) {
 static int fetch_ss_conn(int op_code, const char* filename, const char* extra, Message* out_ss_info) {
     Message msg; memset(&msg,0,sizeof(msg)); msg.op_code = op_code; strcpy(msg.username, username); strncpy(msg.filename, filename, sizeof(msg.filename)-1);
     if (extra) strncpy(msg.data, extra, sizeof(msg.data)-1);
+    nm_route(msg.filename);
     send_message(nm_socket,&msg); receive_message(nm_socket,&msg);
     if (msg.error_code != ERR_SUCCESS) { *out_ss_info = msg; return -1; }
     *out_ss_info = msg; return 0;
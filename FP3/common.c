@@ -1,5 +1,6 @@
 #include "common.h"
 #include <stdarg.h>
+#include <ctype.h>
 
 // Get current timestamp
 char* get_timestamp() {
@@ -85,19 +86,28 @@ int create_socket() {
 }
 
 // Send message
+// One per descriptor (under the default 1024-fd limit) so replies to pipelined requests,
+// sent from different threads, never interleave
+#define SEND_LOCKS 1024
+static pthread_mutex_t send_locks[SEND_LOCKS] = { [0 ... SEND_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER };
+
 int send_message(int socket_fd, Message* msg) {
     int total_sent = 0;
     int bytes_to_send = sizeof(Message);
     char* ptr = (char*)msg;
+    pthread_mutex_t* lock = &send_locks[(unsigned)socket_fd % SEND_LOCKS];
     
+    pthread_mutex_lock(lock);
     while (total_sent < bytes_to_send) {
         int sent = send(socket_fd, ptr + total_sent, bytes_to_send - total_sent, 0);
         if (sent <= 0) {
             if (sent < 0) perror("Send failed");
+            pthread_mutex_unlock(lock);
             return -1;
         }
         total_sent += sent;
     }
+    pthread_mutex_unlock(lock);
     
     return total_sent;
 }
@@ -120,6 +130,36 @@ int receive_message(int socket_fd, Message* msg) {
     return total_received;
 }
 
+// Send exactly len bytes (flags as for send(), e.g. MSG_MORE)
+int send_all(int socket_fd, const void* buf, size_t len, int flags) {
+    const char* ptr = buf;
+    while (len > 0) {
+        ssize_t sent = send(socket_fd, ptr, len, flags);
+        if (sent <= 0) {
+            if (sent < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        ptr += sent;
+        len -= (size_t)sent;
+    }
+    return 0;
+}
+
+// Receive exactly len bytes
+int recv_all(int socket_fd, void* buf, size_t len) {
+    char* ptr = buf;
+    while (len > 0) {
+        ssize_t received = recv(socket_fd, ptr, len, 0);
+        if (received <= 0) {
+            if (received < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        ptr += received;
+        len -= (size_t)received;
+    }
+    return 0;
+}
+
 // Print error
 void print_error(int error_code, const char* context) {
     const char* error_messages[] = {
@@ -135,26 +175,28 @@ void print_error(int error_code, const char* context) {
         "Not the owner",
         "User not found",
         "Storage server not found",
-        "No undo history available"
+        "No undo history available",
+        "File is moving to another storage server, try again",
+        "Path belongs to another Name Server shard"
     };
     
-    if (error_code >= 0 && error_code <= ERR_NO_UNDO) {
+    if (error_code >= 0 && error_code <= ERR_WRONG_SHARD) {
         fprintf(stderr, "ERROR [%s]: %s\n", context, error_messages[error_code]);
     } else {
         fprintf(stderr, "ERROR [%s]: Unknown error code %d\n", context, error_code);
     }
 }
 
-// Check access
-int check_access(FileMetadata* file, const char* username, int required_access) {
-    if (file == NULL || username == NULL) return 0;
+// Check access (user_id 0, an unknown user, has none)
+int check_access(FileMetadata* file, int user_id, int required_access) {
+    if (file == NULL || user_id <= 0) return 0;
     
     // Owner always has full access
-    if (strcmp(file->owner, username) == 0) return 1;
+    if (file->owner_id == user_id) return 1;
     
     // Check access list
     for (int i = 0; i < file->access_count; i++) {
-        if (strcmp(file->access_list[i].username, username) == 0) {
+        if (file->access_list[i].user_id == user_id) {
             if (required_access == ACCESS_READ) {
                 return file->access_list[i].access_type >= ACCESS_READ;
             } else if (required_access == ACCESS_WRITE) {
@@ -166,6 +208,274 @@ int check_access(FileMetadata* file, const char* username, int required_access)
     return 0;
 }
 
+// FNV-1a hash for string-keyed tables
+unsigned int hash_string(const char* str) {
+    unsigned int h = 2166136261u;
+    if (str == NULL) return h;
+    for (const unsigned char* p = (const unsigned char*)str; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// ---- Inventory digests ----
+// A storage server's file set and the NM's copy of it are compared bucket by bucket. A
+// file falls in the bucket given by the top bits of its 64-bit name hash, and a bucket's
+// digest is the XOR of its files' entry hashes, so adding or dropping a file is O(1).
+
+unsigned long long inv_name_hash(const char* name) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (const unsigned char* p = (const unsigned char*)name; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// The entry hash also covers the counts the NM shows, so a changed file changes its bucket
+unsigned long long inv_entry_hash(unsigned long long name_hash, int words, int chars) {
+    unsigned long long x = ((unsigned long long)(unsigned int)words << 32) | (unsigned int)chars;
+    x ^= x >> 33; x *= 0xff51afd7ed558ccdULL; x ^= x >> 33;
+    return name_hash ^ x;
+}
+
+int inv_bucket(unsigned long long name_hash) {
+    return (int)(name_hash >> 58);   // INV_BUCKETS == 64
+}
+
+unsigned long long inv_root(const unsigned long long* digests) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (int b = 0; b < INV_BUCKETS; b++) {
+        h ^= digests[b];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Word and character counts as VIEW -l and INFO show them
+void count_words_chars(const char* text, int* words, int* chars) {
+    int w = 0, in_word = 0, n = 0;
+    for (; text[n]; n++) {
+        if (!isspace((unsigned char)text[n])) { if (!in_word) { w++; in_word = 1; } }
+        else in_word = 0;
+    }
+    *words = w;
+    *chars = n;
+}
+
+// ---- String interning ----
+
+static int intern_find_slot(InternTable* t, const char* str, unsigned int h) {
+    unsigned int mask = (unsigned int)t->slot_cap - 1;
+    for (unsigned int i = h & mask;; i = (i + 1) & mask) {
+        int id = t->slots[i];
+        if (id == 0 || strcmp(t->chunks[(id - 1) / INTERN_CHUNK][(id - 1) % INTERN_CHUNK], str) == 0) return (int)i;
+    }
+}
+
+static int intern_grow(InternTable* t) {
+    int cap = t->slot_cap ? t->slot_cap * 2 : 1024;
+    int* slots = calloc(cap, sizeof(int));
+    if (slots == NULL) return -1;
+    int* old = t->slots;
+    int old_cap = t->slot_cap;
+    t->slots = slots;
+    t->slot_cap = cap;
+    for (int i = 0; i < old_cap; i++) {
+        int id = old[i];
+        if (id == 0) continue;
+        const char* s = t->chunks[(id - 1) / INTERN_CHUNK][(id - 1) % INTERN_CHUNK];
+        t->slots[intern_find_slot(t, s, hash_string(s))] = id;
+    }
+    free(old);
+    return 0;
+}
+
+// ID of str, adding it if new; 0 if the table is full or out of memory
+int intern_id(InternTable* t, const char* str) {
+    if (str == NULL || str[0] == '\0') return 0;
+    unsigned int h = hash_string(str);
+    pthread_mutex_lock(&t->lock);
+    if (t->slot_cap == 0 || (t->count + 1) * 2 > t->slot_cap) {
+        if (intern_grow(t) != 0) { pthread_mutex_unlock(&t->lock); return 0; }
+    }
+    int slot = intern_find_slot(t, str, h);
+    int id = t->slots[slot];
+    if (id == 0 && t->count < INTERN_CHUNK * INTERN_MAX_CHUNKS) {
+        int c = t->count / INTERN_CHUNK;
+        if (t->chunks[c] == NULL) t->chunks[c] = calloc(INTERN_CHUNK, sizeof(char*));
+        char* copy = t->chunks[c] ? strdup(str) : NULL;
+        if (copy) {
+            t->chunks[c][t->count % INTERN_CHUNK] = copy;
+            id = ++t->count;
+            t->slots[slot] = id;
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+    return id;
+}
+
+// ID of str if it was ever interned, else 0
+int intern_lookup(InternTable* t, const char* str) {
+    if (str == NULL || str[0] == '\0') return 0;
+    pthread_mutex_lock(&t->lock);
+    int id = t->slot_cap ? t->slots[intern_find_slot(t, str, hash_string(str))] : 0;
+    pthread_mutex_unlock(&t->lock);
+    return id;
+}
+
+// String for an ID ("" for 0 or an ID not handed out)
+const char* intern_str(InternTable* t, int id) {
+    if (id <= 0 || id > t->count) return "";
+    return t->chunks[(id - 1) / INTERN_CHUNK][(id - 1) % INTERN_CHUNK];
+}
+
+// Read a positive integer tunable from the environment, falling back to default_value
+int get_env_int(const char* name, int default_value) {
+    const char* v = getenv(name);
+    if (v == NULL || v[0] == '\0') return default_value;
+    char* end = NULL;
+    long n = strtol(v, &end, 10);
+    if (end == v || n < 0) return default_value;
+    return (int)n;
+}
+
+// ---- Name Server address lists ----
+void nm_addrs_add(NmAddrList* list, const char* ip, int port) {
+    struct in_addr probe;
+    if (port <= 0 || port > 65535 || inet_pton(AF_INET, ip, &probe) != 1) return;
+    for (int i = 0; i < list->count; i++) {
+        if (list->addrs[i].port == port && strcmp(list->addrs[i].ip, ip) == 0) return;
+    }
+    if (list->count == MAX_NM_ADDRS) return;
+    strncpy(list->addrs[list->count].ip, ip, INET_ADDRSTRLEN - 1);
+    list->addrs[list->count].ip[INET_ADDRSTRLEN - 1] = '\0';
+    list->addrs[list->count].port = port;
+    list->count++;
+}
+
+// Add every "<ip>:<port>" token of text (NM_ADDRS, or the standby lines of a registration reply)
+void nm_addrs_parse(NmAddrList* list, const char* text) {
+    if (text == NULL) return;
+    char buf[MAX_CONTENT];
+    strncpy(buf, text, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    char* save = NULL;
+    for (char* tok = strtok_r(buf, ", \t\n", &save); tok; tok = strtok_r(NULL, ", \t\n", &save)) {
+        char* colon = strrchr(tok, ':');
+        if (colon == NULL) continue;
+        *colon = '\0';
+        nm_addrs_add(list, tok, atoi(colon + 1));
+    }
+}
+
+// Connect to the Name Server, starting with the one last reached and going down the list,
+// for up to wait_sec seconds (0: one pass). Returns the socket or -1.
+int nm_connect(NmAddrList* list, int wait_sec) {
+    time_t deadline = time(NULL) + wait_sec;
+    while (list->count > 0) {
+        for (int k = 0; k < list->count; k++) {
+            int i = (list->current + k) % list->count;
+            int sock = socket(AF_INET, SOCK_STREAM, 0);
+            if (sock < 0) return -1;
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(list->addrs[i].port);
+            inet_pton(AF_INET, list->addrs[i].ip, &addr.sin_addr);
+            struct timeval tv = { 2, 0 }, none = { 0, 0 };   // bounds connect() to a dead host
+            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+                setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &none, sizeof(none));
+                list->current = i;
+                return sock;
+            }
+            close(sock);
+        }
+        if (time(NULL) >= deadline) break;
+        sleep(1);
+    }
+    return -1;
+}
+
+// ---- Namespace shards ----
+// A path goes to the shard of its first component, so a folder and everything under it
+// live on one Name Server and prefix listings and folder operations stay on one shard
+
+int shard_of(const char* path, int shard_count) {
+    if (shard_count <= 1 || path == NULL) return 0;
+    size_t len = strcspn(path, "/");
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 16777619u;
+    }
+    return (int)(h % (unsigned int)shard_count);
+}
+
+// Fill shards[] from "<ip>:<port>" tokens (comma or space separated), one shard each in
+// order; returns how many (at most MAX_NM_SHARDS)
+int shard_list_parse(NmAddrList* shards, const char* text) {
+    if (text == NULL) return 0;
+    char buf[MAX_CONTENT];
+    strncpy(buf, text, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    int n = 0;
+    char* save = NULL;
+    for (char* tok = strtok_r(buf, ", \t\n", &save); tok && n < MAX_NM_SHARDS; tok = strtok_r(NULL, ", \t\n", &save)) {
+        memset(&shards[n], 0, sizeof(shards[n]));
+        nm_addrs_parse(&shards[n], tok);
+        if (shards[n].count == 0) return 0;   // malformed list
+        n++;
+    }
+    return n;
+}
+
+// ---- Growable tables ----
+// Reserve address space for limit records (no memory yet); returns the base or NULL
+void* table_init(GrowTable* t, size_t elem_size, size_t limit) {
+    memset(t, 0, sizeof(*t));
+    if (elem_size == 0 || limit == 0) return NULL;
+    void* base = mmap(NULL, elem_size * limit, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+    t->base = base;
+    t->elem_size = elem_size;
+    t->limit = limit;
+    return base;
+}
+
+// Make records [0, count) usable, committing at least double the current size at a time.
+// New records are zeroed. Returns -1 past the limit or when memory runs out.
+int table_grow(GrowTable* t, size_t count) {
+    if (count <= t->committed) return 0;
+    if (t->base == NULL || count > t->limit) return -1;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t want = t->committed * 2 > count ? t->committed * 2 : count;
+    if (want > t->limit) want = t->limit;
+    size_t old_bytes = (t->committed * t->elem_size + page - 1) / page * page;
+    size_t new_bytes = (want * t->elem_size + page - 1) / page * page;
+    size_t max_bytes = (t->limit * t->elem_size + page - 1) / page * page;
+    if (new_bytes > max_bytes) new_bytes = max_bytes;
+    if (new_bytes > old_bytes && mprotect(t->base + old_bytes, new_bytes - old_bytes, PROT_READ | PROT_WRITE) != 0) return -1;
+    t->committed = new_bytes / t->elem_size;
+    if (t->committed > t->limit) t->committed = t->limit;
+    return 0;
+}
+
+// Back records [0, count) with the file's bytes from offset (page-aligned) instead of fresh
+// memory. The mapping is private: pages are read in on first touch and changes stay in memory.
+int table_map(GrowTable* t, int fd, off_t offset, size_t count) {
+    if (t->base == NULL || count > t->limit || t->committed > 0) return -1;
+    if (count == 0) return 0;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t bytes = (count * t->elem_size + page - 1) / page * page;
+    if (mmap(t->base, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) return -1;
+    t->committed = bytes / t->elem_size;
+    if (t->committed > t->limit) t->committed = t->limit;
+    return 0;
+}
+
 // Trie Operations
 TrieNode* create_trie_node() {
     TrieNode* node = (TrieNode*)calloc(1, sizeof(TrieNode));
@@ -189,6 +499,7 @@ void trie_insert(TrieNode* root, const char* filename, FileMetadata* file_info)
         unsigned char index = (unsigned char)filename[i];
         if (current->children[index] == NULL) {
             current->children[index] = create_trie_node();
+            current->child_count++;
         }
         current = current->children[index];
     }
@@ -219,12 +530,15 @@ FileMetadata* trie_search(TrieNode* root, const char* filename) {
 void trie_delete(TrieNode* root, const char* filename) {
     if (root == NULL || filename == NULL) return;
     
+    TrieNode* path[MAX_FILENAME];
+    int depth = 0;
     TrieNode* current = root;
     for (int i = 0; filename[i] != '\0'; i++) {
         unsigned char index = (unsigned char)filename[i];
-        if (current->children[index] == NULL) {
+        if (current->children[index] == NULL || depth >= MAX_FILENAME) {
             return;
         }
+        path[depth++] = current;
         current = current->children[index];
     }
     
@@ -232,6 +546,63 @@ void trie_delete(TrieNode* root, const char* filename) {
         current->is_end = 0;
         current->file_info = NULL;
     }
+    // Free the now-empty tail of the branch so prefix walks never visit dead nodes
+    while (depth > 0 && !current->is_end && current->child_count == 0) {
+        TrieNode* parent = path[--depth];
+        parent->children[(unsigned char)filename[depth]] = NULL;
+        parent->child_count--;
+        free(current);
+        current = parent;
+    }
+}
+
+static int trie_walk_node(TrieNode* node, char* name, int depth, const char* after, int after_live,
+                          int (*visit)(const char*, FileMetadata*, void*), void* arg) {
+    name[depth] = '\0';
+    // after_live: name equals after's first depth characters, so it sorts at or before after
+    if (node->is_end && node->file_info && !after_live) {
+        int stop = visit(name, node->file_info, arg);
+        if (stop) return stop;
+    }
+    if (depth >= MAX_FILENAME - 1) return 0;
+    int first = after_live ? (unsigned char)after[depth] : 0;
+    if (after_live && after[depth] == '\0') after_live = 0;   // every descendant sorts after
+    int seen = 0;
+    for (int c = 0; c < 256 && seen < node->child_count; c++) {
+        TrieNode* child = node->children[c];
+        if (!child) continue;
+        seen++;
+        if (after_live && c < first) continue;
+        name[depth] = (char)c;
+        int stop = trie_walk_node(child, name, depth + 1, after, after_live && c == first, visit, arg);
+        if (stop) return stop;
+    }
+    name[depth] = '\0';
+    return 0;
+}
+
+// Visit, in name order, every file whose name starts with prefix and sorts strictly after
+// `after` ("" or NULL: from the first). Stops early when visit returns non-zero and returns
+// that value. Costs the size of the subtree walked, not the number of files.
+int trie_walk_prefix(TrieNode* root, const char* prefix, const char* after,
+                     int (*visit)(const char* name, FileMetadata* file, void* arg), void* arg) {
+    if (root == NULL || prefix == NULL) return 0;
+    char name[MAX_FILENAME];
+    TrieNode* node = root;
+    int depth = 0;
+    for (; prefix[depth] != '\0'; depth++) {
+        if (depth >= MAX_FILENAME - 1) return 0;
+        node = node->children[(unsigned char)prefix[depth]];
+        if (node == NULL) return 0;
+        name[depth] = prefix[depth];
+    }
+    name[depth] = '\0';
+    if (after == NULL || after[0] == '\0') return trie_walk_node(node, name, depth, "", 0, visit, arg);
+    // Resume point must lie at or past the prefix: compare the prefix part first
+    int cmp = strncmp(after, prefix, depth);
+    if (cmp < 0) return trie_walk_node(node, name, depth, "", 0, visit, arg);
+    if (cmp > 0) return 0;
+    return trie_walk_node(node, name, depth, after, 1, visit, arg);
 }
 
 void trie_free(TrieNode* root) {
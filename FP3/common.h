@@ -16,6 +16,7 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <signal.h>
+#include <sys/mman.h>
 
 // Constants
 #define MAX_FILENAME 256
@@ -23,9 +24,11 @@
 #define MAX_USERNAME 64
 #define MAX_CONTENT 8192
 #define MAX_COMMAND 1024
-#define MAX_CLIENTS 100
-#define MAX_SS 50
-#define MAX_FILES 10000
+#define DEFAULT_MAX_CLIENTS 65536     // table limits; NM_MAX_CLIENTS etc. override them at startup
+#define DEFAULT_MAX_SS 1024
+#define MAX_REPLICAS 4 // copies of a file including the primary (NM_REPLICATION_FACTOR is capped here)
+#define DEFAULT_MAX_FILES 16777216
+#define DEFAULT_SS_MAX_FILES 1048576   // per storage server (SS_MAX_FILES)
 #define MAX_SENTENCE_LEN 4096
 #define MAX_WORD_LEN 256
 #define MAX_ACCESS_LIST 50
@@ -48,6 +51,8 @@
 #define ERR_USER_NOT_FOUND 10
 #define ERR_SS_NOT_FOUND 11
 #define ERR_NO_UNDO 12
+#define ERR_FILE_MOVED 13 // primary is handing the file to another SS; ask the NM again
+#define ERR_WRONG_SHARD 14 // the path belongs to another Name Server shard
 
 // Operation Codes
 #define OP_VIEW 1
@@ -86,21 +91,89 @@
 #define OP_RECENTS 38
 // Replication of folder creation
 #define OP_REPL_CREATEFOLDER 39
+// Storage server runtime statistics (NM port)
+#define OP_SS_STATS 40
+#define OP_REPL_STATUS 41 // SS -> NM: data "<ss_id> <in_sync> <partner_ip> <partner_nm_port>", filename
+#define OP_HEARTBEAT 42   // NM -> SS: reply data "<free_mb> <total_mb> <files> <req_per_sec>"
+#define OP_CLUSTER 43     // client -> NM: storage server placement/load table
+#define OP_SET_REPLICAS 44 // NM -> primary SS: data "replica <ip> <nm_port> ...", SS pushes the file to them
+#define OP_FREEZE 45      // NM -> primary SS: stop client edits, push the file to its replicas (migration)
+#define OP_MIGRATE 46     // client -> NM: data "<ss_id>", move the file's primary there
+#define OP_DRAIN 47       // client -> NM: data "<ss_id> <1|0>", move everything off an SS / let it take files again
+#define OP_BATCH 48       // client -> NM: data lines of CREATE/DELETE/ADDACCESS/REMACCESS, reply "<i> <code> <msg>" lines
+#define BATCH_MAX_ITEMS 128
+#define OP_SEARCH 49      // client -> NM and NM -> SS: data = query words; SS reply "<matched> <tf> <sentence> <file>" lines
+#define SEARCH_MAX_TERMS 8
+#define SEARCH_MAX_RESULTS 50
+#define PIPELINE_DEPTH 32   // pipelined NM requests a connection may have outstanding
+#define OP_NM_FOLLOW 50   // standby NM -> primary NM: data "<ip> <port>" it will serve on; metadata stream follows
+#define OP_SS_HEARTBEAT 51 // SS -> NM on its control session: data "<ss_id> <ip> <nm_port> <client_port> <interval_sec> <rtt_ms> <inv_epoch> <inv_version> <inv_root> <load report>", reply "<nm_boot_id> <inv_mode> <since>"
+#define OP_SS_INVENTORY 52 // SS -> NM after a heartbeat: inventory changes ("C"), bucket digests ("D") or bucket listings ("B")
+#define INV_BUCKETS 64      // inventory digest buckets, by the top bits of the name hash
+#define INV_IN_SYNC 0       // heartbeat reply modes: nothing to send,
+#define INV_CHANGES 1       // the changes after <since>,
+#define INV_DIGESTS 2       // or the bucket digests
+#define OP_REPL_CHECKPOINT 53 // primary -> replica (migration): data "<tag>\n<content>", stored as .checkpoints/<file>/<tag>
+#define OP_REPL_UNDO 54       // primary -> replica (migration): sentence_number = has undo, data = undo content
+#define OP_SHARD_MAP 55       // client/SS -> NM: reply data "<shards> <this shard> <ip>:<port> ..." (NM_SHARDS)
+#define OP_SHARD_PREPARE 56   // NM -> NM (cross-shard MOVE): filename = new name, data = "<txid>\n<record>"; reserves the name
+#define OP_SHARD_COMMIT 57    // NM -> NM: same data; records the moved file under the reserved name
+#define OP_SHARD_ABORT 58     // NM -> NM: data = "<txid>"; drops the reservation
 
 // Access Types
 #define ACCESS_NONE 0
 #define ACCESS_READ 1
 #define ACCESS_WRITE 2
 
+// Name Server addresses: where it was started plus the standbys it has announced.
+// Clients and storage servers go down the list when the one they use stops answering.
+#define MAX_NM_ADDRS 8
+typedef struct {
+    char ip[INET_ADDRSTRLEN];
+    int port;
+} NmAddr;
+typedef struct {
+    NmAddr addrs[MAX_NM_ADDRS];
+    int count;
+    int current;   // the one last reached
+} NmAddrList;
+
+// Namespace shards: with NM_SHARDS set, each Name Server owns the paths whose first
+// component hashes to its place in the list (shard_of); every shard is one NmAddrList
+#define MAX_NM_SHARDS 8
+
+// String interning: each distinct string gets a dense ID (1, 2, ...; 0 means none) that
+// stays valid for the table's lifetime, so hot paths compare integers instead of strings
+#define INTERN_CHUNK 4096
+#define INTERN_MAX_CHUNKS 4096
+typedef struct {
+    pthread_mutex_t lock;
+    char** chunks[INTERN_MAX_CHUNKS];  // ID -> string; chunks never move, so lookups by ID need no lock
+    int count;
+    int* slots;                        // open-addressed hash of IDs by string
+    int slot_cap;
+} InternTable;
+#define INTERN_TABLE_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, { NULL }, 0, NULL, 0 }
+
+// Growable table of fixed-size records whose addresses never change: address space for
+// `limit` records is reserved up front and committed as the table grows, so memory follows
+// the records in use and pointers (and mutexes) into the table stay valid
+typedef struct {
+    char* base;
+    size_t elem_size;
+    size_t limit;
+    size_t committed;      // records backed by memory
+} GrowTable;
+
 // Structures
 typedef struct {
-    char username[MAX_USERNAME];
+    int user_id;     // interned username
     int access_type; // ACCESS_READ or ACCESS_WRITE
 } AccessEntry;
 
 typedef struct {
     char filename[MAX_FILENAME];
-    char owner[MAX_USERNAME];
+    int owner_id;    // interned username
     int ss_id;
     char ss_ip[INET_ADDRSTRLEN];
     int ss_port;
@@ -108,18 +181,22 @@ typedef struct {
     int replica_ss_id;
     char replica_ss_ip[INET_ADDRSTRLEN];
     int replica_ss_port;
-    AccessEntry access_list[MAX_ACCESS_LIST];
+    // Grantees and pending requests live out of line in the name server's
+    // ACL slab; capacity is a power of two, NULL when empty
+    AccessEntry* access_list;
     int access_count;
+    int access_cap;
     // Pending access requests (bonus)
-    AccessEntry pending_requests[MAX_ACCESS_LIST];
+    AccessEntry* pending_requests;
     int pending_count;
+    int pending_cap;
     time_t created_time;
     time_t modified_time;
     time_t accessed_time;
     long size;
     int word_count;
     int char_count;
-    char last_accessed_by[MAX_USERNAME];
+    int last_accessed_by_id;
 } FileMetadata;
 
 typedef struct {
@@ -128,12 +205,14 @@ typedef struct {
     int nm_port;
     int client_port;
     int active;
-    char files[MAX_FILES][MAX_FILENAME];
+    int* files;             // files[] slots of the files it is primary for (NM only; not persisted)
+    int files_cap;
     int file_count;
 } StorageServerInfo;
 
 typedef struct {
     char username[MAX_USERNAME];
+    int user_id;
     char ip[INET_ADDRSTRLEN];
     int nm_port;
     int ss_port;
@@ -152,8 +231,16 @@ typedef struct {
     int error_code;
     char error_msg[256];
     int data_size;
+    int request_id; // NM: non-zero = pipelined, the reply carries it back and may arrive out of order
 } Message;
 
+// Reply header for OP_READ with FLAG_READ_RAW; `size` raw content bytes follow it
+typedef struct {
+    int error_code;
+    int reserved;
+    long long size;
+} RawReadHeader;
+
 typedef struct {
     char ss_ip[INET_ADDRSTRLEN];
     int ss_port;
@@ -163,6 +250,7 @@ typedef struct {
 typedef struct TrieNode {
     struct TrieNode* children[256];
     int is_end;
+    int child_count;   // non-NULL children; empty branches are pruned on delete
     FileMetadata* file_info;
 } TrieNode;
 
@@ -177,8 +265,36 @@ void trim_whitespace(char* str);
 int create_socket();
 int send_message(int socket_fd, Message* msg);
 int receive_message(int socket_fd, Message* msg);
+int send_all(int socket_fd, const void* buf, size_t len, int flags);
+int recv_all(int socket_fd, void* buf, size_t len);
 void print_error(int error_code, const char* context);
-int check_access(FileMetadata* file, const char* username, int required_access);
+int check_access(FileMetadata* file, int user_id, int required_access);
+unsigned int hash_string(const char* str);
+unsigned long long inv_name_hash(const char* name);
+unsigned long long inv_entry_hash(unsigned long long name_hash, int words, int chars);
+int inv_bucket(unsigned long long name_hash);
+unsigned long long inv_root(const unsigned long long* digests);
+void count_words_chars(const char* text, int* words, int* chars);
+int get_env_int(const char* name, int default_value);
+
+// Name Server address lists
+void nm_addrs_add(NmAddrList* list, const char* ip, int port);
+void nm_addrs_parse(NmAddrList* list, const char* text);
+int nm_connect(NmAddrList* list, int wait_sec);
+
+// Namespace shards
+int shard_of(const char* path, int shard_count);
+int shard_list_parse(NmAddrList* shards, const char* text);
+
+// Growable tables
+void* table_init(GrowTable* table, size_t elem_size, size_t limit);
+int table_grow(GrowTable* table, size_t count);
+int table_map(GrowTable* table, int fd, off_t offset, size_t count);
+
+// String interning
+int intern_id(InternTable* table, const char* str);
+int intern_lookup(InternTable* table, const char* str);
+const char* intern_str(InternTable* table, int id);
 
 // Trie Operations
 TrieNode* create_trie_node();
@@ -186,8 +302,22 @@ void trie_insert(TrieNode* root, const char* filename, FileMetadata* file_info);
 FileMetadata* trie_search(TrieNode* root, const char* filename);
 void trie_delete(TrieNode* root, const char* filename);
 void trie_free(TrieNode* root);
+int trie_walk_prefix(TrieNode* root, const char* prefix, const char* after,
+                     int (*visit)(const char* name, FileMetadata* file, void* arg), void* arg);
 
 // Flags (bitmask)
 #define FLAG_REPL 0x100
+#define FLAG_LOCK_SHARED 0x200 // OP_LOCK_SENTENCE/OP_UNLOCK_SENTENCE: shared (reader) lock
+#define FLAG_READ_RAW 0x400    // OP_READ to SS: reply is a RawReadHeader followed by the whole file
+#define FLAG_EXEC_MORE 0x800   // OP_EXEC reply: more output messages follow this one
+#define FLAG_EXEC_STREAM 0x1000 // OP_EXEC: forward output as it is produced (frames of data_size bytes)
+#define FLAG_EXEC_STDERR 0x2000 // OP_EXEC stream frame: the chunk came from stderr
+#define FLAG_EXEC_ACK 0x4000    // client -> NM during a stream: sentence_number frames consumed
+#define EXEC_STREAM_WINDOW 16   // stream frames the NM may have unacknowledged
+#define FLAG_LIST_MORE 0x8000   // VIEW/VIEWFOLDER reply: page is partial, resend with data = reply filename
+
+// Sentence lock leases (seconds). Holders renew by re-sending OP_LOCK_SENTENCE.
+#define DEFAULT_LOCK_LEASE_SEC 120
+#define LOCK_RENEW_INTERVAL_SEC 30
 
 #endif // COMMON_H
@@ -2,6 +2,12 @@
 #include <sys/time.h>
 #include <signal.h>
 #include <ctype.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <fnmatch.h>
+#include <stdint.h>
 
 // Graceful shutdown control
 static volatile sig_atomic_t nm_running = 1;
@@ -16,31 +22,283 @@ static void handle_sigint(int sig) {
     if (nm_socket > 0) close(nm_socket);
 }
 
-// Global variables
-StorageServerInfo storage_servers[MAX_SS];
-ClientInfo clients[MAX_CLIENTS];
-FileMetadata files[MAX_FILES];
+// Global variables: growable tables (see nm_tables_init), so records never move
+StorageServerInfo* storage_servers;
+ClientInfo* clients;
+FileMetadata* files;
+static GrowTable ss_table, client_table, file_table;
+static int max_ss = DEFAULT_MAX_SS;           // NM_MAX_SS
+static int max_clients = DEFAULT_MAX_CLIENTS; // NM_MAX_CLIENTS
+static int max_files = DEFAULT_MAX_FILES;     // NM_MAX_FILES
+
+// Bookkeeping beside each files[] slot (guarded by nm_lock). A record keeps its slot for
+// life, so deleting one frees just that slot: it goes on a free list for the next create
+// and its generation is bumped, so a cached (slot, generation) handle stops matching.
+typedef struct {
+    unsigned int generation;
+    int next_free;    // free-list link while the slot is empty
+    int ss_pos;       // index in its primary's storage_servers[].files, -1 if not listed
+    int ready;        // 0 while the record is still as mapped from nm_data.dat (see file_ready)
+} FileSlot;
+
+static FileSlot* file_slots;
+static GrowTable file_slot_table;
+static int file_free_head = -1;
 TrieNode* file_trie_root;
 int ss_count = 0;
 int client_count = 0;
-int file_count = 0;
+int file_count = 0;   // slots handed out so far; freed ones are empty (filename[0] == '\0')
 pthread_mutex_t nm_lock = PTHREAD_MUTEX_INITIALIZER;
 int nm_socket;
 
-// Cache for recent searches
+// Namespace shards (NM_SHARDS, NM_SHARD_ID): every shard's Name Server, and this one's index
+static NmAddrList shard_addrs[MAX_NM_SHARDS];
+static int shard_count = 1;
+static int shard_id = 0;
+
+// Interned usernames (persisted with the snapshot and journal)
+static InternTable user_names = INTERN_TABLE_INITIALIZER;
+
+// Cache for recent searches; an entry is live while its slot's generation and name still match
 typedef struct {
     char filename[MAX_FILENAME];
-    FileMetadata* file_info;
+    int slot;
+    unsigned int generation;
     time_t timestamp;
 } CacheEntry;
 
 CacheEntry search_cache[100];
 int cache_size = 0;
 
+// Replica freshness as reported by primaries (OP_REPL_STATUS), keyed by filename.
+// Kept outside nm_lock so an SS can report while the NM waits on that SS.
+typedef struct ReplicaState {
+    char filename[MAX_FILENAME];
+    int in_sync;
+    int reporter_ss_id;
+    char partner_ip[INET_ADDRSTRLEN];
+    int partner_nm_port;
+    struct ReplicaState* next;
+} ReplicaState;
+
+#define REPLICA_STATE_BUCKETS 4096
+static ReplicaState* replica_states[REPLICA_STATE_BUCKETS];
+static pthread_mutex_t replica_state_lock = PTHREAD_MUTEX_INITIALIZER; // may be taken under nm_lock
+
+// Capacity and load reported by each SS at registration and on every heartbeat (guarded by nm_lock)
+typedef struct {
+    long long free_mb;     // -1 when unknown
+    long long total_mb;
+    int files;             // files stored on the SS (primary and replica copies)
+    double req_rate;       // client requests per second
+    double rtt_ms;         // smoothed heartbeat round trip
+    time_t updated;
+} SSLoad;
+
+static SSLoad* ss_load;               // max_ss entries
+
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int placement_min_free_mb = 16;
+
+// Consistent-hash ring over the storage servers (guarded by nm_lock). Each server owns
+// NM_VNODES points hashed from its address, so a server joining or leaving only moves
+// the files next to its own points. A file lives on the first NM_REPLICATION_FACTOR
+// distinct servers clockwise from the hash of its name.
+#define MAX_VNODES 256
+typedef struct {
+    unsigned int hash;
+    int ss_id;
+} RingPoint;
+
+static RingPoint* ring;                // max_ss * MAX_VNODES points
+static int ring_size = 0;
+static int ring_members = 0;
+static int ring_vnodes = 64;
+static int replication_factor = 2;
+static int* ss_in_ring;                 // cleared once a server stays down past NM_SS_EXPIRE_SEC
+static time_t* ss_down_since;
+static time_t* ss_session_until;        // heartbeats on the SS's control session cover it until then; no probing
+
+// The NM's copy of each SS's file set (guarded by nm_lock), kept current over the control
+// session (handle_ss_heartbeat, handle_ss_inventory). VIEW and INFO look files up here
+// instead of asking the SS about each one.
+typedef struct InvName {
+    struct InvName* next;
+    unsigned long long name_hash;
+    unsigned long long hash;        // entry hash, as in the SS's bucket digest
+    int words;
+    int chars;
+    char name[];
+} InvName;
+
+typedef struct {
+    long long epoch;                // the SS inventory this copy follows (new on each SS start)
+    unsigned long version;          // complete as of this SS version while synced
+    int synced;
+    int receiving;                  // part way through a change list
+    unsigned long long pending;     // buckets being listed after a digest compare
+    unsigned long pending_version;
+    unsigned long rounds;           // heartbeats answered
+    unsigned long round_open;       // heartbeat that started the sync in progress
+    unsigned long round_checked;    // heartbeat whose SS state this copy matches
+    unsigned long round_touched;    // last heartbeat after which the NM placed a file there
+    unsigned long long digest[INV_BUCKETS];
+    InvName** heads;
+    size_t cap;                     // power of two, 0 until the first name
+    size_t count;
+} SSInventory;
+
+static SSInventory* ss_inv;             // max_ss entries
+static long long nm_boot_id;            // changes on every start, so storage servers notice and register again
+static int ss_expire_sec = 300;
+static int reconcile_running = 0;
+static int reconcile_again = 0;
+static unsigned long placement_moves = 0; // replica copies added by reconciliation
+
+// Every replica of a file, keyed by filename (guarded by nm_lock). FileMetadata keeps
+// the first one in replica_ss_* so its on-disk layout stays as it was.
+typedef struct PlacementEntry {
+    char filename[MAX_FILENAME];
+    int count;
+    int ss[MAX_REPLICAS - 1];
+    struct PlacementEntry* next;
+} PlacementEntry;
+
+#define PLACEMENT_BUCKETS 4096
+static PlacementEntry* placements[PLACEMENT_BUCKETS];
+
+// Serializes replica-set changes sent to storage servers (reconciliation and migration),
+// so neither can unfreeze or re-point a file the other is working on. Taken before nm_lock.
+static pthread_mutex_t placement_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Primary migrations waiting for the rebalancer (guarded by nm_lock)
+typedef struct {
+    char filename[MAX_FILENAME];
+    int target;
+} MigrationJob;
+
+static MigrationJob* migration_queue = NULL;   // ring buffer, doubled when full
+static int migration_cap = 0;
+static int migration_head = 0;
+static int migration_len = 0;
+static pthread_cond_t migration_cond = PTHREAD_COND_INITIALIZER;
+static int migrate_per_sec = 2;
+static int* ss_draining;                // DRAIN: out of the ring, primaries being moved off
+static char migration_current[MAX_FILENAME];
+static struct {
+    unsigned long done;
+    unsigned long failed;
+} migration_stats;
+
+// EXEC sandbox limits and the slots bounding concurrent jobs
+static pthread_mutex_t exec_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t exec_cond = PTHREAD_COND_INITIALIZER;
+static int exec_running = 0;
+static int exec_max = 4;
+static int exec_cpu_sec = 5;
+static int exec_wall_sec = 10;
+static int exec_mem_mb = 256;
+static long exec_max_output = 1024L * 1024;
+
+// Reads routed to each SS, halved every READ_LOAD_HALF_LIFE_MS (guarded by nm_lock)
+#define READ_LOAD_HALF_LIFE_MS 500
+static double* ss_read_load;
+static long long* ss_read_load_ms;
+
+// Reserve the file, storage server and client tables and the per-server state. Limits
+// come from NM_MAX_FILES, NM_MAX_SS and NM_MAX_CLIENTS; memory is committed as they fill.
+static int nm_tables_init() {
+    max_files = get_env_int("NM_MAX_FILES", DEFAULT_MAX_FILES);
+    max_ss = get_env_int("NM_MAX_SS", DEFAULT_MAX_SS);
+    max_clients = get_env_int("NM_MAX_CLIENTS", DEFAULT_MAX_CLIENTS);
+    if (max_files < 1) max_files = 1;
+    if (max_ss < 1) max_ss = 1;
+    if (max_clients < 1) max_clients = 1;
+    files = table_init(&file_table, sizeof(FileMetadata), max_files);
+    file_slots = table_init(&file_slot_table, sizeof(FileSlot), max_files);
+    storage_servers = table_init(&ss_table, sizeof(StorageServerInfo), max_ss);
+    clients = table_init(&client_table, sizeof(ClientInfo), max_clients);
+    ss_load = calloc(max_ss, sizeof(SSLoad));
+    ring = calloc((size_t)max_ss * MAX_VNODES, sizeof(RingPoint));
+    ss_in_ring = calloc(max_ss, sizeof(int));
+    ss_down_since = calloc(max_ss, sizeof(time_t));
+    ss_session_until = calloc(max_ss, sizeof(time_t));
+    ss_inv = calloc(max_ss, sizeof(SSInventory));
+    ss_draining = calloc(max_ss, sizeof(int));
+    ss_read_load = calloc(max_ss, sizeof(double));
+    ss_read_load_ms = calloc(max_ss, sizeof(long long));
+    if (!files || !file_slots || !storage_servers || !clients || !ss_load || !ring || !ss_in_ring ||
+        !ss_down_since || !ss_session_until || !ss_inv || !ss_draining || !ss_read_load || !ss_read_load_ms) return -1;
+    return 0;
+}
+
+static void file_acl_release(FileMetadata* file);
+
+// nm_lock held: a zeroed slot for a new record, reusing freed slots first; -1 when full
+static int file_slot_alloc() {
+    int slot;
+    if (file_free_head >= 0) {
+        slot = file_free_head;
+        file_free_head = file_slots[slot].next_free;
+    } else {
+        if (table_grow(&file_table, file_count + 1) != 0 || table_grow(&file_slot_table, file_count + 1) != 0) return -1;
+        slot = file_count++;
+    }
+    memset(&files[slot], 0, sizeof(files[slot]));
+    file_slots[slot].next_free = -1;
+    file_slots[slot].ss_pos = -1;
+    file_slots[slot].ready = 1;
+    return slot;
+}
+
+// nm_lock held: empty the slot (after the record is unlisted everywhere) and free it
+static void file_slot_free(int slot) {
+    file_acl_release(&files[slot]);
+    memset(&files[slot], 0, sizeof(files[slot]));
+    file_slots[slot].generation++;
+    file_slots[slot].ss_pos = -1;
+    file_slots[slot].next_free = file_free_head;
+    file_free_head = slot;
+}
+
+// nm_lock held: list the record in slot under ss, its primary
+static void ss_files_add(StorageServerInfo* ss, int slot) {
+    if (ss->file_count == ss->files_cap) {
+        int cap = ss->files_cap ? ss->files_cap * 2 : 64;
+        int* grown = realloc(ss->files, (size_t)cap * sizeof(int));
+        if (grown == NULL) return;
+        ss->files = grown;
+        ss->files_cap = cap;
+    }
+    file_slots[slot].ss_pos = ss->file_count;
+    ss->files[ss->file_count++] = slot;
+}
+
+// nm_lock held: unlist the record from its primary's list by swapping the last entry in
+static void ss_files_remove(int slot) {
+    int sid = files[slot].ss_id, pos = file_slots[slot].ss_pos;
+    file_slots[slot].ss_pos = -1;
+    if (sid < 0 || sid >= ss_count || pos < 0) return;
+    StorageServerInfo* ss = &storage_servers[sid];
+    if (pos >= ss->file_count || ss->files[pos] != slot) return;
+    int moved = ss->files[--ss->file_count];
+    if (moved != slot) {
+        ss->files[pos] = moved;
+        file_slots[moved].ss_pos = pos;
+    }
+}
+
 // Function prototypes
 void* handle_ss_connection(void* arg);
 void* handle_client_connection(void* arg);
 void register_storage_server(int socket_fd, Message* msg);
+void handle_ss_heartbeat(int socket_fd, Message* msg);
+void handle_ss_inventory(int socket_fd, Message* msg);
 void register_client(int socket_fd, Message* msg);
 int find_ss_for_file(const char* filename);
 void handle_view_command(int client_sock, Message* msg);
@@ -62,35 +320,133 @@ void handle_viewrequests_command(int client_sock, Message* msg);
 void handle_approve_command(int client_sock, Message* msg);
 void handle_deny_command(int client_sock, Message* msg);
 void handle_recents_command(int client_sock, Message* msg);
+void handle_search_command(int client_sock, Message* msg);
+void handle_repl_status(int client_sock, Message* msg);
+void handle_cluster_command(int client_sock, Message* msg);
+static void replica_state_forget(const char* filename);
+static void placement_forget(const char* filename);
+static void placement_rename(const char* oldname, const char* newname);
+static void ring_rebuild();
+static void schedule_reconcile();
+static int rank_storage_servers(int* order, double* scores);
+static int migration_enqueue(const char* filename, int target);
+static int pick_migration_target(FileMetadata* file);
+static void* migration_worker(void* arg);
+static void* pipeline_worker(void* arg);
+void handle_migrate_command(int client_sock, Message* msg);
+void handle_drain_command(int client_sock, Message* msg);
 FileMetadata* search_file_cached(const char* filename);
 void update_cache(const char* filename, FileMetadata* file_info);
 void load_persistent_data();
 void save_persistent_data();
+static void journal_file_put(FileMetadata* file);
+static void journal_file_del(const char* filename);
+static FileMetadata* file_lookup(const char* filename);
+static FileMetadata* file_ready(int slot);
+static void files_wait_indexed();
+static void name_index_put(int slot);
+static void name_index_del(const char* filename);
+static void journal_user(const char* name);
+static void journal_commit();
+void handle_batch_command(int client_sock, Message* msg);
+void handle_standby_follow(int client_sock, Message* msg);
+static void standby_follow(const char* primary, int serve_port);
+static void standby_list(char* out, size_t cap);
+static void shard_init();
+static int shard_owns(const char* path);
+static int shard_name_busy(const char* name);
+static void shard_move_file(int client_sock, Message* msg, const char* newname);
+static void handle_shard_map(int client_sock, Message* msg);
+static void handle_shard_prepare(int client_sock, Message* msg);
+static void handle_shard_commit(int client_sock, Message* msg);
+static void handle_shard_abort(int client_sock, Message* msg);
 
 // Helpers to validate SS state and purge stale metadata
-static int ss_file_exists(FileMetadata* file);
+static int ss_inventory_check(FileMetadata* file);
+static void inventory_touch(FileMetadata* file);
 static void purge_file_metadata(const char* filename);
 // Forward declarations for heartbeat & sync threads
 void* storage_server_heartbeat_loop(void* arg);
+static void ss_mark_alive(int i, const char* report, double rtt_ms);
 void* sync_returned_primary(void* arg);
 
+static const char* user_name(int user_id) {
+    return intern_str(&user_names, user_id);
+}
+
+// ID of the requesting user, 0 if the name was never seen (such a user owns and can access nothing)
+static int request_user(Message* msg) {
+    return intern_lookup(&user_names, msg->username);
+}
+
+// nm_lock held: ID for a username that is about to be stored, journaling names seen for the first time
+static int nm_user_id(const char* name) {
+    int id = intern_lookup(&user_names, name);
+    if (id == 0) {
+        id = intern_id(&user_names, name);
+        if (id) journal_user(name);
+    }
+    return id;
+}
+
 int main() {
     // Register SIGINT handler for clean shutdown / quick restart
     signal(SIGINT, handle_sigint);
+    // A client that goes away mid-reply must not take the NM down
+    signal(SIGPIPE, SIG_IGN);
+
+    if (nm_tables_init() != 0) {
+        log_message("NM", "ERROR", "Failed to reserve metadata tables");
+        exit(EXIT_FAILURE);
+    }
+    nm_boot_id = ((long long)time(NULL) << 20) ^ getpid();
 
     // Start heartbeat thread to monitor storage server liveness
     pthread_t hb_thread; pthread_create(&hb_thread, NULL, storage_server_heartbeat_loop, NULL); pthread_detach(hb_thread);
 
     struct sockaddr_in server_addr;
+    int listen_port = get_env_int("NM_PORT", PORT_NM);
     
     printf("=== LangOS Distributed File System - Name Server ===\n");
-    log_message("NM", "INFO", "Starting Name Server on port %d", PORT_NM);
+    log_message("NM", "INFO", "Starting Name Server on port %d", listen_port);
     
     // Initialize trie
     file_trie_root = create_trie_node();
+
+    // A standby mirrors its primary's files here until it has to take over
+    const char* standby_of = getenv("NM_STANDBY_OF");
+    if (standby_of && standby_of[0]) standby_follow(standby_of, listen_port);
     
     // Load persistent data
     load_persistent_data();
+    shard_init();
+    placement_min_free_mb = get_env_int("NM_MIN_FREE_MB", 16);
+    ring_vnodes = get_env_int("NM_VNODES", 64);
+    if (ring_vnodes < 1) ring_vnodes = 1;
+    if (ring_vnodes > MAX_VNODES) ring_vnodes = MAX_VNODES;
+    replication_factor = get_env_int("NM_REPLICATION_FACTOR", 2);
+    if (replication_factor < 1) replication_factor = 1;
+    if (replication_factor > MAX_REPLICAS) replication_factor = MAX_REPLICAS;
+    ss_expire_sec = get_env_int("NM_SS_EXPIRE_SEC", 300);
+    migrate_per_sec = get_env_int("NM_MIGRATE_PER_SEC", 2);
+    if (migrate_per_sec < 1) migrate_per_sec = 1;
+    pthread_t mig_thread; pthread_create(&mig_thread, NULL, migration_worker, NULL); pthread_detach(mig_thread);
+    exec_max = get_env_int("NM_EXEC_WORKERS", 4);
+    if (exec_max < 1) exec_max = 1;
+    exec_cpu_sec = get_env_int("NM_EXEC_CPU_SEC", 5);
+    exec_wall_sec = get_env_int("NM_EXEC_WALL_SEC", 10);
+    exec_mem_mb = get_env_int("NM_EXEC_MEM_MB", 256);
+    exec_max_output = (long)get_env_int("NM_EXEC_MAX_OUTPUT_KB", 1024) * 1024;
+    int pipeline_workers = get_env_int("NM_WORKERS", 8);
+    if (pipeline_workers < 1) pipeline_workers = 1;
+    for (int i = 0; i < pipeline_workers; i++) {
+        pthread_t t; pthread_create(&t, NULL, pipeline_worker, NULL); pthread_detach(t);
+    }
+    pthread_mutex_lock(&nm_lock);
+    for (int i = 0; i < max_ss; i++) { ss_load[i].free_mb = -1; ss_load[i].total_mb = -1; } // unknown until a heartbeat
+    for (int i = 0; i < ss_count; i++) ss_in_ring[i] = 1;
+    ring_rebuild();
+    pthread_mutex_unlock(&nm_lock);
     
     // Create socket
     nm_socket = create_socket();
@@ -106,7 +462,7 @@ int main() {
     // Bind socket
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT_NM);
+    server_addr.sin_port = htons(listen_port);
     
     if (bind(nm_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         perror("Bind failed");
@@ -159,11 +515,223 @@ int main() {
     return 0;
 }
 
+// Pipelined requests (request_id != 0) are queued to a shared worker pool and answered
+// as they finish; each connection may have PIPELINE_DEPTH of them outstanding
+typedef struct {
+    int sock;
+    int inflight;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ClientConn;
+
+typedef struct PipelineJob {
+    ClientConn* conn;
+    Message msg;
+    struct PipelineJob* next;
+} PipelineJob;
+
+#define PIPELINE_QUEUE_MAX 1024
+static PipelineJob* pipeline_head = NULL;
+static PipelineJob* pipeline_tail = NULL;
+static int pipeline_len = 0;
+static pthread_mutex_t pipeline_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pipeline_nonempty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pipeline_nonfull = PTHREAD_COND_INITIALIZER;
+
+// Requests naming a path in msg->filename, which only the path's shard may serve
+static int shard_routed_op(int op) {
+    switch (op) {
+        case OP_CREATE: case OP_CREATEFOLDER: case OP_DELETE: case OP_MOVE: case OP_INFO:
+        case OP_ADDACCESS: case OP_REMACCESS: case OP_REQACCESS: case OP_VIEWREQUESTS:
+        case OP_APPROVE: case OP_DENY: case OP_EXEC: case OP_READ: case OP_STREAM: case OP_UNDO:
+        case OP_CHECKPOINT: case OP_VIEWCHECKPOINT: case OP_REVERT: case OP_LISTCHECKPOINTS:
+        case OP_WRITE: case OP_MIGRATE: case OP_VIEWFOLDER:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Route one request to its handler, which sends the reply
+static void dispatch_request(int client_sock, Message* msg) {
+    if (shard_routed_op(msg->op_code) && !shard_owns(msg->filename)) {
+        msg->error_code = ERR_WRONG_SHARD;
+        snprintf(msg->error_msg, sizeof(msg->error_msg), "Path belongs to shard %d", shard_of(msg->filename, shard_count));
+        send_message(client_sock, msg);
+        return;
+    }
+    switch (msg->op_code) {
+        case OP_REGISTER_SS:
+            register_storage_server(client_sock, msg);
+            break;
+        case OP_REGISTER_CLIENT:
+            register_client(client_sock, msg);
+            break;
+        case OP_SS_HEARTBEAT:
+            handle_ss_heartbeat(client_sock, msg);
+            break;
+        case OP_SS_INVENTORY:
+            handle_ss_inventory(client_sock, msg);
+            break;
+        case OP_REPL_STATUS:
+            handle_repl_status(client_sock, msg);
+            break;
+        case OP_NM_FOLLOW:
+            handle_standby_follow(client_sock, msg);
+            break;
+        case OP_CLUSTER:
+            handle_cluster_command(client_sock, msg);
+            break;
+        case OP_MIGRATE:
+            handle_migrate_command(client_sock, msg);
+            break;
+        case OP_DRAIN:
+            handle_drain_command(client_sock, msg);
+            break;
+        case OP_VIEW:
+            handle_view_command(client_sock, msg);
+            break;
+        case OP_VIEWFOLDER:
+            handle_viewfolder_command(client_sock, msg);
+            break;
+        case OP_CREATE:
+            handle_create_command(client_sock, msg);
+            break;
+        case OP_CREATEFOLDER:
+            handle_createfolder_command(client_sock, msg);
+            break;
+        case OP_DELETE:
+            handle_delete_command(client_sock, msg);
+            break;
+        case OP_MOVE:
+            handle_move_command(client_sock, msg);
+            break;
+        case OP_INFO:
+            handle_info_command(client_sock, msg);
+            break;
+        case OP_LIST:
+            handle_list_command(client_sock, msg);
+            break;
+        case OP_ADDACCESS:
+            handle_addaccess_command(client_sock, msg);
+            break;
+        case OP_REMACCESS:
+            handle_remaccess_command(client_sock, msg);
+            break;
+        case OP_BATCH:
+            handle_batch_command(client_sock, msg);
+            break;
+        case OP_REQACCESS:
+            handle_reqaccess_command(client_sock, msg);
+            break;
+        case OP_VIEWREQUESTS:
+            handle_viewrequests_command(client_sock, msg);
+            break;
+        case OP_APPROVE:
+            handle_approve_command(client_sock, msg);
+            break;
+        case OP_DENY:
+            handle_deny_command(client_sock, msg);
+            break;
+        case OP_EXEC:
+            handle_exec_command(client_sock, msg);
+            break;
+        case OP_READ:
+        case OP_STREAM:
+        case OP_UNDO:
+        case OP_CHECKPOINT:
+        case OP_VIEWCHECKPOINT:
+        case OP_REVERT:
+        case OP_LISTCHECKPOINTS:
+            handle_read_stream_undo_command(client_sock, msg);
+            break;
+        case OP_WRITE:
+            handle_write_command(client_sock, msg);
+            break;
+        case OP_RECENTS:
+            handle_recents_command(client_sock, msg);
+            break;
+        case OP_SEARCH:
+            handle_search_command(client_sock, msg);
+            break;
+        case OP_SHARD_MAP:
+            handle_shard_map(client_sock, msg);
+            break;
+        case OP_SHARD_PREPARE:
+            handle_shard_prepare(client_sock, msg);
+            break;
+        case OP_SHARD_COMMIT:
+            handle_shard_commit(client_sock, msg);
+            break;
+        case OP_SHARD_ABORT:
+            handle_shard_abort(client_sock, msg);
+            break;
+        default:
+            msg->error_code = ERR_INVALID_COMMAND;
+            strcpy(msg->error_msg, "Invalid command");
+            send_message(client_sock, msg);
+            break;
+    }
+}
+
+static void* pipeline_worker(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&pipeline_lock);
+        while (pipeline_head == NULL) pthread_cond_wait(&pipeline_nonempty, &pipeline_lock);
+        PipelineJob* job = pipeline_head;
+        pipeline_head = job->next;
+        if (!pipeline_head) pipeline_tail = NULL;
+        pipeline_len--;
+        pthread_cond_signal(&pipeline_nonfull);
+        pthread_mutex_unlock(&pipeline_lock);
+
+        dispatch_request(job->conn->sock, &job->msg);
+
+        pthread_mutex_lock(&job->conn->lock);
+        job->conn->inflight--;
+        pthread_cond_broadcast(&job->conn->cond);
+        pthread_mutex_unlock(&job->conn->lock);
+        free(job);
+    }
+    return NULL;
+}
+
+// Reader thread: blocks while the connection is at its depth limit or the pool queue is full
+static void pipeline_submit(ClientConn* conn, Message* msg) {
+    PipelineJob* job = malloc(sizeof(PipelineJob));
+    if (!job) {
+        msg->error_code = ERR_SERVER_ERROR;
+        strcpy(msg->error_msg, "Out of memory");
+        send_message(conn->sock, msg);
+        return;
+    }
+    job->conn = conn;
+    job->msg = *msg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&conn->lock);
+    while (conn->inflight >= PIPELINE_DEPTH) pthread_cond_wait(&conn->cond, &conn->lock);
+    conn->inflight++;
+    pthread_mutex_unlock(&conn->lock);
+
+    pthread_mutex_lock(&pipeline_lock);
+    while (pipeline_len >= PIPELINE_QUEUE_MAX) pthread_cond_wait(&pipeline_nonfull, &pipeline_lock);
+    if (pipeline_tail) pipeline_tail->next = job; else pipeline_head = job;
+    pipeline_tail = job;
+    pipeline_len++;
+    pthread_cond_signal(&pipeline_nonempty);
+    pthread_mutex_unlock(&pipeline_lock);
+}
+
 void* handle_client_connection(void* arg) {
     int client_sock = *(int*)arg;
     free(arg);
     
     Message msg;
+    ClientConn conn = { .sock = client_sock, .inflight = 0 };
+    pthread_mutex_init(&conn.lock, NULL);
+    pthread_cond_init(&conn.cond, NULL);
     
     while (1) {
         memset(&msg, 0, sizeof(Message));
@@ -186,82 +754,22 @@ void* handle_client_connection(void* arg) {
         
         log_request("NM", "client", client_sock, msg.username, "Operation");
         
-        // Route based on operation
-        switch (msg.op_code) {
-            case OP_REGISTER_SS:
-                register_storage_server(client_sock, &msg);
-                break;
-            case OP_REGISTER_CLIENT:
-                register_client(client_sock, &msg);
-                break;
-            case OP_VIEW:
-                handle_view_command(client_sock, &msg);
-                break;
-            case OP_VIEWFOLDER:
-                handle_viewfolder_command(client_sock, &msg);
-                break;
-            case OP_CREATE:
-                handle_create_command(client_sock, &msg);
-                break;
-            case OP_CREATEFOLDER:
-                handle_createfolder_command(client_sock, &msg);
-                break;
-            case OP_DELETE:
-                handle_delete_command(client_sock, &msg);
-                break;
-            case OP_MOVE:
-                handle_move_command(client_sock, &msg);
-                break;
-            case OP_INFO:
-                handle_info_command(client_sock, &msg);
-                break;
-            case OP_LIST:
-                handle_list_command(client_sock, &msg);
-                break;
-            case OP_ADDACCESS:
-                handle_addaccess_command(client_sock, &msg);
-                break;
-            case OP_REMACCESS:
-                handle_remaccess_command(client_sock, &msg);
-                break;
-            case OP_REQACCESS:
-                handle_reqaccess_command(client_sock, &msg);
-                break;
-            case OP_VIEWREQUESTS:
-                handle_viewrequests_command(client_sock, &msg);
-                break;
-            case OP_APPROVE:
-                handle_approve_command(client_sock, &msg);
-                break;
-            case OP_DENY:
-                handle_deny_command(client_sock, &msg);
-                break;
-            case OP_EXEC:
-                handle_exec_command(client_sock, &msg);
-                break;
-            case OP_READ:
-            case OP_STREAM:
-            case OP_UNDO:
-            case OP_CHECKPOINT:
-            case OP_VIEWCHECKPOINT:
-            case OP_REVERT:
-            case OP_LISTCHECKPOINTS:
-                handle_read_stream_undo_command(client_sock, &msg);
-                break;
-            case OP_WRITE:
-                handle_write_command(client_sock, &msg);
-                break;
-            case OP_RECENTS:
-                handle_recents_command(client_sock, &msg);
-                break;
-            default:
-                msg.error_code = ERR_INVALID_COMMAND;
-                strcpy(msg.error_msg, "Invalid command");
-                send_message(client_sock, &msg);
-                break;
+        // Registration sets up per-connection state, so it always runs in order; a streaming
+        // EXEC reads the client's acks from this socket, so it keeps the reader too
+        if (msg.request_id != 0 && msg.op_code != OP_REGISTER_SS && msg.op_code != OP_REGISTER_CLIENT &&
+            !(msg.op_code == OP_EXEC && (msg.flags & FLAG_EXEC_STREAM))) {
+            pipeline_submit(&conn, &msg);
+            continue;
         }
+        dispatch_request(client_sock, &msg);
     }
     
+    // Workers may still be answering on this socket
+    pthread_mutex_lock(&conn.lock);
+    while (conn.inflight > 0) pthread_cond_wait(&conn.cond, &conn.lock);
+    pthread_mutex_unlock(&conn.lock);
+    pthread_mutex_destroy(&conn.lock);
+    pthread_cond_destroy(&conn.cond);
     close(client_sock);
     return NULL;
 }
@@ -271,7 +779,9 @@ void register_storage_server(int socket_fd, Message* msg) {
     
     // Parse registration data first
     char reg_ip[INET_ADDRSTRLEN]; int reg_nm_port = 0; int reg_client_port = 0;
-    sscanf(msg->data, "%15s %d %d", reg_ip, &reg_nm_port, &reg_client_port);
+    SSLoad reg_load; memset(&reg_load, 0, sizeof(reg_load)); reg_load.free_mb = -1; reg_load.total_mb = -1;
+    int reg_fields = sscanf(msg->data, "%15s %d %d %lld %lld %d %lf", reg_ip, &reg_nm_port, &reg_client_port,
+                            &reg_load.free_mb, &reg_load.total_mb, &reg_load.files, &reg_load.req_rate);
 
     // Try to find existing inactive (or active) entry matching ip+ports to reuse
     StorageServerInfo* ss = NULL;
@@ -287,7 +797,7 @@ void register_storage_server(int socket_fd, Message* msg) {
     int was_inactive = 0;
     // If not found, append new entry
     if (ss == NULL) {
-        if (ss_count >= MAX_SS) {
+        if (table_grow(&ss_table, ss_count + 1) != 0) {
             msg->error_code = ERR_SERVER_ERROR;
             strcpy(msg->error_msg, "Maximum storage servers reached");
             pthread_mutex_unlock(&nm_lock);
@@ -300,20 +810,34 @@ void register_storage_server(int socket_fd, Message* msg) {
         ss->nm_port = reg_nm_port;
         ss->client_port = reg_client_port;
         ss->active = 1;
-        // Keep existing file_count if this SS had files persisted; only zero if brand new
-        if (ss->file_count < 0 || ss->file_count > MAX_FILES) ss->file_count = 0;
         ss_count++;
     }
     
+    // A new server, or one that had expired, (re)joins the ring: move the files it now owns
+    if (!ss_in_ring[ss->ss_id] && !ss_draining[ss->ss_id]) {
+        ss_in_ring[ss->ss_id] = 1;
+        ring_rebuild();
+        schedule_reconcile();
+    }
+    ss_down_since[ss->ss_id] = 0;
+
+    // Capacity/load arrive with the registration; older servers send none
+    if (reg_fields < 7) { reg_load.free_mb = -1; reg_load.total_mb = -1; reg_load.files = 0; reg_load.req_rate = 0.0; }
+    reg_load.updated = time(NULL);
+    ss_load[ss->ss_id] = reg_load;
+
     log_message("NM", "INFO", "Registered Storage Server %d: %s:%d (client_port: %d) active=%d", 
                 ss->ss_id, ss->ip, ss->nm_port, ss->client_port, ss->active);
     
     msg->error_code = ERR_SUCCESS;
-    sprintf(msg->data, "%d", ss->ss_id);
+    sprintf(msg->data, "%d %lld", ss->ss_id, nm_boot_id);
+    standby_list(msg->data, sizeof(msg->data));
     
     pthread_mutex_unlock(&nm_lock);
     send_message(socket_fd, msg);
+    pthread_mutex_lock(&nm_lock);
     save_persistent_data();
+    pthread_mutex_unlock(&nm_lock);
 
     // If this was a returning server (previously inactive), trigger resync
     if (was_inactive) {
@@ -352,12 +876,256 @@ void register_storage_server(int socket_fd, Message* msg) {
     }
 }
 
+// Heartbeat on an SS's control session. The reply carries this NM's boot id; a server that
+// sees it change, or is told it is unknown, registers again. It also says what the SS must
+// send for the NM's copy of its inventory: nothing, the changes after a version, or digests.
+void handle_ss_heartbeat(int socket_fd, Message* msg) {
+    int id = -1, nm_port = 0, client_port = 0, interval = 0, used = 0;
+    char ip[INET_ADDRSTRLEN] = "";
+    double rtt_ms = 0.0;
+    long long epoch = 0;
+    unsigned long version = 0;
+    unsigned long long root = 0;
+    int fields = sscanf(msg->data, "%d %15s %d %d %d %lf %lld %lu %llx %n", &id, ip, &nm_port, &client_port,
+                        &interval, &rtt_ms, &epoch, &version, &root, &used);
+
+    pthread_mutex_lock(&nm_lock);
+    int known = fields >= 9 && id >= 0 && id < ss_count && strcmp(storage_servers[id].ip, ip) == 0 &&
+                storage_servers[id].nm_port == nm_port && storage_servers[id].client_port == client_port;
+    if (known) {
+        ss_mark_alive(id, msg->data + used, rtt_ms);
+        // Three missed heartbeats and the probe loop takes over again
+        ss_session_until[id] = time(NULL) + 3 * (interval > 0 ? interval : 5);
+
+        SSInventory* inv = &ss_inv[id];
+        inv->rounds++;
+        if (inv->epoch != epoch) { inv->epoch = epoch; inv->synced = 0; }
+        int mode = INV_DIGESTS;
+        unsigned long since = 0;
+        if (inv->synced && inv->version == version && inv_root(inv->digest) == root) mode = INV_IN_SYNC;
+        else if (inv->synced && inv->version < version) { mode = INV_CHANGES; since = inv->version; }
+        if (mode == INV_IN_SYNC) inv->round_checked = inv->rounds;
+        else inv->round_open = inv->rounds;
+        inv->receiving = 0;
+
+        msg->error_code = ERR_SUCCESS;
+        sprintf(msg->data, "%lld %d %lu", nm_boot_id, mode, since);
+        standby_list(msg->data, sizeof(msg->data));
+    } else {
+        msg->error_code = ERR_SS_NOT_FOUND;
+        strcpy(msg->error_msg, "Unknown storage server, register again");
+    }
+    pthread_mutex_unlock(&nm_lock);
+    send_message(socket_fd, msg);
+}
+
+static InvName** inv_slot(SSInventory* inv, const char* name, unsigned long long name_hash) {
+    InvName** slot = &inv->heads[name_hash & (inv->cap - 1)];
+    while (*slot && ((*slot)->name_hash != name_hash || strcmp((*slot)->name, name) != 0)) slot = &(*slot)->next;
+    return slot;
+}
+
+static InvName* inv_find(SSInventory* inv, const char* name) {
+    if (inv->cap == 0) return NULL;
+    return *inv_slot(inv, name, inv_name_hash(name));
+}
+
+static void inv_put(SSInventory* inv, const char* name, int words, int chars) {
+    if (inv->count >= inv->cap) {   // keep chains short: double and rehash
+        size_t cap = inv->cap ? inv->cap * 2 : 1024;
+        InvName** heads = calloc(cap, sizeof(InvName*));
+        if (heads == NULL) return;
+        for (size_t i = 0; i < inv->cap; i++) {
+            for (InvName* e = inv->heads[i]; e; ) {
+                InvName* next = e->next;
+                e->next = heads[e->name_hash & (cap - 1)];
+                heads[e->name_hash & (cap - 1)] = e;
+                e = next;
+            }
+        }
+        free(inv->heads);
+        inv->heads = heads;
+        inv->cap = cap;
+    }
+    unsigned long long name_hash = inv_name_hash(name);
+    InvName** slot = inv_slot(inv, name, name_hash);
+    InvName* e = *slot;
+    if (e == NULL) {
+        size_t len = strlen(name);
+        e = malloc(sizeof(InvName) + len + 1);
+        if (e == NULL) return;
+        memcpy(e->name, name, len + 1);
+        e->name_hash = name_hash;
+        e->next = NULL;
+        *slot = e;
+        inv->count++;
+    } else {
+        inv->digest[inv_bucket(name_hash)] ^= e->hash;
+    }
+    e->words = words;
+    e->chars = chars;
+    e->hash = inv_entry_hash(name_hash, words, chars);
+    inv->digest[inv_bucket(name_hash)] ^= e->hash;
+}
+
+static void inv_drop(SSInventory* inv, const char* name) {
+    if (inv->cap == 0) return;
+    unsigned long long name_hash = inv_name_hash(name);
+    InvName** slot = inv_slot(inv, name, name_hash);
+    InvName* e = *slot;
+    if (e == NULL) return;
+    inv->digest[inv_bucket(name_hash)] ^= e->hash;
+    *slot = e->next;
+    free(e);
+    inv->count--;
+}
+
+// Forget every name in the buckets of mask, before they are listed again
+static void inv_drop_buckets(SSInventory* inv, unsigned long long mask) {
+    for (size_t i = 0; i < inv->cap; i++) {
+        InvName** slot = &inv->heads[i];
+        while (*slot) {
+            InvName* e = *slot;
+            if (mask & (1ULL << inv_bucket(e->name_hash))) {
+                *slot = e->next;
+                free(e);
+                inv->count--;
+            } else {
+                slot = &e->next;
+            }
+        }
+    }
+    for (int b = 0; b < INV_BUCKETS; b++) if (mask & (1ULL << b)) inv->digest[b] = 0;
+}
+
+static void inv_synced(SSInventory* inv, unsigned long version) {
+    inv->version = version;
+    inv->synced = 1;
+    inv->receiving = 0;
+    inv->pending = 0;
+    inv->round_checked = inv->round_open;
+}
+
+// OP_SS_INVENTORY: one message of a sync the heartbeat reply asked for (see inventory_sync
+// on the SS). Each is applied as it arrives; the copy counts as synced after the last.
+void handle_ss_inventory(int socket_fd, Message* msg) {
+    char kind = 0;
+    int id = -1, used = 0;
+    long long epoch = 0;
+    sscanf(msg->data, " %c %d %lld%n", &kind, &id, &epoch, &used);
+    const char* p = msg->data + used;
+
+    pthread_mutex_lock(&nm_lock);
+    SSInventory* inv = (id >= 0 && id < ss_count) ? &ss_inv[id] : NULL;
+    msg->error_code = ERR_SUCCESS;
+    if (inv == NULL || inv->epoch != epoch) {
+        msg->error_code = ERR_INVALID_COMMAND;
+    } else if (kind == 'C') {
+        unsigned long from = 0, to = 0;
+        int last = 0, n = 0;
+        sscanf(p, "%lu %lu %d%n", &from, &to, &last, &n);
+        if (!(inv->synced || inv->receiving) || from != inv->version) {
+            inv->synced = 0;
+            inv->receiving = 0;
+            msg->error_code = ERR_INVALID_COMMAND;
+        } else {
+            inv->synced = 0;
+            inv->receiving = 1;
+            for (char* line = strchr(p + n, '\n'); line && line[1]; ) {
+                line++;
+                char* end = strchr(line, '\n');
+                if (end) *end = '\0';
+                int words = 0, chars = 0, off = 0;
+                if (line[0] == '+' && sscanf(line, "+ %d %d %n", &words, &chars, &off) == 2 && off > 0) inv_put(inv, line + off, words, chars);
+                else if (line[0] == '-' && line[1] == ' ') inv_drop(inv, line + 2);
+                if (!end) break;
+                line = end;
+            }
+            if (last) inv_synced(inv, to);
+        }
+    } else if (kind == 'D') {
+        unsigned long version = 0;
+        int n = 0;
+        sscanf(p, "%lu%n", &version, &n);
+        p += n;
+        unsigned long long mask = 0;
+        for (int b = 0; b < INV_BUCKETS; b++) {
+            unsigned long long d = 0;
+            if (sscanf(p, "%llx%n", &d, &n) != 1) { mask = ~0ULL; break; }
+            p += n;
+            if (d != inv->digest[b]) mask |= 1ULL << b;
+        }
+        inv->receiving = 0;
+        if (mask == 0) {
+            inv_synced(inv, version);
+            strcpy(msg->data, "0");
+        } else {
+            inv->synced = 0;
+            inv->pending = mask;
+            inv->pending_version = version;
+            inv_drop_buckets(inv, mask);
+            int count = 0, len = 0;
+            char list[INV_BUCKETS * 4];
+            for (int b = 0; b < INV_BUCKETS; b++) if (mask & (1ULL << b)) { count++; len += sprintf(list + len, " %d", b); }
+            snprintf(msg->data, sizeof(msg->data), "%d%s", count, list);
+            log_message("NM", "INFO", "Inventory of SS %d: %d of %d buckets differ, relisting them", id, count, INV_BUCKETS);
+        }
+    } else if (kind == 'B' && inv->pending) {
+        int last = 0, n = 0;
+        sscanf(p, "%d%n", &last, &n);
+        for (char* line = strchr(p + n, '\n'); line && line[1]; ) {
+            line++;
+            char* end = strchr(line, '\n');
+            if (end) *end = '\0';
+            int words = 0, chars = 0, off = 0;
+            if (sscanf(line, "%d %d %n", &words, &chars, &off) == 2 && off > 0) inv_put(inv, line + off, words, chars);
+            if (!end) break;
+            line = end;
+        }
+        if (last) inv_synced(inv, inv->pending_version);
+    } else {
+        msg->error_code = ERR_INVALID_COMMAND;
+    }
+    if (msg->error_code != ERR_SUCCESS) strcpy(msg->error_msg, "Inventory out of step, send digests");
+    pthread_mutex_unlock(&nm_lock);
+    send_message(socket_fd, msg);
+}
+
+// nm_lock held: the NM just put the file on its servers, so a listing from before this
+// heartbeat round cannot show it missing
+static void inventory_touch(FileMetadata* file) {
+    int ids[2] = { file->ss_id, file->replica_ss_id };
+    for (int i = 0; i < 2; i++) {
+        if (ids[i] >= 0 && ids[i] < ss_count) ss_inv[ids[i]].round_touched = ss_inv[ids[i]].rounds;
+    }
+}
+
+// nm_lock held: 1 if the server holding the file (the primary, or the replica while the
+// primary is down) lists it, refreshing the file's counts; 0 if that server's listing is
+// complete and current yet lacks it; -1 if there is no such listing yet
+static int ss_inventory_check(FileMetadata* file) {
+    int id = file->ss_id;
+    if (id < 0 || id >= ss_count) return -1;
+    if (!storage_servers[id].active && file->replica_ss_id >= 0 && file->replica_ss_id < ss_count &&
+        storage_servers[file->replica_ss_id].active) id = file->replica_ss_id;
+    SSInventory* inv = &ss_inv[id];
+    InvName* e = inv_find(inv, file->filename);
+    if (e) {
+        file->word_count = e->words;
+        file->char_count = e->chars;
+        return 1;
+    }
+    if (inv->synced && inv->round_checked > inv->round_touched) return 0;
+    return -1;
+}
+
 void register_client(int socket_fd, Message* msg) {
     pthread_mutex_lock(&nm_lock);
 
     // If a client with the same username already exists, update it instead of adding duplicates
+    int uid = nm_user_id(msg->username);
     for (int i = 0; i < client_count; i++) {
-        if (strcmp(clients[i].username, msg->username) == 0) {
+        if (clients[i].user_id == uid) {
             sscanf(msg->data, "%s %d %d", clients[i].ip, &clients[i].nm_port, &clients[i].ss_port);
             clients[i].socket_fd = socket_fd;
             clients[i].active = 1;
@@ -365,13 +1133,14 @@ void register_client(int socket_fd, Message* msg) {
             log_message("NM", "INFO", "Re-registered Client: %s from %s:%d (active clients: %d)", clients[i].username, clients[i].ip, clients[i].nm_port, active_total);
             msg->error_code = ERR_SUCCESS;
             strcpy(msg->data, "Registration successful");
+            standby_list(msg->data, sizeof(msg->data));
             pthread_mutex_unlock(&nm_lock);
             send_message(socket_fd, msg);
             return;
         }
     }
 
-    if (client_count >= MAX_CLIENTS) {
+    if (table_grow(&client_table, client_count + 1) != 0) {
         msg->error_code = ERR_SERVER_ERROR;
         strcpy(msg->error_msg, "Maximum clients reached");
         pthread_mutex_unlock(&nm_lock);
@@ -381,6 +1150,7 @@ void register_client(int socket_fd, Message* msg) {
 
     ClientInfo* client = &clients[client_count];
     strcpy(client->username, msg->username);
+    client->user_id = uid;
     sscanf(msg->data, "%s %d %d", client->ip, &client->nm_port, &client->ss_port);
     client->socket_fd = socket_fd;
     client->active = 1;
@@ -391,141 +1161,1129 @@ void register_client(int socket_fd, Message* msg) {
 
     msg->error_code = ERR_SUCCESS;
     strcpy(msg->data, "Registration successful");
+    standby_list(msg->data, sizeof(msg->data));
 
     pthread_mutex_unlock(&nm_lock);
     send_message(socket_fd, msg);
 }
 
-void handle_view_command(int client_sock, Message* msg) {
-    int show_all = msg->flags & 1;  // -a flag
-    int show_details = msg->flags & 2;  // -l flag
-    
-    pthread_mutex_lock(&nm_lock);
-    
-    char response[BUFFER_SIZE] = "";
-    // To avoid showing duplicate filenames (from any prior inconsistent state),
-    // keep track of what we've already emitted in this response.
-    char seen[MAX_FILES][MAX_FILENAME];
-    int seen_count = 0;
-    
-    if (show_details) {
-        strcat(response, "---------------------------------------------------------\n");
-        strcat(response, "|  Filename  | Words | Chars | Last Access Time | Owner |\n");
-        strcat(response, "|------------|-------|-------|------------------|-------|\n");
+// ACL slab (guarded by nm_lock). Grantee and pending-request lists live outside
+// FileMetadata in power-of-two blocks of 1..64 entries carved from 64 KB arena chunks;
+// freed blocks go on a free list per size class. Files nobody shares cost no block.
+#define ACL_CLASSES 7
+#define ACL_ARENA_BYTES (64 * 1024)
+
+static void* acl_free_lists[ACL_CLASSES];
+static char* acl_arena = NULL;
+static size_t acl_arena_used = ACL_ARENA_BYTES;
+
+static int acl_class(int cap) {
+    int cls = 0;
+    while ((1 << cls) < cap) cls++;
+    return cls;
+}
+
+static AccessEntry* acl_block_alloc(int cap) {
+    int cls = acl_class(cap);
+    if (acl_free_lists[cls] != NULL) {
+        void* block = acl_free_lists[cls];
+        acl_free_lists[cls] = *(void**)block;
+        return block;
     }
-    
-    // Iterate carefully since we may purge stale entries (modifies files[]/file_count)
-    for (int i = 0; i < file_count; ) {
-        FileMetadata* file = &files[i];
-        
-        // If file doesn't exist on SS anymore (stale), purge and continue without incrementing i
-        int pre_count = file_count;
-        int exists = ss_file_exists(file);
-        if (exists == 0) {
-            purge_file_metadata(file->filename);
-            // If purge didn't change file_count (unexpected), advance to prevent infinite loop
-            if (file_count == pre_count) {
-                i++;
-            }
-            // After purge, files[i] now contains a new entry (swapped), so re-check same index if count changed
-            continue;
-        }
-        // If SS unreachable, we don't purge metadata; just skip listing to avoid showing ghost files
-        if (exists < 0) {
-            i++;
-            continue;
-        }
-        
-        // Listing policy:
-        // - If both primary and replica servers inactive -> hide file entirely (skip)
-        int primary_active = (file->ss_id >=0 && file->ss_id < ss_count && storage_servers[file->ss_id].active);
-        int replica_active = (file->replica_ss_id >=0 && file->replica_ss_id < ss_count && storage_servers[file->replica_ss_id].active);
-        if (!primary_active && !replica_active) { i++; continue; }
-        // VIEW / VIEW -l (without -a): show files where user is owner OR has been granted at least READ access.
-        // Previously we only showed owner files; now we include any file for which access_list grants READ/WRITE.
-        if (!show_all) {
-            int is_owner = (strcmp(file->owner, msg->username) == 0);
-            int has_access = is_owner || check_access(file, msg->username, ACCESS_READ);
-            if (!has_access) { i++; continue; }
-        }
-        // Skip duplicates within this listing
-        int dup = 0;
-        for (int s = 0; s < seen_count; s++) {
-            if (strcmp(seen[s], file->filename) == 0) { dup = 1; break; }
-        }
-        if (!dup) {
-            strcpy(seen[seen_count++], file->filename);
-            
-            if (show_details) {
-                char time_str[32];
-                strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M", localtime(&file->accessed_time));
-                char line[256];
-                snprintf(line, sizeof(line), "| %-32s | %5d | %5d | %16s | %-12s |\n",
-                        file->filename, file->word_count, file->char_count, time_str, file->owner);
-                strcat(response, line);
-            } else {
-                strcat(response, "--> ");
-                strcat(response, file->filename);
-                strcat(response, "\n");
-            }
-        }
-        i++;
+    size_t bytes = sizeof(AccessEntry) << cls;
+    if (acl_arena_used + bytes > ACL_ARENA_BYTES) {
+        char* chunk = malloc(ACL_ARENA_BYTES);
+        if (chunk == NULL) return NULL;
+        acl_arena = chunk;
+        acl_arena_used = 0;
     }
-    
-    if (show_details) {
-        strcat(response, "-------------------------------------------------------------------------------------------------------------\n");
+    AccessEntry* block = (AccessEntry*)(acl_arena + acl_arena_used);
+    acl_arena_used += bytes;
+    return block;
+}
+
+static void acl_block_free(AccessEntry* block, int cap) {
+    if (block == NULL) return;
+    int cls = acl_class(cap);
+    *(void**)block = acl_free_lists[cls];
+    acl_free_lists[cls] = block;
+}
+
+// Append a zeroed entry, doubling the block when full; NULL at MAX_ACCESS_LIST or out of memory
+static AccessEntry* acl_push(AccessEntry** list, int* count, int* cap) {
+    if (*count >= MAX_ACCESS_LIST) return NULL;
+    if (*count == *cap) {
+        int grown_cap = *cap ? *cap * 2 : 1;
+        AccessEntry* grown = acl_block_alloc(grown_cap);
+        if (grown == NULL) return NULL;
+        if (*count > 0) memcpy(grown, *list, (size_t)*count * sizeof(AccessEntry));
+        acl_block_free(*list, *cap);
+        *list = grown;
+        *cap = grown_cap;
     }
-    
-    strcpy(msg->data, response);
-    msg->error_code = ERR_SUCCESS;
-    
-    pthread_mutex_unlock(&nm_lock);
-    send_message(client_sock, msg);
-    
-    log_response("NM", "client", client_sock, ERR_SUCCESS, "VIEW command completed");
+    AccessEntry* entry = &(*list)[(*count)++];
+    memset(entry, 0, sizeof(*entry));
+    return entry;
 }
 
-// Heartbeat thread: periodically probe SS nm_port to update active flag
-void* storage_server_heartbeat_loop(void* arg) {
-    (void)arg;
-    while (1) {
-        pthread_mutex_lock(&nm_lock);
-        for (int i=0;i<ss_count;i++) {
-            StorageServerInfo* ss = &storage_servers[i];
-            int s = socket(AF_INET, SOCK_STREAM, 0);
-            if (s < 0) { ss->active = 0; continue; }
-            struct sockaddr_in addr; memset(&addr,0,sizeof(addr)); addr.sin_family=AF_INET; addr.sin_port=htons(ss->nm_port); inet_pton(AF_INET, ss->ip, &addr.sin_addr);
-            int ok = (connect(s,(struct sockaddr*)&addr,sizeof(addr))==0);
-            close(s);
-            if (!ok && ss->active){
-                ss->active = 0; log_message("NM","WARN","Heartbeat: SS %d marked inactive", ss->ss_id);
-            } else if (ok && !ss->active){
-                ss->active = 1; log_message("NM","INFO","Heartbeat: SS %d marked active", ss->ss_id);
-                // Could trigger resync if becoming active spontaneously without registration path
-            }
-        }
-        pthread_mutex_unlock(&nm_lock);
-        sleep(5);
+// Remove entry i keeping order; the block goes back to the slab once the list empties
+static void acl_remove_at(AccessEntry** list, int* count, int* cap, int i) {
+    memmove(&(*list)[i], &(*list)[i + 1], (size_t)(*count - i - 1) * sizeof(AccessEntry));
+    (*count)--;
+    if (*count == 0) {
+        acl_block_free(*list, *cap);
+        *list = NULL;
+        *cap = 0;
     }
-    return NULL;
+}
+
+static int acl_find(const AccessEntry* list, int count, int user_id) {
+    for (int i = 0; user_id > 0 && i < count; i++) {
+        if (list[i].user_id == user_id) return i;
+    }
+    return -1;
+}
+
+// Replace both lists of a file with copies of the given entries (snapshot and journal load)
+static int file_acl_set(FileMetadata* file, const AccessEntry* access, int access_count,
+                        const AccessEntry* pending, int pending_count) {
+    file->access_list = NULL; file->access_count = 0; file->access_cap = 0;
+    file->pending_requests = NULL; file->pending_count = 0; file->pending_cap = 0;
+    for (int i = 0; i < access_count; i++) {
+        AccessEntry* entry = acl_push(&file->access_list, &file->access_count, &file->access_cap);
+        if (entry == NULL) return -1;
+        *entry = access[i];
+    }
+    for (int i = 0; i < pending_count; i++) {
+        AccessEntry* entry = acl_push(&file->pending_requests, &file->pending_count, &file->pending_cap);
+        if (entry == NULL) return -1;
+        *entry = pending[i];
+    }
+    return 0;
+}
+
+static void file_acl_release(FileMetadata* file) {
+    acl_block_free(file->access_list, file->access_cap);
+    acl_block_free(file->pending_requests, file->pending_cap);
+    file->access_list = NULL; file->access_count = 0; file->access_cap = 0;
+    file->pending_requests = NULL; file->pending_count = 0; file->pending_cap = 0;
+}
+
+// Per-user index of the files a user owns or has been granted, sorted by name in trie
+// order (guarded by nm_lock). VIEW, VIEWFOLDER and RECENTS for one user walk this list
+// instead of every file; check_access still decides the level of access.
+typedef struct {
+    char** names;
+    int count;
+    int cap;
+} UserFiles;
+
+static UserFiles* user_files_table = NULL;   // indexed by user ID
+static int user_files_cap = 0;
+
+static UserFiles* user_files_get(int user_id, int create) {
+    if (user_id <= 0) return NULL;
+    if (user_id >= user_files_cap) {
+        if (!create) return NULL;
+        int cap = user_files_cap ? user_files_cap : 64;
+        while (cap <= user_id) cap *= 2;
+        UserFiles* grown = realloc(user_files_table, (size_t)cap * sizeof(UserFiles));
+        if (grown == NULL) return NULL;
+        memset(grown + user_files_cap, 0, (size_t)(cap - user_files_cap) * sizeof(UserFiles));
+        user_files_table = grown;
+        user_files_cap = cap;
+    }
+    return &user_files_table[user_id];
+}
+
+// First position whose name sorts at or after name
+static int user_files_lower_bound(UserFiles* uf, const char* name) {
+    int lo = 0, hi = uf->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(uf->names[mid], name) < 0) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+static void user_files_add(int user_id, const char* filename) {
+    UserFiles* uf = user_files_get(user_id, 1);
+    if (uf == NULL) return;
+    int pos = user_files_lower_bound(uf, filename);
+    if (pos < uf->count && strcmp(uf->names[pos], filename) == 0) return;
+    if (uf->count == uf->cap) {
+        int cap = uf->cap ? uf->cap * 2 : 8;
+        char** grown = realloc(uf->names, (size_t)cap * sizeof(char*));
+        if (grown == NULL) return;
+        uf->names = grown;
+        uf->cap = cap;
+    }
+    char* copy = strdup(filename);
+    if (copy == NULL) return;
+    memmove(&uf->names[pos + 1], &uf->names[pos], (size_t)(uf->count - pos) * sizeof(char*));
+    uf->names[pos] = copy;
+    uf->count++;
+}
+
+static void user_files_remove(int user_id, const char* filename) {
+    UserFiles* uf = user_files_get(user_id, 0);
+    if (uf == NULL) return;
+    int pos = user_files_lower_bound(uf, filename);
+    if (pos == uf->count || strcmp(uf->names[pos], filename) != 0) return;
+    free(uf->names[pos]);
+    memmove(&uf->names[pos], &uf->names[pos + 1], (size_t)(uf->count - pos - 1) * sizeof(char*));
+    uf->count--;
+}
+
+// Index (or unindex) the file under its owner and every grantee
+static void user_files_add_file(FileMetadata* file) {
+    user_files_add(file->owner_id, file->filename);
+    for (int i = 0; i < file->access_count; i++) user_files_add(file->access_list[i].user_id, file->filename);
+}
+
+static void user_files_remove_file(FileMetadata* file) {
+    user_files_remove(file->owner_id, file->filename);
+    for (int i = 0; i < file->access_count; i++) user_files_remove(file->access_list[i].user_id, file->filename);
+}
+
+// trie_walk_prefix over only the files indexed for user_id: visits, in name order, those
+// starting with prefix and sorting after `after`. Costs the user's matching files.
+static int user_files_walk(int user_id, const char* prefix, const char* after,
+                           int (*visit)(const char* name, FileMetadata* file, void* arg), void* arg) {
+    UserFiles* uf = user_files_get(user_id, 0);
+    if (uf == NULL) return 0;
+    size_t plen = strlen(prefix);
+    int i;
+    if (after && after[0] && strcmp(after, prefix) >= 0) {
+        i = user_files_lower_bound(uf, after);
+        if (i < uf->count && strcmp(uf->names[i], after) == 0) i++;
+    } else {
+        i = user_files_lower_bound(uf, prefix);
+    }
+    for (; i < uf->count; i++) {
+        const char* name = uf->names[i];
+        if (strncmp(name, prefix, plen) != 0) break;
+        FileMetadata* file = file_lookup(name);
+        if (file == NULL) continue;
+        int stop = visit(name, file, arg);
+        if (stop) return stop;
+    }
+    return 0;
+}
+
+// One page of a VIEW/VIEWFOLDER listing, filled by walking the trie under a name prefix
+#define LIST_MAX_STALE 64
+typedef struct {
+    int user_id;
+    const char* pattern;      // glob the full name must match (NULL: everything under the prefix)
+    int show_all;
+    int show_details;
+    int probe_ss;             // VIEW: drop files their SS's inventory no longer lists
+    size_t strip;             // leading characters left out of each printed name
+    char* out;
+    size_t used;
+    size_t room;              // bytes a page may use, leaving space for the footer
+    int count;
+    int more;
+    char last[MAX_FILENAME];  // cursor: last name put on the page
+    char stale[LIST_MAX_STALE][MAX_FILENAME];
+    int stale_count;
+} ListPage;
+
+// nm_lock held; purges are deferred until the walk is over since they reshape the trie
+static int list_visit(const char* name, FileMetadata* file, void* arg) {
+    ListPage* pg = arg;
+    if (pg->pattern && fnmatch(pg->pattern, name, FNM_PATHNAME) != 0) return 0;
+    if (!pg->show_all && !check_access(file, pg->user_id, ACCESS_READ)) return 0;
+    if (pg->probe_ss) {
+        // Listing policy: hide files whose primary and replica servers are both inactive
+        int primary_active = (file->ss_id >= 0 && file->ss_id < ss_count && storage_servers[file->ss_id].active);
+        int replica_active = (file->replica_ss_id >= 0 && file->replica_ss_id < ss_count && storage_servers[file->replica_ss_id].active);
+        if (!primary_active && !replica_active) return 0;
+        // Gone from its server's inventory: purge. Not yet reported either way: list it.
+        if (ss_inventory_check(file) == 0) {
+            if (pg->stale_count == LIST_MAX_STALE) { pg->more = 1; return 1; }
+            strcpy(pg->stale[pg->stale_count++], name);
+            return 0;
+        }
+    }
+
+    char line[MAX_FILENAME + 128];
+    int len;
+    if (pg->show_details) {
+        char time_str[32];
+        struct tm tm_buf;
+        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M", localtime_r(&file->accessed_time, &tm_buf));
+        len = snprintf(line, sizeof(line), "| %-32s | %5d | %5d | %16s | %-12s |\n",
+                       name + pg->strip, file->word_count, file->char_count, time_str, user_name(file->owner_id));
+    } else {
+        len = snprintf(line, sizeof(line), "--> %s\n", name + pg->strip);
+    }
+    if (len >= (int)sizeof(line)) len = sizeof(line) - 1;
+    if (pg->used + len > pg->room) { pg->more = 1; return 1; }
+    memcpy(pg->out + pg->used, line, len + 1);
+    pg->used += len;
+    pg->count++;
+    strcpy(pg->last, name);
+    return 0;
+}
+
+// Fill msg->data with the page after the cursor in msg->data. If more remain, the reply has
+// FLAG_LIST_MORE set and the cursor to send next in msg->filename.
+static void list_page_reply(Message* msg, ListPage* pg, const char* prefix, const char* header, const char* footer) {
+    files_wait_indexed();   // walks need the trie and per-user index complete
+    char cursor[MAX_FILENAME];
+    strncpy(cursor, msg->data, sizeof(cursor) - 1);
+    cursor[sizeof(cursor) - 1] = '\0';
+    cursor[strcspn(cursor, "\n")] = '\0';
+
+    pg->out = msg->data;
+    pg->out[0] = '\0';
+    pg->used = 0;
+    size_t footer_len = footer ? strlen(footer) : 0;
+    pg->room = sizeof(msg->data) - 1 - footer_len;
+    if (header && cursor[0] == '\0') {
+        strcpy(pg->out, header);
+        pg->used = strlen(header);
+    }
+    // Without -a only the user's own and granted files can be listed
+    if (pg->show_all) trie_walk_prefix(file_trie_root, prefix, cursor, list_visit, pg);
+    else user_files_walk(pg->user_id, prefix, cursor, list_visit, pg);
+    for (int i = 0; i < pg->stale_count; i++) purge_file_metadata(pg->stale[i]);
+
+    msg->flags &= ~FLAG_LIST_MORE;
+    if (pg->more) {
+        msg->flags |= FLAG_LIST_MORE;
+        // Nothing fitted but stale entries were dropped: resume from the same place
+        strcpy(msg->filename, pg->count > 0 ? pg->last : cursor);
+    } else if (footer) {
+        strcpy(pg->out + pg->used, footer);
+    }
+    msg->error_code = ERR_SUCCESS;
+}
+
+// VIEW [-a] [-l] [pattern]: the pattern is a glob on full names ("docs/*.txt"); the trie is
+// walked only under its literal prefix
+void handle_view_command(int client_sock, Message* msg) {
+    ListPage* pg = calloc(1, sizeof(ListPage));
+    if (!pg) {
+        msg->error_code = ERR_SERVER_ERROR;
+        strcpy(msg->error_msg, "Out of memory");
+        send_message(client_sock, msg);
+        return;
+    }
+    char pattern[MAX_FILENAME];
+    strncpy(pattern, msg->filename, sizeof(pattern) - 1);
+    pattern[sizeof(pattern) - 1] = '\0';
+    char prefix[MAX_FILENAME];
+    size_t plen = strcspn(pattern, "*?[\\");
+    memcpy(prefix, pattern, plen);
+    prefix[plen] = '\0';
+
+    pg->user_id = request_user(msg);
+    pg->show_all = msg->flags & 1;  // -a flag
+    pg->show_details = msg->flags & 2;  // -l flag
+    pg->probe_ss = 1;
+    pg->pattern = pattern[0] && pattern[plen] ? pattern : NULL;   // no wildcard: plain prefix
+
+    pthread_mutex_lock(&nm_lock);
+    list_page_reply(msg, pg, prefix,
+                    pg->show_details ? "---------------------------------------------------------\n"
+                                       "|  Filename  | Words | Chars | Last Access Time | Owner |\n"
+                                       "|------------|-------|-------|------------------|-------|\n" : NULL,
+                    pg->show_details ? "-------------------------------------------------------------------------------------------------------------\n" : NULL);
+    pthread_mutex_unlock(&nm_lock);
+    journal_commit();   // files found gone were purged and journaled
+    send_message(client_sock, msg);
+    free(pg);
+    
+    log_response("NM", "client", client_sock, ERR_SUCCESS, "VIEW command completed");
+}
+
+// Heartbeat thread: periodically probe SS nm_port to update active flag
+// Send OP_HEARTBEAT to one SS. Returns 1 if it answered; report gets its load line
+// (empty if it sent none) and rtt_ms the round trip including connect.
+static int heartbeat_probe(const char* ip, int port, char* report, size_t report_len, double* rtt_ms) {
+    report[0] = '\0';
+    *rtt_ms = 0.0;
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) return 0;
+    struct timeval tv = { 2, 0 };
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    struct sockaddr_in addr; memset(&addr,0,sizeof(addr)); addr.sin_family=AF_INET; addr.sin_port=htons(port); inet_pton(AF_INET, ip, &addr.sin_addr);
+
+    long long t0 = now_us();
+    int ok = (connect(s,(struct sockaddr*)&addr,sizeof(addr))==0);
+    if (ok) {
+        Message hb; memset(&hb, 0, sizeof(hb));
+        hb.op_code = OP_HEARTBEAT;
+        if (send_message(s, &hb) > 0 && receive_message(s, &hb) > 0 && hb.error_code == ERR_SUCCESS) {
+            strncpy(report, hb.data, report_len - 1);
+            report[report_len - 1] = '\0';
+        }
+        *rtt_ms = (now_us() - t0) / 1000.0;
+    }
+    close(s);
+    return ok;
+}
+
+// nm_lock held: SS i answered a probe or heartbeat with report "<free_mb> <total_mb> <files> <req_per_sec>"
+static void ss_mark_alive(int i, const char* report, double rtt_ms) {
+    StorageServerInfo* ss = &storage_servers[i];
+    if (!ss->active) {
+        ss->active = 1; log_message("NM","INFO","Heartbeat: SS %d marked active", ss->ss_id);
+    }
+    ss_down_since[i] = 0;
+    if (!ss_in_ring[i] && !ss_draining[i]) {
+        ss_in_ring[i] = 1;
+        log_message("NM","INFO","SS %d back, rejoined placement ring", ss->ss_id);
+        ring_rebuild();
+        schedule_reconcile();
+    }
+    SSLoad* load = &ss_load[i];
+    SSLoad r; memset(&r, 0, sizeof(r));
+    if (sscanf(report, "%lld %lld %d %lf", &r.free_mb, &r.total_mb, &r.files, &r.req_rate) == 4) {
+        load->free_mb = r.free_mb; load->total_mb = r.total_mb;
+        load->files = r.files; load->req_rate = r.req_rate;
+    }
+    if (rtt_ms > 0.0) load->rtt_ms = load->rtt_ms > 0.0 ? 0.7 * load->rtt_ms + 0.3 * rtt_ms : rtt_ms;
+    load->updated = time(NULL);
+}
+
+void* storage_server_heartbeat_loop(void* arg) {
+    (void)arg;
+    char (*ips)[INET_ADDRSTRLEN] = calloc(max_ss, sizeof(*ips));
+    int* ports = calloc(max_ss, sizeof(int));
+    int* alive = calloc(max_ss, sizeof(int));
+    char (*reports)[128] = calloc(max_ss, sizeof(*reports));
+    double* rtts = calloc(max_ss, sizeof(double));
+    int* skip = calloc(max_ss, sizeof(int));
+    if (!ips || !ports || !alive || !reports || !rtts || !skip) {
+        log_message("NM", "ERROR", "Heartbeat: out of memory");
+        return NULL;
+    }
+    while (1) {
+        // Probe without nm_lock so a slow server does not stall every client request. Servers
+        // heartbeating on their control session are left alone until it goes quiet.
+        pthread_mutex_lock(&nm_lock);
+        int n = ss_count;
+        time_t now = time(NULL);
+        for (int i=0;i<n;i++) {
+            strcpy(ips[i], storage_servers[i].ip); ports[i] = storage_servers[i].nm_port;
+            skip[i] = ss_session_until[i] >= now;
+        }
+        pthread_mutex_unlock(&nm_lock);
+
+        for (int i=0;i<n;i++) alive[i] = skip[i] || heartbeat_probe(ips[i], ports[i], reports[i], sizeof(reports[i]), &rtts[i]);
+
+        pthread_mutex_lock(&nm_lock);
+        for (int i=0;i<n && i<ss_count;i++) {
+            StorageServerInfo* ss = &storage_servers[i];
+            if (skip[i]) continue;
+            if (alive[i]) {
+                ss_mark_alive(i, reports[i], rtts[i]);
+                continue;
+            }
+            if (ss->active){
+                ss->active = 0; log_message("NM","WARN","Heartbeat: SS %d marked inactive", ss->ss_id);
+            }
+            // Down for longer than NM_SS_EXPIRE_SEC: leave the ring so its copies are re-created elsewhere
+            now = time(NULL);
+            if (ss_down_since[i] == 0) ss_down_since[i] = now;
+            if (ss_in_ring[i] && ss_expire_sec > 0 && now - ss_down_since[i] >= ss_expire_sec) {
+                ss_in_ring[i] = 0;
+                log_message("NM","WARN","SS %d down for %lds, removed from placement ring", ss->ss_id, (long)(now - ss_down_since[i]));
+                ring_rebuild();
+                schedule_reconcile();
+            }
+        }
+        pthread_mutex_unlock(&nm_lock);
+        sleep(5);
+    }
+    return NULL;
+}
+
+// ---- Consistent-hash placement ----
+
+static PlacementEntry** placement_slot(const char* filename) {
+    PlacementEntry** slot = &placements[hash_string(filename) % PLACEMENT_BUCKETS];
+    while (*slot && strcmp((*slot)->filename, filename) != 0) slot = &(*slot)->next;
+    return slot;
+}
+
+// nm_lock held: the file's replicas (primary excluded); returns how many
+static int file_replicas(FileMetadata* file, int* out) {
+    PlacementEntry* e = *placement_slot(file->filename);
+    if (e) {
+        for (int i = 0; i < e->count; i++) out[i] = e->ss[i];
+        return e->count;
+    }
+    // Placed before replica lists existed: just the one in FileMetadata
+    if (file->replica_ss_id >= 0 && file->replica_ss_id < ss_count) { out[0] = file->replica_ss_id; return 1; }
+    return 0;
+}
+
+// nm_lock held: record the file's replicas and mirror the first into FileMetadata
+static void set_file_replicas(FileMetadata* file, const int* ids, int n) {
+    PlacementEntry** slot = placement_slot(file->filename);
+    if (!*slot) {
+        *slot = calloc(1, sizeof(PlacementEntry));
+        if (!*slot) return;
+        strncpy((*slot)->filename, file->filename, sizeof((*slot)->filename) - 1);
+    }
+    (*slot)->count = n;
+    for (int i = 0; i < n; i++) (*slot)->ss[i] = ids[i];
+    if (n > 0) {
+        StorageServerInfo* rss = &storage_servers[ids[0]];
+        file->replica_ss_id = rss->ss_id;
+        strcpy(file->replica_ss_ip, rss->ip);
+        file->replica_ss_port = rss->client_port;
+    } else {
+        file->replica_ss_id = -1; file->replica_ss_ip[0] = '\0'; file->replica_ss_port = 0;
+    }
+}
+
+static void placement_forget(const char* filename) {
+    PlacementEntry** slot = placement_slot(filename);
+    if (*slot) {
+        PlacementEntry* e = *slot;
+        *slot = e->next;
+        free(e);
+    }
+}
+
+static void placement_rename(const char* oldname, const char* newname) {
+    PlacementEntry** slot = placement_slot(oldname);
+    if (!*slot) return;
+    PlacementEntry* e = *slot;
+    *slot = e->next;
+    strncpy(e->filename, newname, sizeof(e->filename) - 1);
+    e->filename[sizeof(e->filename) - 1] = '\0';
+    PlacementEntry** dst = &placements[hash_string(e->filename) % PLACEMENT_BUCKETS];
+    e->next = *dst;
+    *dst = e;
+}
+
+// FNV-1a alone clusters keys that differ only in their last characters ("ip:port#1",
+// "#2", ...); finish with the murmur3 mixer so vnodes spread around the ring
+static unsigned int ring_hash(const char* key) {
+    unsigned int h = hash_string(key);
+    h ^= h >> 16; h *= 0x85ebca6bu;
+    h ^= h >> 13; h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int ring_point_cmp(const void* a, const void* b) {
+    unsigned int x = ((const RingPoint*)a)->hash, y = ((const RingPoint*)b)->hash;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// nm_lock held: rebuild the ring from the member servers. Points are derived from the
+// server address, not its slot, so the ring is the same after an NM restart.
+static void ring_rebuild() {
+    ring_size = 0;
+    ring_members = 0;
+    for (int i = 0; i < ss_count; i++) {
+        if (!ss_in_ring[i]) continue;
+        ring_members++;
+        for (int v = 0; v < ring_vnodes; v++) {
+            char key[64];
+            snprintf(key, sizeof(key), "%s:%d#%d", storage_servers[i].ip, storage_servers[i].nm_port, v);
+            ring[ring_size].hash = ring_hash(key);
+            ring[ring_size].ss_id = i;
+            ring_size++;
+        }
+    }
+    qsort(ring, ring_size, sizeof(RingPoint), ring_point_cmp);
+}
+
+// nm_lock held: ring members clockwise from the file's hash, each listed once
+static int ring_lookup(const char* filename, int* out, int max) {
+    if (ring_size == 0) return 0;
+    unsigned int h = ring_hash(filename);
+    int lo = 0, hi = ring_size;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < h) lo = mid + 1; else hi = mid;
+    }
+    int seen[ss_count + 1]; memset(seen, 0, sizeof(seen));
+    int n = 0;
+    for (int k = 0; k < ring_size && n < max && n < ring_members; k++) {
+        int id = ring[(lo + k) % ring_size].ss_id;
+        if (seen[id]) continue;
+        seen[id] = 1;
+        out[n++] = id;
+    }
+    return n;
+}
+
+// Send one message to an SS's NM port and wait for the answer; returns 0 on ERR_SUCCESS
+static int ss_request(const char* ip, int port, Message* m, int timeout_sec) {
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) return -1;
+    struct timeval tv = { timeout_sec, 0 };
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET; addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    int rc = -1;
+    if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) == 0 && send_message(s, m) > 0 &&
+        receive_message(s, m) > 0 && m->error_code == ERR_SUCCESS) {
+        rc = 0;
+    }
+    close(s);
+    return rc;
+}
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    int primary;
+    int count;
+    int ss[MAX_REPLICAS - 1];
+    int dropped_count;
+    int dropped[MAX_REPLICAS - 1];
+} PlacementJob;
+
+// Bring every file's replica set in line with the ring after a membership change.
+// Only files whose ring successors changed produce work: the primary is told its new
+// replicas (OP_SET_REPLICAS) and pushes them the content, then copies on servers that
+// left the set are removed. Primaries stay put; files whose primary is down wait.
+static void* reconcile_placement(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&nm_lock);
+        PlacementJob* jobs = malloc(sizeof(PlacementJob) * (file_count > 0 ? file_count : 1));
+        int njobs = 0;
+        for (int f = 0; jobs && f < file_count; f++) {
+            FileMetadata* file = file_ready(f);
+            if (file->filename[0] == '\0') continue;
+            int primary = file->ss_id;
+            if (primary < 0 || primary >= ss_count || !storage_servers[primary].active) continue;
+
+            int pref[MAX_REPLICAS];
+            int npref = ring_lookup(file->filename, pref, replication_factor);
+            // A primary that is no longer among the file's ring servers is moved by the rebalancer
+            int primary_owned = 0;
+            for (int k = 0; k < npref; k++) if (pref[k] == primary) primary_owned = 1;
+            if (!primary_owned && npref > 0) {
+                int target = pick_migration_target(file);
+                if (target >= 0) migration_enqueue(file->filename, target);
+            }
+
+            PlacementJob* job = &jobs[njobs];
+            job->count = 0;
+            for (int k = 0; k < npref && job->count < replication_factor - 1; k++) {
+                if (pref[k] != primary) job->ss[job->count++] = pref[k];
+            }
+
+            int cur[MAX_REPLICAS - 1];
+            int ncur = file_replicas(file, cur);
+            // Replica order carries no meaning, so only a different set of servers is work
+            int same = ncur == job->count;
+            for (int k = 0; same && k < ncur; k++) {
+                int found = 0;
+                for (int j = 0; j < job->count; j++) if (job->ss[j] == cur[k]) found = 1;
+                same = found;
+            }
+            if (same) continue;
+
+            job->dropped_count = 0;
+            for (int k = 0; k < ncur; k++) {
+                int kept = cur[k] == primary;
+                for (int j = 0; j < job->count; j++) if (job->ss[j] == cur[k]) kept = 1;
+                if (!kept) job->dropped[job->dropped_count++] = cur[k];
+            }
+            strcpy(job->filename, file->filename);
+            job->primary = primary;
+            njobs++;
+        }
+        pthread_mutex_unlock(&nm_lock);
+
+        if (njobs > 0) log_message("NM", "INFO", "Placement: %d file(s) changed ring owners", njobs);
+        int moved = 0;
+        for (int j = 0; j < njobs; j++) {
+            PlacementJob* job = &jobs[j];
+            Message m; memset(&m, 0, sizeof(m));
+            m.op_code = OP_SET_REPLICAS;
+            strcpy(m.filename, job->filename);
+            char pip[INET_ADDRSTRLEN]; int pport;
+            pthread_mutex_lock(&placement_lock);
+            pthread_mutex_lock(&nm_lock);
+            // A migration may have moved the file since the jobs were collected
+            FileMetadata* cur = file_lookup(job->filename);
+            if (!cur || cur->ss_id != job->primary) {
+                pthread_mutex_unlock(&nm_lock);
+                pthread_mutex_unlock(&placement_lock);
+                continue;
+            }
+            strcpy(pip, storage_servers[job->primary].ip);
+            pport = storage_servers[job->primary].nm_port;
+            size_t used = 0;
+            for (int k = 0; k < job->count; k++) {
+                used += snprintf(m.data + used, sizeof(m.data) - used, "replica %s %d ",
+                                 storage_servers[job->ss[k]].ip, storage_servers[job->ss[k]].nm_port);
+            }
+            pthread_mutex_unlock(&nm_lock);
+
+            if (ss_request(pip, pport, &m, 10) != 0) {
+                pthread_mutex_unlock(&placement_lock);
+                log_message("NM", "WARN", "Placement: SS %d did not take new replicas for %s", job->primary, job->filename);
+                continue;
+            }
+
+            pthread_mutex_lock(&nm_lock);
+            FileMetadata* file = file_lookup(job->filename);
+            if (file && file->ss_id == job->primary) {
+                set_file_replicas(file, job->ss, job->count);
+                journal_file_put(file);
+                moved++;
+                placement_moves++;
+            }
+            pthread_mutex_unlock(&nm_lock);
+            pthread_mutex_unlock(&placement_lock);
+            journal_commit();
+
+            // The old copies are no longer tracked; remove them where reachable
+            for (int k = 0; k < job->dropped_count; k++) {
+                pthread_mutex_lock(&nm_lock);
+                StorageServerInfo* dss = &storage_servers[job->dropped[k]];
+                int active = dss->active;
+                char dip[INET_ADDRSTRLEN]; strcpy(dip, dss->ip);
+                int dport = dss->nm_port;
+                pthread_mutex_unlock(&nm_lock);
+                if (!active) continue;
+                Message d; memset(&d, 0, sizeof(d));
+                d.op_code = OP_DELETE;
+                d.flags = FLAG_REPL;
+                strcpy(d.filename, job->filename);
+                ss_request(dip, dport, &d, 5);
+            }
+        }
+        free(jobs);
+        if (moved > 0) {
+            log_message("NM", "INFO", "Placement: re-replicated %d file(s)", moved);
+        }
+
+        pthread_mutex_lock(&nm_lock);
+        if (!reconcile_again) {
+            reconcile_running = 0;
+            pthread_mutex_unlock(&nm_lock);
+            break;
+        }
+        reconcile_again = 0;
+        pthread_mutex_unlock(&nm_lock);
+    }
+    return NULL;
+}
+
+// ---- Primary migration (rebalancer) ----
+
+// nm_lock held: queue a move of the file's primary; a file is queued at most once
+static int migration_enqueue(const char* filename, int target) {
+    for (int k = 0; k < migration_len; k++) {
+        MigrationJob* q = &migration_queue[(migration_head + k) % migration_cap];
+        if (strcmp(q->filename, filename) == 0) { q->target = target; return 0; }
+    }
+    if (migration_len == migration_cap) {
+        int cap = migration_cap ? migration_cap * 2 : 256;
+        MigrationJob* grown = malloc((size_t)cap * sizeof(MigrationJob));
+        if (grown == NULL) return -1;
+        for (int k = 0; k < migration_len; k++) grown[k] = migration_queue[(migration_head + k) % migration_cap];
+        free(migration_queue);
+        migration_queue = grown;
+        migration_cap = cap;
+        migration_head = 0;
+    }
+    MigrationJob* job = &migration_queue[(migration_head + migration_len) % migration_cap];
+    strncpy(job->filename, filename, sizeof(job->filename) - 1);
+    job->filename[sizeof(job->filename) - 1] = '\0';
+    job->target = target;
+    migration_len++;
+    pthread_cond_signal(&migration_cond);
+    return 0;
+}
+
+// nm_lock held: where the file's primary should go — the first of its ring servers that
+// is up, has room and is not the current primary. -1 if there is none.
+static int pick_migration_target(FileMetadata* file) {
+    int order[ss_count + 1]; double scores[ss_count + 1];
+    rank_storage_servers(order, scores);
+    int pref[ss_count + 1];
+    int npref = ring_lookup(file->filename, pref, ss_count);
+    for (int k = 0; k < npref; k++) {
+        int id = pref[k];
+        if (id != file->ss_id && scores[id] >= 0.0 && !ss_draining[id]) return id;
+    }
+    return -1;
+}
+
+// nm_lock held: replicas for a file whose primary becomes `primary`: its ring servers,
+// else whatever live copies `fallback` lists
+static int choose_replicas(FileMetadata* file, int primary, const int* fallback, int nfallback, int* out) {
+    int n = 0;
+    int pref[ss_count + 1];
+    int npref = ring_lookup(file->filename, pref, ss_count);
+    for (int k = 0; k < npref && n < replication_factor - 1; k++) {
+        int id = pref[k];
+        if (id != primary && storage_servers[id].active && !ss_draining[id]) out[n++] = id;
+    }
+    for (int k = 0; k < nfallback && n < replication_factor - 1; k++) {
+        int id = fallback[k], dup = id == primary;
+        for (int j = 0; j < n; j++) if (out[j] == id) dup = 1;
+        if (!dup && storage_servers[id].active) out[n++] = id;
+    }
+    return n;
+}
+
+// Format "replica <ip> <nm_port> ..." for OP_SET_REPLICAS (nm_lock held)
+static void format_replica_list(char* out, size_t out_len, const int* ids, int n) {
+    size_t used = 0;
+    out[0] = '\0';
+    for (int k = 0; k < n && used < out_len; k++) {
+        used += snprintf(out + used, out_len - used, "replica %s %d ", storage_servers[ids[k]].ip, storage_servers[ids[k]].nm_port);
+    }
+}
+
+// Move a file's primary to `target` without stopping it:
+//   1. the target is added to the source's replicas, so it receives the content now and
+//      every edit after (catch-up rides on normal replication);
+//   2. the source is frozen (OP_FREEZE): client edits get ERR_FILE_MOVED, batched ones
+//      land and the final content is pushed and acknowledged by every replica;
+//   3. the NM flips ss_id to the target and persists it;
+//   4. the target is told its replicas (which also lets it take edits) and brings them
+//      up to date, then copies outside the new set are deleted.
+// A failure before the flip restores the source's replicas, which unfreezes it, and
+// deletes the copy from a target that was not already a replica.
+static int migrate_file(const char* filename, int target) {
+    pthread_mutex_lock(&placement_lock);
+    pthread_mutex_lock(&nm_lock);
+    FileMetadata* file = file_lookup(filename);
+    if (!file || target < 0 || target >= ss_count || file->ss_id == target ||
+        file->ss_id < 0 || file->ss_id >= ss_count ||
+        !storage_servers[target].active || !storage_servers[file->ss_id].active) {
+        pthread_mutex_unlock(&nm_lock);
+        pthread_mutex_unlock(&placement_lock);
+        return -1;
+    }
+    int source = file->ss_id;
+    int reps[MAX_REPLICAS - 1];
+    int nreps = file_replicas(file, reps);
+    int staged[MAX_REPLICAS - 1];
+    int nstaged = 0;
+    int target_is_replica = 0;
+    for (int k = 0; k < nreps; k++) if (reps[k] == target) target_is_replica = 1;
+    for (int k = 0; k < nreps && nstaged < MAX_REPLICAS - 2 + target_is_replica; k++) staged[nstaged++] = reps[k];
+    if (!target_is_replica) staged[nstaged++] = target;
+
+    char sip[INET_ADDRSTRLEN]; int sport = storage_servers[source].nm_port;
+    strcpy(sip, storage_servers[source].ip);
+    Message stage; memset(&stage, 0, sizeof(stage));
+    stage.op_code = OP_SET_REPLICAS;
+    strcpy(stage.filename, filename);
+    format_replica_list(stage.data, sizeof(stage.data), staged, nstaged);
+    Message restore = stage;
+    format_replica_list(restore.data, sizeof(restore.data), reps, nreps);
+    strcpy(migration_current, filename);
+
+    char tip[INET_ADDRSTRLEN]; int tport = storage_servers[target].nm_port;
+    strcpy(tip, storage_servers[target].ip);
+    pthread_mutex_unlock(&nm_lock);
+
+    int rc = -1;
+    Message m = stage;
+    if (ss_request(sip, sport, &m, 10) != 0) {
+        log_message("NM", "WARN", "Migrate %s: SS %d could not copy it to SS %d", filename, source, target);
+        goto abort;
+    }
+    memset(&m, 0, sizeof(m));
+    m.op_code = OP_FREEZE;
+    strcpy(m.filename, filename);
+    if (ss_request(sip, sport, &m, 10) != 0) {
+        log_message("NM", "WARN", "Migrate %s: cut-over failed (%s), staying on SS %d", filename, m.error_msg, source);
+        goto abort;
+    }
+
+    // Cut-over: the target holds the final content, its checkpoints and undo state
+    pthread_mutex_lock(&nm_lock);
+    file = file_lookup(filename);
+    if (!file || file->ss_id != source) {
+        pthread_mutex_unlock(&nm_lock);
+        goto abort;
+    }
+    int newreps[MAX_REPLICAS - 1];
+    int nnew = choose_replicas(file, target, staged, nstaged, newreps);
+    StorageServerInfo* tss = &storage_servers[target];
+    int slot = (int)(file - files);
+    ss_files_remove(slot);
+    file->ss_id = target;
+    strcpy(file->ss_ip, tss->ip);
+    file->ss_port = tss->client_port;
+    set_file_replicas(file, newreps, nnew);
+    replica_state_forget(filename);
+    ss_files_add(tss, slot);
+    inventory_touch(file);
+
+    Message takeover; memset(&takeover, 0, sizeof(takeover));
+    takeover.op_code = OP_SET_REPLICAS;
+    strcpy(takeover.filename, filename);
+    format_replica_list(takeover.data, sizeof(takeover.data), newreps, nnew);
+
+    // Copies outside the new set: the old primary and any replaced replica
+    int drop[MAX_REPLICAS]; int ndrop = 0;
+    int old[MAX_REPLICAS]; int nold = 0;
+    old[nold++] = source;
+    for (int k = 0; k < nreps; k++) old[nold++] = reps[k];
+    for (int k = 0; k < nold; k++) {
+        int keep = old[k] == target;
+        for (int j = 0; j < nnew; j++) if (newreps[j] == old[k]) keep = 1;
+        if (!keep) drop[ndrop++] = old[k];
+    }
+    char drop_ip[MAX_REPLICAS][INET_ADDRSTRLEN]; int drop_port[MAX_REPLICAS];
+    for (int k = 0; k < ndrop; k++) { strcpy(drop_ip[k], storage_servers[drop[k]].ip); drop_port[k] = storage_servers[drop[k]].nm_port; }
+    journal_file_put(file);
+    pthread_mutex_unlock(&nm_lock);
+    journal_commit();
+
+    m = takeover;
+    if (ss_request(tip, tport, &m, 10) != 0) {
+        log_message("NM", "WARN", "Migrate %s: SS %d is primary but its replicas are not in sync yet", filename, target);
+    }
+    for (int k = 0; k < ndrop; k++) {
+        Message d; memset(&d, 0, sizeof(d));
+        d.op_code = OP_DELETE;
+        d.flags = FLAG_REPL;
+        strcpy(d.filename, filename);
+        ss_request(drop_ip[k], drop_port[k], &d, 5);
+    }
+    log_message("NM", "INFO", "Migrated %s: SS %d -> SS %d", filename, source, target);
+    rc = 0;
+    goto out;
+
+abort:
+    // The source may already list the target, or be frozen: give it back its old
+    // replicas, and remove the partial copy from a target that held none before
+    m = restore;
+    ss_request(sip, sport, &m, 10);
+    if (!target_is_replica) {
+        memset(&m, 0, sizeof(m));
+        m.op_code = OP_DELETE;
+        m.flags = FLAG_REPL;
+        strcpy(m.filename, filename);
+        ss_request(tip, tport, &m, 5);
+    }
+
+out:
+    pthread_mutex_lock(&nm_lock);
+    migration_current[0] = '\0';
+    if (rc == 0) migration_stats.done++; else migration_stats.failed++;
+    pthread_mutex_unlock(&nm_lock);
+    pthread_mutex_unlock(&placement_lock);
+    return rc;
+}
+
+// Background rebalancer: runs queued migrations one at a time, at most
+// NM_MIGRATE_PER_SEC per second so copies do not crowd out client traffic
+static void* migration_worker(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&nm_lock);
+        while (migration_len == 0) pthread_cond_wait(&migration_cond, &nm_lock);
+        MigrationJob job = migration_queue[migration_head];
+        migration_head = (migration_head + 1) % migration_cap;
+        migration_len--;
+        pthread_mutex_unlock(&nm_lock);
+
+        migrate_file(job.filename, job.target);
+        usleep(1000000 / migrate_per_sec);
+    }
+    return NULL;
+}
+
+void handle_migrate_command(int client_sock, Message* msg) {
+    pthread_mutex_lock(&nm_lock);
+    FileMetadata* file = file_lookup(msg->filename);
+    int target = -1;
+    if (!file) {
+        msg->error_code = ERR_FILE_NOT_FOUND;
+        strcpy(msg->error_msg, "File not found");
+    } else if (file->owner_id != request_user(msg)) {
+        msg->error_code = ERR_NOT_OWNER;
+        strcpy(msg->error_msg, "Only the owner can migrate the file");
+    } else if (sscanf(msg->data, "%d", &target) != 1 || target < 0 || target >= ss_count || !storage_servers[target].active) {
+        msg->error_code = ERR_SS_NOT_FOUND;
+        strcpy(msg->error_msg, "No such active storage server");
+    } else if (file->ss_id == target) {
+        msg->error_code = ERR_SUCCESS;
+        snprintf(msg->data, sizeof(msg->data), "%s is already on SS %d", file->filename, target);
+    } else if (migration_enqueue(file->filename, target) != 0) {
+        msg->error_code = ERR_SERVER_ERROR;
+        strcpy(msg->error_msg, "Migration queue is full");
+    } else {
+        msg->error_code = ERR_SUCCESS;
+        snprintf(msg->data, sizeof(msg->data), "Migration of %s from SS %d to SS %d queued", file->filename, file->ss_id, target);
+    }
+    pthread_mutex_unlock(&nm_lock);
+    send_message(client_sock, msg);
+}
+
+// DRAIN <ss_id> 1: take the SS out of the ring (its replicas move via reconciliation)
+// and queue its primaries for migration. DRAIN <ss_id> 0 lets it take files again.
+void handle_drain_command(int client_sock, Message* msg) {
+    int id = -1, on = 1;
+    pthread_mutex_lock(&nm_lock);
+    if (sscanf(msg->data, "%d %d", &id, &on) < 1 || id < 0 || id >= ss_count) {
+        msg->error_code = ERR_SS_NOT_FOUND;
+        strcpy(msg->error_msg, "No such storage server");
+        pthread_mutex_unlock(&nm_lock);
+        send_message(client_sock, msg);
+        return;
+    }
+    if (!on) {
+        ss_draining[id] = 0;
+        if (storage_servers[id].active && !ss_in_ring[id]) {
+            ss_in_ring[id] = 1;
+            ring_rebuild();
+            schedule_reconcile();
+        }
+        msg->error_code = ERR_SUCCESS;
+        snprintf(msg->data, sizeof(msg->data), "SS %d takes files again", id);
+        pthread_mutex_unlock(&nm_lock);
+        send_message(client_sock, msg);
+        return;
+    }
+
+    ss_draining[id] = 1;
+    if (ss_in_ring[id]) {
+        ss_in_ring[id] = 0;
+        ring_rebuild();
+        schedule_reconcile();
+    }
+    int queued = 0, stuck = 0;
+    for (int f = 0; f < file_count; f++) {
+        if (file_ready(f)->ss_id != id || files[f].filename[0] == '\0') continue;
+        int target = pick_migration_target(&files[f]);
+        if (target >= 0 && migration_enqueue(files[f].filename, target) == 0) queued++; else stuck++;
+    }
+    log_message("NM", "INFO", "Draining SS %d: %d primaries queued, %d without a target", id, queued, stuck);
+    msg->error_code = ERR_SUCCESS;
+    snprintf(msg->data, sizeof(msg->data), "Draining SS %d: %d files queued for migration%s", id, queued,
+             stuck ? " (some files have no other server to go to)" : "");
+    pthread_mutex_unlock(&nm_lock);
+    send_message(client_sock, msg);
+}
+
+// nm_lock held: run reconcile_placement once more after the current pass, or start it
+static void schedule_reconcile() {
+    if (reconcile_running) { reconcile_again = 1; return; }
+    reconcile_running = 1;
+    pthread_t t;
+    if (pthread_create(&t, NULL, reconcile_placement, NULL) != 0) { reconcile_running = 0; return; }
+    pthread_detach(t);
+}
+
+// ---- Load-aware placement ----
+
+// nm_lock held: score every active SS with enough free space (lower is better) and
+// return them best first. Each term is normalised against the largest value in the
+// cluster, so disk fullness, stored files, request rate and RTT are traded off by weight.
+static int rank_storage_servers(int* order, double* scores) {
+    // A replica copy counts half: the primary also takes every write
+    double counts[ss_count + 1];
+    for (int i = 0; i <= ss_count; i++) counts[i] = 0.0;
+    for (int f = 0; f < file_count; f++) {
+        if (file_ready(f)->filename[0] == '\0') continue;
+        if (files[f].ss_id >= 0 && files[f].ss_id < ss_count) counts[files[f].ss_id] += 1.0;
+        int reps[MAX_REPLICAS - 1];
+        int n = file_replicas(&files[f], reps);
+        for (int r = 0; r < n; r++) if (reps[r] >= 0 && reps[r] < ss_count) counts[reps[r]] += 0.5;
+    }
+    double max_files = 1.0, max_rate = 1.0, max_rtt = 1.0;
+    for (int i = 0; i < ss_count; i++) {
+        if (!storage_servers[i].active) continue;
+        if (counts[i] > max_files) max_files = counts[i];
+        if (ss_load[i].req_rate > max_rate) max_rate = ss_load[i].req_rate;
+        if (ss_load[i].rtt_ms > max_rtt) max_rtt = ss_load[i].rtt_ms;
+    }
+
+    int n = 0;
+    for (int i = 0; i < ss_count; i++) {
+        SSLoad* l = &ss_load[i];
+        scores[i] = -1.0;
+        if (!storage_servers[i].active || ss_draining[i]) continue;
+        if (l->free_mb >= 0 && l->free_mb < placement_min_free_mb) continue; // full
+        double disk = (l->total_mb > 0 && l->free_mb >= 0) ? 1.0 - (double)l->free_mb / (double)l->total_mb : 0.5;
+        scores[i] = 0.35 * disk + 0.25 * counts[i] / max_files + 0.25 * l->req_rate / max_rate + 0.15 * l->rtt_ms / max_rtt;
+        // Insertion sort; ties keep the lower index
+        int j = n++;
+        while (j > 0 && scores[order[j-1]] > scores[i]) { order[j] = order[j-1]; j--; }
+        order[j] = i;
+    }
+    return n;
+}
+
+void handle_cluster_command(int client_sock, Message* msg) {
+    pthread_mutex_lock(&nm_lock);
+    int order[ss_count + 1]; double scores[ss_count + 1];
+    rank_storage_servers(order, scores);
+    int primaries[ss_count + 1]; int replicas[ss_count + 1];
+    memset(primaries, 0, sizeof(primaries)); memset(replicas, 0, sizeof(replicas));
+    for (int f = 0; f < file_count; f++) {
+        if (file_ready(f)->filename[0] == '\0') continue;
+        if (files[f].ss_id >= 0 && files[f].ss_id < ss_count) primaries[files[f].ss_id]++;
+        int reps[MAX_REPLICAS - 1];
+        int n = file_replicas(&files[f], reps);
+        for (int r = 0; r < n; r++) if (reps[r] >= 0 && reps[r] < ss_count) replicas[reps[r]]++;
+    }
+    size_t used = snprintf(msg->data, sizeof(msg->data),
+                           "Ring: %d servers x %d vnodes, replication factor %d, %lu replica sets moved\n",
+                           ring_members, ring_vnodes, replication_factor, placement_moves);
+    used += snprintf(msg->data + used, sizeof(msg->data) - used, "Migrations: %d queued, %lu done, %lu failed%s%s\n",
+                     migration_len, migration_stats.done, migration_stats.failed,
+                     migration_current[0] ? ", moving " : "", migration_current);
+    used += snprintf(msg->data + used, sizeof(msg->data) - used, "%-3s %-22s %-6s %-5s %-9s %-8s %-15s %-8s %-7s %s\n",
+                     "SS", "Address", "Active", "Ring", "Primaries", "Replicas", "Free/Total MB", "Req/s", "RTT ms", "Score");
+    for (int i = 0; i < ss_count && used < sizeof(msg->data); i++) {
+        StorageServerInfo* ss = &storage_servers[i];
+        char addr[40]; snprintf(addr, sizeof(addr), "%s:%d", ss->ip, ss->client_port);
+        char cap[32];
+        if (ss_load[i].free_mb >= 0) snprintf(cap, sizeof(cap), "%lld/%lld", ss_load[i].free_mb, ss_load[i].total_mb);
+        else strcpy(cap, "?");
+        char score[16];
+        if (scores[i] >= 0.0) snprintf(score, sizeof(score), "%.3f", scores[i]); else strcpy(score, "-");
+        used += snprintf(msg->data + used, sizeof(msg->data) - used, "%-3d %-22s %-6s %-5s %-9d %-8d %-15s %-8.2f %-7.2f %s\n",
+                         ss->ss_id, addr, ss->active ? "yes" : "no",
+                         ss_draining[i] ? "drain" : (ss_in_ring[i] ? "yes" : "no"), primaries[i], replicas[i], cap,
+                         ss_load[i].req_rate, ss_load[i].rtt_ms, score);
+    }
+    msg->error_code = ERR_SUCCESS;
+    pthread_mutex_unlock(&nm_lock);
+    send_message(client_sock, msg);
 }
 
 // Sync thread for a returning primary: copy replica contents back
 void* sync_returned_primary(void* arg) {
     int ss_id = *(int*)arg; free(arg);
     pthread_mutex_lock(&nm_lock);
-    // Collect files belonging to this primary
-    FileMetadata local_files[MAX_FILES]; int count=0;
-    for (int i=0;i<file_count;i++) {
-        if (files[i].ss_id == ss_id && files[i].replica_ss_id >=0) {
-            local_files[count++] = files[i];
+    // Collect files belonging to this primary (only what the copy needs, not whole records)
+    struct SyncItem { char filename[MAX_FILENAME]; int ss_id; int replica_ss_id; } *local_files = NULL;
+    int count=0;
+    if (file_count > 0) local_files = malloc(sizeof(*local_files) * file_count);
+    for (int i=0;local_files && i<file_count;i++) {
+        if (file_ready(i)->filename[0] && files[i].ss_id == ss_id && files[i].replica_ss_id >=0) {
+            strcpy(local_files[count].filename, files[i].filename);
+            local_files[count].ss_id = files[i].ss_id;
+            local_files[count].replica_ss_id = files[i].replica_ss_id;
+            count++;
         }
     }
     pthread_mutex_unlock(&nm_lock);
-    if (count==0) return NULL;
+    if (count==0) { free(local_files); return NULL; }
     log_message("NM","INFO","Sync: primary SS %d returning, syncing %d files from replicas", ss_id, count);
     for (int i=0;i<count;i++) {
-        FileMetadata* f = &local_files[i];
+        struct SyncItem* f = &local_files[i];
         // Read content from replica
         if (f->replica_ss_id <0 || f->replica_ss_id >= ss_count) continue;
         StorageServerInfo* rss = &storage_servers[f->replica_ss_id];
@@ -542,39 +2300,61 @@ void* sync_returned_primary(void* arg) {
         if (connect(ps,(struct sockaddr*)&paddr,sizeof(paddr))!=0){ close(ps); continue; }
         Message w; memset(&w,0,sizeof(w)); w.op_code=OP_REPL_WRITE; strncpy(w.filename,f->filename,sizeof(w.filename)-1); strncpy(w.data,req.data,sizeof(w.data)-1); send_message(ps,&w); receive_message(ps,&w); close(ps);
     }
+    free(local_files);
     log_message("NM","INFO","Sync: completed for primary SS %d", ss_id);
     return NULL;
 }
 
-void handle_create_command(int client_sock, Message* msg) {
-    pthread_mutex_lock(&nm_lock);
-    
+// nm_lock held: create the file on its storage servers and record (and journal) its metadata.
+// Leaves the reply in msg; the caller unlocks, calls journal_commit() and sends it.
+static int create_file_locked(Message* msg) {
     // Check if file exists
-    if (trie_search(file_trie_root, msg->filename) != NULL) {
+    if (file_lookup(msg->filename) != NULL || shard_name_busy(msg->filename)) {
         msg->error_code = ERR_FILE_EXISTS;
         strcpy(msg->error_msg, "File already exists");
-        pthread_mutex_unlock(&nm_lock);
-        send_message(client_sock, msg);
-        return;
+        return msg->error_code;
+    }
+    if (file_free_head < 0 && (table_grow(&file_table, file_count + 1) != 0 ||
+                               table_grow(&file_slot_table, file_count + 1) != 0)) {
+        msg->error_code = ERR_SERVER_ERROR;
+        strcpy(msg->error_msg, "File table full");
+        return msg->error_code;
     }
     
     // Find an available storage server
     if (ss_count == 0) {
         msg->error_code = ERR_SS_NOT_FOUND;
         strcpy(msg->error_msg, "No storage servers available");
-        pthread_mutex_unlock(&nm_lock);
-        send_message(client_sock, msg);
-        return;
+        return msg->error_code;
     }
     
-    // Try to create on an active storage server. Start from round-robin index but probe others if needed.
-    int start = (file_count < ss_count) ? (file_count % ss_count) : (file_count % ss_count);
+    // The ring names the file's servers (skipping ones that are down or full); the
+    // best-scored of them becomes the primary and the others its replicas
+    int order[ss_count + 1]; double scores[ss_count + 1];
+    rank_storage_servers(order, scores);
+    int pref[ss_count + 1];
+    int npref = ring_lookup(msg->filename, pref, ss_count);
+    int set[MAX_REPLICAS]; int nset = 0;
+    for (int k = 0; k < npref && nset < replication_factor; k++) {
+        if (scores[pref[k]] >= 0.0) set[nset++] = pref[k];
+    }
+    int tries[MAX_REPLICAS];
+    for (int k = 0; k < nset; k++) {
+        int j = k;
+        while (j > 0 && scores[tries[j-1]] > scores[set[k]]) { tries[j] = tries[j-1]; j--; }
+        tries[j] = set[k];
+    }
+
     int chosen = -1;
+    int replica_ids[MAX_REPLICAS - 1]; int replica_n = 0;
     Message ss_reply;
-    for (int attempt = 0; attempt < ss_count; attempt++) {
-        int idx = (start + attempt) % ss_count;
+    for (int attempt = 0; attempt < nset; attempt++) {
+        int idx = tries[attempt];
         StorageServerInfo* cand = &storage_servers[idx];
-        if (!cand->active) continue; // skip inactive
+        replica_n = 0;
+        for (int k = 0; k < nset; k++) {
+            if (set[k] != idx) replica_ids[replica_n++] = set[k];
+        }
 
         int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
         if (ss_sock < 0) continue;
@@ -582,8 +2362,14 @@ void handle_create_command(int client_sock, Message* msg) {
         ss_addr.sin_family = AF_INET; ss_addr.sin_port = htons(cand->nm_port);
         inet_pton(AF_INET, cand->ip, &ss_addr.sin_addr);
         if (connect(ss_sock, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) == 0) {
-            // Send create to this SS
+            // Send create to this SS, naming the replicas it should keep in sync
             Message req = *msg; // includes filename/username/op already
+            req.data[0] = '\0';
+            size_t used = 0;
+            for (int k = 0; k < replica_n; k++) {
+                used += snprintf(req.data + used, sizeof(req.data) - used, "replica %s %d ",
+                                 storage_servers[replica_ids[k]].ip, storage_servers[replica_ids[k]].nm_port);
+            }
             send_message(ss_sock, &req);
             memset(&ss_reply, 0, sizeof(ss_reply));
             if (receive_message(ss_sock, &ss_reply) > 0 && ss_reply.error_code == ERR_SUCCESS) {
@@ -598,81 +2384,71 @@ void handle_create_command(int client_sock, Message* msg) {
     if (chosen < 0) {
         msg->error_code = ERR_CONNECTION_FAILED;
         strcpy(msg->error_msg, "Failed to connect to storage server");
-        pthread_mutex_unlock(&nm_lock);
-        send_message(client_sock, msg);
-        return;
+        return msg->error_code;
     }
 
     // Persist metadata only after SS confirmed creation
     StorageServerInfo* ss = &storage_servers[chosen];
-    FileMetadata* file = &files[file_count];
+    int slot = file_slot_alloc();   // cannot fail: room was checked above under the same lock
+    FileMetadata* file = &files[slot];
     strcpy(file->filename, msg->filename);
-    strcpy(file->owner, msg->username);
+    file->owner_id = nm_user_id(msg->username);
     file->ss_id = ss->ss_id;
     strcpy(file->ss_ip, ss->ip);
     file->ss_port = ss->client_port;
-    // Set replica to next ACTIVE SS if exists
-    int replica_id = -1; int replica_idx = -1;
-    if (ss_count > 1) {
-        for (int off = 1; off <= ss_count; off++) {
-            int j = (chosen + off) % ss_count;
-            if (storage_servers[j].active && j != chosen) { replica_idx = j; break; }
-        }
-    }
-    if (replica_idx >= 0) {
-        StorageServerInfo* rss = &storage_servers[replica_idx];
-        replica_id = rss->ss_id;
-        file->replica_ss_id = replica_id;
-        strcpy(file->replica_ss_ip, rss->ip);
-        file->replica_ss_port = rss->client_port;
-    } else {
-        file->replica_ss_id = -1; file->replica_ss_ip[0] = '\0'; file->replica_ss_port = 0;
-    }
-    file->access_count = 0;
+    // Replicas as placed above (the SS was told to replicate there)
+    set_file_replicas(file, replica_ids, replica_n);
     file->created_time = time(NULL);
     file->modified_time = time(NULL);
     file->accessed_time = time(NULL);
     file->size = 0;
     file->word_count = 0;
     file->char_count = 0;
-    strcpy(file->last_accessed_by, msg->username);
+    file->last_accessed_by_id = nm_user_id(msg->username);
 
     trie_insert(file_trie_root, msg->filename, file);
+    name_index_put(slot);
+    user_files_add(file->owner_id, file->filename);
     // Add to SS file list for chosen
-    strcpy(ss->files[ss->file_count], msg->filename);
-    ss->file_count++;
-    file_count++;
+    ss_files_add(ss, slot);
+    inventory_touch(file);
+    journal_file_put(file);
 
     // Return success to client
     msg->error_code = ERR_SUCCESS;
     strcpy(msg->data, "File created successfully");
-    pthread_mutex_unlock(&nm_lock);
-    send_message(client_sock, msg);
-
-    save_persistent_data();
     log_message("NM", "INFO", "File created: %s by %s on SS %d", msg->filename, msg->username, ss->ss_id);
+    return ERR_SUCCESS;
 }
 
-void handle_delete_command(int client_sock, Message* msg) {
+void handle_create_command(int client_sock, Message* msg) {
     pthread_mutex_lock(&nm_lock);
-    
-    FileMetadata* file = trie_search(file_trie_root, msg->filename);
+    create_file_locked(msg);
+    pthread_mutex_unlock(&nm_lock);
+    journal_commit();
+    send_message(client_sock, msg);
+}
+
+// nm_lock held: delete the file on its storage server, then drop (and journal) its metadata
+static int delete_file_locked(Message* msg) {
+    FileMetadata* file = file_lookup(msg->filename);
     
     if (file == NULL) {
         msg->error_code = ERR_FILE_NOT_FOUND;
         strcpy(msg->error_msg, "File not found");
-        pthread_mutex_unlock(&nm_lock);
-        send_message(client_sock, msg);
-        return;
+        return msg->error_code;
     }
     
     // Check if user is owner
-    if (strcmp(file->owner, msg->username) != 0) {
+    if (file->owner_id != request_user(msg)) {
         msg->error_code = ERR_NOT_OWNER;
         strcpy(msg->error_msg, "Only the owner can delete the file");
-        pthread_mutex_unlock(&nm_lock);
-        send_message(client_sock, msg);
-        return;
+        return msg->error_code;
+    }
+    if (shard_name_busy(file->filename)) {
+        msg->error_code = ERR_FILE_MOVED;
+        strcpy(msg->error_msg, "File is being moved to another shard");
+        return msg->error_code;
     }
     
     // Forward to storage server
@@ -700,23 +2476,23 @@ void handle_delete_command(int client_sock, Message* msg) {
     }
 
     // If SS deletion failed, abort here without touching NM metadata
-    if (msg->error_code != ERR_SUCCESS) {
-        pthread_mutex_unlock(&nm_lock);
-        send_message(client_sock, msg);
-        return;
-    }
+    if (msg->error_code != ERR_SUCCESS) return msg->error_code;
 
     // Purge metadata now that SS deletion succeeded
     purge_file_metadata(msg->filename);
 
     msg->error_code = ERR_SUCCESS;
     strcpy(msg->data, "File deleted successfully");
-    
+    log_message("NM", "INFO", "File deleted: %s by %s", msg->filename, msg->username);
+    return ERR_SUCCESS;
+}
+
+void handle_delete_command(int client_sock, Message* msg) {
+    pthread_mutex_lock(&nm_lock);
+    delete_file_locked(msg);
     pthread_mutex_unlock(&nm_lock);
+    journal_commit();
     send_message(client_sock, msg);
-    
-    save_persistent_data();
-    log_message("NM", "INFO", "File deleted: %s by %s", msg->filename, msg->username);
 }
 
 void handle_info_command(int client_sock, Message* msg) {
@@ -732,18 +2508,17 @@ void handle_info_command(int client_sock, Message* msg) {
         return;
     }
     
-    // Validate existence on SS; if missing, purge metadata and report not found
-    int exists = ss_file_exists(file);
-    if (exists == 0) {
+    // Gone from its SS's inventory: purge metadata and report not found. Not reported yet:
+    // answer from the metadata we have.
+    if (ss_inventory_check(file) == 0) {
         purge_file_metadata(file->filename);
         msg->error_code = ERR_FILE_NOT_FOUND;
         strcpy(msg->error_msg, "File not found");
         pthread_mutex_unlock(&nm_lock);
+        journal_commit();
         send_message(client_sock, msg);
         return;
     }
-    // If SS unreachable, fall through to return metadata we have (avoid blocking all INFO)
-    
     char response[BUFFER_SIZE];
     char created_time[64], modified_time[64], accessed_time[64];
     
@@ -758,19 +2533,19 @@ void handle_info_command(int client_sock, Message* msg) {
             "--> Last Modified: %s\n"
             "--> Size: %ld bytes\n"
             "--> Access: %s (RW)",
-            file->filename, file->owner, created_time, modified_time, file->size, file->owner);
+            file->filename, user_name(file->owner_id), created_time, modified_time, file->size, user_name(file->owner_id));
     
     for (int i = 0; i < file->access_count; i++) {
         char access_str[128];
         snprintf(access_str, sizeof(access_str), ", %s (%s)",
-                file->access_list[i].username,
+                user_name(file->access_list[i].user_id),
                 file->access_list[i].access_type == ACCESS_WRITE ? "RW" : "R");
         strcat(response, access_str);
     }
     
     char last_access[128];
     snprintf(last_access, sizeof(last_access), "\n--> Last Accessed: %s by %s",
-            accessed_time, file->last_accessed_by);
+            accessed_time, user_name(file->last_accessed_by_id));
     strcat(response, last_access);
     
     strcpy(msg->data, response);
@@ -834,31 +2609,27 @@ void handle_createfolder_command(int client_sock, Message* msg) {
     send_message(client_sock, msg);
 }
 
-// BONUS: VIEWFOLDER - list files under a given folder prefix
+// BONUS: VIEWFOLDER - list files under a given folder (recursively), from the trie
 void handle_viewfolder_command(int client_sock, Message* msg) {
-    pthread_mutex_lock(&nm_lock);
-    char folder[MAX_FILENAME];
-    strncpy(folder, msg->filename, sizeof(folder)-1);
-    folder[sizeof(folder)-1] = '\0';
-    char prefix[MAX_FILENAME+2];
-    snprintf(prefix, sizeof(prefix), "%s/", folder);
-    size_t plen = strlen(prefix);
-    char response[BUFFER_SIZE] = "";
-    for (int i = 0; i < file_count; i++) {
-        FileMetadata* f = &files[i];
-        if (strncmp(f->filename, prefix, plen) == 0) {
-            if (!check_access(f, msg->username, ACCESS_READ)) continue;
-            strcat(response, "--> ");
-            // Show leaf name after folder/
-            const char* leaf = f->filename + plen;
-            strcat(response, leaf);
-            strcat(response, "\n");
-        }
+    ListPage* pg = calloc(1, sizeof(ListPage));
+    if (!pg) {
+        msg->error_code = ERR_SERVER_ERROR;
+        strcpy(msg->error_msg, "Out of memory");
+        send_message(client_sock, msg);
+        return;
     }
+    char prefix[MAX_FILENAME + 2];
+    snprintf(prefix, sizeof(prefix), "%s/", msg->filename);
+    pg->user_id = request_user(msg);
+    // Show leaf name after folder/
+    pg->strip = strlen(prefix);
+
+    pthread_mutex_lock(&nm_lock);
+    list_page_reply(msg, pg, prefix, NULL, NULL);
     pthread_mutex_unlock(&nm_lock);
-    msg->error_code = ERR_SUCCESS;
-    strncpy(msg->data, response, sizeof(msg->data)-1);
+    journal_commit();
     send_message(client_sock, msg);
+    free(pg);
 }
 
 // BONUS: MOVE - move a file into a folder (updates metadata and ask SS to rename)
@@ -867,9 +2638,62 @@ static const char* basename_const(const char* path) {
     return slash ? slash + 1 : path;
 }
 
+// Ask a storage server to rename one of its files; leaves its reply in m
+static int ss_rename(const char* ip, int nm_port, const char* from, const char* to, Message* m) {
+    memset(m, 0, sizeof(*m));
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET; addr.sin_port = htons(nm_port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    if (s < 0 || connect(s, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        if (s >= 0) close(s);
+        m->error_code = ERR_CONNECTION_FAILED;
+        strcpy(m->error_msg, "Failed to connect to storage server");
+        return m->error_code;
+    }
+    m->op_code = OP_MOVE;
+    strncpy(m->filename, from, sizeof(m->filename) - 1);
+    strncpy(m->data, to, sizeof(m->data) - 1);
+    send_message(s, m);
+    if (receive_message(s, m) <= 0) {
+        m->error_code = ERR_CONNECTION_FAILED;
+        strcpy(m->error_msg, "Storage server closed the connection");
+    }
+    close(s);
+    return m->error_code;
+}
+
+// nm_lock held: rename the file on its primary, then on its replica
+static int ss_rename_file(FileMetadata* file, const char* to, Message* m) {
+    StorageServerInfo* ss = &storage_servers[file->ss_id];
+    if (ss_rename(ss->ip, ss->nm_port, file->filename, to, m) != ERR_SUCCESS) return m->error_code;
+    // Best-effort replicate MOVE to replica SS (synchronous to ensure path consistency if partner exists)
+    if (file->replica_ss_port > 0 && strlen(file->replica_ss_ip) > 0 &&
+        file->replica_ss_id >= 0 && file->replica_ss_id < ss_count) {
+        StorageServerInfo* rss = &storage_servers[file->replica_ss_id];
+        Message rm;
+        ss_rename(rss->ip, rss->nm_port, file->filename, to, &rm);   // ignore response errors best-effort
+    }
+    return ERR_SUCCESS;
+}
+
 void handle_move_command(int client_sock, Message* msg) {
+    char folder[MAX_FILENAME]; strncpy(folder, msg->data, sizeof(folder)-1); folder[sizeof(folder)-1] = '\0';
+    char newname[MAX_FILENAME];
+    int newlen = snprintf(newname, sizeof(newname), "%s/%s", folder, basename_const(msg->filename));
+    if (newlen < 0 || newlen >= (int)sizeof(newname)) {
+        msg->error_code = ERR_INVALID_COMMAND;
+        snprintf(msg->error_msg, sizeof(msg->error_msg), "Moved name is longer than %d characters", MAX_FILENAME - 1);
+        send_message(client_sock, msg);
+        return;
+    }
+    // A name that belongs to another shard is handed over there in a two-phase commit
+    if (!shard_owns(newname)) {
+        shard_move_file(client_sock, msg, newname);
+        return;
+    }
     pthread_mutex_lock(&nm_lock);
-    FileMetadata* file = trie_search(file_trie_root, msg->filename);
+    FileMetadata* file = file_lookup(msg->filename);
     if (!file) {
         msg->error_code = ERR_FILE_NOT_FOUND;
         strcpy(msg->error_msg, "File not found");
@@ -877,98 +2701,662 @@ void handle_move_command(int client_sock, Message* msg) {
         send_message(client_sock, msg);
         return;
     }
-    if (strcmp(file->owner, msg->username) != 0) {
+    if (file->owner_id != request_user(msg)) {
         msg->error_code = ERR_NOT_OWNER;
         strcpy(msg->error_msg, "Only owner can move file");
         pthread_mutex_unlock(&nm_lock);
         send_message(client_sock, msg);
         return;
     }
-    char folder[MAX_FILENAME]; strncpy(folder, msg->data, sizeof(folder)-1); folder[sizeof(folder)-1] = '\0';
-    char newname[MAX_FILENAME];
-    snprintf(newname, sizeof(newname), "%s/%s", folder, basename_const(file->filename));
-    // Ask SS to move first
-    StorageServerInfo* ss = &storage_servers[file->ss_id];
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s >= 0) {
-        struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
-        addr.sin_family = AF_INET; addr.sin_port = htons(ss->nm_port);
-        inet_pton(AF_INET, ss->ip, &addr.sin_addr);
-        if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
-            Message m; memset(&m, 0, sizeof(m));
-            m.op_code = OP_MOVE; strncpy(m.filename, file->filename, sizeof(m.filename)-1);
-            strncpy(m.data, newname, sizeof(m.data)-1);
-            send_message(s, &m);
-            receive_message(s, &m);
-            close(s);
-            if (m.error_code != ERR_SUCCESS) {
-                msg->error_code = m.error_code;
-                strncpy(msg->error_msg, m.error_msg, sizeof(msg->error_msg)-1);
-                pthread_mutex_unlock(&nm_lock);
-                send_message(client_sock, msg);
-                return;
-            }
-            // Best-effort replicate MOVE to replica SS (synchronous to ensure path consistency if partner exists)
-            if (file->replica_ss_port > 0 && strlen(file->replica_ss_ip) > 0) {
-                int rs = socket(AF_INET, SOCK_STREAM, 0);
-                if (rs >= 0) {
-                    struct sockaddr_in raddr; memset(&raddr, 0, sizeof(raddr));
-                    raddr.sin_family = AF_INET; raddr.sin_port = htons(storage_servers[file->replica_ss_id].nm_port);
-                    inet_pton(AF_INET, storage_servers[file->replica_ss_id].ip, &raddr.sin_addr);
-                    if (connect(rs, (struct sockaddr*)&raddr, sizeof(raddr)) == 0) {
-                        Message rm; memset(&rm, 0, sizeof(rm));
-                        rm.op_code = OP_MOVE; // use normal MOVE so replica renames and its own code can replicate if chain exists
-                        strncpy(rm.filename, file->filename, sizeof(rm.filename)-1);
-                        strncpy(rm.data, newname, sizeof(rm.data)-1);
-                        send_message(rs, &rm);
-                        // ignore response errors best-effort
-                        receive_message(rs, &rm);
-                    }
-                    close(rs);
-                }
-            }
+    if (shard_name_busy(file->filename)) {
+        msg->error_code = ERR_FILE_MOVED;
+        strcpy(msg->error_msg, "File is being moved to another shard");
+        pthread_mutex_unlock(&nm_lock);
+        send_message(client_sock, msg);
+        return;
+    }
+    if (file_lookup(newname) != NULL || shard_name_busy(newname)) {
+        msg->error_code = ERR_FILE_EXISTS;
+        strcpy(msg->error_msg, "File already exists");
+        pthread_mutex_unlock(&nm_lock);
+        send_message(client_sock, msg);
+        return;
+    }
+    // Ask SS to move first
+    Message m;
+    if (ss_rename_file(file, newname, &m) != ERR_SUCCESS) {
+        msg->error_code = m.error_code;
+        strncpy(msg->error_msg, m.error_msg, sizeof(msg->error_msg)-1);
+        pthread_mutex_unlock(&nm_lock);
+        send_message(client_sock, msg);
+        return;
+    }
+    // Update NM metadata and trie
+    char oldname[MAX_FILENAME]; strncpy(oldname, file->filename, sizeof(oldname)-1); oldname[sizeof(oldname)-1] = '\0';
+    trie_delete(file_trie_root, oldname);
+    name_index_del(oldname);
+    replica_state_forget(oldname);
+    placement_rename(oldname, newname);
+    user_files_remove_file(file);
+    strncpy(file->filename, newname, sizeof(file->filename)-1);
+    trie_insert(file_trie_root, file->filename, file);
+    name_index_put((int)(file - files));
+    inventory_touch(file);
+    user_files_add_file(file);
+    save_persistent_data();
+    pthread_mutex_unlock(&nm_lock);
+    msg->error_code = ERR_SUCCESS;
+    strcpy(msg->data, "Move successful");
+    send_message(client_sock, msg);
+}
+
+// ---- Namespace shards ----
+// NM_SHARDS="<ip>:<port>,..." names every shard's Name Server in shard order and
+// NM_SHARD_ID this one's place in it. A path belongs to shard_of(path): requests for
+// another shard's paths get ERR_WRONG_SHARD, and clients route by the map (OP_SHARD_MAP).
+// Storage servers register with every shard, so each shard places its own files.
+//
+// A MOVE to a name of another shard is a two-phase commit run by the source shard, with
+// an intent log (nm_moves.log, each line synced before it is acted on) on both sides:
+//   B <txid> <shard> <old> <new>   source: about to ask the destination to reserve <new>
+//   P <txid> <new>                 destination: <new> is reserved for the move
+//   C <txid>, record lines, "."    source: the storage servers renamed the file, so the
+//                                  move is decided; the record is what the destination gets
+//   E <txid>                       destination: the record was journaled, or the move aborted
+//   D <txid>                       source: its record is gone, or the move was undone
+// On restart the source finishes a decided move and undoes (presumed abort) one that was
+// not, retrying in the background until the destination answers. The destination keeps a
+// reservation until the source commits or aborts it.
+#define SHARD_MOVES_MAX 64
+#define SHARD_LOG_PATH "nm_moves.log"
+#define SHARD_RETRY_SEC 5
+
+typedef struct {
+    char txid[64];
+    int coordinator;               // 1: this shard is the source
+    int shard;                     // source: the destination shard
+    char oldname[MAX_FILENAME];
+    char newname[MAX_FILENAME];
+    char* record;                  // source, once decided: the record sent with the commit
+    int busy;                      // a request thread is driving it; recovery leaves it alone
+} ShardMove;
+
+static ShardMove shard_moves[SHARD_MOVES_MAX];
+static int shard_move_count = 0;
+static unsigned int shard_move_seq = 0;
+static int shard_log_fd = -1;
+static pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;   // may be taken under nm_lock
+
+static int shard_owns(const char* path) {
+    return shard_count <= 1 || shard_of(path, shard_count) == shard_id;
+}
+
+// shard_lock held
+static ShardMove* shard_move_find(const char* txid) {
+    for (int i = 0; i < shard_move_count; i++) {
+        if (strcmp(shard_moves[i].txid, txid) == 0) return &shard_moves[i];
+    }
+    return NULL;
+}
+
+// 1 if a cross-shard move is taking name away from this shard or into it
+static int shard_name_busy(const char* name) {
+    if (shard_count <= 1) return 0;
+    pthread_mutex_lock(&shard_lock);
+    int busy = 0;
+    for (int i = 0; i < shard_move_count && !busy; i++) {
+        busy = strcmp(shard_moves[i].coordinator ? shard_moves[i].oldname : shard_moves[i].newname, name) == 0;
+    }
+    pthread_mutex_unlock(&shard_lock);
+    return busy;
+}
+
+// shard_lock held: append text to the intent log and sync it; 0 on success
+static int shard_log_append(const char* text) {
+    size_t len = strlen(text);
+    if (shard_log_fd < 0 || write(shard_log_fd, text, len) != (ssize_t)len || fdatasync(shard_log_fd) != 0) {
+        log_message("NM", "ERROR", "Cannot write %s: %s", SHARD_LOG_PATH, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// shard_lock held: log the end of a move (E or D) and forget it; the log starts over once
+// no move is open
+static void shard_move_end(ShardMove* mv, char kind) {
+    char line[96];
+    snprintf(line, sizeof(line), "%c %s\n", kind, mv->txid);
+    shard_log_append(line);
+    free(mv->record);
+    *mv = shard_moves[--shard_move_count];
+    if (shard_move_count == 0 && shard_log_fd >= 0 && ftruncate(shard_log_fd, 0) == 0) lseek(shard_log_fd, 0, SEEK_SET);
+}
+
+// Send m to the Name Server of a shard and read its reply into m; 0 if it answered
+static int shard_call(int shard, Message* m) {
+    pthread_mutex_lock(&shard_lock);
+    int sock = nm_connect(&shard_addrs[shard], 0);
+    pthread_mutex_unlock(&shard_lock);
+    if (sock < 0) return -1;
+    struct timeval tv = { 10, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int ok = send_message(sock, m) > 0 && receive_message(sock, m) > 0;
+    close(sock);
+    return ok ? 0 : -1;
+}
+
+// nm_lock held: the file as text for another shard, where server IDs mean nothing: users
+// by name and servers by address. Returns the length, -1 if it does not fit.
+static int shard_record_format(FileMetadata* file, char* out, size_t cap) {
+    size_t used = 0;
+    int n = snprintf(out, cap, "owner %s\nss %s %d\ntimes %lld %lld %lld\nstats %ld %d %d %s\n",
+                     user_name(file->owner_id), storage_servers[file->ss_id].ip, storage_servers[file->ss_id].nm_port,
+                     (long long)file->created_time, (long long)file->modified_time, (long long)file->accessed_time,
+                     file->size, file->word_count, file->char_count,
+                     file->last_accessed_by_id ? user_name(file->last_accessed_by_id) : "-");
+    if (n < 0 || (size_t)n >= cap) return -1;
+    used = n;
+    int reps[MAX_REPLICAS];
+    int nrep = file_replicas(file, reps);
+    for (int i = 0; i < nrep + file->access_count + file->pending_count; i++) {
+        if (i < nrep) {
+            n = snprintf(out + used, cap - used, "replica %s %d\n", storage_servers[reps[i]].ip, storage_servers[reps[i]].nm_port);
+        } else if (i < nrep + file->access_count) {
+            AccessEntry* e = &file->access_list[i - nrep];
+            n = snprintf(out + used, cap - used, "acl %s %d\n", user_name(e->user_id), e->access_type);
+        } else {
+            AccessEntry* e = &file->pending_requests[i - nrep - file->access_count];
+            n = snprintf(out + used, cap - used, "req %s %d\n", user_name(e->user_id), e->access_type);
+        }
+        if (n < 0 || (size_t)n >= cap - used) return -1;
+        used += n;
+    }
+    return (int)used;
+}
+
+// nm_lock held: the storage server registered here at ip:nm_port, -1 if none
+static int ss_find_addr(const char* ip, int nm_port) {
+    for (int i = 0; i < ss_count; i++) {
+        if (storage_servers[i].nm_port == nm_port && strcmp(storage_servers[i].ip, ip) == 0) return i;
+    }
+    return -1;
+}
+
+// nm_lock held: check a record from another shard (create = 0) or record it as name
+// (create = 1, journaled). Leaves an error in msg when it cannot.
+static int shard_record_apply(const char* name, const char* record, int create, Message* msg) {
+    char buf[MAX_CONTENT];
+    strncpy(buf, record, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    char owner[MAX_USERNAME] = "", last[MAX_USERNAME] = "-", ip[INET_ADDRSTRLEN];
+    int primary = -1, port;
+    int reps[MAX_REPLICAS - 1], nrep = 0;
+    long long created = 0, modified = 0, accessed = 0;
+    long size = 0;
+    int words = 0, chars = 0;
+    char* save = NULL;
+    for (char* line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        if (sscanf(line, "owner %63s", owner) == 1) continue;
+        if (sscanf(line, "ss %15s %d", ip, &port) == 2) {
+            primary = ss_find_addr(ip, port);
+            if (primary < 0) {
+                msg->error_code = ERR_SS_NOT_FOUND;
+                snprintf(msg->error_msg, sizeof(msg->error_msg), "Storage server %s:%d is not registered with shard %d", ip, port, shard_id);
+                return msg->error_code;
+            }
+        } else if (sscanf(line, "replica %15s %d", ip, &port) == 2) {
+            int r = ss_find_addr(ip, port);
+            if (r >= 0 && nrep < MAX_REPLICAS - 1) reps[nrep++] = r;
+        } else {
+            sscanf(line, "times %lld %lld %lld", &created, &modified, &accessed);
+            sscanf(line, "stats %ld %d %d %63s", &size, &words, &chars, last);
+        }
+    }
+    if (owner[0] == '\0' || primary < 0) {
+        msg->error_code = ERR_INVALID_COMMAND;
+        strcpy(msg->error_msg, "Malformed file record");
+        return msg->error_code;
+    }
+    if (!create) return ERR_SUCCESS;
+
+    int slot = file_slot_alloc();
+    if (slot < 0) {
+        msg->error_code = ERR_SERVER_ERROR;
+        strcpy(msg->error_msg, "File table full");
+        return msg->error_code;
+    }
+    FileMetadata* file = &files[slot];
+    StorageServerInfo* ss = &storage_servers[primary];
+    strncpy(file->filename, name, sizeof(file->filename) - 1);
+    file->owner_id = nm_user_id(owner);
+    file->ss_id = ss->ss_id;
+    strcpy(file->ss_ip, ss->ip);
+    file->ss_port = ss->client_port;
+    set_file_replicas(file, reps, nrep);
+    file->created_time = (time_t)created;
+    file->modified_time = (time_t)modified;
+    file->accessed_time = (time_t)accessed;
+    file->size = size;
+    file->word_count = words;
+    file->char_count = chars;
+    file->last_accessed_by_id = strcmp(last, "-") == 0 ? 0 : nm_user_id(last);
+    strncpy(buf, record, sizeof(buf) - 1);
+    save = NULL;
+    for (char* line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char user[MAX_USERNAME]; int type;
+        AccessEntry* e = NULL;
+        if (sscanf(line, "acl %63s %d", user, &type) == 2) e = acl_push(&file->access_list, &file->access_count, &file->access_cap);
+        else if (sscanf(line, "req %63s %d", user, &type) == 2) e = acl_push(&file->pending_requests, &file->pending_count, &file->pending_cap);
+        if (e) { e->user_id = nm_user_id(user); e->access_type = type; }
+    }
+    trie_insert(file_trie_root, file->filename, file);
+    name_index_put(slot);
+    user_files_add_file(file);
+    ss_files_add(ss, slot);
+    inventory_touch(file);
+    journal_file_put(file);
+    return ERR_SUCCESS;
+}
+
+// OP_SHARD_MAP: "<shards> <this shard>" and the shard list; "1 0" when not sharded
+static void handle_shard_map(int client_sock, Message* msg) {
+    size_t used = snprintf(msg->data, sizeof(msg->data), "%d %d", shard_count, shard_id);
+    for (int i = 0; shard_count > 1 && i < shard_count; i++) {
+        used += snprintf(msg->data + used, sizeof(msg->data) - used, " %s:%d", shard_addrs[i].addrs[0].ip, shard_addrs[i].addrs[0].port);
+    }
+    msg->error_code = ERR_SUCCESS;
+    send_message(client_sock, msg);
+}
+
+// Split "<txid>\n<record>" in place; returns the record
+static char* shard_split_txid(Message* msg, char* txid, size_t cap) {
+    msg->data[sizeof(msg->data) - 1] = '\0';
+    char* nl = strchr(msg->data, '\n');
+    if (nl) *nl = '\0';
+    snprintf(txid, cap, "%s", msg->data);
+    return nl ? nl + 1 : msg->data + strlen(msg->data);
+}
+
+// Destination, phase one: reserve msg->filename for the move if it is free here and the
+// record's primary is registered here
+static void handle_shard_prepare(int client_sock, Message* msg) {
+    char txid[64];
+    char* record = shard_split_txid(msg, txid, sizeof(txid));
+    msg->error_code = ERR_SUCCESS;
+    pthread_mutex_lock(&nm_lock);
+    pthread_mutex_lock(&shard_lock);
+    ShardMove* mv = shard_move_find(txid);
+    pthread_mutex_unlock(&shard_lock);
+    if (mv == NULL) {
+        if (!shard_owns(msg->filename)) {
+            msg->error_code = ERR_WRONG_SHARD;
+            strcpy(msg->error_msg, "Path belongs to another shard");
+        } else if (file_lookup(msg->filename) != NULL || shard_name_busy(msg->filename)) {
+            msg->error_code = ERR_FILE_EXISTS;
+            strcpy(msg->error_msg, "File already exists");
+        } else if (shard_record_apply(msg->filename, record, 0, msg) == ERR_SUCCESS) {
+            char line[MAX_FILENAME + 96];
+            snprintf(line, sizeof(line), "P %s %s\n", txid, msg->filename);
+            pthread_mutex_lock(&shard_lock);
+            if (shard_move_count == SHARD_MOVES_MAX || shard_log_append(line) != 0) {
+                msg->error_code = ERR_SERVER_ERROR;
+                strcpy(msg->error_msg, "Cannot record the move");
+            } else {
+                mv = &shard_moves[shard_move_count++];
+                memset(mv, 0, sizeof(*mv));
+                snprintf(mv->txid, sizeof(mv->txid), "%s", txid);
+                snprintf(mv->newname, sizeof(mv->newname), "%s", msg->filename);
+            }
+            pthread_mutex_unlock(&shard_lock);
+        }
+    }
+    pthread_mutex_unlock(&nm_lock);
+    if (msg->error_code == ERR_SUCCESS) log_message("NM", "INFO", "Move %s: reserved %s", txid, msg->filename);
+    send_message(client_sock, msg);
+}
+
+// Destination, phase two: record the file under the reserved name. A move it no longer
+// knows was committed before (commits are retried until acknowledged).
+static void handle_shard_commit(int client_sock, Message* msg) {
+    char txid[64];
+    char* record = shard_split_txid(msg, txid, sizeof(txid));
+    msg->error_code = ERR_SUCCESS;
+    pthread_mutex_lock(&nm_lock);
+    pthread_mutex_lock(&shard_lock);
+    int pending = shard_move_find(txid) != NULL;
+    pthread_mutex_unlock(&shard_lock);
+    if (pending && file_lookup(msg->filename) == NULL) shard_record_apply(msg->filename, record, 1, msg);
+    pthread_mutex_unlock(&nm_lock);
+    if (pending && msg->error_code == ERR_SUCCESS) {
+        journal_commit();
+        pthread_mutex_lock(&shard_lock);
+        ShardMove* mv = shard_move_find(txid);
+        if (mv) shard_move_end(mv, 'E');
+        pthread_mutex_unlock(&shard_lock);
+        log_message("NM", "INFO", "Move %s: recorded %s", txid, msg->filename);
+    }
+    send_message(client_sock, msg);
+}
+
+static void handle_shard_abort(int client_sock, Message* msg) {
+    char txid[64];
+    shard_split_txid(msg, txid, sizeof(txid));
+    pthread_mutex_lock(&shard_lock);
+    ShardMove* mv = shard_move_find(txid);
+    if (mv) shard_move_end(mv, 'E');
+    pthread_mutex_unlock(&shard_lock);
+    if (mv) log_message("NM", "INFO", "Move %s: reservation dropped", txid);
+    msg->error_code = ERR_SUCCESS;
+    send_message(client_sock, msg);
+}
+
+// Source: send the decided move's commit and drop the record here. 0 when done.
+static int shard_move_finish(ShardMove* mv) {
+    Message* m = calloc(1, sizeof(Message));
+    if (m == NULL) return -1;
+    m->op_code = OP_SHARD_COMMIT;
+    strncpy(m->filename, mv->newname, sizeof(m->filename) - 1);
+    snprintf(m->data, sizeof(m->data), "%s\n%s", mv->txid, mv->record);
+    int rc = shard_call(mv->shard, m);
+    if (rc != 0 || m->error_code != ERR_SUCCESS) {
+        log_message("NM", "WARN", "Move %s: shard %d did not take the commit (%s), retrying later", mv->txid, mv->shard,
+                    rc != 0 ? "no answer" : m->error_msg);
+        free(m);
+        return -1;
+    }
+    free(m);
+    pthread_mutex_lock(&nm_lock);
+    if (file_lookup(mv->oldname) != NULL) purge_file_metadata(mv->oldname);
+    pthread_mutex_unlock(&nm_lock);
+    journal_commit();
+    log_message("NM", "INFO", "Moved %s to %s on shard %d", mv->oldname, mv->newname, mv->shard);
+    return 0;
+}
+
+// Source: undo a move that was not decided: drop the reservation and, if the storage
+// servers renamed the file, rename it back. 0 when done.
+static int shard_move_undo(ShardMove* mv, int renamed) {
+    Message* m = calloc(1, sizeof(Message));
+    if (m == NULL) return -1;
+    m->op_code = OP_SHARD_ABORT;
+    snprintf(m->data, sizeof(m->data), "%s", mv->txid);
+    int rc = shard_call(mv->shard, m);
+    free(m);
+    if (rc != 0) return -1;
+    if (renamed) {
+        pthread_mutex_lock(&nm_lock);
+        FileMetadata* file = file_lookup(mv->oldname);
+        if (file) {
+            // The record still has the old name: rename the servers' copies back from the new one
+            Message rm;
+            StorageServerInfo* ss = &storage_servers[file->ss_id];
+            ss_rename(ss->ip, ss->nm_port, mv->newname, mv->oldname, &rm);
+            if (file->replica_ss_id >= 0 && file->replica_ss_id < ss_count) {
+                StorageServerInfo* rss = &storage_servers[file->replica_ss_id];
+                ss_rename(rss->ip, rss->nm_port, mv->newname, mv->oldname, &rm);
+            }
+        }
+        pthread_mutex_unlock(&nm_lock);
+    }
+    log_message("NM", "INFO", "Move %s of %s aborted", mv->txid, mv->oldname);
+    return 0;
+}
+
+// shard_lock held: a finished or undone source move leaves the log
+static void shard_move_close(const char* txid) {
+    ShardMove* mv = shard_move_find(txid);
+    if (mv) shard_move_end(mv, 'D');
+}
+
+// Source side of a cross-shard MOVE (see above); replies to the client
+static void shard_move_file(int client_sock, Message* msg, const char* newname) {
+    ShardMove mv;
+    memset(&mv, 0, sizeof(mv));
+    mv.coordinator = 1;
+    mv.shard = shard_of(newname, shard_count);
+    snprintf(mv.oldname, sizeof(mv.oldname), "%s", msg->filename);
+    snprintf(mv.newname, sizeof(mv.newname), "%s", newname);
+    Message* m = calloc(1, sizeof(Message));
+    char* record = malloc(MAX_CONTENT);
+    if (m == NULL || record == NULL) {
+        free(m); free(record);
+        msg->error_code = ERR_SERVER_ERROR;
+        strcpy(msg->error_msg, "Out of memory");
+        send_message(client_sock, msg);
+        return;
+    }
+    // placement_lock keeps migration and reconciliation off the file until it has moved
+    pthread_mutex_lock(&placement_lock);
+    pthread_mutex_lock(&nm_lock);
+    FileMetadata* file = file_lookup(mv.oldname);
+    int rc = ERR_SUCCESS;
+    if (!file) {
+        rc = msg->error_code = ERR_FILE_NOT_FOUND;
+        strcpy(msg->error_msg, "File not found");
+    } else if (file->owner_id != request_user(msg)) {
+        rc = msg->error_code = ERR_NOT_OWNER;
+        strcpy(msg->error_msg, "Only owner can move file");
+    } else if (shard_name_busy(mv.oldname)) {
+        rc = msg->error_code = ERR_FILE_MOVED;
+        strcpy(msg->error_msg, "File is being moved to another shard");
+    } else if (shard_record_format(file, record, MAX_CONTENT) < 0) {
+        rc = msg->error_code = ERR_SERVER_ERROR;
+        strcpy(msg->error_msg, "File record too large to move");
+    } else {
+        char line[2 * MAX_FILENAME + 96];
+        pthread_mutex_lock(&shard_lock);
+        snprintf(mv.txid, sizeof(mv.txid), "%d-%llx-%u", shard_id, (unsigned long long)nm_boot_id, ++shard_move_seq);
+        snprintf(line, sizeof(line), "B %s %d %s %s\n", mv.txid, mv.shard, mv.oldname, mv.newname);
+        if (shard_move_count == SHARD_MOVES_MAX || shard_log_append(line) != 0) {
+            rc = msg->error_code = ERR_SERVER_ERROR;
+            strcpy(msg->error_msg, "Cannot record the move");
+        } else {
+            mv.busy = 1;
+            shard_moves[shard_move_count++] = mv;
+        }
+        pthread_mutex_unlock(&shard_lock);
+    }
+    pthread_mutex_unlock(&nm_lock);
+    if (rc != ERR_SUCCESS) {
+        pthread_mutex_unlock(&placement_lock);
+        free(m); free(record);
+        send_message(client_sock, msg);
+        return;
+    }
+
+    // Phase one: the destination reserves the name
+    m->op_code = OP_SHARD_PREPARE;
+    strncpy(m->filename, mv.newname, sizeof(m->filename) - 1);
+    snprintf(m->data, sizeof(m->data), "%s\n%s", mv.txid, record);
+    int renamed = 0;
+    if (shard_call(mv.shard, m) != 0) {
+        rc = msg->error_code = ERR_CONNECTION_FAILED;
+        snprintf(msg->error_msg, sizeof(msg->error_msg), "Shard %d did not answer", mv.shard);
+    } else if (m->error_code != ERR_SUCCESS) {
+        rc = msg->error_code = m->error_code;
+        strncpy(msg->error_msg, m->error_msg, sizeof(msg->error_msg) - 1);
+    } else {
+        // The storage servers rename the file; once they have, the move is decided
+        pthread_mutex_lock(&nm_lock);
+        file = file_lookup(mv.oldname);
+        if (!file) {
+            rc = msg->error_code = ERR_FILE_NOT_FOUND;
+            strcpy(msg->error_msg, "File not found");
+        } else if (ss_rename_file(file, mv.newname, m) != ERR_SUCCESS) {
+            rc = msg->error_code = m->error_code;
+            strncpy(msg->error_msg, m->error_msg, sizeof(msg->error_msg) - 1);
+        } else {
+            renamed = 1;
+        }
+        pthread_mutex_unlock(&nm_lock);
+        if (renamed) {
+            char* decision = malloc(MAX_CONTENT + 128);
+            pthread_mutex_lock(&shard_lock);
+            if (decision) snprintf(decision, MAX_CONTENT + 128, "C %s\n%s.\n", mv.txid, record);
+            if (decision == NULL || shard_log_append(decision) != 0) {
+                rc = msg->error_code = ERR_SERVER_ERROR;
+                strcpy(msg->error_msg, "Cannot record the move");
+            } else {
+                ShardMove* cur = shard_move_find(mv.txid);
+                cur->record = record;
+                record = NULL;
+                mv.record = cur->record;
+            }
+            pthread_mutex_unlock(&shard_lock);
+            free(decision);
+        }
+    }
+    pthread_mutex_unlock(&placement_lock);
+    free(m); free(record);
+
+    if (rc != ERR_SUCCESS) {
+        int undone = shard_move_undo(&mv, renamed) == 0;
+        pthread_mutex_lock(&shard_lock);
+        if (undone) shard_move_close(mv.txid);
+        else shard_move_find(mv.txid)->busy = 0;   // the recovery thread retries it
+        pthread_mutex_unlock(&shard_lock);
+        send_message(client_sock, msg);
+        return;
+    }
+
+    // Phase two: the destination records the file, then this shard drops it
+    int done = shard_move_finish(&mv) == 0;
+    pthread_mutex_lock(&shard_lock);
+    if (done) shard_move_close(mv.txid);
+    else shard_move_find(mv.txid)->busy = 0;
+    pthread_mutex_unlock(&shard_lock);
+    msg->error_code = ERR_SUCCESS;
+    if (done) strcpy(msg->data, "Move successful");
+    else snprintf(msg->data, sizeof(msg->data), "Move committed; shard %d will record it once it answers", mv.shard);
+    send_message(client_sock, msg);
+}
+
+// Finish or undo the source moves left open by a restart or an unreachable shard
+static void* shard_recovery_loop(void* arg) {
+    (void)arg;
+    char txids[SHARD_MOVES_MAX][64];
+    while (1) {
+        sleep(SHARD_RETRY_SEC);
+        pthread_mutex_lock(&shard_lock);
+        int n = 0;
+        for (int i = 0; i < shard_move_count; i++) {
+            if (shard_moves[i].coordinator && !shard_moves[i].busy) strcpy(txids[n++], shard_moves[i].txid);
+        }
+        pthread_mutex_unlock(&shard_lock);
+        for (int i = 0; i < n; i++) {
+            pthread_mutex_lock(&shard_lock);
+            ShardMove* cur = shard_move_find(txids[i]);
+            ShardMove mv;
+            int mine = cur && !cur->busy;
+            if (mine) { cur->busy = 1; mv = *cur; }
+            pthread_mutex_unlock(&shard_lock);
+            if (!mine) continue;
+            // An undecided move may or may not have been renamed on the servers; renaming
+            // back a name that is not there fails harmlessly
+            int rc = mv.record ? shard_move_finish(&mv) : shard_move_undo(&mv, 1);
+            pthread_mutex_lock(&shard_lock);
+            if (rc == 0) shard_move_close(mv.txid);
+            else shard_move_find(mv.txid)->busy = 0;
+            pthread_mutex_unlock(&shard_lock);
+        }
+    }
+    return NULL;
+}
+
+// Read NM_SHARDS / NM_SHARD_ID and the moves left open in nm_moves.log. Exits on a bad map,
+// which would send requests to the wrong Name Server.
+static void shard_init() {
+    const char* list = getenv("NM_SHARDS");
+    if (list == NULL || list[0] == '\0') return;
+    shard_count = shard_list_parse(shard_addrs, list);
+    shard_id = get_env_int("NM_SHARD_ID", -1);
+    if (shard_count < 2 || shard_id < 0 || shard_id >= shard_count) {
+        log_message("NM", "ERROR", "NM_SHARDS needs 2 to %d <ip>:<port> entries and NM_SHARD_ID an index into them",
+                     MAX_NM_SHARDS);
+        exit(EXIT_FAILURE);
+    }
+
+    // Replay the intent log; a record without its closing "." (torn C) is not a decision
+    FILE* f = fopen(SHARD_LOG_PATH, "r");
+    char line[MAX_CONTENT];
+    ShardMove* open_c = NULL;
+    size_t rec_used = 0;
+    while (f && fgets(line, sizeof(line), f)) {
+        if (line[strlen(line) - 1] != '\n') break;   // torn tail
+        if (open_c) {
+            if (strcmp(line, ".\n") == 0) { open_c = NULL; continue; }
+            size_t n = strlen(line);
+            if (rec_used + n < MAX_CONTENT) { memcpy(open_c->record + rec_used, line, n + 1); rec_used += n; }
+            continue;
+        }
+        char kind, txid[64] = "", a[MAX_FILENAME] = "", b[MAX_FILENAME] = "";
+        int other = 0;
+        if (sscanf(line, "%c %63s", &kind, txid) != 2) continue;
+        ShardMove* mv = shard_move_find(txid);
+        if (kind == 'B' && !mv && shard_move_count < SHARD_MOVES_MAX &&
+            sscanf(line, "B %*s %d %255s %255s", &other, a, b) == 3) {
+            mv = &shard_moves[shard_move_count++];
+            memset(mv, 0, sizeof(*mv));
+            mv->coordinator = 1;
+            mv->shard = other;
+            snprintf(mv->oldname, sizeof(mv->oldname), "%s", a);
+            snprintf(mv->newname, sizeof(mv->newname), "%s", b);
+        } else if (kind == 'P' && !mv && shard_move_count < SHARD_MOVES_MAX && sscanf(line, "P %*s %255s", b) == 1) {
+            mv = &shard_moves[shard_move_count++];
+            memset(mv, 0, sizeof(*mv));
+            snprintf(mv->newname, sizeof(mv->newname), "%s", b);
+        } else if (kind == 'C' && mv && !mv->record && (mv->record = calloc(1, MAX_CONTENT)) != NULL) {
+            open_c = mv;
+            rec_used = 0;
+            continue;
+        } else if ((kind == 'E' || kind == 'D') && mv) {
+            free(mv->record);
+            *mv = shard_moves[--shard_move_count];
+            continue;
         } else {
-            close(s);
-            msg->error_code = ERR_CONNECTION_FAILED;
-            strcpy(msg->error_msg, "Failed to connect to storage server");
-            pthread_mutex_unlock(&nm_lock);
-            send_message(client_sock, msg);
-            return;
+            continue;
         }
+        snprintf(mv->txid, sizeof(mv->txid), "%s", txid);
     }
-    // Update NM metadata and trie
-    char oldname[MAX_FILENAME]; strncpy(oldname, file->filename, sizeof(oldname)-1); oldname[sizeof(oldname)-1] = '\0';
-    trie_delete(file_trie_root, oldname);
-    strncpy(file->filename, newname, sizeof(file->filename)-1);
-    trie_insert(file_trie_root, file->filename, file);
-    // Also update SS file list entry
-    StorageServerInfo* ssp = &storage_servers[file->ss_id];
-    for (int i = 0; i < ssp->file_count; i++) {
-        if (strcmp(ssp->files[i], oldname) == 0) { strncpy(ssp->files[i], newname, MAX_FILENAME-1); ssp->files[i][MAX_FILENAME-1]='\0'; break; }
+    if (open_c) { free(open_c->record); open_c->record = NULL; }
+    if (f) fclose(f);
+
+    // Start the log over with just the open moves
+    FILE* out = fopen(SHARD_LOG_PATH ".tmp", "w");
+    for (int i = 0; out && i < shard_move_count; i++) {
+        ShardMove* mv = &shard_moves[i];
+        if (mv->coordinator) fprintf(out, "B %s %d %s %s\n", mv->txid, mv->shard, mv->oldname, mv->newname);
+        else fprintf(out, "P %s %s\n", mv->txid, mv->newname);
+        if (mv->record) fprintf(out, "C %s\n%s.\n", mv->txid, mv->record);
     }
-    save_persistent_data();
-    pthread_mutex_unlock(&nm_lock);
-    msg->error_code = ERR_SUCCESS;
-    strcpy(msg->data, "Move successful");
-    send_message(client_sock, msg);
+    if (out == NULL || fflush(out) != 0 || fsync(fileno(out)) != 0 || fclose(out) != 0 ||
+        rename(SHARD_LOG_PATH ".tmp", SHARD_LOG_PATH) != 0 ||
+        (shard_log_fd = open(SHARD_LOG_PATH, O_WRONLY | O_APPEND)) < 0) {
+        log_message("NM", "ERROR", "Cannot rewrite %s: %s", SHARD_LOG_PATH, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    log_message("NM", "INFO", "Shard %d of %d; %d cross-shard moves to finish", shard_id, shard_count, shard_move_count);
+    pthread_t t; pthread_create(&t, NULL, shard_recovery_loop, NULL); pthread_detach(t);
 }
 
 // BONUS: Access requests
 void handle_reqaccess_command(int client_sock, Message* msg) {
     pthread_mutex_lock(&nm_lock);
-    FileMetadata* file = trie_search(file_trie_root, msg->filename);
+    FileMetadata* file = file_lookup(msg->filename);
     if (!file) { msg->error_code = ERR_FILE_NOT_FOUND; strcpy(msg->error_msg, "File not found"); pthread_mutex_unlock(&nm_lock); send_message(client_sock, msg); return; }
-    if (strcmp(file->owner, msg->username) == 0) { msg->error_code = ERR_INVALID_COMMAND; strcpy(msg->error_msg, "Owner already has full access"); pthread_mutex_unlock(&nm_lock); send_message(client_sock, msg); return; }
+    if (file->owner_id == request_user(msg)) { msg->error_code = ERR_INVALID_COMMAND; strcpy(msg->error_msg, "Owner already has full access"); pthread_mutex_unlock(&nm_lock); send_message(client_sock, msg); return; }
     // If already has access, ignore
-    if (check_access(file, msg->username, (msg->flags & 1) ? ACCESS_WRITE : ACCESS_READ)) {
+    if (check_access(file, request_user(msg), (msg->flags & 1) ? ACCESS_WRITE : ACCESS_READ)) {
         msg->error_code = ERR_SUCCESS; strcpy(msg->data, "Already has access"); pthread_mutex_unlock(&nm_lock); send_message(client_sock, msg); return;
     }
     // Add pending if not present
-    for (int i=0;i<file->pending_count;i++){ if (strcmp(file->pending_requests[i].username, msg->username)==0){ msg->error_code=ERR_SUCCESS; strcpy(msg->data, "Request already pending"); pthread_mutex_unlock(&nm_lock); send_message(client_sock,msg); return; }}
-    if (file->pending_count < MAX_ACCESS_LIST) {
-        strcpy(file->pending_requests[file->pending_count].username, msg->username);
-        file->pending_requests[file->pending_count].access_type = (msg->flags & 1) ? ACCESS_WRITE : ACCESS_READ;
-        file->pending_count++;
+    int uid = nm_user_id(msg->username);
+    if (acl_find(file->pending_requests, file->pending_count, uid) >= 0){ msg->error_code=ERR_SUCCESS; strcpy(msg->data, "Request already pending"); pthread_mutex_unlock(&nm_lock); send_message(client_sock,msg); return; }
+    AccessEntry* req = acl_push(&file->pending_requests, &file->pending_count, &file->pending_cap);
+    if (req) {
+        req->user_id = uid;
+        req->access_type = (msg->flags & 1) ? ACCESS_WRITE : ACCESS_READ;
         save_persistent_data();
         msg->error_code = ERR_SUCCESS; strcpy(msg->data, "Access request submitted");
     } else { msg->error_code = ERR_SERVER_ERROR; strcpy(msg->error_msg, "Too many pending requests"); }
@@ -978,12 +3366,12 @@ void handle_reqaccess_command(int client_sock, Message* msg) {
 
 void handle_viewrequests_command(int client_sock, Message* msg) {
     pthread_mutex_lock(&nm_lock);
-    FileMetadata* file = trie_search(file_trie_root, msg->filename);
+    FileMetadata* file = file_lookup(msg->filename);
     if (!file) { msg->error_code = ERR_FILE_NOT_FOUND; strcpy(msg->error_msg, "File not found"); pthread_mutex_unlock(&nm_lock); send_message(client_sock, msg); return; }
-    if (strcmp(file->owner, msg->username) != 0) { msg->error_code = ERR_NOT_OWNER; strcpy(msg->error_msg, "Only owner can view requests"); pthread_mutex_unlock(&nm_lock); send_message(client_sock, msg); return; }
+    if (file->owner_id != request_user(msg)) { msg->error_code = ERR_NOT_OWNER; strcpy(msg->error_msg, "Only owner can view requests"); pthread_mutex_unlock(&nm_lock); send_message(client_sock, msg); return; }
     char resp[BUFFER_SIZE] = "";
     for (int i=0;i<file->pending_count;i++) {
-        char line[128]; snprintf(line, sizeof(line), "--> %s (%s)\n", file->pending_requests[i].username, file->pending_requests[i].access_type==ACCESS_WRITE?"W":"R");
+        char line[128]; snprintf(line, sizeof(line), "--> %s (%s)\n", user_name(file->pending_requests[i].user_id), file->pending_requests[i].access_type==ACCESS_WRITE?"W":"R");
         strcat(resp, line);
     }
     msg->error_code = ERR_SUCCESS; strncpy(msg->data, resp, sizeof(msg->data)-1);
@@ -993,20 +3381,21 @@ void handle_viewrequests_command(int client_sock, Message* msg) {
 
 void handle_approve_command(int client_sock, Message* msg) {
     pthread_mutex_lock(&nm_lock);
-    FileMetadata* file = trie_search(file_trie_root, msg->filename);
+    FileMetadata* file = file_lookup(msg->filename);
     if (!file) { msg->error_code = ERR_FILE_NOT_FOUND; strcpy(msg->error_msg, "File not found"); pthread_mutex_unlock(&nm_lock); send_message(client_sock, msg); return; }
-    if (strcmp(file->owner, msg->username) != 0) { msg->error_code = ERR_NOT_OWNER; strcpy(msg->error_msg, "Only owner can approve"); pthread_mutex_unlock(&nm_lock); send_message(client_sock, msg); return; }
-    char target[MAX_USERNAME]; int want_write = (msg->flags & 1);
+    if (file->owner_id != request_user(msg)) { msg->error_code = ERR_NOT_OWNER; strcpy(msg->error_msg, "Only owner can approve"); pthread_mutex_unlock(&nm_lock); send_message(client_sock, msg); return; }
+    char target[MAX_USERNAME] = ""; int want_write = (msg->flags & 1);
     sscanf(msg->data, "%63s", target);
-    int idx=-1; for (int i=0;i<file->pending_count;i++){ if(strcmp(file->pending_requests[i].username,target)==0){ idx=i; break; }}
+    int target_id = intern_lookup(&user_names, target);
+    int idx = acl_find(file->pending_requests, file->pending_count, target_id);
     if (idx<0){ msg->error_code=ERR_USER_NOT_FOUND; strcpy(msg->error_msg, "Request not found"); pthread_mutex_unlock(&nm_lock); send_message(client_sock,msg); return; }
     int grant = want_write ? ACCESS_WRITE : file->pending_requests[idx].access_type;
     // Update or add access entry
-    int aidx=-1; for(int i=0;i<file->access_count;i++){ if(strcmp(file->access_list[i].username,target)==0){ aidx=i; break; }}
-    if (aidx>=0){ file->access_list[aidx].access_type = grant; } else if (file->access_count<MAX_ACCESS_LIST){ strcpy(file->access_list[file->access_count].username,target); file->access_list[file->access_count].access_type=grant; file->access_count++; }
+    int aidx = acl_find(file->access_list, file->access_count, target_id);
+    if (aidx>=0){ file->access_list[aidx].access_type = grant; }
+    else { AccessEntry* e = acl_push(&file->access_list, &file->access_count, &file->access_cap); if (e){ e->user_id=target_id; e->access_type=grant; user_files_add(target_id, file->filename); } }
     // Remove pending
-    for (int j=idx;j<file->pending_count-1;j++){ file->pending_requests[j]=file->pending_requests[j+1]; }
-    file->pending_count--;
+    acl_remove_at(&file->pending_requests, &file->pending_count, &file->pending_cap, idx);
     save_persistent_data();
     msg->error_code=ERR_SUCCESS; strcpy(msg->data, "Approved");
     pthread_mutex_unlock(&nm_lock);
@@ -1015,14 +3404,14 @@ void handle_approve_command(int client_sock, Message* msg) {
 
 void handle_deny_command(int client_sock, Message* msg) {
     pthread_mutex_lock(&nm_lock);
-    FileMetadata* file = trie_search(file_trie_root, msg->filename);
+    FileMetadata* file = file_lookup(msg->filename);
     if (!file) { msg->error_code = ERR_FILE_NOT_FOUND; strcpy(msg->error_msg, "File not found"); pthread_mutex_unlock(&nm_lock); send_message(client_sock, msg); return; }
-    if (strcmp(file->owner, msg->username) != 0) { msg->error_code = ERR_NOT_OWNER; strcpy(msg->error_msg, "Only owner can deny"); pthread_mutex_unlock(&nm_lock); send_message(client_sock, msg); return; }
-    char target[MAX_USERNAME]; sscanf(msg->data, "%63s", target);
-    int idx=-1; for (int i=0;i<file->pending_count;i++){ if(strcmp(file->pending_requests[i].username,target)==0){ idx=i; break; }}
+    if (file->owner_id != request_user(msg)) { msg->error_code = ERR_NOT_OWNER; strcpy(msg->error_msg, "Only owner can deny"); pthread_mutex_unlock(&nm_lock); send_message(client_sock, msg); return; }
+    char target[MAX_USERNAME] = ""; sscanf(msg->data, "%63s", target);
+    int target_id = intern_lookup(&user_names, target);
+    int idx = acl_find(file->pending_requests, file->pending_count, target_id);
     if (idx<0){ msg->error_code=ERR_USER_NOT_FOUND; strcpy(msg->error_msg, "Request not found"); pthread_mutex_unlock(&nm_lock); send_message(client_sock,msg); return; }
-    for (int j=idx;j<file->pending_count-1;j++){ file->pending_requests[j]=file->pending_requests[j+1]; }
-    file->pending_count--;
+    acl_remove_at(&file->pending_requests, &file->pending_count, &file->pending_cap, idx);
     save_persistent_data();
     msg->error_code=ERR_SUCCESS; strcpy(msg->data, "Denied");
     pthread_mutex_unlock(&nm_lock);
@@ -1032,24 +3421,24 @@ void handle_deny_command(int client_sock, Message* msg) {
 // BONUS: RECENTS - list last 5 files accessed by user
 void handle_recents_command(int client_sock, Message* msg) {
     pthread_mutex_lock(&nm_lock);
-    // Collect candidates
-    int idxs[100]; int cnt=0;
-    for (int i=0;i<file_count;i++) {
-        if (check_access(&files[i], msg->username, ACCESS_READ)) {
-            idxs[cnt++] = i; if (cnt>=100) break;
-        }
-    }
-    // Partial sort by accessed_time desc (simple selection of top 5)
-    int top = cnt < 5 ? cnt : 5;
-    for (int i=0;i<top;i++){
-        int best=i; for(int j=i+1;j<cnt;j++){ if(files[idxs[j]].accessed_time > files[idxs[best]].accessed_time) best=j; }
-        int tmp=idxs[i]; idxs[i]=idxs[best]; idxs[best]=tmp;
+    // Keep the 5 most recently accessed of the user's own and granted files, newest first
+    FileMetadata* recent[5]; int top = 0;
+    files_wait_indexed();
+    int uid = request_user(msg);
+    UserFiles* uf = user_files_get(uid, 0);
+    for (int i = 0; uf && i < uf->count; i++) {
+        FileMetadata* f = file_lookup(uf->names[i]);
+        if (!f || !check_access(f, uid, ACCESS_READ)) continue;
+        if (top == 5 && f->accessed_time <= recent[4]->accessed_time) continue;
+        int j = top < 5 ? top++ : 4;
+        while (j > 0 && recent[j-1]->accessed_time < f->accessed_time) { recent[j] = recent[j-1]; j--; }
+        recent[j] = f;
     }
     char resp[BUFFER_SIZE] = "";
     for (int i=0;i<top;i++){
-        char line[256];
-        char time_str[32]; strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M", localtime(&files[idxs[i]].accessed_time));
-        snprintf(line, sizeof(line), "--> %s (last: %s)\n", files[idxs[i]].filename, time_str);
+        char line[MAX_FILENAME + 64];
+        char time_str[32]; strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M", localtime(&recent[i]->accessed_time));
+        snprintf(line, sizeof(line), "--> %s (last: %s)\n", recent[i]->filename, time_str);
         strcat(resp, line);
     }
     pthread_mutex_unlock(&nm_lock);
@@ -1057,34 +3446,160 @@ void handle_recents_command(int client_sock, Message* msg) {
     send_message(client_sock, msg);
 }
 
-void handle_addaccess_command(int client_sock, Message* msg) {
+typedef struct {
+    int ss_id;
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    int ok;
+    Message m;
+} SearchShard;
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    int primary;       // answered by the file's primary SS
+    int matched;
+    int tf;
+    int sentence;
+} SearchHit;
+
+static void* search_shard_query(void* arg) {
+    SearchShard* sh = arg;
+    sh->ok = (ss_request(sh->ip, sh->port, &sh->m, 2) == 0);
+    return NULL;
+}
+
+static int search_hit_by_name(const void* a, const void* b) {
+    const SearchHit* x = a;
+    const SearchHit* y = b;
+    int c = strcmp(x->filename, y->filename);
+    return c ? c : y->primary - x->primary;
+}
+
+static int search_hit_by_rank(const void* a, const void* b) {
+    const SearchHit* x = a;
+    const SearchHit* y = b;
+    if (x->matched != y->matched) return y->matched - x->matched;
+    if (x->tf != y->tf) return y->tf - x->tf;
+    return strcmp(x->filename, y->filename);
+}
+
+// SEARCH: msg->data holds the query words. Every active SS is asked in parallel for
+// its ranked matches from its full-text index; copies of a file are merged (the
+// primary's answer wins), files the user cannot read are dropped, and the best
+// SEARCH_MAX_RESULTS are returned, most query words matched first.
+void handle_search_command(int client_sock, Message* msg) {
+    char query[MAX_CONTENT];
+    strncpy(query, msg->data, sizeof(query) - 1);
+    query[sizeof(query) - 1] = '\0';
+    trim_whitespace(query);
+    if (query[0] == '\0') {
+        msg->error_code = ERR_INVALID_COMMAND;
+        strcpy(msg->error_msg, "Usage: SEARCH <words>");
+        send_message(client_sock, msg);
+        return;
+    }
+
     pthread_mutex_lock(&nm_lock);
-    
-    FileMetadata* file = trie_search(file_trie_root, msg->filename);
+    SearchShard* shards = calloc(ss_count + 1, sizeof(SearchShard));
+    if (shards == NULL) {
+        pthread_mutex_unlock(&nm_lock);
+        msg->error_code = ERR_SERVER_ERROR;
+        strcpy(msg->error_msg, "Out of memory");
+        send_message(client_sock, msg);
+        return;
+    }
+    int n = 0;
+    for (int i = 0; i < ss_count; i++) {
+        if (!storage_servers[i].active) continue;
+        shards[n].ss_id = i;
+        strcpy(shards[n].ip, storage_servers[i].ip);
+        shards[n].port = storage_servers[i].nm_port;
+        n++;
+    }
+    pthread_mutex_unlock(&nm_lock);
+
+    // Scatter without nm_lock; the slowest server bounds the latency
+    pthread_t tids[n + 1];
+    int started[n + 1];
+    for (int i = 0; i < n; i++) {
+        shards[i].m.op_code = OP_SEARCH;
+        strcpy(shards[i].m.data, query);
+        started[i] = (pthread_create(&tids[i], NULL, search_shard_query, &shards[i]) == 0);
+        if (!started[i]) search_shard_query(&shards[i]);
+    }
+    for (int i = 0; i < n; i++) if (started[i]) pthread_join(tids[i], NULL);
+
+    SearchHit* hits = NULL;
+    int nhits = 0, cap = 0, answered = 0;
+    pthread_mutex_lock(&nm_lock);
+    for (int i = 0; i < n; i++) {
+        if (!shards[i].ok) continue;
+        answered++;
+        char* save = NULL;
+        for (char* line = strtok_r(shards[i].m.data, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+            SearchHit h;
+            memset(&h, 0, sizeof(h));
+            if (sscanf(line, "%d %d %d %255s", &h.matched, &h.tf, &h.sentence, h.filename) != 4) continue;
+            FileMetadata* file = file_lookup(h.filename);
+            if (file == NULL || !check_access(file, request_user(msg), ACCESS_READ)) continue;
+            h.primary = (file->ss_id == shards[i].ss_id);
+            if (nhits == cap) {
+                cap = cap ? cap * 2 : 128;
+                SearchHit* grown = realloc(hits, (size_t)cap * sizeof(SearchHit));
+                if (grown == NULL) break;
+                hits = grown;
+            }
+            hits[nhits++] = h;
+        }
+    }
+    pthread_mutex_unlock(&nm_lock);
+    free(shards);
+
+    // One entry per file, preferring the primary's copy
+    if (nhits > 1) qsort(hits, nhits, sizeof(SearchHit), search_hit_by_name);
+    int unique = 0;
+    for (int i = 0; i < nhits; i++) {
+        if (unique > 0 && strcmp(hits[unique - 1].filename, hits[i].filename) == 0) continue;
+        hits[unique++] = hits[i];
+    }
+    if (unique > 1) qsort(hits, unique, sizeof(SearchHit), search_hit_by_rank);
+
+    int shown = unique < SEARCH_MAX_RESULTS ? unique : SEARCH_MAX_RESULTS;
+    size_t used = snprintf(msg->data, sizeof(msg->data), "%d file(s) match \"%s\" (%d/%d servers answered)\n",
+                           unique, query, answered, n);
+    for (int i = 0; i < shown && used < sizeof(msg->data); i++) {
+        used += snprintf(msg->data + used, sizeof(msg->data) - used, "--> %s (sentence %d, %d word(s), %d hit(s))\n",
+                         hits[i].filename, hits[i].sentence, hits[i].matched, hits[i].tf);
+    }
+    free(hits);
+    msg->error_code = ERR_SUCCESS;
+    send_message(client_sock, msg);
+}
+
+// nm_lock held: grant msg->data's user read (or, with flag 1, write) access
+static int add_access_locked(Message* msg) {
+    FileMetadata* file = file_lookup(msg->filename);
     
     if (file == NULL) {
         msg->error_code = ERR_FILE_NOT_FOUND;
         strcpy(msg->error_msg, "File not found");
-        pthread_mutex_unlock(&nm_lock);
-        send_message(client_sock, msg);
-        return;
+        return msg->error_code;
     }
     
-    if (strcmp(file->owner, msg->username) != 0) {
+    if (file->owner_id != request_user(msg)) {
         msg->error_code = ERR_NOT_OWNER;
         strcpy(msg->error_msg, "Only the owner can grant access");
-        pthread_mutex_unlock(&nm_lock);
-        send_message(client_sock, msg);
-        return;
+        return msg->error_code;
     }
     
-    char target_user[MAX_USERNAME];
-    sscanf(msg->data, "%s", target_user);
+    char target_user[MAX_USERNAME] = "";
+    sscanf(msg->data, "%63s", target_user);
     
     // Check if user exists
+    int target_id = intern_lookup(&user_names, target_user);
     int user_exists = 0;
-    for (int i = 0; i < client_count; i++) {
-        if (strcmp(clients[i].username, target_user) == 0) {
+    for (int i = 0; target_id && i < client_count; i++) {
+        if (clients[i].user_id == target_id) {
             user_exists = 1;
             break;
         }
@@ -1093,91 +3608,323 @@ void handle_addaccess_command(int client_sock, Message* msg) {
     if (!user_exists) {
         msg->error_code = ERR_USER_NOT_FOUND;
         strcpy(msg->error_msg, "User not found");
-        pthread_mutex_unlock(&nm_lock);
-        send_message(client_sock, msg);
-        return;
+        return msg->error_code;
     }
     
     // Check if already has access
-    int access_index = -1;
-    for (int i = 0; i < file->access_count; i++) {
-        if (strcmp(file->access_list[i].username, target_user) == 0) {
-            access_index = i;
-            break;
-        }
-    }
+    int access_index = acl_find(file->access_list, file->access_count, target_id);
     
     int access_type = (msg->flags & 1) ? ACCESS_WRITE : ACCESS_READ;  // -W or -R
     
     if (access_index >= 0) {
         file->access_list[access_index].access_type = access_type;
     } else {
-        if (file->access_count < MAX_ACCESS_LIST) {
-            strcpy(file->access_list[file->access_count].username, target_user);
-            file->access_list[file->access_count].access_type = access_type;
-            file->access_count++;
+        AccessEntry* entry = acl_push(&file->access_list, &file->access_count, &file->access_cap);
+        if (entry != NULL) {
+            entry->user_id = target_id;
+            entry->access_type = access_type;
+            user_files_add(target_id, file->filename);
         }
     }
     
+    journal_file_put(file);
     msg->error_code = ERR_SUCCESS;
     strcpy(msg->data, "Access granted successfully");
-    
-    pthread_mutex_unlock(&nm_lock);
-    send_message(client_sock, msg);
-    
-    save_persistent_data();
     log_message("NM", "INFO", "Access granted to %s for file %s", target_user, msg->filename);
+    return ERR_SUCCESS;
 }
 
-void handle_remaccess_command(int client_sock, Message* msg) {
+void handle_addaccess_command(int client_sock, Message* msg) {
     pthread_mutex_lock(&nm_lock);
-    
-    FileMetadata* file = trie_search(file_trie_root, msg->filename);
+    add_access_locked(msg);
+    pthread_mutex_unlock(&nm_lock);
+    journal_commit();
+    send_message(client_sock, msg);
+}
+
+// nm_lock held: drop msg->data's user from the file's access list
+static int remove_access_locked(Message* msg) {
+    FileMetadata* file = file_lookup(msg->filename);
     
     if (file == NULL) {
         msg->error_code = ERR_FILE_NOT_FOUND;
         strcpy(msg->error_msg, "File not found");
-        pthread_mutex_unlock(&nm_lock);
-        send_message(client_sock, msg);
-        return;
+        return msg->error_code;
     }
     
-    if (strcmp(file->owner, msg->username) != 0) {
+    if (file->owner_id != request_user(msg)) {
         msg->error_code = ERR_NOT_OWNER;
         strcpy(msg->error_msg, "Only the owner can remove access");
-        pthread_mutex_unlock(&nm_lock);
-        send_message(client_sock, msg);
-        return;
+        return msg->error_code;
     }
     
-    char target_user[MAX_USERNAME];
-    sscanf(msg->data, "%s", target_user);
+    char target_user[MAX_USERNAME] = "";
+    sscanf(msg->data, "%63s", target_user);
     
     // Remove access
-    for (int i = 0; i < file->access_count; i++) {
-        if (strcmp(file->access_list[i].username, target_user) == 0) {
-            for (int j = i; j < file->access_count - 1; j++) {
-                file->access_list[j] = file->access_list[j + 1];
-            }
-            file->access_count--;
-            break;
-        }
+    int target_id = intern_lookup(&user_names, target_user);
+    int access_index = acl_find(file->access_list, file->access_count, target_id);
+    if (access_index >= 0) {
+        acl_remove_at(&file->access_list, &file->access_count, &file->access_cap, access_index);
+        if (target_id != file->owner_id) user_files_remove(target_id, file->filename);
     }
     
+    journal_file_put(file);
     msg->error_code = ERR_SUCCESS;
     strcpy(msg->data, "Access removed successfully");
-    
+    log_message("NM", "INFO", "Access removed from %s for file %s", target_user, msg->filename);
+    return ERR_SUCCESS;
+}
+
+void handle_remaccess_command(int client_sock, Message* msg) {
+    pthread_mutex_lock(&nm_lock);
+    remove_access_locked(msg);
     pthread_mutex_unlock(&nm_lock);
+    journal_commit();
     send_message(client_sock, msg);
-    
-    save_persistent_data();
-    log_message("NM", "INFO", "Access removed from %s for file %s", target_user, msg->filename);
+}
+
+// BATCH: data holds up to BATCH_MAX_ITEMS lines of "CREATE <file>", "DELETE <file>",
+// "ADDACCESS -R|-W <file> <user>" or "REMACCESS <file> <user>", all on behalf of msg->username.
+// They are applied in order under one nm_lock hold and made durable by one journal commit.
+// Reply data has a line "<item> <error_code> <message>" per item; a failed item does not stop the rest.
+void handle_batch_command(int client_sock, Message* msg) {
+    char* req = malloc(sizeof(msg->data));
+    char* out = malloc(sizeof(msg->data));
+    Message* item = malloc(sizeof(Message));
+    if (!req || !out || !item) {
+        free(req); free(out); free(item);
+        msg->error_code = ERR_SERVER_ERROR;
+        strcpy(msg->error_msg, "Out of memory");
+        send_message(client_sock, msg);
+        return;
+    }
+    memcpy(req, msg->data, sizeof(msg->data));
+    req[sizeof(msg->data) - 1] = '\0';
+    size_t used = 0;
+    out[0] = '\0';
+    int n = 0, failed = 0;
+
+    pthread_mutex_lock(&nm_lock);
+    char* save = NULL;
+    for (char* line = strtok_r(req, "\n", &save); line && n < BATCH_MAX_ITEMS; line = strtok_r(NULL, "\n", &save)) {
+        char verb[16] = "", a1[MAX_FILENAME] = "", a2[MAX_FILENAME] = "", a3[MAX_USERNAME] = "";
+        int fields = sscanf(line, "%15s %255s %255s %63s", verb, a1, a2, a3);
+        if (fields < 1) continue;   // blank line
+
+        memset(item, 0, sizeof(Message));
+        strcpy(item->username, msg->username);
+        item->error_code = ERR_INVALID_COMMAND;
+        strcpy(item->error_msg, "Malformed batch item");
+        if (!shard_owns(strcmp(verb, "ADDACCESS") == 0 ? a2 : a1)) {
+            item->error_code = ERR_WRONG_SHARD;
+            snprintf(item->error_msg, sizeof(item->error_msg), "Belongs to shard %d",
+                     shard_of(strcmp(verb, "ADDACCESS") == 0 ? a2 : a1, shard_count));
+        } else if (strcmp(verb, "CREATE") == 0 && fields == 2) {
+            item->op_code = OP_CREATE;
+            strcpy(item->filename, a1);
+            create_file_locked(item);
+        } else if (strcmp(verb, "DELETE") == 0 && fields == 2) {
+            item->op_code = OP_DELETE;
+            strcpy(item->filename, a1);
+            delete_file_locked(item);
+        } else if (strcmp(verb, "ADDACCESS") == 0 && fields == 4 &&
+                   (strcmp(a1, "-R") == 0 || strcmp(a1, "-W") == 0)) {
+            item->op_code = OP_ADDACCESS;
+            item->flags = a1[1] == 'W' ? 1 : 0;
+            strcpy(item->filename, a2);
+            strcpy(item->data, a3);
+            add_access_locked(item);
+        } else if (strcmp(verb, "REMACCESS") == 0 && fields == 3) {
+            item->op_code = OP_REMACCESS;
+            strcpy(item->filename, a1);
+            strncpy(item->data, a2, MAX_USERNAME - 1);
+            remove_access_locked(item);
+        }
+        if (item->error_code != ERR_SUCCESS) failed++;
+        used += snprintf(out + used, sizeof(msg->data) - used, "%d %d %.48s\n", n, item->error_code,
+                         item->error_code == ERR_SUCCESS ? item->data : item->error_msg);
+        n++;
+    }
+    pthread_mutex_unlock(&nm_lock);
+    journal_commit();
+
+    msg->error_code = ERR_SUCCESS;
+    memcpy(msg->data, out, used + 1);
+    send_message(client_sock, msg);
+    log_message("NM", "INFO", "Batch from %s: %d items, %d failed", msg->username, n, failed);
+    free(req); free(out); free(item);
+}
+
+// Remove a job's scratch directory and whatever the script left in it
+static void exec_remove_tree(const char* path) {
+    DIR* d = opendir(path);
+    if (d) {
+        struct dirent* e;
+        while ((e = readdir(d)) != NULL) {
+            if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+            char child[MAX_PATH];
+            snprintf(child, sizeof(child), "%s/%s", path, e->d_name);
+            struct stat st;
+            if (lstat(child, &st) == 0 && S_ISDIR(st.st_mode)) exec_remove_tree(child);
+            else unlink(child);
+        }
+        closedir(d);
+    }
+    rmdir(path);
+}
+
+// EXEC jobs run each script line as "sh -c <line>" in a child process of its own: a new
+// session in a scratch directory, niced, with CPU/memory/file-size rlimits. A job gets
+// NM_EXEC_WALL_SEC in total and NM_EXEC_MAX_OUTPUT_KB of output, sent to the client in
+// Message-sized pieces (FLAG_EXEC_MORE on all but the last). At most NM_EXEC_WORKERS jobs
+// run at once; the others wait for a slot.
+
+// Fork one sandboxed "sh -c line" writing into out_fd and err_fd (-1: discard stderr);
+// returns its pid (also its process group)
+static pid_t exec_spawn(const char* line, const char* dir, int out_fd, int err_fd) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    // Child: only async-signal-safe calls until exec
+    setsid();
+    if (chdir(dir) != 0) _exit(126);
+    int devnull = open("/dev/null", O_RDWR);
+    if (devnull >= 0) { dup2(devnull, STDIN_FILENO); dup2(devnull, STDERR_FILENO); }
+    dup2(out_fd, STDOUT_FILENO);
+    if (err_fd >= 0) dup2(err_fd, STDERR_FILENO);
+    for (int fd = 3; fd < 1024; fd++) close(fd);
+    struct rlimit cpu = { exec_cpu_sec, exec_cpu_sec + 1 };
+    struct rlimit mem = { (rlim_t)exec_mem_mb << 20, (rlim_t)exec_mem_mb << 20 };
+    struct rlimit fsize = { (rlim_t)exec_max_output, (rlim_t)exec_max_output };
+    setrlimit(RLIMIT_CPU, &cpu);
+    setrlimit(RLIMIT_AS, &mem);
+    setrlimit(RLIMIT_FSIZE, &fsize);
+    setpriority(PRIO_PROCESS, 0, 10);
+    signal(SIGPIPE, SIG_DFL);
+    execl("/bin/sh", "sh", "-c", line, (char*)NULL);
+    _exit(127);
+}
+
+// Streaming mode: one FLAG_EXEC_MORE frame per chunk read, data_size bytes of it valid
+static int exec_send_frame(int client_sock, const Message* msg, const char* buf, size_t n, int is_err) {
+    Message frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.op_code = OP_EXEC;
+    frame.request_id = msg->request_id;
+    frame.flags = FLAG_EXEC_STREAM | FLAG_EXEC_MORE | (is_err ? FLAG_EXEC_STDERR : 0);
+    frame.error_code = ERR_SUCCESS;
+    memcpy(frame.data, buf, n);
+    frame.data_size = (int)n;
+    return send_message(client_sock, &frame);
+}
+
+// Run every line of script. Buffered mode sends output as msg->data fills and leaves the
+// rest there. Streaming mode (FLAG_EXEC_STREAM) sends stdout and stderr as they are read,
+// with at most EXEC_STREAM_WINDOW frames unacknowledged; the client's FLAG_EXEC_ACK messages
+// return credit (sentence_number frames each). *exit_status gets the last command's status.
+// Returns NULL when the script ran to the end, else why it was stopped.
+static const char* exec_run_script(int client_sock, Message* msg, char* script, int* exit_status) {
+    int stream = (msg->flags & FLAG_EXEC_STREAM) != 0;
+    char dir[] = "/tmp/nm_exec.XXXXXX";
+    if (!mkdtemp(dir)) return "no scratch directory";
+    long long deadline = now_us() + (long long)exec_wall_sec * 1000000;
+    long total = 0;
+    size_t used = 0;
+    int unacked = 0;
+    const char* outcome = NULL;
+    char chunk[MAX_CONTENT];
+    msg->data[0] = '\0';
+    *exit_status = 0;
+
+    char* save = NULL;
+    for (char* line = strtok_r(script, "\n", &save); line && !outcome; line = strtok_r(NULL, "\n", &save)) {
+        if (line[strspn(line, " \t\r")] == '\0') continue;
+        int out[2], err[2] = { -1, -1 };
+        if (pipe(out) != 0) { outcome = "pipe failed"; break; }
+        if (stream && pipe(err) != 0) { close(out[0]); close(out[1]); outcome = "pipe failed"; break; }
+        fcntl(out[0], F_SETFD, FD_CLOEXEC);
+        if (stream) fcntl(err[0], F_SETFD, FD_CLOEXEC);
+        pid_t pid = exec_spawn(line, dir, out[1], err[1]);
+        close(out[1]);
+        if (stream) close(err[1]);
+        if (pid < 0) { close(out[0]); if (stream) close(err[0]); outcome = "fork failed"; break; }
+
+        int src[2] = { out[0], stream ? err[0] : -1 };
+        while (!outcome && (src[0] >= 0 || src[1] >= 0)) {
+            long long left_ms = (deadline - now_us()) / 1000;
+            if (left_ms <= 0) { outcome = "wall-time limit"; break; }
+            // Out of credit: stop draining the pipes so the command blocks until the client catches up
+            struct pollfd pfd[3];
+            int nfds = 0, which[3];
+            for (int k = 0; k < 2; k++) {
+                if (src[k] >= 0 && (!stream || unacked < EXEC_STREAM_WINDOW)) {
+                    pfd[nfds].fd = src[k]; pfd[nfds].events = POLLIN; pfd[nfds].revents = 0; which[nfds++] = k;
+                }
+            }
+            if (stream) { pfd[nfds].fd = client_sock; pfd[nfds].events = POLLIN; pfd[nfds].revents = 0; which[nfds++] = 2; }
+            if (poll(pfd, nfds, (int)(left_ms > 1000 ? 1000 : left_ms)) <= 0) continue;
+
+            for (int p = 0; p < nfds && !outcome; p++) {
+                if (!pfd[p].revents) continue;
+                if (which[p] == 2) {
+                    Message ack;
+                    if (receive_message(client_sock, &ack) <= 0) { outcome = "client gone"; break; }
+                    if (ack.op_code == OP_EXEC && (ack.flags & FLAG_EXEC_ACK)) {
+                        unacked -= ack.sentence_number;
+                        if (unacked < 0) unacked = 0;
+                    }
+                    continue;
+                }
+                int k = which[p];
+                ssize_t n = stream ? read(src[k], chunk, sizeof(chunk))
+                                   : read(src[k], msg->data + used, sizeof(msg->data) - 1 - used);
+                if (n <= 0) { close(src[k]); src[k] = -1; continue; }   // EOF
+                total += n;
+                if (stream) {
+                    if (exec_send_frame(client_sock, msg, chunk, n, k == 1) < 0) { outcome = "client gone"; break; }
+                    unacked++;
+                } else {
+                    used += n;
+                    msg->data[used] = '\0';
+                    if (used == sizeof(msg->data) - 1) {
+                        msg->flags |= FLAG_EXEC_MORE;
+                        msg->error_code = ERR_SUCCESS;
+                        if (send_message(client_sock, msg) < 0) { outcome = "client gone"; break; }
+                        used = 0;
+                        msg->data[0] = '\0';
+                    }
+                }
+                if (total >= exec_max_output) outcome = "output limit";
+            }
+        }
+        if (outcome) kill(-pid, SIGKILL);
+        for (int k = 0; k < 2; k++) if (src[k] >= 0) close(src[k]);
+        int status;
+        waitpid(pid, &status, 0);
+        *exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        if (!outcome && WIFSIGNALED(status) && WTERMSIG(status) == SIGXCPU) {
+            char note[MAX_COMMAND + 32];
+            int len = snprintf(note, sizeof(note), "[%s: CPU limit]\n", line);
+            if (stream) {
+                exec_send_frame(client_sock, msg, note, len < (int)sizeof(note) ? len : (int)sizeof(note) - 1, 1);
+                unacked++;
+            } else {
+                snprintf(msg->data + used, sizeof(msg->data) - used, "%s", note);
+                used = strlen(msg->data);
+            }
+        }
+    }
+    exec_remove_tree(dir);
+    return outcome;
 }
 
 void handle_exec_command(int client_sock, Message* msg) {
+    // Credit for a stream that already ended; nothing to answer
+    if (msg->flags & FLAG_EXEC_ACK) return;
+
     pthread_mutex_lock(&nm_lock);
     
-    FileMetadata* file = trie_search(file_trie_root, msg->filename);
+    FileMetadata* file = file_lookup(msg->filename);
     
     if (file == NULL) {
         msg->error_code = ERR_FILE_NOT_FOUND;
@@ -1187,7 +3934,7 @@ void handle_exec_command(int client_sock, Message* msg) {
         return;
     }
     
-    if (!check_access(file, msg->username, ACCESS_READ)) {
+    if (!check_access(file, request_user(msg), ACCESS_READ)) {
         msg->error_code = ERR_ACCESS_DENIED;
         strcpy(msg->error_msg, "Access denied");
         pthread_mutex_unlock(&nm_lock);
@@ -1234,44 +3981,181 @@ void handle_exec_command(int client_sock, Message* msg) {
         return;
     }
     
-    // Execute commands
-    FILE* temp_file = tmpfile();
-    if (temp_file == NULL) {
-        msg->error_code = ERR_SERVER_ERROR;
-        strcpy(msg->error_msg, "Failed to create temporary file");
-        send_message(client_sock, msg);
-        return;
-    }
-    
-    fprintf(temp_file, "%s", ss_msg.data);
-    fflush(temp_file);
-    rewind(temp_file);
-    
-    char command[MAX_COMMAND];
-    char output[BUFFER_SIZE] = "";
-    
-    while (fgets(command, sizeof(command), temp_file)) {
-        command[strcspn(command, "\n")] = 0;
-        
-        FILE* pipe = popen(command, "r");
-        if (pipe) {
-            char line[1024];
-            while (fgets(line, sizeof(line), pipe)) {
-                strcat(output, line);
-            }
-            pclose(pipe);
+    // Run the script in sandboxed processes, at most exec_max jobs at a time
+    pthread_mutex_lock(&exec_lock);
+    while (exec_running >= exec_max) pthread_cond_wait(&exec_cond, &exec_lock);
+    exec_running++;
+    pthread_mutex_unlock(&exec_lock);
+
+    char* script = strdup(ss_msg.data);
+    int exit_status = -1;
+    const char* outcome = script ? exec_run_script(client_sock, msg, script, &exit_status) : "out of memory";
+    free(script);
+
+    pthread_mutex_lock(&exec_lock);
+    exec_running--;
+    pthread_cond_signal(&exec_cond);
+    pthread_mutex_unlock(&exec_lock);
+
+    if (outcome) {
+        size_t used = strlen(msg->data);
+        if (used > sizeof(msg->data) - 64) {
+            msg->flags |= FLAG_EXEC_MORE;
+            msg->error_code = ERR_SUCCESS;
+            send_message(client_sock, msg);
+            msg->data[0] = '\0';
+            used = 0;
         }
+        snprintf(msg->data + used, sizeof(msg->data) - used, "[EXEC stopped: %s]\n", outcome);
     }
-    
-    fclose(temp_file);
-    
-    strcpy(msg->data, output);
+    msg->flags &= ~FLAG_EXEC_MORE;
     msg->error_code = ERR_SUCCESS;
+    // Streaming: this is the closing frame; sentence_number is the exit status (-1 if stopped)
+    msg->sentence_number = outcome ? -1 : exit_status;
+    msg->data_size = (int)strlen(msg->data);
     send_message(client_sock, msg);
     
     log_message("NM", "INFO", "Executed file: %s by %s", msg->filename, msg->username);
 }
 
+// ---- Replica-aware read routing ----
+
+static ReplicaState** replica_state_slot(const char* filename) {
+    ReplicaState** slot = &replica_states[hash_string(filename) % REPLICA_STATE_BUCKETS];
+    while (*slot && strcmp((*slot)->filename, filename) != 0) slot = &(*slot)->next;
+    return slot;
+}
+
+// Drop what is known about a file's replica (delete/move); unknown means stale
+static void replica_state_forget(const char* filename) {
+    pthread_mutex_lock(&replica_state_lock);
+    ReplicaState** slot = replica_state_slot(filename);
+    if (*slot) {
+        ReplicaState* st = *slot;
+        *slot = st->next;
+        free(st);
+    }
+    pthread_mutex_unlock(&replica_state_lock);
+}
+
+// A primary reports whether its partner acknowledged the file's latest content.
+// Sent before the writers are answered, so a completed write is never hidden by a
+// read routed to a replica that missed it.
+void handle_repl_status(int client_sock, Message* msg) {
+    int reporter = -1, in_sync = 0, partner_nm_port = 0;
+    char partner_ip[INET_ADDRSTRLEN] = "";
+    if (sscanf(msg->data, "%d %d %15s %d", &reporter, &in_sync, partner_ip, &partner_nm_port) < 2) {
+        msg->error_code = ERR_INVALID_COMMAND;
+        strcpy(msg->error_msg, "Malformed replication status");
+        send_message(client_sock, msg);
+        return;
+    }
+
+    pthread_mutex_lock(&replica_state_lock);
+    ReplicaState** slot = replica_state_slot(msg->filename);
+    ReplicaState* st = *slot;
+    if (st == NULL) {
+        st = calloc(1, sizeof(ReplicaState));
+        if (st) {
+            strncpy(st->filename, msg->filename, MAX_FILENAME - 1);
+            *slot = st;
+        }
+    }
+    if (st) {
+        st->in_sync = in_sync ? 1 : 0;
+        st->reporter_ss_id = reporter;
+        strncpy(st->partner_ip, partner_ip, sizeof(st->partner_ip) - 1);
+        st->partner_nm_port = partner_nm_port;
+    }
+    pthread_mutex_unlock(&replica_state_lock);
+
+    log_message("NM", "INFO", "Replica of %s %s (reported by SS %d)", msg->filename,
+                in_sync ? "in sync" : "stale", reporter);
+    msg->error_code = st ? ERR_SUCCESS : ERR_SERVER_ERROR;
+    send_message(client_sock, msg);
+}
+
+// nm_lock held: may reads of this file go to its replica?
+static int replica_in_sync(FileMetadata* file) {
+    int r = file->replica_ss_id;
+    if (r < 0 || r >= ss_count || !storage_servers[r].active) return 0;
+    int ok = 0;
+    pthread_mutex_lock(&replica_state_lock);
+    ReplicaState* st = *replica_state_slot(file->filename);
+    // The acknowledgement must come from the primary and be for this file's replica
+    if (st && st->in_sync && st->reporter_ss_id == file->ss_id &&
+        strcmp(st->partner_ip, storage_servers[r].ip) == 0 &&
+        st->partner_nm_port == storage_servers[r].nm_port) {
+        ok = 1;
+    }
+    pthread_mutex_unlock(&replica_state_lock);
+    return ok;
+}
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// nm_lock held: decayed count of reads recently routed to an SS
+static double read_load(int ss, long long now) {
+    long long elapsed = now - ss_read_load_ms[ss];
+    if (elapsed >= READ_LOAD_HALF_LIFE_MS) {
+        long long halvings = elapsed / READ_LOAD_HALF_LIFE_MS;
+        ss_read_load[ss] = halvings >= 32 ? 0.0 : ss_read_load[ss] / (double)(1LL << halvings);
+        ss_read_load_ms[ss] += halvings * READ_LOAD_HALF_LIFE_MS;
+    }
+    return ss_read_load[ss];
+}
+
+static int probe_ss(const char* ip, int port) {
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) return 1; // cannot tell; assume reachable as before
+    struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    int ok = connect(s, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    close(s);
+    return ok;
+}
+
+// nm_lock held: send a READ/STREAM to the less loaded of the primary and an in-sync
+// replica. If the pick does not answer, fall back to the other copy.
+static void route_read(FileMetadata* file, SSConnection* out) {
+    long long now = now_ms();
+    int primary = (file->ss_id >= 0 && file->ss_id < ss_count) ? file->ss_id : -1;
+    int replica = replica_in_sync(file) ? file->replica_ss_id : -1;
+    int primary_up = primary >= 0 && storage_servers[primary].active;
+
+    int use_replica = 0;
+    if (replica >= 0) {
+        use_replica = !primary_up || read_load(replica, now) < read_load(primary, now);
+    }
+
+    const char* ip = use_replica ? file->replica_ss_ip : file->ss_ip;
+    int port = use_replica ? file->replica_ss_port : file->ss_port;
+    if (!probe_ss(ip, port)) {
+        // Unreachable: try the other copy (a stale replica beats no answer)
+        if (!use_replica && file->replica_ss_port > 0 && strlen(file->replica_ss_ip) > 0) {
+            use_replica = 1;
+            ip = file->replica_ss_ip; port = file->replica_ss_port;
+        } else if (use_replica) {
+            use_replica = 0;
+            ip = file->ss_ip; port = file->ss_port;
+        }
+    }
+
+    int chosen = use_replica ? file->replica_ss_id : primary;
+    if (chosen >= 0 && chosen < ss_count) {
+        read_load(chosen, now);
+        ss_read_load[chosen] += 1.0;
+    }
+    strcpy(out->ss_ip, ip);
+    out->ss_port = port;
+}
+
 void handle_read_stream_undo_command(int client_sock, Message* msg) {
     pthread_mutex_lock(&nm_lock);
     
@@ -1286,7 +4170,7 @@ void handle_read_stream_undo_command(int client_sock, Message* msg) {
     }
     
     if (msg->op_code == OP_READ || msg->op_code == OP_STREAM || msg->op_code == OP_VIEWCHECKPOINT || msg->op_code == OP_LISTCHECKPOINTS) {
-        if (!check_access(file, msg->username, ACCESS_READ)) {
+        if (!check_access(file, request_user(msg), ACCESS_READ)) {
             msg->error_code = ERR_ACCESS_DENIED;
             strcpy(msg->error_msg, "Access denied");
             pthread_mutex_unlock(&nm_lock);
@@ -1295,7 +4179,7 @@ void handle_read_stream_undo_command(int client_sock, Message* msg) {
         }
     }
     if (msg->op_code == OP_UNDO || msg->op_code == OP_REVERT || msg->op_code == OP_CHECKPOINT) {
-        if (!check_access(file, msg->username, ACCESS_WRITE)) {
+        if (!check_access(file, request_user(msg), ACCESS_WRITE)) {
             msg->error_code = ERR_ACCESS_DENIED;
             strcpy(msg->error_msg, "Access denied");
             pthread_mutex_unlock(&nm_lock);
@@ -1306,24 +4190,18 @@ void handle_read_stream_undo_command(int client_sock, Message* msg) {
     
     // Return SS connection info with fallback to replica if primary unreachable
     SSConnection ss_conn;
-    strcpy(ss_conn.ss_ip, file->ss_ip);
-    ss_conn.ss_port = file->ss_port;
-    
-    // Probe primary client port; if unreachable and replica exists, use replica
-    int probe_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (probe_sock >= 0) {
-        struct sockaddr_in addr; memset(&addr, 0, sizeof(addr));
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(ss_conn.ss_port);
-        inet_pton(AF_INET, ss_conn.ss_ip, &addr.sin_addr);
-        if (connect(probe_sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
-            // try replica
-            if (file->replica_ss_port > 0 && strlen(file->replica_ss_ip) > 0) {
-                strcpy(ss_conn.ss_ip, file->replica_ss_ip);
-                ss_conn.ss_port = file->replica_ss_port;
-            }
+    strcpy(ss_conn.ss_ip, file->ss_ip);
+    ss_conn.ss_port = file->ss_port;
+    
+    if (msg->op_code == OP_READ || msg->op_code == OP_STREAM) {
+        // Plain reads may be served by an in-sync replica
+        route_read(file, &ss_conn);
+    } else if (!probe_ss(ss_conn.ss_ip, ss_conn.ss_port)) {
+        // Primary client port unreachable: use the replica if one exists
+        if (file->replica_ss_port > 0 && strlen(file->replica_ss_ip) > 0) {
+            strcpy(ss_conn.ss_ip, file->replica_ss_ip);
+            ss_conn.ss_port = file->replica_ss_port;
         }
-        close(probe_sock);
     }
     
     strcpy(msg->data, "");
@@ -1331,7 +4209,7 @@ void handle_read_stream_undo_command(int client_sock, Message* msg) {
     msg->error_code = ERR_SUCCESS;
     
     file->accessed_time = time(NULL);
-    strcpy(file->last_accessed_by, msg->username);
+    file->last_accessed_by_id = nm_user_id(msg->username);
     
     pthread_mutex_unlock(&nm_lock);
     send_message(client_sock, msg);
@@ -1340,7 +4218,7 @@ void handle_read_stream_undo_command(int client_sock, Message* msg) {
 void handle_write_command(int client_sock, Message* msg) {
     pthread_mutex_lock(&nm_lock);
     
-    FileMetadata* file = trie_search(file_trie_root, msg->filename);
+    FileMetadata* file = file_lookup(msg->filename);
     
     if (file == NULL) {
         msg->error_code = ERR_FILE_NOT_FOUND;
@@ -1350,7 +4228,7 @@ void handle_write_command(int client_sock, Message* msg) {
         return;
     }
     
-    if (!check_access(file, msg->username, ACCESS_WRITE)) {
+    if (!check_access(file, request_user(msg), ACCESS_WRITE)) {
         msg->error_code = ERR_ACCESS_DENIED;
         strcpy(msg->error_msg, "Access denied");
         pthread_mutex_unlock(&nm_lock);
@@ -1383,7 +4261,7 @@ void handle_write_command(int client_sock, Message* msg) {
     
     file->modified_time = time(NULL);
     file->accessed_time = time(NULL);
-    strcpy(file->last_accessed_by, msg->username);
+    file->last_accessed_by_id = nm_user_id(msg->username);
     
     pthread_mutex_unlock(&nm_lock);
     send_message(client_sock, msg);
@@ -1394,14 +4272,17 @@ FileMetadata* search_file_cached(const char* filename) {
     time_t now = time(NULL);
     for (int i = 0; i < cache_size; i++) {
         if (strcmp(search_cache[i].filename, filename) == 0) {
-            if (difftime(now, search_cache[i].timestamp) < 60) {  // Cache valid for 60 seconds
-                return search_cache[i].file_info;
+            int slot = search_cache[i].slot;
+            if (difftime(now, search_cache[i].timestamp) < 60 &&  // Cache valid for 60 seconds
+                file_slots[slot].generation == search_cache[i].generation &&
+                strcmp(files[slot].filename, filename) == 0) {
+                return &files[slot];
             }
         }
     }
     
     // Search in trie
-    FileMetadata* file = trie_search(file_trie_root, filename);
+    FileMetadata* file = file_lookup(filename);
     if (file != NULL) {
         update_cache(filename, file);
     }
@@ -1412,7 +4293,8 @@ FileMetadata* search_file_cached(const char* filename) {
 void update_cache(const char* filename, FileMetadata* file_info) {
     if (cache_size < 100) {
         strcpy(search_cache[cache_size].filename, filename);
-        search_cache[cache_size].file_info = file_info;
+        search_cache[cache_size].slot = (int)(file_info - files);
+        search_cache[cache_size].generation = file_slots[file_info - files].generation;
         search_cache[cache_size].timestamp = time(NULL);
         cache_size++;
     } else {
@@ -1424,208 +4306,1154 @@ void update_cache(const char* filename, FileMetadata* file_info) {
             }
         }
         strcpy(search_cache[oldest].filename, filename);
-        search_cache[oldest].file_info = file_info;
+        search_cache[oldest].slot = (int)(file_info - files);
+        search_cache[oldest].generation = file_slots[file_info - files].generation;
         search_cache[oldest].timestamp = time(NULL);
     }
 }
 
-void load_persistent_data() {
-    FILE* fp = fopen("nm_data.dat", "rb");
-    if (fp == NULL) {
-        log_message("NM", "INFO", "No persistent data found, starting fresh");
+// ---- Metadata journal ----
+// CREATE/DELETE/ADDACCESS/REMACCESS (and BATCH) append one record per changed file to
+// nm_journal.log instead of rewriting nm_data.dat; journal_commit() makes them durable with a
+// single fdatasync. save_persistent_data() is the checkpoint: it writes a fresh snapshot and
+// empties the journal. Startup loads the snapshot and then replays the journal over it.
+#define SNAPSHOT_MAGIC 0x534d4e46   // leads nm_data.dat
+#define SNAPSHOT_VERSION 5          // 5: mapped in place (see SnapshotHeader)
+#define JOURNAL_PATH "nm_journal.log"
+#define JOURNAL_MAGIC 0x4a4d4e46u
+#define J_FILE_PUT 1   // payload: JournalFilePut + access and pending entries (whole record, upsert)
+#define J_FILE_DEL 2   // payload: filename
+#define J_USER 3       // payload: username (MAX_USERNAME bytes), takes the next user ID
+
+typedef struct {
+    unsigned int magic;
+    int type;
+    int len;
+    unsigned int sum;   // FNV-1a of the payload
+} JournalHeader;
+
+typedef struct {
+    FileMetadata meta;   // list pointers cleared; meta.access_count + meta.pending_count entries follow
+    int replica_count;
+    int replicas[MAX_REPLICAS - 1];
+} JournalFilePut;
+#define JOURNAL_PUT_MAX (sizeof(JournalFilePut) + 2 * MAX_ACCESS_LIST * sizeof(AccessEntry))
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER; // taken after nm_lock
+static int journal_fd = -1;
+static long journal_bytes = 0;
+static int journal_dirty = 0;
+static int journal_fsync = 1;
+static long journal_max_bytes = 4096L * 1024;
+
+static unsigned int journal_sum(const void* buf, size_t len) {
+    unsigned int h = 2166136261u;
+    const unsigned char* p = buf;
+    for (size_t i = 0; i < len; i++) { h ^= p[i]; h *= 16777619u; }
+    return h;
+}
+
+// ---- Standby Name Servers ----
+// A standby (started with NM_STANDBY_OF=<ip>:<port>) follows the primary with OP_NM_FOLLOW
+// and mirrors its nm_data.dat and nm_journal.log. It is sent the snapshot and journal as they
+// stand, then each journal record as it is appended and each snapshot a checkpoint writes.
+// Frames are queued under journal_lock, so their order matches the files, and the standby's
+// connection thread sends them with no lock held: metadata operations never wait on a
+// standby. One that falls NM_STANDBY_QUEUE_MB behind, or stops taking data for 2 s, is
+// dropped and resyncs when it reconnects.
+#define MAX_STANDBYS 4
+#define SHIP_MAGIC 0x53484950u
+#define SHIP_SNAPSHOT 1   // len bytes of nm_data.dat (0: none); the journal starts over
+#define SHIP_JOURNAL 2    // len bytes of journal records
+#define SHIP_PING 3       // after a second with nothing to send, so a standby can tell a quiet primary from a dead one
+
+typedef struct {
+    unsigned int magic;
+    int type;
+    long len;
+} ShipHeader;
+
+typedef struct ShipFrame {
+    int type;
+    int fd;                  // SHIP_SNAPSHOT: the file as it was when queued (-1: none)
+    long len;
+    struct ShipFrame* next;
+    char data[];             // SHIP_JOURNAL: the bytes
+} ShipFrame;
+
+typedef struct {
+    int sock;
+    char addr[INET_ADDRSTRLEN + 8];
+    ShipFrame* head;
+    ShipFrame* tail;
+    long queued;             // journal bytes waiting
+    int dropped;
+    pthread_cond_t cond;     // used with journal_lock
+} Standby;
+
+static Standby* standbys[MAX_STANDBYS];   // guarded by journal_lock
+static int standby_count = 0;
+static long standby_queue_max = 64L * 1024 * 1024;
+
+// journal_lock held
+static void standby_queue(Standby* sb, ShipFrame* f) {
+    if (f == NULL || sb->dropped) {
+        if (f && f->fd >= 0) close(f->fd);
+        free(f);
+        if (!sb->dropped) {
+            sb->dropped = 1;   // a frame is missing; the standby has to start over
+            pthread_cond_signal(&sb->cond);
+        }
         return;
     }
-    
-    // Validate file size and read counts defensively
-    int rc;
-    rc = fread(&file_count, sizeof(int), 1, fp);
-    if (rc != 1 || file_count < 0 || file_count > MAX_FILES) {
-        fclose(fp);
-        file_count = 0; ss_count = 0;
-        log_message("NM", "ERROR", "Corrupt nm_data.dat (file_count). Starting fresh");
-        save_persistent_data();
-        return;
+    f->next = NULL;
+    if (sb->tail) sb->tail->next = f; else sb->head = f;
+    sb->tail = f;
+    if (f->type == SHIP_JOURNAL) sb->queued += f->len;
+    if (sb->queued > standby_queue_max) {
+        log_message("NM", "WARN", "Standby %s is %ld bytes behind; dropping it", sb->addr, sb->queued);
+        sb->dropped = 1;
     }
-    rc = fread(files, sizeof(FileMetadata), file_count, fp);
-    if (rc != file_count) {
-        fclose(fp);
-        file_count = 0; ss_count = 0;
-        log_message("NM", "ERROR", "Corrupt nm_data.dat (files array). Starting fresh");
-        save_persistent_data();
-        return;
+    pthread_cond_signal(&sb->cond);
+}
+
+static ShipFrame* ship_frame_bytes(const void* a, size_t alen, const void* b, size_t blen) {
+    ShipFrame* f = malloc(sizeof(ShipFrame) + alen + blen);
+    if (f == NULL) return NULL;
+    f->type = SHIP_JOURNAL;
+    f->fd = -1;
+    f->len = (long)(alen + blen);
+    if (alen > 0) memcpy(f->data, a, alen);
+    if (blen > 0) memcpy(f->data + alen, b, blen);
+    return f;
+}
+
+// The file at path as it is now; a later checkpoint renaming over it does not change what is sent
+static ShipFrame* ship_frame_file(const char* path) {
+    ShipFrame* f = malloc(sizeof(ShipFrame));
+    if (f == NULL) return NULL;
+    struct stat st;
+    f->type = SHIP_SNAPSHOT;
+    f->fd = open(path, O_RDONLY);
+    f->len = (f->fd >= 0 && fstat(f->fd, &st) == 0) ? (long)st.st_size : 0;
+    return f;
+}
+
+static void ship_frame_free(ShipFrame* f) {
+    if (f->fd >= 0) close(f->fd);
+    free(f);
+}
+
+static int ship_frame_send(int sock, ShipFrame* f) {
+    ShipHeader h = { SHIP_MAGIC, f->type, f->len };
+    if (send_all(sock, &h, sizeof(h), MSG_NOSIGNAL) != 0) return -1;
+    if (f->fd < 0) return f->len > 0 ? send_all(sock, f->data, f->len, MSG_NOSIGNAL) : 0;
+    char buf[65536];
+    for (off_t off = 0; off < f->len; ) {
+        ssize_t n = pread(f->fd, buf, f->len - off < (off_t)sizeof(buf) ? (size_t)(f->len - off) : sizeof(buf), off);
+        if (n <= 0 || send_all(sock, buf, n, MSG_NOSIGNAL) != 0) return -1;
+        off += n;
+    }
+    return 0;
+}
+
+// journal_lock held: a record was just appended to the journal
+static void standby_ship_record(const JournalHeader* h, const void* payload, int len) {
+    for (int i = 0; i < standby_count; i++) {
+        standby_queue(standbys[i], ship_frame_bytes(h, sizeof(*h), payload, len));
+    }
+}
+
+// journal_lock held: a checkpoint just replaced nm_data.dat and emptied the journal
+static void standby_ship_snapshot() {
+    for (int i = 0; i < standby_count; i++) standby_queue(standbys[i], ship_frame_file("nm_data.dat"));
+}
+
+// Append "standby <ip>:<port>" lines to a registration reply, so clients and storage
+// servers know where to go if this NM stops answering
+static void standby_list(char* out, size_t cap) {
+    pthread_mutex_lock(&journal_lock);
+    size_t used = strlen(out);
+    for (int i = 0; i < standby_count && used < cap; i++) {
+        used += snprintf(out + used, cap - used, "\nstandby %s", standbys[i]->addr);
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+static void journal_append(int type, const void* payload, int len) {
+    pthread_mutex_lock(&journal_lock);
+    if (journal_fd >= 0) {
+        JournalHeader h = { JOURNAL_MAGIC, type, len, journal_sum(payload, len) };
+        struct iovec iov[2] = { { &h, sizeof(h) }, { (void*)payload, len } };
+        ssize_t n = writev(journal_fd, iov, 2);
+        if (n != (ssize_t)(sizeof(h) + len)) {
+            log_message("NM", "ERROR", "Journal append failed: %s", strerror(errno));
+        } else {
+            journal_bytes += n;
+            journal_dirty = 1;
+            standby_ship_record(&h, payload, len);
+        }
     }
-    rc = fread(&ss_count, sizeof(int), 1, fp);
-    if (rc != 1 || ss_count < 0 || ss_count > MAX_SS) {
-        fclose(fp);
-        ss_count = 0;
-        log_message("NM", "ERROR", "Corrupt nm_data.dat (ss_count); continuing with 0 storage servers");
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// On-disk copy of a record: the slab pointers mean nothing outside this process
+static void file_record_strip(FileMetadata* rec) {
+    rec->access_list = NULL; rec->access_cap = 0;
+    rec->pending_requests = NULL; rec->pending_cap = 0;
+}
+
+// nm_lock held
+static void journal_file_put(FileMetadata* file) {
+    char buf[JOURNAL_PUT_MAX];
+    JournalFilePut* r = (JournalFilePut*)buf;
+    memset(r, 0, sizeof(*r));
+    r->meta = *file;
+    file_record_strip(&r->meta);
+    r->replica_count = file_replicas(file, r->replicas);
+    AccessEntry* entries = (AccessEntry*)(buf + sizeof(JournalFilePut));
+    memcpy(entries, file->access_list, (size_t)file->access_count * sizeof(AccessEntry));
+    memcpy(entries + file->access_count, file->pending_requests, (size_t)file->pending_count * sizeof(AccessEntry));
+    journal_append(J_FILE_PUT, buf, (int)(sizeof(JournalFilePut) + (file->access_count + file->pending_count) * sizeof(AccessEntry)));
+}
+
+static void journal_file_del(const char* filename) {
+    char name[MAX_FILENAME];
+    memset(name, 0, sizeof(name));
+    strncpy(name, filename, sizeof(name) - 1);
+    journal_append(J_FILE_DEL, name, sizeof(name));
+}
+
+// nm_lock held: a name was just given the next user ID; records after this one may use it
+static void journal_user(const char* name) {
+    char buf[MAX_USERNAME];
+    memset(buf, 0, sizeof(buf));
+    strncpy(buf, name, sizeof(buf) - 1);
+    journal_append(J_USER, buf, sizeof(buf));
+}
+
+// Call without nm_lock: flush everything appended so far, checkpointing once the journal is large
+static void journal_commit() {
+    pthread_mutex_lock(&journal_lock);
+    if (journal_fd >= 0 && journal_dirty && journal_fsync) fdatasync(journal_fd);
+    journal_dirty = 0;
+    int full = journal_bytes > journal_max_bytes;
+    pthread_mutex_unlock(&journal_lock);
+    if (full) {
+        pthread_mutex_lock(&nm_lock);
         save_persistent_data();
-        // continue with files only
-        fp = NULL;
+        pthread_mutex_unlock(&nm_lock);
+    }
+}
+
+// ---- Mapped metadata store ----
+// nm_data.dat is laid out to be used where it lies rather than parsed:
+//   header    SnapshotHeader (first page)
+//   records   FileMetadata[file_count], page-aligned; access_list/pending_requests hold the
+//             file offsets of their entry blocks, sized to the slab's power-of-two classes
+//   replicas  int[file_count][MAX_REPLICAS]: how many, then the server IDs
+//   acl       the entry blocks
+//   index     int[index_cap]: filename -> record, open addressing by hash_string
+//   servers   StorageServerInfo[ss_count] without their file lists
+//   users     char[user_count][MAX_USERNAME] in ID order
+// Startup maps the file privately: the records become files[] and the index serves lookups
+// without reading either. A background thread then links each record into the trie, the
+// per-user index and its server's list; whatever touches a record first links it
+// (file_ready), and listings wait for the thread to finish (files_wait_indexed).
+typedef struct {
+    unsigned int magic;
+    int version;
+    int file_count;
+    int ss_count;
+    int user_count;
+    int index_cap;
+    long records_off;
+    long replicas_off;
+    long acl_off;
+    long acl_bytes;
+    long index_off;
+    long ss_off;
+    long users_off;
+    long total_size;
+} SnapshotHeader;
+
+static char* snap_base = NULL;       // private mapping of the nm_data.dat loaded at startup
+static SnapshotHeader snap;
+static int files_unindexed_end = 0;  // slots below this came from the mapping (guarded by nm_lock)
+static int files_indexed = 1;
+static pthread_cond_t files_indexed_cond = PTHREAD_COND_INITIALIZER;
+
+// Name index (guarded by nm_lock): slot of each live record by filename
+#define NAME_INDEX_EMPTY -1
+#define NAME_INDEX_DELETED -2
+static int* name_index = NULL;
+static unsigned int name_index_cap = 0;    // power of two
+static unsigned int name_index_used = 0;   // live and deleted entries
+static unsigned int name_index_live = 0;
+static int name_index_mapped = 0;          // still the array inside snap_base
+
+static long name_index_find(const char* filename) {
+    if (name_index_cap == 0) return -1;
+    unsigned int mask = name_index_cap - 1, i = hash_string(filename) & mask;
+    for (unsigned int n = 0; n < name_index_cap; n++, i = (i + 1) & mask) {
+        int slot = name_index[i];
+        if (slot == NAME_INDEX_EMPTY) return -1;
+        if (slot >= 0 && slot < file_count && strcmp(files[slot].filename, filename) == 0) return i;
+    }
+    return -1;
+}
+
+static int name_index_resize(unsigned int cap) {
+    int* grown = malloc((size_t)cap * sizeof(int));
+    if (grown == NULL) return -1;
+    memset(grown, 0xff, (size_t)cap * sizeof(int));   // NAME_INDEX_EMPTY
+    unsigned int live = 0;
+    for (unsigned int i = 0; i < name_index_cap; i++) {
+        int slot = name_index[i];
+        if (slot < 0 || slot >= file_count) continue;
+        unsigned int j = hash_string(files[slot].filename) & (cap - 1);
+        while (grown[j] != NAME_INDEX_EMPTY) j = (j + 1) & (cap - 1);
+        grown[j] = slot;
+        live++;
+    }
+    if (!name_index_mapped) free(name_index);
+    name_index = grown;
+    name_index_cap = cap;
+    name_index_used = name_index_live = live;
+    name_index_mapped = 0;
+    return 0;
+}
+
+// nm_lock held: index the record in slot under its filename
+static void name_index_put(int slot) {
+    if ((name_index_used + 1) * 4 > name_index_cap * 3) {
+        unsigned int cap = name_index_cap ? name_index_cap : 1024;
+        while ((name_index_live + 1) * 2 > cap) cap *= 2;
+        if (name_index_resize(cap) != 0) return;
+    }
+    const char* filename = files[slot].filename;
+    unsigned int mask = name_index_cap - 1, i = hash_string(filename) & mask;
+    long reuse = -1;
+    for (;; i = (i + 1) & mask) {
+        int cur = name_index[i];
+        if (cur == NAME_INDEX_EMPTY) break;
+        if (cur < 0 || cur >= file_count) { if (reuse < 0) reuse = i; continue; }
+        if (cur == slot || strcmp(files[cur].filename, filename) == 0) { name_index[i] = slot; return; }
+    }
+    if (reuse >= 0) i = reuse;
+    else name_index_used++;
+    name_index[i] = slot;
+    name_index_live++;
+}
+
+static void name_index_del(const char* filename) {
+    long i = name_index_find(filename);
+    if (i < 0) return;
+    name_index[i] = NAME_INDEX_DELETED;
+    name_index_live--;
+}
+
+// A stored entry block: its file offset becomes a pointer into the mapping, from where the
+// block joins the ACL slab like any other. Anything out of bounds drops the list.
+static AccessEntry* snapshot_acl(AccessEntry* stored, int* count, int* cap) {
+    uintptr_t off = (uintptr_t)stored;
+    int c = *cap;
+    if (*count <= 0 || *count > MAX_ACCESS_LIST || c < *count || c > 1 << (ACL_CLASSES - 1) || c != 1 << acl_class(c) ||
+        off < (uintptr_t)snap.acl_off || off % sizeof(void*) != 0 ||
+        off + (size_t)c * sizeof(AccessEntry) > (uintptr_t)(snap.acl_off + snap.acl_bytes)) {
+        *count = 0;
+        *cap = 0;
+        return NULL;
+    }
+    return (AccessEntry*)(snap_base + off);
+}
+
+// nm_lock held: the record in slot, linked everywhere first if it is still as mapped
+static FileMetadata* file_ready(int slot) {
+    FileMetadata* file = &files[slot];
+    if (file_slots[slot].ready) return file;
+    file_slots[slot].ready = 1;
+    file_slots[slot].next_free = -1;
+    file_slots[slot].ss_pos = -1;
+    if (file->filename[0] == '\0') return file;
+    file->access_list = snapshot_acl(file->access_list, &file->access_count, &file->access_cap);
+    file->pending_requests = snapshot_acl(file->pending_requests, &file->pending_count, &file->pending_cap);
+    file->filename[MAX_FILENAME - 1] = '\0';
+    if (user_name(file->owner_id)[0] == '\0') {
+        name_index_del(file->filename);
+        file_slot_free(slot);
+        return file;
+    }
+    if (file->char_count < 0) file->char_count = 0;
+    if (file->word_count < 0) file->word_count = 0;
+    if (file->ss_id < 0 || file->ss_id >= max_ss) file->ss_id = 0;
+    if (file->created_time == 0) file->created_time = time(NULL);
+    if (file->modified_time == 0) file->modified_time = file->created_time;
+    if (file->accessed_time == 0) file->accessed_time = file->modified_time;
+
+    const int* stored = (const int*)(snap_base + snap.replicas_off) + (size_t)slot * MAX_REPLICAS;
+    int n = 0, ids[MAX_REPLICAS - 1];
+    for (int k = 0; k < stored[0] && k < MAX_REPLICAS - 1; k++) {
+        if (stored[k + 1] >= 0 && stored[k + 1] < ss_count) ids[n++] = stored[k + 1];
     }
-    if (fp) {
-        rc = fread(storage_servers, sizeof(StorageServerInfo), ss_count, fp);
-        if (rc != ss_count) {
-            log_message("NM", "ERROR", "Corrupt nm_data.dat (storage_servers array); zeroing SS list");
-            ss_count = 0;
+    if (n > 0) set_file_replicas(file, ids, n);
+
+    trie_insert(file_trie_root, file->filename, file);
+    user_files_add_file(file);
+    if (file->ss_id < ss_count) ss_files_add(&storage_servers[file->ss_id], slot);
+    return file;
+}
+
+// nm_lock held: the live record named filename, or NULL
+static FileMetadata* file_lookup(const char* filename) {
+    long i = name_index_find(filename);
+    if (i < 0) return NULL;
+    FileMetadata* file = file_ready(name_index[i]);
+    return file->filename[0] != '\0' ? file : NULL;
+}
+
+// nm_lock held: block until every mapped record is linked (listings walk the trie and lists)
+static void files_wait_indexed() {
+    while (!files_indexed) pthread_cond_wait(&files_indexed_cond, &nm_lock);
+}
+
+// Links the mapped records in batches, releasing nm_lock between them so requests keep flowing
+static void* file_index_builder(void* arg) {
+    (void)arg;
+    long long t0 = now_us();
+    int next = 0, done = 0;
+    while (!done) {
+        pthread_mutex_lock(&nm_lock);
+        int end = files_unindexed_end - next > 1024 ? next + 1024 : files_unindexed_end;
+        for (; next < end; next++) file_ready(next);
+        done = next >= files_unindexed_end;
+        if (done) {
+            files_indexed = 1;
+            pthread_cond_broadcast(&files_indexed_cond);
         }
+        pthread_mutex_unlock(&nm_lock);
     }
-    
-    // Rebuild trie with de-duplication to recover from any stale entries
-    int new_count = 0;
+    log_message("NM", "INFO", "Indexed %d mapped file records in %.1f ms", next, (now_us() - t0) / 1000.0);
+    return NULL;
+}
+
+// Map a version 5 snapshot; 0 on success, -1 (nothing loaded) if it is unusable
+static int snapshot_map(int fd) {
+    struct stat st;
+    SnapshotHeader h;
+    long page = sysconf(_SC_PAGESIZE);
+    if (fstat(fd, &st) != 0 || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) return -1;
+    if (h.magic != SNAPSHOT_MAGIC || h.version != SNAPSHOT_VERSION || h.total_size != (long)st.st_size ||
+        h.file_count < 0 || h.file_count > max_files || h.ss_count < 0 || h.ss_count > max_ss ||
+        h.user_count < 0 || h.index_cap <= h.file_count || (h.index_cap & (h.index_cap - 1)) != 0 ||
+        h.records_off < (long)sizeof(h) || h.records_off % page != 0 ||
+        h.replicas_off % 8 || h.acl_off % 8 || h.index_off % 8 || h.ss_off % 8 || h.acl_bytes < 0 ||
+        h.replicas_off < h.records_off + (long)(h.file_count * sizeof(FileMetadata)) ||
+        h.acl_off < h.replicas_off + (long)(h.file_count * MAX_REPLICAS * sizeof(int)) ||
+        h.index_off < h.acl_off + h.acl_bytes ||
+        h.ss_off < h.index_off + (long)(h.index_cap * sizeof(int)) ||
+        h.users_off < h.ss_off + (long)(h.ss_count * sizeof(StorageServerInfo)) ||
+        h.total_size < h.users_off + (long)h.user_count * MAX_USERNAME) return -1;
+    char* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) return -1;
+    if (table_grow(&file_slot_table, h.file_count) != 0 || table_grow(&ss_table, h.ss_count) != 0 ||
+        table_map(&file_table, fd, h.records_off, h.file_count) != 0) {
+        munmap(base, st.st_size);
+        return -1;
+    }
+    snap_base = base;
+    snap = h;
+    file_count = h.file_count;
+    ss_count = h.ss_count;
+    memcpy(storage_servers, base + h.ss_off, (size_t)ss_count * sizeof(StorageServerInfo));
+    for (int s = 0; s < ss_count; s++) {
+        storage_servers[s].files = NULL; storage_servers[s].files_cap = 0; storage_servers[s].file_count = 0;
+    }
+    for (int i = 0; i < h.user_count; i++) {
+        char name[MAX_USERNAME];
+        memcpy(name, base + h.users_off + (long)i * MAX_USERNAME, MAX_USERNAME);
+        name[MAX_USERNAME - 1] = '\0';
+        intern_id(&user_names, name);
+    }
+    name_index = (int*)(base + h.index_off);
+    name_index_cap = h.index_cap;
+    name_index_used = name_index_live = h.file_count;
+    name_index_mapped = 1;
+    return 0;
+}
+
+// ---- Headerless snapshots ----
+// Name Servers before versioned snapshots wrote nm_data.dat as raw arrays in their own
+// record layout: int file_count, the records, int ss_count, the servers, and (once replica
+// lists existed) int count plus that many replica lists. Such a file is read once, into
+// the tables, and checkpointed as the current version by load_persistent_data.
+#define LEGACY_MAX_FILES 10000
+#define LEGACY_MAX_SS 50
+
+typedef struct {
+    char username[MAX_USERNAME];
+    int access_type;
+} LegacyAccessEntry;
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    char owner[MAX_USERNAME];
+    int ss_id;
+    char ss_ip[INET_ADDRSTRLEN];
+    int ss_port;
+    int replica_ss_id;
+    char replica_ss_ip[INET_ADDRSTRLEN];
+    int replica_ss_port;
+    LegacyAccessEntry access_list[MAX_ACCESS_LIST];
+    int access_count;
+    LegacyAccessEntry pending_requests[MAX_ACCESS_LIST];
+    int pending_count;
+    time_t created_time;
+    time_t modified_time;
+    time_t accessed_time;
+    long size;
+    int word_count;
+    int char_count;
+    char last_accessed_by[MAX_USERNAME];
+} LegacyFileMetadata;
+
+typedef struct {
+    int ss_id;
+    char ip[INET_ADDRSTRLEN];
+    int nm_port;
+    int client_port;
+    int active;
+} LegacyServerHead;
+
+typedef struct {
+    LegacyServerHead head;
+    char files[LEGACY_MAX_FILES][MAX_FILENAME];   // never read: rebuilt from the records
+    int file_count;
+} LegacyStorageServerInfo;                        // only its size is used, for the stride
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    int count;
+    int ss[MAX_REPLICAS - 1];
+} LegacyPlacement;
+
+// Interned copies of a legacy access list, skipping unnamed entries; returns how many
+static int legacy_acl(const LegacyAccessEntry* in, int count, AccessEntry* out) {
+    int n = 0;
+    if (count < 0 || count > MAX_ACCESS_LIST) return 0;
+    for (int i = 0; i < count; i++) {
+        if (in[i].username[0] == '\0' || memchr(in[i].username, '\0', MAX_USERNAME) == NULL) continue;
+        out[n].user_id = intern_id(&user_names, in[i].username);
+        out[n].access_type = in[i].access_type;
+        n++;
+    }
+    return n;
+}
+
+// Startup only: load a headerless snapshot; 0 on success, -1 (nothing loaded) if it is not one
+static int snapshot_load_legacy(int fd) {
+    struct stat st;
+    int fc, sc, pc = 0;
+    if (fstat(fd, &st) != 0 || pread(fd, &fc, sizeof(int), 0) != (ssize_t)sizeof(int) ||
+        fc < 0 || fc > LEGACY_MAX_FILES || fc > max_files) return -1;
+    off_t ss_pos = sizeof(int) + (off_t)fc * sizeof(LegacyFileMetadata);
+    if (pread(fd, &sc, sizeof(int), ss_pos) != (ssize_t)sizeof(int) ||
+        sc < 0 || sc > LEGACY_MAX_SS || sc > max_ss) return -1;
+    off_t pl_pos = ss_pos + sizeof(int) + (off_t)sc * sizeof(LegacyStorageServerInfo);
+    if (st.st_size != pl_pos) {
+        if (pread(fd, &pc, sizeof(int), pl_pos) != (ssize_t)sizeof(int) || pc < 0 ||
+            st.st_size != pl_pos + (off_t)sizeof(int) + (off_t)pc * (off_t)sizeof(LegacyPlacement)) return -1;
+    }
+
+    if (table_grow(&ss_table, sc) != 0) return -1;
+    for (int s = 0; s < sc; s++) {
+        LegacyServerHead rec;
+        off_t at = ss_pos + sizeof(int) + (off_t)s * sizeof(LegacyStorageServerInfo);
+        if (pread(fd, &rec, sizeof(rec), at) != (ssize_t)sizeof(rec)) return -1;
+        StorageServerInfo* ss = &storage_servers[s];
+        memset(ss, 0, sizeof(*ss));
+        ss->ss_id = rec.ss_id;
+        memcpy(ss->ip, rec.ip, sizeof(ss->ip));
+        ss->ip[INET_ADDRSTRLEN - 1] = '\0';
+        ss->nm_port = rec.nm_port;
+        ss->client_port = rec.client_port;
+        ss->active = rec.active;
+    }
+    ss_count = sc;
+
+    LegacyFileMetadata* rec = malloc(sizeof(LegacyFileMetadata));
+    if (rec == NULL) return -1;
+    int loaded = 0;
     time_t now = time(NULL);
-    for (int i = 0; i < file_count; i++) {
-        // Basic validation of each record; skip invalid ones
-        files[i].filename[MAX_FILENAME-1] = '\0';
-        files[i].owner[MAX_USERNAME-1] = '\0';
-        if (files[i].filename[0] == '\0' || files[i].owner[0] == '\0') continue;
-        if (files[i].access_count < 0 || files[i].access_count > MAX_ACCESS_LIST) files[i].access_count = 0;
-        if (files[i].char_count < 0) files[i].char_count = 0;
-        if (files[i].word_count < 0) files[i].word_count = 0;
-        if (files[i].ss_id < 0 || files[i].ss_id >= MAX_SS) files[i].ss_id = 0;
-
-        int exists = 0;
-        for (int j = 0; j < new_count; j++) {
-            if (strcmp(files[j].filename, files[i].filename) == 0) { exists = 1; break; }
-        }
-        if (!exists) {
-            if (i != new_count) {
-                files[new_count] = files[i];
+    for (int i = 0; i < fc; i++) {
+        if (pread(fd, rec, sizeof(*rec), sizeof(int) + (off_t)i * sizeof(*rec)) != (ssize_t)sizeof(*rec)) break;
+        rec->filename[MAX_FILENAME - 1] = '\0';
+        rec->owner[MAX_USERNAME - 1] = '\0';
+        rec->last_accessed_by[MAX_USERNAME - 1] = '\0';
+        if (rec->filename[0] == '\0' || rec->owner[0] == '\0' || file_lookup(rec->filename) != NULL) continue;
+        int slot = file_slot_alloc();
+        if (slot < 0) break;
+        FileMetadata* file = &files[slot];
+        memcpy(file->filename, rec->filename, MAX_FILENAME);
+        file->owner_id = intern_id(&user_names, rec->owner);
+        file->ss_id = rec->ss_id >= 0 && rec->ss_id < max_ss ? rec->ss_id : 0;
+        memcpy(file->ss_ip, rec->ss_ip, INET_ADDRSTRLEN);
+        file->ss_ip[INET_ADDRSTRLEN - 1] = '\0';
+        file->ss_port = rec->ss_port;
+        file->replica_ss_id = rec->replica_ss_id == rec->ss_id ? -1 : rec->replica_ss_id;
+        memcpy(file->replica_ss_ip, rec->replica_ss_ip, INET_ADDRSTRLEN);
+        file->replica_ss_ip[INET_ADDRSTRLEN - 1] = '\0';
+        file->replica_ss_port = rec->replica_ss_port;
+        file->created_time = rec->created_time ? rec->created_time : now;
+        file->modified_time = rec->modified_time ? rec->modified_time : file->created_time;
+        file->accessed_time = rec->accessed_time ? rec->accessed_time : file->modified_time;
+        file->size = rec->size;
+        file->word_count = rec->word_count > 0 ? rec->word_count : 0;
+        file->char_count = rec->char_count > 0 ? rec->char_count : 0;
+        file->last_accessed_by_id = rec->last_accessed_by[0] ? intern_id(&user_names, rec->last_accessed_by) : 0;
+        AccessEntry access[MAX_ACCESS_LIST], pending[MAX_ACCESS_LIST];
+        int na = legacy_acl(rec->access_list, rec->access_count, access);
+        int np = legacy_acl(rec->pending_requests, rec->pending_count, pending);
+        file_acl_set(file, access, na, pending, np);
+
+        trie_insert(file_trie_root, file->filename, file);
+        name_index_put(slot);
+        user_files_add_file(file);
+        if (file->ss_id < ss_count) ss_files_add(&storage_servers[file->ss_id], slot);
+        loaded++;
+    }
+    free(rec);
+
+    // Replica lists; files without one keep replica_ss_id (see file_replicas)
+    for (int i = 0; i < pc; i++) {
+        LegacyPlacement p;
+        if (pread(fd, &p, sizeof(p), pl_pos + sizeof(int) + (off_t)i * sizeof(p)) != (ssize_t)sizeof(p)) break;
+        p.filename[MAX_FILENAME - 1] = '\0';
+        FileMetadata* file = file_lookup(p.filename);
+        if (file == NULL) continue;
+        int n = 0, ids[MAX_REPLICAS - 1];
+        for (int k = 0; k < p.count && k < MAX_REPLICAS - 1; k++) {
+            if (p.ss[k] >= 0 && p.ss[k] < ss_count && p.ss[k] != file->ss_id) ids[n++] = p.ss[k];
+        }
+        set_file_replicas(file, ids, n);
+    }
+    log_message("NM", "INFO", "Read %d file records and %d storage servers from a headerless snapshot", loaded, ss_count);
+    return 0;
+}
+
+// Write up to target, zero-filling the gap since the last section
+static void snapshot_pad(FILE* fp, long* pos, long target) {
+    static const char zeros[256];
+    while (*pos < target) {
+        long n = target - *pos > (long)sizeof(zeros) ? (long)sizeof(zeros) : target - *pos;
+        fwrite(zeros, 1, n, fp);
+        *pos += n;
+    }
+}
+
+static long snapshot_align(long off) { return (off + 7) & ~7L; }
+
+static int snapshot_acl_cap(int count) { return count > 0 ? 1 << acl_class(count) : 0; }
+
+// Startup only: apply the journal to the mapped snapshot.
+// Stops at the first torn or corrupt record and cuts the journal there.
+static void journal_replay() {
+    int fd = open(JOURNAL_PATH, O_RDWR);
+    if (fd < 0) return;
+    JournalFilePut* r = malloc(JOURNAL_PUT_MAX);
+    if (!r) { close(fd); return; }
+    const AccessEntry* entries = (const AccessEntry*)((char*)r + sizeof(JournalFilePut));
+    off_t good = 0;
+    int applied = 0;
+    JournalHeader h;
+    while (read(fd, &h, sizeof(h)) == (ssize_t)sizeof(h)) {
+        if (h.magic != JOURNAL_MAGIC || h.len <= 0 || h.len > (int)JOURNAL_PUT_MAX) break;
+        if (read(fd, r, h.len) != h.len || journal_sum(r, h.len) != h.sum) break;
+        const char* name = h.type == J_FILE_PUT ? r->meta.filename : (const char*)r;
+        if ((h.type == J_FILE_PUT && (h.len < (int)sizeof(JournalFilePut) ||
+             r->meta.access_count < 0 || r->meta.access_count > MAX_ACCESS_LIST ||
+             r->meta.pending_count < 0 || r->meta.pending_count > MAX_ACCESS_LIST ||
+             h.len != (int)(sizeof(JournalFilePut) + (r->meta.access_count + r->meta.pending_count) * sizeof(AccessEntry)))) ||
+            (h.type == J_FILE_DEL && h.len != MAX_FILENAME) || (h.type == J_USER && h.len != MAX_USERNAME) ||
+            (h.type != J_FILE_PUT && h.type != J_FILE_DEL && h.type != J_USER)) break;
+        if (memchr(name, '\0', h.type == J_USER ? MAX_USERNAME : MAX_FILENAME) == NULL) break;
+        good += sizeof(h) + h.len;
+        applied++;
+        if (h.type == J_USER) {
+            intern_id(&user_names, name);
+            continue;
+        }
+
+        if (h.type == J_FILE_DEL) {
+            purge_file_metadata(name);   // not journaled again: the journal opens after replay
+            continue;
+        }
+        FileMetadata* file = file_lookup(name);
+        int idx;
+        if (file != NULL) {
+            idx = (int)(file - files);
+            user_files_remove_file(file);
+            ss_files_remove(idx);
+            file_acl_release(file);
+        } else {
+            idx = file_slot_alloc();
+            if (idx < 0) continue;
+        }
+        placement_forget(name);
+        files[idx] = r->meta;
+        file_acl_set(&files[idx], entries, r->meta.access_count,
+                     entries + r->meta.access_count, r->meta.pending_count);
+        if (files[idx].ss_id < 0 || files[idx].ss_id >= max_ss) files[idx].ss_id = 0;
+        int n = 0, ids[MAX_REPLICAS - 1];
+        for (int k = 0; k < r->replica_count && k < MAX_REPLICAS - 1; k++) {
+            if (r->replicas[k] >= 0 && r->replicas[k] < ss_count) ids[n++] = r->replicas[k];
+        }
+        if (n > 0) set_file_replicas(&files[idx], ids, n);
+        if (file == NULL) {
+            trie_insert(file_trie_root, files[idx].filename, &files[idx]);
+            name_index_put(idx);
+        }
+        user_files_add_file(&files[idx]);
+        if (files[idx].ss_id < ss_count) ss_files_add(&storage_servers[files[idx].ss_id], idx);
+    }
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (end != good) {
+        log_message("NM", "WARN", "Journal has %ld trailing bytes after the last good record; discarding", (long)(end - good));
+        if (ftruncate(fd, good) != 0) log_message("NM", "ERROR", "Failed to truncate journal");
+    }
+    free(r);
+    close(fd);
+    journal_bytes = good;
+    if (applied > 0) log_message("NM", "INFO", "Replayed %d journal records", applied);
+}
+
+static void journal_open() {
+    journal_fsync = get_env_int("NM_JOURNAL_FSYNC", 1);
+    journal_max_bytes = (long)get_env_int("NM_JOURNAL_MAX_KB", 4096) * 1024;
+    int fd = open(JOURNAL_PATH, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) {
+        log_message("NM", "ERROR", "Failed to open journal; metadata changes fall back to snapshots");
+        return;
+    }
+    pthread_mutex_lock(&journal_lock);
+    journal_fd = fd;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+void load_persistent_data() {
+    long long t0 = now_us();
+    int upgraded = 0;
+    int fd = open("nm_data.dat", O_RDONLY);
+    if (fd < 0) {
+        log_message("NM", "INFO", "No persistent data found, starting fresh");
+    } else {
+        SnapshotHeader h;
+        struct stat jst;
+        int headerless = pread(fd, &h, sizeof(h.magic), 0) == (ssize_t)sizeof(h.magic) && h.magic != SNAPSHOT_MAGIC;
+        // Journals only exist alongside versioned snapshots: one next to a headerless
+        // file was written in another record layout and cannot be replayed over it
+        int journal_empty = stat(JOURNAL_PATH, &jst) != 0 || jst.st_size == 0;
+        if (headerless && journal_empty && snapshot_load_legacy(fd) == 0) {
+            upgraded = 1;
+        } else if (headerless || snapshot_map(fd) != 0) {
+            // Starting empty would let the journal replay cut nm_journal.log and the first
+            // checkpoint replace nm_data.dat, losing every file record: stop with both untouched
+            if (headerless && !journal_empty) {
+                log_message("NM", "ERROR", "nm_data.dat has no version header but nm_journal.log is not empty; cannot upgrade it");
+            } else if (!headerless && pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) && h.version != SNAPSHOT_VERSION) {
+                log_message("NM", "ERROR", "nm_data.dat is a version %d snapshot; this Name Server reads version %d and headerless ones",
+                            h.version, SNAPSHOT_VERSION);
+            } else {
+                log_message("NM", "ERROR", "nm_data.dat is not a usable version %d snapshot", SNAPSHOT_VERSION);
             }
-            // Initialize any zero timestamps (legacy persisted entries) to current time
-            if (files[new_count].created_time == 0) files[new_count].created_time = now;
-            if (files[new_count].modified_time == 0) files[new_count].modified_time = files[new_count].created_time;
-            if (files[new_count].accessed_time == 0) files[new_count].accessed_time = files[new_count].modified_time;
-            trie_insert(file_trie_root, files[new_count].filename, &files[new_count]);
-            new_count++;
+            log_message("NM", "ERROR", "Refusing to start. nm_data.dat and nm_journal.log are left as they are; move them aside to start empty");
+            exit(EXIT_FAILURE);
         }
+        close(fd);
+    }
+    if (name_index == NULL && name_index_resize(1024) != 0) {
+        log_message("NM", "ERROR", "Failed to allocate the name index");
+    }
+    files_unindexed_end = upgraded ? 0 : file_count;   // upgraded records are linked already
+    files_indexed = file_count == 0;
+
+    // Changes made since that snapshot
+    journal_replay();
+    journal_open();
+
+    if (!files_indexed) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, file_index_builder, NULL) == 0) {
+            pthread_detach(t);
+        } else {
+            for (int i = 0; i < files_unindexed_end; i++) file_ready(i);
+            files_indexed = 1;
+        }
+    }
+    log_message("NM", "INFO", "%s %d file records and %d storage servers from persistent storage in %.1f ms",
+                upgraded ? "Loaded" : "Mapped", file_count, ss_count, (now_us() - t0) / 1000.0);
+
+    if (upgraded) {
+        // Keep the original for a downgrade, then write it out in the current layout
+        if (link("nm_data.dat", "nm_data.dat.old") != 0 && errno != EEXIST) {
+            log_message("NM", "ERROR", "Failed to keep the headerless snapshot as nm_data.dat.old; refusing to replace it");
+            exit(EXIT_FAILURE);
+        }
+        save_persistent_data();
+        log_message("NM", "INFO", "Upgraded nm_data.dat to a version %d snapshot; the original is in nm_data.dat.old", SNAPSHOT_VERSION);
     }
-    file_count = new_count;
-    
-    fclose(fp);
-    log_message("NM", "INFO", "Loaded %d files and %d storage servers from persistent storage", file_count, ss_count);
 }
 
+// nm_lock held. Checkpoint: write the whole state to a fresh snapshot, swap it in, then empty
+// the journal. The running process keeps using the old file's mapping until it restarts.
 void save_persistent_data() {
-    FILE* fp = fopen("nm_data.dat", "wb");
+    // Records are written from memory, so the mapped ones must be linked first
+    for (int i = 0; i < files_unindexed_end; i++) file_ready(i);
+
+    SnapshotHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SNAPSHOT_MAGIC;
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.ss_count = ss_count;
+    hdr.user_count = user_names.count;
+    for (int i = 0; i < file_count; i++) {   // emptied slots are left out
+        if (files[i].filename[0] == '\0') continue;
+        hdr.file_count++;
+        hdr.acl_bytes += (long)(snapshot_acl_cap(files[i].access_count) + snapshot_acl_cap(files[i].pending_count)) * sizeof(AccessEntry);
+    }
+    hdr.index_cap = 1024;
+    while (hdr.index_cap < 2 * hdr.file_count) hdr.index_cap *= 2;
+    hdr.records_off = sysconf(_SC_PAGESIZE);
+    hdr.replicas_off = snapshot_align(hdr.records_off + (long)(hdr.file_count * sizeof(FileMetadata)));
+    hdr.acl_off = snapshot_align(hdr.replicas_off + (long)(hdr.file_count * MAX_REPLICAS * sizeof(int)));
+    hdr.index_off = snapshot_align(hdr.acl_off + hdr.acl_bytes);
+    hdr.ss_off = snapshot_align(hdr.index_off + (long)(hdr.index_cap * sizeof(int)));
+    hdr.users_off = snapshot_align(hdr.ss_off + (long)(hdr.ss_count * sizeof(StorageServerInfo)));
+    hdr.total_size = hdr.users_off + (long)hdr.user_count * MAX_USERNAME;
+
+    int* index = malloc((size_t)hdr.index_cap * sizeof(int));
+    if (index == NULL) {
+        log_message("NM", "ERROR", "Failed to save persistent data");
+        return;
+    }
+    memset(index, 0xff, (size_t)hdr.index_cap * sizeof(int));   // NAME_INDEX_EMPTY
+
+    pthread_mutex_lock(&journal_lock);
+    FILE* fp = fopen("nm_data.dat.tmp", "wb");
     if (fp == NULL) {
+        pthread_mutex_unlock(&journal_lock);
+        free(index);
         log_message("NM", "ERROR", "Failed to save persistent data");
         return;
     }
+
+    long pos = 0;
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    pos += sizeof(hdr);
+    snapshot_pad(fp, &pos, hdr.records_off);
+    long acl_next = hdr.acl_off;
+    int n = 0;
+    for (int i = 0; i < file_count; i++) {
+        if (files[i].filename[0] == '\0') continue;
+        FileMetadata rec = files[i];
+        rec.access_cap = snapshot_acl_cap(rec.access_count);
+        rec.access_list = rec.access_cap ? (AccessEntry*)(uintptr_t)acl_next : NULL;
+        acl_next += rec.access_cap * sizeof(AccessEntry);
+        rec.pending_cap = snapshot_acl_cap(rec.pending_count);
+        rec.pending_requests = rec.pending_cap ? (AccessEntry*)(uintptr_t)acl_next : NULL;
+        acl_next += rec.pending_cap * sizeof(AccessEntry);
+        fwrite(&rec, sizeof(FileMetadata), 1, fp);
+        unsigned int j = hash_string(rec.filename) & (hdr.index_cap - 1);
+        while (index[j] != NAME_INDEX_EMPTY) j = (j + 1) & (hdr.index_cap - 1);
+        index[j] = n++;
+    }
+    pos += (long)(hdr.file_count * sizeof(FileMetadata));
+    snapshot_pad(fp, &pos, hdr.replicas_off);
+    for (int i = 0; i < file_count; i++) {
+        if (files[i].filename[0] == '\0') continue;
+        int rep[MAX_REPLICAS] = {0};
+        rep[0] = file_replicas(&files[i], rep + 1);
+        fwrite(rep, sizeof(int), MAX_REPLICAS, fp);
+    }
+    pos += (long)(hdr.file_count * MAX_REPLICAS * sizeof(int));
+    snapshot_pad(fp, &pos, hdr.acl_off);
+    for (int i = 0; i < file_count; i++) {
+        if (files[i].filename[0] == '\0') continue;
+        fwrite(files[i].access_list, sizeof(AccessEntry), files[i].access_count, fp);
+        pos += files[i].access_count * sizeof(AccessEntry);
+        snapshot_pad(fp, &pos, pos + (snapshot_acl_cap(files[i].access_count) - files[i].access_count) * sizeof(AccessEntry));
+        fwrite(files[i].pending_requests, sizeof(AccessEntry), files[i].pending_count, fp);
+        pos += files[i].pending_count * sizeof(AccessEntry);
+        snapshot_pad(fp, &pos, pos + (snapshot_acl_cap(files[i].pending_count) - files[i].pending_count) * sizeof(AccessEntry));
+    }
+    snapshot_pad(fp, &pos, hdr.index_off);
+    fwrite(index, sizeof(int), hdr.index_cap, fp);
+    pos += (long)(hdr.index_cap * sizeof(int));
+    free(index);
+    snapshot_pad(fp, &pos, hdr.ss_off);
+    for (int s = 0; s < ss_count; s++) {
+        StorageServerInfo rec = storage_servers[s];
+        rec.files = NULL; rec.files_cap = 0; rec.file_count = 0;   // rebuilt from the records at load
+        fwrite(&rec, sizeof(StorageServerInfo), 1, fp);
+    }
+    pos += (long)(hdr.ss_count * sizeof(StorageServerInfo));
+    snapshot_pad(fp, &pos, hdr.users_off);
+    for (int id = 1; id <= hdr.user_count; id++) {
+        char name[MAX_USERNAME];
+        memset(name, 0, sizeof(name));
+        strncpy(name, user_name(id), sizeof(name) - 1);
+        fwrite(name, MAX_USERNAME, 1, fp);
+    }
     
-    fwrite(&file_count, sizeof(int), 1, fp);
-    fwrite(files, sizeof(FileMetadata), file_count, fp);
-    fwrite(&ss_count, sizeof(int), 1, fp);
-    fwrite(storage_servers, sizeof(StorageServerInfo), ss_count, fp);
-    
+    int ok = fflush(fp) == 0 && !ferror(fp);
+    if (ok && journal_fsync) fsync(fileno(fp));
     fclose(fp);
+    if (ok && rename("nm_data.dat.tmp", "nm_data.dat") == 0) {
+        if (journal_fd >= 0 && ftruncate(journal_fd, 0) == 0) {
+            journal_bytes = 0;
+            journal_dirty = 0;
+        }
+        standby_ship_snapshot();
+    } else {
+        log_message("NM", "ERROR", "Failed to save persistent data");
+    }
+    pthread_mutex_unlock(&journal_lock);
 }
 
-// Connect to SS (NM port) and check if file exists by attempting a lightweight READ
-// Returns: 1 = exists, 0 = not found (purge candidate), -1 = SS unreachable/error
-static int ss_file_exists(FileMetadata* file) {
-    if (file == NULL) return 0;
-    int tried_replica = 0;
-    int which_ss = file->ss_id;
-    if (which_ss < 0 || which_ss >= ss_count) return -1;
-retry_probe:
-    StorageServerInfo* ss = &storage_servers[which_ss];
-
-    int ss_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (ss_sock < 0) return -1;
+// OP_NM_FOLLOW: queue the state as it stands for the standby, then send it its frames on
+// this connection's thread until it goes away or is dropped
+void handle_standby_follow(int client_sock, Message* msg) {
+    char ip[INET_ADDRSTRLEN] = "";
+    int port = 0;
+    sscanf(msg->data, "%15s %d", ip, &port);
+    struct timeval tv = { 2, 0 };
+    setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    standby_queue_max = (long)get_env_int("NM_STANDBY_QUEUE_MB", 64) * 1024 * 1024;
 
-    struct sockaddr_in ss_addr;
-    ss_addr.sin_family = AF_INET;
-    ss_addr.sin_port = htons(ss->nm_port);
-    if (inet_pton(AF_INET, ss->ip, &ss_addr.sin_addr) != 1) {
-        close(ss_sock);
-        return -1;
+    Standby* sb = calloc(1, sizeof(Standby));
+    pthread_mutex_lock(&journal_lock);
+    int full = standby_count == MAX_STANDBYS;
+    pthread_mutex_unlock(&journal_lock);
+    if (sb == NULL || full) {
+        free(sb);
+        msg->error_code = ERR_SERVER_ERROR;
+        strcpy(msg->error_msg, "Too many standbys");
+        send_message(client_sock, msg);
+        return;
+    }
+    msg->error_code = ERR_SUCCESS;
+    if (send_message(client_sock, msg) < 0) {
+        free(sb);
+        return;
     }
-    // Set a short timeout to avoid blocking VIEW if SS is down
-    struct timeval tv; tv.tv_sec = 0; tv.tv_usec = 300000; // 300ms
-    setsockopt(ss_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    setsockopt(ss_sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    sb->sock = client_sock;
+    snprintf(sb->addr, sizeof(sb->addr), "%s:%d", ip, port);
+    pthread_cond_init(&sb->cond, NULL);
 
-    if (connect(ss_sock, (struct sockaddr*)&ss_addr, sizeof(ss_addr)) < 0) {
-        close(ss_sock);
-        // if primary failed and replica exists, probe replica
-        if (!tried_replica && file->replica_ss_id >= 0 && file->replica_ss_id < ss_count) {
-            tried_replica = 1; which_ss = file->replica_ss_id; goto retry_probe;
+    pthread_mutex_lock(&journal_lock);
+    if (standby_count == MAX_STANDBYS) {
+        sb->dropped = 1;
+    } else {
+        standbys[standby_count++] = sb;
+        standby_queue(sb, ship_frame_file("nm_data.dat"));
+        // The journal as it stands is copied now: a checkpoint may empty the file before it is sent
+        ShipFrame* jf = ship_frame_file(JOURNAL_PATH);
+        if (jf && jf->fd >= 0 && jf->len > 0) {
+            ShipFrame* copy = malloc(sizeof(ShipFrame) + jf->len);
+            if (copy && pread(jf->fd, copy->data, jf->len, 0) == jf->len) {
+                copy->type = SHIP_JOURNAL; copy->fd = -1; copy->len = jf->len;
+            } else {
+                free(copy);
+                copy = NULL;
+            }
+            ship_frame_free(jf);
+            jf = copy;
+        } else if (jf) {
+            if (jf->fd >= 0) close(jf->fd);
+            jf->type = SHIP_JOURNAL; jf->fd = -1; jf->len = 0;
         }
-        return -1;
+        standby_queue(sb, jf);
     }
+    pthread_mutex_unlock(&journal_lock);
+    log_message("NM", "INFO", "Standby %s is following", sb->addr);
 
-    Message m; memset(&m, 0, sizeof(m));
-    m.op_code = OP_READ; // SS NM listener supports OP_READ
-    strncpy(m.filename, file->filename, sizeof(m.filename)-1);
-    strncpy(m.username, "NM", sizeof(m.username)-1);
-    send_message(ss_sock, &m);
-    if (receive_message(ss_sock, &m) <= 0) { close(ss_sock); return -1; }
-    close(ss_sock);
+    pthread_mutex_lock(&journal_lock);
+    while (!sb->dropped) {
+        if (sb->head == NULL) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            if (pthread_cond_timedwait(&sb->cond, &journal_lock, &ts) == ETIMEDOUT && sb->head == NULL && !sb->dropped) {
+                pthread_mutex_unlock(&journal_lock);
+                ShipHeader ping = { SHIP_MAGIC, SHIP_PING, 0 };
+                int rc = send_all(client_sock, &ping, sizeof(ping), MSG_NOSIGNAL);
+                pthread_mutex_lock(&journal_lock);
+                if (rc != 0) break;
+            }
+            continue;
+        }
+        ShipFrame* f = sb->head;
+        sb->head = f->next;
+        if (sb->head == NULL) sb->tail = NULL;
+        if (f->type == SHIP_JOURNAL) sb->queued -= f->len;
+        pthread_mutex_unlock(&journal_lock);
+        int rc = ship_frame_send(client_sock, f);
+        ship_frame_free(f);
+        pthread_mutex_lock(&journal_lock);
+        if (rc != 0) break;
+    }
+    for (int i = 0; i < standby_count; i++) {
+        if (standbys[i] == sb) {
+            standbys[i] = standbys[--standby_count];
+            break;
+        }
+    }
+    while (sb->head) {
+        ShipFrame* f = sb->head;
+        sb->head = f->next;
+        ship_frame_free(f);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    log_message("NM", "INFO", "Standby %s disconnected", sb->addr);
+    shutdown(client_sock, SHUT_RDWR);   // so the connection's reader stops too
+    pthread_cond_destroy(&sb->cond);
+    free(sb);
+}
 
-    if (m.error_code == ERR_SUCCESS) {
-        // Update metadata counts opportunistically using returned content
-        // Count chars and words in m.data
-        int chars = (int)strlen(m.data);
-        int words = 0; int inw = 0;
-        for (int i=0; i<chars; i++) {
-            if (!isspace((unsigned char)m.data[i])) { if (!inw) { words++; inw=1; } }
-            else { inw=0; }
-        }
-        file->char_count = chars;
-        file->word_count = words;
-        return 1;
+// Copy len bytes from the stream into fd
+static int standby_recv_file(int sock, int fd, long len) {
+    char buf[65536];
+    while (len > 0) {
+        size_t n = len < (long)sizeof(buf) ? (size_t)len : sizeof(buf);
+        if (recv_all(sock, buf, n) != 0 || write(fd, buf, n) != (ssize_t)n) return -1;
+        len -= n;
     }
-    if (m.error_code == ERR_FILE_NOT_FOUND) return 0;
-    return -1;
+    return 0;
 }
 
-// Remove all traces of a filename from NM memory (trie, arrays, SS lists) and reset cache
-static void purge_file_metadata(const char* filename) {
-    if (filename == NULL || filename[0] == '\0') return;
+static int standby_recv_to(int sock, const char* path, long len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    int rc = standby_recv_file(sock, fd, len);
+    if (rc == 0 && fsync(fd) != 0) rc = -1;
+    close(fd);
+    return rc;
+}
 
-    // Remove from trie (primary index) — safe even if not present
-    trie_delete(file_trie_root, filename);
+// Put a received snapshot (len 0: the primary has none) in place of nm_data.dat
+static int standby_install_snapshot(long len) {
+    if (len > 0) return rename("nm_data.dat.tmp", "nm_data.dat");
+    unlink("nm_data.dat.tmp");
+    return unlink("nm_data.dat") == 0 || errno == ENOENT ? 0 : -1;
+}
 
-    // Remove from ALL SS file lists (clean up any stale entries)
-    for (int s = 0; s < ss_count; s++) {
-        StorageServerInfo* ssp = &storage_servers[s];
-        for (int i = 0; i < ssp->file_count; i++) {
-            if (strcmp(ssp->files[i], filename) == 0) {
-                for (int j = i; j < ssp->file_count - 1; j++) {
-                    strcpy(ssp->files[j], ssp->files[j + 1]);
-                }
-                ssp->file_count--;
-                i--; // stay at same index after shift
+// Apply one connection's stream to the local files. The first snapshot and journal replace
+// the local ones together, once both have arrived; *synced is set from then on.
+static void standby_mirror(int sock, time_t* last_heard, int* synced) {
+    int journal = -1, initial = 1;
+    long initial_snapshot = 0;
+    ShipHeader h;
+    while (recv_all(sock, &h, sizeof(h)) == 0 && h.magic == SHIP_MAGIC && h.len >= 0) {
+        *last_heard = time(NULL);
+        if (h.type == SHIP_SNAPSHOT) {
+            if (standby_recv_to(sock, "nm_data.dat.tmp", h.len) != 0) break;
+            if (initial) {
+                initial_snapshot = h.len;
+                continue;
             }
+            if (journal >= 0) close(journal);
+            journal = -1;
+            if (standby_install_snapshot(h.len) != 0) break;
+            journal = open(JOURNAL_PATH, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+            if (journal < 0) break;
+        } else if (h.type == SHIP_JOURNAL && initial) {
+            if (standby_recv_to(sock, JOURNAL_PATH ".tmp", h.len) != 0 ||
+                standby_install_snapshot(initial_snapshot) != 0 ||
+                rename(JOURNAL_PATH ".tmp", JOURNAL_PATH) != 0) break;
+            journal = open(JOURNAL_PATH, O_WRONLY | O_APPEND);
+            if (journal < 0) break;
+            initial = 0;
+            *synced = 1;
+            log_message("NM", "INFO", "Standby in sync: %ld byte snapshot, %ld byte journal", initial_snapshot, h.len);
+        } else if (h.type == SHIP_JOURNAL) {
+            if (standby_recv_file(sock, journal, h.len) != 0) break;
+        } else if (h.type != SHIP_PING) {
+            break;
         }
     }
+    if (journal >= 0) close(journal);
+}
 
-    // Remove ALL occurrences from files[] and keep array compact
-    int i = 0;
-    while (i < file_count) {
-        if (strcmp(files[i].filename, filename) == 0) {
-            int last = file_count - 1;
-            if (i != last) {
-                char swapped_name[MAX_FILENAME];
-                strcpy(swapped_name, files[last].filename);
-                files[i] = files[last];
-                file_count--;
-                // Update trie pointer for swapped element
-                trie_delete(file_trie_root, swapped_name);
-                trie_insert(file_trie_root, swapped_name, &files[i]);
-                // re-check this index
-            } else {
-                file_count--;
-            }
-        } else {
-            i++;
+// Standby mode: mirror the primary named by NM_STANDBY_OF, and return (so main() starts
+// serving from the mirrored files) once it has been silent for NM_FAILOVER_SEC seconds.
+// A standby that has never completed a sync keeps waiting for the primary instead.
+static void standby_follow(const char* primary, int serve_port) {
+    NmAddrList list;
+    memset(&list, 0, sizeof(list));
+    nm_addrs_parse(&list, primary);
+    if (list.count == 0) {
+        log_message("NM", "ERROR", "NM_STANDBY_OF must be <ip>:<port>; starting as a primary");
+        return;
+    }
+    int failover_sec = get_env_int("NM_FAILOVER_SEC", 3);
+    if (failover_sec < 1) failover_sec = 1;
+    log_message("NM", "INFO", "Standby for %s:%d, taking over after %d s without it",
+                list.addrs[0].ip, list.addrs[0].port, failover_sec);
+
+    int synced = 0;
+    time_t last_heard = time(NULL);
+    while (!synced || time(NULL) - last_heard < failover_sec) {
+        int sock = nm_connect(&list, 0);
+        if (sock < 0) {
+            sleep(1);
+            continue;
         }
+        Message msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.op_code = OP_NM_FOLLOW;
+        char ip[INET_ADDRSTRLEN] = "127.0.0.1";
+        const char* advertise = getenv("NM_ADVERTISE_IP");
+        struct sockaddr_in local;
+        socklen_t local_len = sizeof(local);
+        if (advertise && advertise[0]) {
+            strncpy(ip, advertise, sizeof(ip) - 1);
+        } else if (getsockname(sock, (struct sockaddr*)&local, &local_len) == 0) {
+            inet_ntop(AF_INET, &local.sin_addr, ip, sizeof(ip));
+        }
+        snprintf(msg.data, sizeof(msg.data), "%s %d", ip, serve_port);
+        struct timeval tv = { failover_sec, 0 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (send_message(sock, &msg) > 0 && receive_message(sock, &msg) > 0 && msg.error_code == ERR_SUCCESS) {
+            last_heard = time(NULL);
+            standby_mirror(sock, &last_heard, &synced);
+            log_message("NM", "WARN", "Lost the primary at %s:%d", list.addrs[0].ip, list.addrs[0].port);
+        }
+        close(sock);
+        if (!synced || time(NULL) - last_heard < failover_sec) sleep(1);
     }
+    log_message("NM", "INFO", "Primary silent for %d s; taking over", failover_sec);
+}
+
+// Remove all traces of a filename from NM memory (trie, per-user index, SS list, its slot)
+// and journal the delete. Costs O(name length): cached handles expire with the slot's generation.
+static void purge_file_metadata(const char* filename) {
+    if (filename == NULL || filename[0] == '\0') return;
+    char name[MAX_FILENAME];   // filename may point into the record being freed
+    strncpy(name, filename, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
 
-    // Invalidate search cache (pointers may have moved)
-    cache_size = 0;
+    FileMetadata* file = file_lookup(name);
+    trie_delete(file_trie_root, name);
+    name_index_del(name);
+    replica_state_forget(name);
+    placement_forget(name);
+    if (file) {
+        int slot = (int)(file - files);
+        user_files_remove_file(file);
+        ss_files_remove(slot);
+        file_slot_free(slot);
+    }
 
-    // Persist immediately to avoid stale records after restart
-    save_persistent_data();
+    // Journal it so the record does not come back after a restart
+    journal_file_del(name);
 }
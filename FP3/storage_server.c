@@ -1,35 +1,167 @@
 #include "common.h"
+#include <sys/sendfile.h>
+#include <sys/statvfs.h>
+#include <ctype.h>
+#include <stdarg.h>
 
 // Global variables
-int ss_id = -1;
 char ss_ip[INET_ADDRSTRLEN];
 int nm_port;
 int client_port;
 char storage_dir[MAX_PATH] = "./storage/";
-pthread_mutex_t file_locks[MAX_FILES];
+pthread_mutex_t* file_locks;            // parallel to file_lock_info, in a growable table
 pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
 
 typedef struct {
-    int sentence_number;
-    char locked_by[MAX_USERNAME];
+    char username[MAX_USERNAME];
+    time_t lease_expires;
+} LockHolder;
+
+// One entry of a file's sentence lock table: at most one writer or any number of readers
+typedef struct {
+    int sentence_number;   // -1 marks an empty slot
+    LockHolder writer;     // writer.username[0] == '\0' when not write-locked
+    LockHolder* readers;
+    int reader_count;
+    int reader_cap;
 } SentenceLock;
 
 typedef struct {
     char filename[MAX_FILENAME];
-    SentenceLock sentence_locks[100];  // Support up to 100 locked sentences per file
+    SentenceLock* sentence_locks;  // open-addressed by sentence number (linear probing)
+    int lock_cap;                  // power of two; 0 until the first lock
     int lock_count;
+    // Cached sentence count of the persisted content (guarded by global_lock)
+    int sentence_count;
+    int last_has_delim;
+    int sentence_cache_valid;
+    unsigned long content_gen;
     char undo_content[MAX_CONTENT];
     int has_undo;
+    int hash_next;                 // next entry in the filename index chain
+    int repl_reported;             // last OP_REPL_STATUS sent to the NM: -1 none, 0 stale, 1 in sync (global_lock)
+    // Replicas chosen by the NM (create or OP_SET_REPLICAS); none = use the partner (global_lock)
+    int replica_count;
+    char replica_ip[MAX_REPLICAS - 1][INET_ADDRSTRLEN];
+    int replica_nm_port[MAX_REPLICAS - 1];
+    int frozen;                    // handed to another SS (OP_FREEZE): client edits refused until OP_SET_REPLICAS (file mutex)
+    // Inventory entry reported to the NM (global_lock, see inv_note_locked)
+    int inv_present;               // the file is on disk
+    int inv_words;
+    int inv_chars;
+    unsigned long long inv_hash;   // entry hash XORed into its bucket digest while present
+    // Write batching (guarded by the file's mutex, see write_batch_commit)
+    char* batch_content;           // content including every applied edit; NULL when nothing is pending
+    unsigned long batch_seq;       // edits applied to batch_content
+    unsigned long flushed_seq;     // edits settled by a finished flush, saved or failed
+    unsigned long persisted_seq;   // edits covered by the last successful flush
+    int batch_replicate;           // some pending edit came from a client, not a replication (FLAG_REPL)
+    int flush_active;
+    int writers_inflight;          // writers inside handle_write_file (updated atomically)
+    pthread_cond_t batch_cond;
 } FileLockInfo;
 
-FileLockInfo file_lock_info[MAX_FILES];
+// Shared immutable copy of a file's content (see the content cache)
+typedef struct {
+    int refs;               // the cache's reference plus one per reader
+    size_t len;
+    char data[];            // NUL-terminated content
+} ContentBlob;
+
+// Entries are appended and never move (the tables only grow), up to SS_MAX_FILES
+FileLockInfo* file_lock_info;
 int file_lock_count = 0;
+static GrowTable lock_table, lock_info_table;
+
+// Filename -> file_lock_info index (chained through FileLockInfo.hash_next, guarded by global_lock)
+#define LOCK_INDEX_BUCKETS 16384
+static int lock_index_heads[LOCK_INDEX_BUCKETS];
+
+static int lock_lease_sec = DEFAULT_LOCK_LEASE_SEC;
+
+// Lock manager counters (guarded by stats_lock)
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    unsigned long acquired;
+    unsigned long renewed;
+    unsigned long conflicts;
+    unsigned long expired;
+    unsigned long waits;
+    unsigned long long wait_us;
+} lock_stats;
+
+// Durability of saved file content (see init_durability)
+#define DURABILITY_NONE 0
+#define DURABILITY_FSYNC 1
+#define DURABILITY_GROUP 2
+static int durability_mode = DURABILITY_FSYNC;
+static int group_commit_ms = 5;
+static int wal_max_bytes = 8 * 1024 * 1024;
+static char wal_path[MAX_PATH + 8];
+static int wal_fd = -1;
+static unsigned long wal_bytes = 0;
+static unsigned long wal_appended_lsn = 0;
+static unsigned long wal_durable_lsn = 0;
+static int wal_unapplied = 0;          // durable records whose rename has not happened yet
+static int wal_failed = 0;             // a sync failed: the log is being dropped, saves use fsync
+static unsigned long wal_failed_lsn = 0;  // first record whose writer was told it failed
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_durable_cond = PTHREAD_COND_INITIALIZER;
+static struct {
+    unsigned long saves;
+    unsigned long save_failures;
+    unsigned long group_commits;  // guarded by wal_lock
+    unsigned long group_records;  // guarded by wal_lock
+    unsigned long checkpoints;    // guarded by wal_lock
+} durability_stats;
+
+// How long a flush leader lingers for concurrent edits to the same file (SS_WRITE_BATCH_MS)
+static int write_batch_ms = 2;
+static struct {
+    unsigned long batches;
+    unsigned long edits;
+} write_batch_stats;              // guarded by stats_lock
+
+// Zero-copy READ counters (guarded by stats_lock)
+static struct {
+    unsigned long reads;
+    unsigned long long bytes;
+} raw_read_stats;
+
+// Content cache limits and counters (see content_cache_get)
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t cache_max_bytes = 64 * 1024 * 1024;
+static unsigned long cache_epoch = 0;
+static struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long entries;
+    size_t bytes;
+} cache_stats;                     // guarded by cache_lock
+
+// Name Server and its standbys (NM_ADDRS, and those named at registration), for
+// registration, the control session and the reports the SS sends on its own (OP_REPL_STATUS).
+// With namespace shards there is one per shard (OP_SHARD_MAP), each with its own session
+// and the ID it gave this server; a file's reports go to its own shard.
+typedef struct {
+    NmAddrList addrs;
+    int ss_id;
+    long long boot_id;   // boot id of the NM this server last registered with
+} NmShard;
+static NmShard nm_shards[MAX_NM_SHARDS];
+static int nm_shard_count = 1;
+static pthread_mutex_t nm_addrs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Requests served, sampled by heartbeats into a request rate for placement
+static unsigned long requests_served = 0;
 
 // Replication partner info (provided by NM via OP_SS_ACK)
 static int partner_set = 0;
 static char partner_ip[INET_ADDRSTRLEN];
 static int partner_nm_port = 0;
 static int partner_client_port = 0;
+static int repl_timeout_sec = 5;     // SS_REPL_TIMEOUT_SEC: per-replica connect/send/ack limit
 
 static void mkdir_p_for_path(const char* fullpath) {
     // Create parent directories for fullpath
@@ -39,41 +171,136 @@ static void mkdir_p_for_path(const char* fullpath) {
     }
 }
 
-static void replicate_send(Message* msg) {
-    if (!partner_set) return;
-    Message m = *msg;
-    m.flags |= FLAG_REPL; // mark as replication to avoid loops
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0) return;
-    struct sockaddr_in addr; memset(&addr,0,sizeof(addr));
-    addr.sin_family = AF_INET; addr.sin_port = htons(partner_nm_port);
-    inet_pton(AF_INET, partner_ip, &addr.sin_addr);
-    if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
-        send_message(s, &m);
-        // best-effort, no wait necessary but read response to close cleanly
-        receive_message(s, &m);
+static int lock_index_lookup(const char* filename);
+
+// Where changes to a file are replicated: the replicas the NM placed it with, else the partner.
+// Returns the number of targets.
+static int replica_targets(const char* filename, char ips[][INET_ADDRSTRLEN], int* ports) {
+    int n = 0;
+    pthread_mutex_lock(&global_lock);
+    int idx = lock_index_lookup(filename);
+    if (idx >= 0) {
+        for (n = 0; n < file_lock_info[idx].replica_count; n++) {
+            strcpy(ips[n], file_lock_info[idx].replica_ip[n]);
+            ports[n] = file_lock_info[idx].replica_nm_port[n];
+        }
+    }
+    pthread_mutex_unlock(&global_lock);
+    if (n == 0 && partner_set) {
+        strcpy(ips[0], partner_ip);
+        ports[0] = partner_nm_port;
+        n = 1;
+    }
+    return n;
+}
+
+// Parse "replica <ip> <nm_port> ..." as sent by the NM; returns the number of replicas
+static int parse_replica_list(const char* data, char ips[][INET_ADDRSTRLEN], int* ports) {
+    int n = 0, used = 0;
+    while (n < MAX_REPLICAS - 1 && sscanf(data, " replica %15s %d%n", ips[n], &ports[n], &used) == 2) {
+        data += used;
+        n++;
+    }
+    return n;
+}
+
+// Send to every replica of the file; returns 0 once all of them acknowledged success
+static int replicate_send(Message* msg) {
+    char target_ips[MAX_REPLICAS - 1][INET_ADDRSTRLEN];
+    int target_ports[MAX_REPLICAS - 1];
+    int targets = replica_targets(msg->filename, target_ips, target_ports);
+    if (targets == 0) return -1;
+    int rc = 0;
+    for (int t = 0; t < targets; t++) {
+        Message m = *msg;
+        m.flags |= FLAG_REPL; // mark as replication to avoid loops
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        if (s < 0) { rc = -1; continue; }
+        int acked = 0;
+        // Bounded so two servers replicating to each other's (single-threaded) NM port
+        // cannot wait on each other forever; SO_SNDTIMEO also bounds the connect
+        struct timeval tv = { repl_timeout_sec, 0 };
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        struct sockaddr_in addr; memset(&addr,0,sizeof(addr));
+        addr.sin_family = AF_INET; addr.sin_port = htons(target_ports[t]);
+        inet_pton(AF_INET, target_ips[t], &addr.sin_addr);
+        if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            send_message(s, &m);
+            // Wait for the replica's answer; it tells whether it applied the change
+            if (receive_message(s, &m) > 0 && m.error_code == ERR_SUCCESS) acked = 1;
+        }
+        close(s);
+        if (!acked) rc = -1;
+    }
+    return rc;
+}
+
+// Rewrite the replica lines of a file's .meta, keeping everything else
+static void write_meta_replicas(const char* filename, char ips[][INET_ADDRSTRLEN], const int* ports, int n) {
+    char meta_path[MAX_PATH + MAX_FILENAME + 8];
+    snprintf(meta_path, sizeof(meta_path), "%s%s.meta", storage_dir, filename);
+    char kept[4096] = "";
+    size_t kept_len = 0;
+    FILE* fp = fopen(meta_path, "r");
+    if (fp) {
+        char line[256];
+        while (fgets(line, sizeof(line), fp)) {
+            if (strncmp(line, "replica:", 8) == 0) continue;
+            size_t l = strlen(line);
+            if (kept_len + l < sizeof(kept)) { memcpy(kept + kept_len, line, l + 1); kept_len += l; }
+        }
+        fclose(fp);
     }
-    close(s);
+    fp = fopen(meta_path, "w");
+    if (!fp) return;
+    fputs(kept, fp);
+    for (int i = 0; i < n; i++) fprintf(fp, "replica:%s %d\n", ips[i], ports[i]);
+    fclose(fp);
 }
 
 // Function prototypes
 void* handle_nm_connection(void* arg);
 void* handle_client_request(void* arg);
-void register_with_nm();
+static void* serve_client_connection(void* arg);
+static void nm_shards_load(int sock);
+static int register_with_nm(NmShard* sh, int sock);
+static int nm_open(NmShard* sh);
+static void* nm_session_loop(void* arg);
+static int inventory_sync(NmShard* sh, int sock, int mode, unsigned long since);
 void handle_create_file(Message* msg);
+static int remove_file_durable(const char* filename);
+static int rename_file_durable(const char* from, const char* to);
 void handle_delete_file(Message* msg);
 void handle_read_file(Message* msg);
 void handle_write_file(Message* msg);
 void handle_stream_file(int client_sock, Message* msg);
+void handle_read_raw(int client_sock, Message* msg);
 void handle_undo_file(Message* msg);
+void handle_set_replicas(Message* msg);
+void handle_freeze_file(Message* msg);
 void handle_lock_sentence(Message* msg);
 void handle_unlock_sentence(Message* msg);
 int get_file_lock_info(const char* filename);
-void save_file_content(const char* filename, const char* content);
+int save_file_content(const char* filename, const char* content);
 char* load_file_content(const char* filename);
 void parse_sentences(const char* content, char sentences[][MAX_SENTENCE_LEN], int* sentence_count);
 void reconstruct_content(char sentences[][MAX_SENTENCE_LEN], int sentence_count, char* output);
 void load_storage_files();
+static void init_durability();
+static void init_content_cache();
+static void content_cache_invalidate(const char* filename);
+static void index_update(const char* filename, const char* content);
+static void index_remove(const char* filename);
+static void index_rename(const char* oldname, const char* newname);
+static void handle_search(Message* msg);
+static ContentBlob* content_cache_get(const char* filename);
+static void content_blob_release(ContentBlob* blob);
+static void write_batch_wait_idle(int lock_index);
+static void write_batch_drain(const char* filename);
+static int reject_if_frozen(int lock_index, Message* msg);
+static void report_replication(const char* filename, int in_sync);
+static void format_load_report(char* out, size_t out_len);
 
 // Helper: check if the last non-whitespace character in content is a sentence delimiter
 static int ends_with_delimiter(const char* content) {
@@ -87,6 +314,461 @@ static int ends_with_delimiter(const char* content) {
     return (content[i] == '.' || content[i] == '!' || content[i] == '?') ? 1 : 0;
 }
 
+// Count sentences the same way parse_sentences() splits them, without copying:
+// every delimiter closes a sentence, plus a trailing non-blank remainder.
+static int count_sentences(const char* content) {
+    if (content == NULL) return 0;
+    int count = 0;
+    int pending = 0; // non-blank characters seen since the last delimiter
+    for (int i = 0; content[i] != '\0' && count < 1000; i++) {
+        char c = content[i];
+        if (c == '.' || c == '!' || c == '?') { count++; pending = 0; }
+        else if (c != ' ' && c != '\n' && c != '\t') pending = 1;
+    }
+    if (pending && count < 1000) count++;
+    return count;
+}
+
+// ---- Sentence lock manager ----
+
+static void record_lock_stat(unsigned long* counter) {
+    pthread_mutex_lock(&stats_lock);
+    (*counter)++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Acquire a per-file mutex, accounting the time spent waiting when it is contended
+static void lock_file_mutex(int lock_index) {
+    if (pthread_mutex_trylock(&file_locks[lock_index]) == 0) return;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_mutex_lock(&file_locks[lock_index]);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    long long us = (long long)(t1.tv_sec - t0.tv_sec) * 1000000LL + (t1.tv_nsec - t0.tv_nsec) / 1000;
+    pthread_mutex_lock(&stats_lock);
+    lock_stats.waits++;
+    lock_stats.wait_us += (unsigned long long)(us > 0 ? us : 0);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static int holder_live(const LockHolder* h, time_t now) {
+    return h->username[0] != '\0' && h->lease_expires > now;
+}
+
+static SentenceLock* lock_table_find(FileLockInfo* info, int sentence_number) {
+    if (info->lock_cap == 0) return NULL;
+    int mask = info->lock_cap - 1;
+    for (int i = sentence_number & mask; ; i = (i + 1) & mask) {
+        SentenceLock* sl = &info->sentence_locks[i];
+        if (sl->sentence_number == -1) return NULL;
+        if (sl->sentence_number == sentence_number) return sl;
+    }
+}
+
+static int lock_table_grow(FileLockInfo* info) {
+    int new_cap = info->lock_cap ? info->lock_cap * 2 : 8;
+    SentenceLock* slots = malloc(sizeof(SentenceLock) * new_cap);
+    if (slots == NULL) return -1;
+    for (int i = 0; i < new_cap; i++) {
+        memset(&slots[i], 0, sizeof(SentenceLock));
+        slots[i].sentence_number = -1;
+    }
+    for (int i = 0; i < info->lock_cap; i++) {
+        SentenceLock* old = &info->sentence_locks[i];
+        if (old->sentence_number == -1) continue;
+        int j = old->sentence_number & (new_cap - 1);
+        while (slots[j].sentence_number != -1) j = (j + 1) & (new_cap - 1);
+        slots[j] = *old;
+    }
+    free(info->sentence_locks);
+    info->sentence_locks = slots;
+    info->lock_cap = new_cap;
+    return 0;
+}
+
+static SentenceLock* lock_table_insert(FileLockInfo* info, int sentence_number) {
+    if ((info->lock_count + 1) * 2 > info->lock_cap && lock_table_grow(info) != 0) return NULL;
+    int mask = info->lock_cap - 1;
+    int i = sentence_number & mask;
+    while (info->sentence_locks[i].sentence_number != -1) i = (i + 1) & mask;
+    SentenceLock* sl = &info->sentence_locks[i];
+    memset(sl, 0, sizeof(*sl));
+    sl->sentence_number = sentence_number;
+    info->lock_count++;
+    return sl;
+}
+
+// Remove a slot using backward-shift deletion so probe chains stay intact
+static void lock_table_remove(FileLockInfo* info, SentenceLock* sl) {
+    int mask = info->lock_cap - 1;
+    int hole = (int)(sl - info->sentence_locks);
+    free(info->sentence_locks[hole].readers);
+    int j = hole;
+    while (1) {
+        j = (j + 1) & mask;
+        SentenceLock* cand = &info->sentence_locks[j];
+        if (cand->sentence_number == -1) break;
+        int home = cand->sentence_number & mask;
+        // Move cand into the hole if its home position does not lie in (hole, j]
+        int between = (hole <= j) ? (home > hole && home <= j) : (home > hole || home <= j);
+        if (!between) {
+            info->sentence_locks[hole] = *cand;
+            hole = j;
+        }
+    }
+    memset(&info->sentence_locks[hole], 0, sizeof(SentenceLock));
+    info->sentence_locks[hole].sentence_number = -1;
+    info->lock_count--;
+}
+
+static void lock_table_clear(FileLockInfo* info) {
+    for (int i = 0; i < info->lock_cap; i++) free(info->sentence_locks[i].readers);
+    free(info->sentence_locks);
+    info->sentence_locks = NULL;
+    info->lock_cap = 0;
+    info->lock_count = 0;
+}
+
+// Drop expired holders from a slot; returns the number of leases reclaimed
+static int lock_slot_prune(SentenceLock* sl, time_t now) {
+    int reclaimed = 0;
+    if (sl->writer.username[0] != '\0' && sl->writer.lease_expires <= now) {
+        log_message("SS", "INFO", "Lease expired: sentence %d writer %s", sl->sentence_number, sl->writer.username);
+        sl->writer.username[0] = '\0';
+        reclaimed++;
+    }
+    for (int r = 0; r < sl->reader_count; ) {
+        if (sl->readers[r].lease_expires <= now) {
+            sl->readers[r] = sl->readers[--sl->reader_count];
+            reclaimed++;
+        } else {
+            r++;
+        }
+    }
+    return reclaimed;
+}
+
+static LockHolder* lock_slot_reader(SentenceLock* sl, const char* username) {
+    for (int r = 0; r < sl->reader_count; r++) {
+        if (strcmp(sl->readers[r].username, username) == 0) return &sl->readers[r];
+    }
+    return NULL;
+}
+
+static LockHolder* lock_slot_add_reader(SentenceLock* sl, const char* username) {
+    if (sl->reader_count == sl->reader_cap) {
+        int cap = sl->reader_cap ? sl->reader_cap * 2 : 2;
+        LockHolder* r = realloc(sl->readers, sizeof(LockHolder) * cap);
+        if (r == NULL) return NULL;
+        sl->readers = r;
+        sl->reader_cap = cap;
+    }
+    LockHolder* h = &sl->readers[sl->reader_count++];
+    strncpy(h->username, username, MAX_USERNAME - 1);
+    h->username[MAX_USERNAME - 1] = '\0';
+    return h;
+}
+
+// Prune expired holders and release the slot once nobody holds it
+static void lock_slot_release_if_idle(FileLockInfo* info, SentenceLock* sl, time_t now) {
+    int reclaimed = lock_slot_prune(sl, now);
+    if (reclaimed > 0) {
+        pthread_mutex_lock(&stats_lock);
+        lock_stats.expired += reclaimed;
+        pthread_mutex_unlock(&stats_lock);
+    }
+    if (sl->writer.username[0] == '\0' && sl->reader_count == 0) lock_table_remove(info, sl);
+}
+
+// Record new persisted content for the sentence count cache (caller holds global_lock)
+static void sentence_cache_store(FileLockInfo* info, const char* content) {
+    info->sentence_count = count_sentences(content);
+    info->last_has_delim = ends_with_delimiter(content);
+    info->sentence_cache_valid = 1;
+    info->content_gen++;
+}
+
+static void sentence_cache_invalidate(FileLockInfo* info) {
+    info->sentence_cache_valid = 0;
+    info->content_gen++;
+}
+
+// Fetch the cached sentence count, reading the file only when the cache is cold
+static void sentence_cache_get(int lock_index, int* sentence_count, int* last_has_delim) {
+    FileLockInfo* info = &file_lock_info[lock_index];
+    pthread_mutex_lock(&global_lock);
+    if (info->sentence_cache_valid) {
+        *sentence_count = info->sentence_count;
+        *last_has_delim = info->last_has_delim;
+        pthread_mutex_unlock(&global_lock);
+        return;
+    }
+    unsigned long gen = info->content_gen;
+    pthread_mutex_unlock(&global_lock);
+
+    char* content = load_file_content(info->filename);
+    *sentence_count = count_sentences(content);
+    *last_has_delim = ends_with_delimiter(content);
+
+    pthread_mutex_lock(&global_lock);
+    if (info->content_gen == gen) {
+        info->sentence_count = *sentence_count;
+        info->last_has_delim = *last_has_delim;
+        info->sentence_cache_valid = 1;
+    }
+    pthread_mutex_unlock(&global_lock);
+    free(content);
+}
+
+// Filename index over file_lock_info (caller holds global_lock)
+static int lock_index_lookup(const char* filename) {
+    for (int i = lock_index_heads[hash_string(filename) % LOCK_INDEX_BUCKETS]; i >= 0; i = file_lock_info[i].hash_next) {
+        if (strcmp(file_lock_info[i].filename, filename) == 0) return i;
+    }
+    return -1;
+}
+
+static void lock_index_link(int idx) {
+    unsigned int b = hash_string(file_lock_info[idx].filename) % LOCK_INDEX_BUCKETS;
+    file_lock_info[idx].hash_next = lock_index_heads[b];
+    lock_index_heads[b] = idx;
+}
+
+static void lock_index_unlink(int idx) {
+    unsigned int b = hash_string(file_lock_info[idx].filename) % LOCK_INDEX_BUCKETS;
+    int* link = &lock_index_heads[b];
+    while (*link >= 0) {
+        if (*link == idx) { *link = file_lock_info[idx].hash_next; break; }
+        link = &file_lock_info[*link].hash_next;
+    }
+    file_lock_info[idx].hash_next = -1;
+}
+
+// Find or append the lock entry for filename (caller holds global_lock); -1 when full
+static int add_file_lock_info_locked(const char* filename) {
+    int idx = lock_index_lookup(filename);
+    if (idx >= 0) return idx;
+    if (table_grow(&lock_table, file_lock_count + 1) != 0 ||
+        table_grow(&lock_info_table, file_lock_count + 1) != 0) return -1;
+    idx = file_lock_count;
+    FileLockInfo* info = &file_lock_info[idx];
+    pthread_mutex_init(&file_locks[idx], NULL);
+    pthread_cond_init(&info->batch_cond, NULL);
+    strncpy(info->filename, filename, MAX_FILENAME - 1);
+    info->filename[MAX_FILENAME - 1] = '\0';
+    info->lock_count = 0;
+    info->has_undo = 0;
+    info->repl_reported = -1;
+    info->replica_count = 0;
+    info->frozen = 0;
+    info->inv_present = 0;
+    info->inv_hash = 0;
+    sentence_cache_invalidate(info);
+    lock_index_link(idx);
+    file_lock_count++;
+    return idx;
+}
+
+// Follow a rename so locks, undo and the sentence cache stay attached to the file
+static void rename_file_lock_info(const char* oldname, const char* newname) {
+    pthread_mutex_lock(&global_lock);
+    int idx = lock_index_lookup(oldname);
+    if (idx >= 0 && lock_index_lookup(newname) < 0) {
+        lock_index_unlink(idx);
+        strncpy(file_lock_info[idx].filename, newname, MAX_FILENAME - 1);
+        file_lock_info[idx].filename[MAX_FILENAME - 1] = '\0';
+        lock_index_link(idx);
+    }
+    pthread_mutex_unlock(&global_lock);
+}
+
+// ---- Versioned inventory ----
+// The files this SS holds, with the counts the NM shows, kept for the NM's copy (see
+// nm_session_loop). Every change bumps inv_version and goes in a ring of the last
+// SS_INVENTORY_LOG changes; the NM asks for the changes after the version it has, or,
+// when the ring no longer reaches back that far or either side restarted, compares the
+// INV_BUCKETS bucket digests and fetches only the buckets that differ. inv_epoch is new
+// on every start, since versions restart with it. All guarded by global_lock.
+typedef struct {
+    int present;
+    int words;
+    int chars;
+    char name[MAX_FILENAME];
+} InvChange;
+
+static long long inv_epoch;
+static unsigned long inv_version = 0;
+static unsigned long long inv_digest[INV_BUCKETS];
+static InvChange* inv_log;           // change v is at inv_log[v % inv_log_cap]
+static int inv_log_cap;
+
+static void init_inventory(void) {
+    inv_epoch = ((long long)time(NULL) << 20) ^ getpid();
+    inv_log_cap = get_env_int("SS_INVENTORY_LOG", 4096);
+    if (inv_log_cap < 1) inv_log_cap = 1;
+    inv_log = calloc((size_t)inv_log_cap, sizeof(InvChange));
+    if (inv_log == NULL) {
+        log_message("SS", "ERROR", "Failed to reserve the inventory log");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Record that entry idx is (or is no longer) on disk with the given counts
+static void inv_note_locked(int idx, int present, int words, int chars) {
+    FileLockInfo* info = &file_lock_info[idx];
+    unsigned long long name_hash = inv_name_hash(info->filename);
+    unsigned long long h = present ? inv_entry_hash(name_hash, words, chars) : 0;
+    if (info->inv_present == present && info->inv_hash == h) return;
+    int b = inv_bucket(name_hash);
+    if (info->inv_present) inv_digest[b] ^= info->inv_hash;
+    if (present) inv_digest[b] ^= h;
+    info->inv_present = present;
+    info->inv_words = words;
+    info->inv_chars = chars;
+    info->inv_hash = h;
+
+    InvChange* c = &inv_log[++inv_version % (unsigned long)inv_log_cap];
+    c->present = present;
+    c->words = words;
+    c->chars = chars;
+    strcpy(c->name, info->filename);
+}
+
+static void inv_note_removed(const char* filename) {
+    pthread_mutex_lock(&global_lock);
+    int idx = lock_index_lookup(filename);
+    if (idx >= 0) inv_note_locked(idx, 0, 0, 0);
+    pthread_mutex_unlock(&global_lock);
+}
+
+// A move takes the entry's counts to the new name
+static void inv_note_moved(const char* oldname, const char* newname) {
+    pthread_mutex_lock(&global_lock);
+    int idx = lock_index_lookup(oldname);
+    int words = 0, chars = 0;
+    if (idx >= 0) {
+        words = file_lock_info[idx].inv_words;
+        chars = file_lock_info[idx].inv_chars;
+        inv_note_locked(idx, 0, 0, 0);
+    }
+    pthread_mutex_unlock(&global_lock);
+    rename_file_lock_info(oldname, newname);
+    pthread_mutex_lock(&global_lock);
+    idx = add_file_lock_info_locked(newname);
+    if (idx >= 0) inv_note_locked(idx, 1, words, chars);
+    pthread_mutex_unlock(&global_lock);
+}
+
+// Periodically reclaim expired leases so abandoned locks do not pin memory or block writers
+static void* lock_lease_sweeper(void* arg) {
+    (void)arg;
+    int interval = lock_lease_sec / 4 > 0 ? lock_lease_sec / 4 : 1;
+    while (1) {
+        sleep(interval);
+        time_t now = time(NULL);
+        pthread_mutex_lock(&global_lock);
+        int count = file_lock_count;
+        pthread_mutex_unlock(&global_lock);
+        for (int i = 0; i < count; i++) {
+            if (pthread_mutex_trylock(&file_locks[i]) != 0) continue; // busy: its own requests prune lazily
+            FileLockInfo* info = &file_lock_info[i];
+            int expired[64]; int n = 0;
+            for (int s = 0; s < info->lock_cap && n < 64; s++) {
+                SentenceLock* sl = &info->sentence_locks[s];
+                if (sl->sentence_number == -1) continue;
+                int writer_stale = sl->writer.username[0] != '\0' && sl->writer.lease_expires <= now;
+                int reader_stale = 0;
+                for (int r = 0; r < sl->reader_count; r++) if (sl->readers[r].lease_expires <= now) reader_stale = 1;
+                if (writer_stale || reader_stale) expired[n++] = sl->sentence_number;
+            }
+            for (int k = 0; k < n; k++) {
+                SentenceLock* sl = lock_table_find(info, expired[k]);
+                if (sl) lock_slot_release_if_idle(info, sl, now);
+            }
+            pthread_mutex_unlock(&file_locks[i]);
+        }
+    }
+    return NULL;
+}
+
+// Capacity and load for placement: "<free_mb> <total_mb> <files> <req_per_sec>".
+// The rate covers the interval since the previous report (heartbeats come every few seconds).
+static void format_load_report(char* out, size_t out_len) {
+    static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+    static unsigned long last_count = 0;
+    static struct timespec last_time = { 0, 0 };
+
+    long long free_mb = -1, total_mb = -1;
+    struct statvfs vfs;
+    if (statvfs(storage_dir, &vfs) == 0) {
+        free_mb = (long long)((unsigned long long)vfs.f_bavail * vfs.f_frsize / (1024 * 1024));
+        total_mb = (long long)((unsigned long long)vfs.f_blocks * vfs.f_frsize / (1024 * 1024));
+    }
+
+    pthread_mutex_lock(&global_lock);
+    int files = file_lock_count;
+    pthread_mutex_unlock(&global_lock);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&report_lock);
+    unsigned long count = requests_served;
+    double rate = 0.0;
+    double secs = (double)(now.tv_sec - last_time.tv_sec) + (now.tv_nsec - last_time.tv_nsec) / 1e9;
+    if (last_time.tv_sec != 0 && secs > 0.0) rate = (double)(count - last_count) / secs;
+    last_count = count;
+    last_time = now;
+    pthread_mutex_unlock(&report_lock);
+
+    snprintf(out, out_len, "%lld %lld %d %.2f", free_mb, total_mb, files, rate);
+}
+
+// Human-readable runtime statistics for OP_SS_STATS
+static void format_ss_stats(char* out, size_t out_len) {
+    int active = 0, files = 0;
+    pthread_mutex_lock(&global_lock);
+    files = file_lock_count;
+    for (int i = 0; i < file_lock_count; i++) active += file_lock_info[i].lock_count;
+    pthread_mutex_unlock(&global_lock);
+    pthread_mutex_lock(&wal_lock);
+    unsigned long group_commits = durability_stats.group_commits;
+    unsigned long group_records = durability_stats.group_records;
+    unsigned long checkpoints = durability_stats.checkpoints;
+    pthread_mutex_unlock(&wal_lock);
+    pthread_mutex_lock(&stats_lock);
+    unsigned long long avg_wait = lock_stats.waits ? lock_stats.wait_us / lock_stats.waits : 0;
+    size_t used = snprintf(out, out_len,
+             "files: %d\n"
+             "locks: active=%d acquired=%lu renewed=%lu conflicts=%lu expired=%lu lease=%ds\n"
+             "lock waits: %lu (avg %llu us)\n"
+             "durability: mode=%s saves=%lu failures=%lu group_commits=%lu records_per_commit=%.1f checkpoints=%lu\n",
+             files, active, lock_stats.acquired, lock_stats.renewed, lock_stats.conflicts,
+             lock_stats.expired, lock_lease_sec, lock_stats.waits, avg_wait,
+             durability_mode == DURABILITY_FSYNC ? "fsync" : (durability_mode == DURABILITY_GROUP ? "group" : "none"),
+             durability_stats.saves, durability_stats.save_failures, group_commits,
+             group_commits ? (double)group_records / group_commits : 0.0, checkpoints);
+    if (used < out_len) {
+        snprintf(out + used, out_len - used, "write batches: %lu edits=%lu edits_per_batch=%.1f window=%dms\n",
+                 write_batch_stats.batches, write_batch_stats.edits,
+                 write_batch_stats.batches ? (double)write_batch_stats.edits / write_batch_stats.batches : 0.0,
+                 write_batch_ms);
+    }
+    used = strlen(out);
+    if (used < out_len) {
+        snprintf(out + used, out_len - used, "raw reads: %lu bytes=%llu\n", raw_read_stats.reads, raw_read_stats.bytes);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    pthread_mutex_lock(&cache_lock);
+    used = strlen(out);
+    unsigned long lookups = cache_stats.hits + cache_stats.misses;
+    if (used < out_len) {
+        snprintf(out + used, out_len - used, "content cache: entries=%lu bytes=%zu/%zu hits=%lu misses=%lu hit_ratio=%.1f%% evictions=%lu\n",
+                 cache_stats.entries, cache_stats.bytes, cache_max_bytes, cache_stats.hits, cache_stats.misses,
+                 lookups ? 100.0 * cache_stats.hits / lookups : 0.0, cache_stats.evictions);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
 int main(int argc, char* argv[]) {
     // New usage: ./storage_server [nm_ip] <nm_port> <client_port> <storage_dir>
     // Backwards compatible with old usage lacking nm_ip.
@@ -149,54 +831,63 @@ int main(int argc, char* argv[]) {
         }
     }
     
+    nm_addrs_add(&nm_shards[0].addrs, nm_ip_override, PORT_NM);
+    nm_addrs_parse(&nm_shards[0].addrs, getenv("NM_ADDRS"));
     printf("=== LangOS Storage Server ===\n");
     log_message("SS", "INFO", "Starting Storage Server on %s, ports NM:%d Client:%d", ss_ip, nm_port, client_port);
     
-    // Initialize file locks
-    for (int i = 0; i < MAX_FILES; i++) {
-        pthread_mutex_init(&file_locks[i], NULL);
-        file_lock_info[i].lock_count = 0;
-        file_lock_info[i].has_undo = 0;
+    // Reserve the lock tables; entries are initialised as files are added
+    int max_files = get_env_int("SS_MAX_FILES", DEFAULT_SS_MAX_FILES);
+    if (max_files < 1) max_files = 1;
+    file_locks = table_init(&lock_table, sizeof(pthread_mutex_t), max_files);
+    file_lock_info = table_init(&lock_info_table, sizeof(FileLockInfo), max_files);
+    if (file_locks == NULL || file_lock_info == NULL) {
+        log_message("SS", "ERROR", "Failed to reserve lock tables");
+        exit(EXIT_FAILURE);
     }
+    for (int i = 0; i < LOCK_INDEX_BUCKETS; i++) lock_index_heads[i] = -1;
+    lock_lease_sec = get_env_int("SS_LOCK_LEASE_SEC", DEFAULT_LOCK_LEASE_SEC);
+    if (lock_lease_sec <= 0) lock_lease_sec = DEFAULT_LOCK_LEASE_SEC;
+    write_batch_ms = get_env_int("SS_WRITE_BATCH_MS", 2);
+    if (write_batch_ms < 0) write_batch_ms = 0;
+    repl_timeout_sec = get_env_int("SS_REPL_TIMEOUT_SEC", 5);
+    if (repl_timeout_sec < 1) repl_timeout_sec = 1;
+
+    // Replay any write-ahead log before files are discovered or served
+    init_durability();
+    init_content_cache();
 
     // Populate file_lock_info from existing files in storage_dir so locks and undo work after restarts
+    init_inventory();
     load_storage_files();
     
     // Register with Name Server
-    // Register with Name Server using override IP
-    int sock = create_socket();
-    if (sock < 0) {
-        log_message("SS", "ERROR", "Failed to create socket for NM registration");
-        exit(EXIT_FAILURE);
-    }
-    struct sockaddr_in nm_addr;
-    nm_addr.sin_family = AF_INET;
-    nm_addr.sin_port = htons(PORT_NM);
-    if (inet_pton(AF_INET, nm_ip_override, &nm_addr.sin_addr) != 1) {
+    if (nm_shards[0].addrs.count == 0) {
         log_message("SS", "ERROR", "Invalid NM IP: %s", nm_ip_override);
         exit(EXIT_FAILURE);
     }
-    if (connect(sock, (struct sockaddr*)&nm_addr, sizeof(nm_addr)) < 0) {
+    int sock = nm_open(&nm_shards[0]);
+    if (sock < 0) {
         perror("Failed to connect to Name Server");
         log_message("SS", "ERROR", "Failed to connect to Name Server at %s:%d", nm_ip_override, PORT_NM);
         exit(EXIT_FAILURE);
     }
-    Message regmsg; memset(&regmsg, 0, sizeof(regmsg));
-    regmsg.op_code = OP_REGISTER_SS;
-    sprintf(regmsg.data, "%s %d %d", ss_ip, nm_port, client_port);
-    send_message(sock, &regmsg);
-    receive_message(sock, &regmsg);
-    if (regmsg.error_code == ERR_SUCCESS) {
-        ss_id = atoi(regmsg.data);
-        log_message("SS", "INFO", "Registered with NM %s:%d, assigned ID: %d", nm_ip_override, PORT_NM, ss_id);
-    } else {
-        log_message("SS", "ERROR", "NM registration failed: %s", regmsg.error_msg);
-        exit(EXIT_FAILURE);
+    nm_shards_load(sock);
+    for (int i = 0; i < nm_shard_count; i++) {
+        if (i > 0) {
+            close(sock);
+            sock = nm_open(&nm_shards[i]);
+            if (sock < 0) {
+                log_message("SS", "ERROR", "Failed to connect to the Name Server of shard %d", i);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (register_with_nm(&nm_shards[i], sock) != 0) exit(EXIT_FAILURE);
     }
     close(sock);
     
     // Start client listener thread
-    pthread_t nm_thread, client_thread;
+    pthread_t nm_thread, client_thread, sweeper_thread;
     
     int* nm_port_ptr = malloc(sizeof(int));
     *nm_port_ptr = nm_port;
@@ -207,6 +898,15 @@ int main(int argc, char* argv[]) {
     *client_port_ptr = client_port;
     pthread_create(&client_thread, NULL, handle_client_request, client_port_ptr);
     pthread_detach(client_thread);
+
+    pthread_create(&sweeper_thread, NULL, lock_lease_sweeper, NULL);
+    pthread_detach(sweeper_thread);
+
+    for (int i = 0; i < nm_shard_count; i++) {
+        pthread_t session_thread;
+        pthread_create(&session_thread, NULL, nm_session_loop, &nm_shards[i]);
+        pthread_detach(session_thread);
+    }
     
     // Keep running
     while (1) {
@@ -216,9 +916,12 @@ int main(int argc, char* argv[]) {
     return 0;
 }
 
-// Load existing files from storage directory into file_lock_info
-void load_storage_files() {
-    DIR* d = opendir(storage_dir);
+// Load existing files from storage directory into file_lock_info, the search index and the
+// inventory, folders included
+static void load_storage_dir(const char* rel) {
+    char dirpath[MAX_PATH];
+    snprintf(dirpath, sizeof(dirpath), "%s%s", storage_dir, rel);
+    DIR* d = opendir(dirpath);
     if (!d) return;
 
     struct dirent* entry;
@@ -226,26 +929,67 @@ void load_storage_files() {
         // skip . and ..
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
 
+        // Skip the write-ahead log, checkpoints and temp files; temps are leftovers of an interrupted save
+        if (entry->d_name[0] == '.') {
+            if (strstr(entry->d_name, ".tmp.") != NULL) {
+                char tmp_path[MAX_PATH + MAX_FILENAME];
+                snprintf(tmp_path, sizeof(tmp_path), "%s%s", dirpath, entry->d_name);
+                unlink(tmp_path);
+            }
+            continue;
+        }
+
         // Skip metadata files
         size_t len = strlen(entry->d_name);
         if (len > 5 && strcmp(entry->d_name + len - 5, ".meta") == 0) continue;
 
-        // Only add regular files (ignore directories)
+        char name[MAX_FILENAME];
+        if (snprintf(name, sizeof(name), "%s%s", rel, entry->d_name) >= (int)sizeof(name)) continue;
         char path[MAX_PATH];
-        snprintf(path, sizeof(path), "%s%s", storage_dir, entry->d_name);
+        snprintf(path, sizeof(path), "%s%s", storage_dir, name);
         struct stat st;
         if (stat(path, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            char sub[MAX_FILENAME];
+            if (snprintf(sub, sizeof(sub), "%s/", name) < (int)sizeof(sub)) load_storage_dir(sub);
+            continue;
+        }
         if (!S_ISREG(st.st_mode)) continue;
 
+        // Recover the replicas the file was placed with from its .meta
+        char replica_ips[MAX_REPLICAS - 1][INET_ADDRSTRLEN];
+        int replica_ports[MAX_REPLICAS - 1];
+        int replicas = 0;
+        char meta_path[MAX_PATH + MAX_FILENAME + 8];
+        snprintf(meta_path, sizeof(meta_path), "%s%s.meta", storage_dir, name);
+        FILE* mf = fopen(meta_path, "r");
+        if (mf) {
+            char line[256];
+            while (fgets(line, sizeof(line), mf) && replicas < MAX_REPLICAS - 1) {
+                if (sscanf(line, "replica:%15s %d", replica_ips[replicas], &replica_ports[replicas]) == 2) replicas++;
+            }
+            fclose(mf);
+        }
+
+        int words = 0, chars = 0;
+        char* content = load_file_content(name);
+        if (content) {
+            index_update(name, content);
+            count_words_chars(content, &words, &chars);
+            free(content);
+        }
+
         // Add to file_lock_info if space
         pthread_mutex_lock(&global_lock);
-        if (file_lock_count < MAX_FILES) {
-            strncpy(file_lock_info[file_lock_count].filename, entry->d_name, MAX_FILENAME - 1);
-            file_lock_info[file_lock_count].filename[MAX_FILENAME - 1] = '\0';
-            file_lock_info[file_lock_count].lock_count = 0;
-            file_lock_info[file_lock_count].has_undo = 0;
-            file_lock_count++;
-            log_message("SS", "INFO", "Discovered file on startup: %s", entry->d_name);
+        int idx = add_file_lock_info_locked(name);
+        if (idx >= 0) {
+            file_lock_info[idx].replica_count = replicas;
+            for (int i = 0; i < replicas; i++) {
+                strcpy(file_lock_info[idx].replica_ip[i], replica_ips[i]);
+                file_lock_info[idx].replica_nm_port[i] = replica_ports[i];
+            }
+            inv_note_locked(idx, 1, words, chars);
+            log_message("SS", "INFO", "Discovered file on startup: %s", name);
         }
         pthread_mutex_unlock(&global_lock);
     }
@@ -253,8 +997,250 @@ void load_storage_files() {
     closedir(d);
 }
 
-// Legacy register_with_nm retained for compatibility (unused in new main)
-void register_with_nm() { /* Deprecated path now handled inline in main */ }
+void load_storage_files() {
+    load_storage_dir("");
+}
+
+// Connect to the NM, or to a standby that took over when it is gone
+static int nm_open(NmShard* sh) {
+    pthread_mutex_lock(&nm_addrs_lock);
+    int sock = nm_connect(&sh->addrs, 0);
+    pthread_mutex_unlock(&nm_addrs_lock);
+    return sock;
+}
+
+// Ask the configured NM over sock for the shard map. With shards, the others' Name Servers
+// join nm_shards; the configured one keeps its place (and standbys) in the list.
+static void nm_shards_load(int sock) {
+    Message m; memset(&m, 0, sizeof(m));
+    m.op_code = OP_SHARD_MAP;
+    if (send_message(sock, &m) <= 0 || receive_message(sock, &m) <= 0 || m.error_code != ERR_SUCCESS) return;
+    int n = 0, self = 0, used = 0;
+    if (sscanf(m.data, "%d %d %n", &n, &self, &used) < 2 || n < 2) return;
+    NmAddrList list[MAX_NM_SHARDS];
+    if (shard_list_parse(list, m.data + used) != n || self < 0 || self >= n) {
+        log_message("SS", "ERROR", "Malformed shard map from the Name Server: %s", m.data);
+        exit(EXIT_FAILURE);
+    }
+    NmAddrList configured = nm_shards[0].addrs;
+    for (int i = 0; i < n; i++) nm_shards[i].addrs = list[i];
+    nm_shards[self].addrs = configured;
+    nm_shard_count = n;
+    log_message("SS", "INFO", "Namespace has %d shards; registering with each", n);
+}
+
+// Register over sock (at startup, and again whenever the NM restarts or forgets this server).
+// The reply is "<ss_id> <nm_boot_id>" followed by the NM's standbys. Returns 0 on success.
+static int register_with_nm(NmShard* sh, int sock) {
+    Message regmsg; memset(&regmsg, 0, sizeof(regmsg));
+    regmsg.op_code = OP_REGISTER_SS;
+    int reg_len = snprintf(regmsg.data, sizeof(regmsg.data), "%s %d %d ", ss_ip, nm_port, client_port);
+    format_load_report(regmsg.data + reg_len, sizeof(regmsg.data) - reg_len);
+    if (send_message(sock, &regmsg) <= 0 || receive_message(sock, &regmsg) <= 0) {
+        log_message("SS", "ERROR", "NM registration failed: connection lost");
+        return -1;
+    }
+    if (regmsg.error_code != ERR_SUCCESS) {
+        log_message("SS", "ERROR", "NM registration failed: %s", regmsg.error_msg);
+        return -1;
+    }
+    long long boot_id = 0;
+    sscanf(regmsg.data, "%d %lld", &sh->ss_id, &boot_id);
+    sh->boot_id = boot_id;
+    pthread_mutex_lock(&nm_addrs_lock);
+    const NmAddr* nm = &sh->addrs.addrs[sh->addrs.current];
+    log_message("SS", "INFO", "Registered with NM %s:%d, assigned ID: %d", nm->ip, nm->port, sh->ss_id);
+    nm_addrs_parse(&sh->addrs, regmsg.data);
+    pthread_mutex_unlock(&nm_addrs_lock);
+    return 0;
+}
+
+// One OP_SS_INVENTORY exchange; returns the NM's error code, or -1 if the session broke
+static int inventory_send(int sock, Message* m) {
+    m->op_code = OP_SS_INVENTORY;
+    if (send_message(sock, m) <= 0 || receive_message(sock, m) <= 0) return -1;
+    return m->error_code;
+}
+
+// Send text (whole lines) in as many messages as it takes, each headed by header and a last
+// flag that is 1 on the final one. The NM applies each message as it arrives.
+static int inventory_send_lines(int sock, const char* header, const char* text, size_t len) {
+    size_t off = 0;
+    do {
+        Message m; memset(&m, 0, sizeof(m));
+        int head = snprintf(m.data, sizeof(m.data), "%s ", header);
+        size_t room = sizeof(m.data) - (size_t)head - 3;
+        size_t take = 0;
+        while (off + take < len) {   // whole lines only
+            const char* nl = memchr(text + off + take, '\n', len - off - take);
+            size_t line = nl ? (size_t)(nl - (text + off + take)) + 1 : len - off - take;
+            if (take + line > room) break;
+            take += line;
+        }
+        int last = off + take >= len;
+        int n = snprintf(m.data + head, sizeof(m.data) - head, "%d\n", last);
+        memcpy(m.data + head + n, text + off, take);
+        m.data[head + n + take] = '\0';
+        int rc = inventory_send(sock, &m);
+        if (rc != ERR_SUCCESS) return rc;
+        off += take;
+    } while (off < len);
+    return ERR_SUCCESS;
+}
+
+static int inventory_append(char** buf, size_t* len, size_t* cap, const char* fmt, ...) {
+    char line[MAX_FILENAME + 64];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= (int)sizeof(line)) return 0;
+    if (*len + (size_t)n + 1 > *cap) {
+        size_t grown_cap = *cap ? *cap * 2 : 16384;
+        while (*len + (size_t)n + 1 > grown_cap) grown_cap *= 2;
+        char* grown = realloc(*buf, grown_cap);
+        if (grown == NULL) return -1;
+        *buf = grown;
+        *cap = grown_cap;
+    }
+    memcpy(*buf + *len, line, (size_t)n + 1);
+    *len += (size_t)n;
+    return 0;
+}
+
+// Bring the NM's copy of the inventory up to date: the changes after since when the ring
+// still holds them ("C <ss_id> <epoch> <from> <to> <last>" then "+ <words> <chars> <name>"
+// or "- <name>" lines), otherwise the bucket digests ("D <ss_id> <epoch> <version>") and
+// then a listing of each bucket the NM finds different ("B <ss_id> <epoch> <last>" then
+// "<words> <chars> <name>" lines). A listing may be newer than its digests; the NM keeps
+// the digests' version and replays the changes after it, which leaves the same result.
+static int inventory_sync(NmShard* sh, int sock, int mode, unsigned long since) {
+    char* buf = NULL;
+    size_t len = 0, cap = 0;
+    char header[128];
+    int rc = ERR_SUCCESS;
+
+    pthread_mutex_lock(&global_lock);
+    unsigned long version = inv_version;
+    long long epoch = inv_epoch;
+    int have_changes = mode == INV_CHANGES && since <= version &&
+                       version - since <= (unsigned long)inv_log_cap;
+    if (have_changes) {
+        for (unsigned long v = since + 1; v <= version && rc == ERR_SUCCESS; v++) {
+            InvChange* c = &inv_log[v % (unsigned long)inv_log_cap];
+            if (c->present) rc = inventory_append(&buf, &len, &cap, "+ %d %d %s\n", c->words, c->chars, c->name);
+            else rc = inventory_append(&buf, &len, &cap, "- %s\n", c->name);
+        }
+    }
+    unsigned long long digests[INV_BUCKETS];
+    memcpy(digests, inv_digest, sizeof(digests));
+    pthread_mutex_unlock(&global_lock);
+
+    if (have_changes && rc == ERR_SUCCESS) {
+        snprintf(header, sizeof(header), "C %d %lld %lu %lu", sh->ss_id, epoch, since, version);
+        rc = inventory_send_lines(sock, header, buf, len);
+        if (rc != ERR_INVALID_COMMAND) {
+            free(buf);
+            return rc == ERR_SUCCESS ? 0 : -1;
+        }
+        // The NM lost its place: compare digests instead
+    }
+    free(buf);
+    buf = NULL; len = cap = 0;
+    rc = ERR_SUCCESS;
+
+    Message m; memset(&m, 0, sizeof(m));
+    int used = snprintf(m.data, sizeof(m.data), "D %d %lld %lu\n", sh->ss_id, epoch, version);
+    for (int b = 0; b < INV_BUCKETS; b++) used += snprintf(m.data + used, sizeof(m.data) - used, "%llx\n", digests[b]);
+    if (inventory_send(sock, &m) != ERR_SUCCESS) return -1;
+
+    // Reply: "<n> <bucket> ..." for the buckets whose digests differ
+    unsigned long long wanted = 0;
+    const char* p = m.data;
+    int n = 0, consumed = 0;
+    if (sscanf(p, "%d%n", &n, &consumed) != 1 || n <= 0) return 0;
+    p += consumed;
+    for (int i = 0; i < n; i++) {
+        int b;
+        if (sscanf(p, "%d%n", &b, &consumed) != 1) break;
+        p += consumed;
+        if (b >= 0 && b < INV_BUCKETS) wanted |= 1ULL << b;
+    }
+
+    pthread_mutex_lock(&global_lock);
+    for (int i = 0; i < file_lock_count && rc == ERR_SUCCESS; i++) {
+        FileLockInfo* info = &file_lock_info[i];
+        if (!info->inv_present || !(wanted & (1ULL << inv_bucket(inv_name_hash(info->filename))))) continue;
+        rc = inventory_append(&buf, &len, &cap, "%d %d %s\n", info->inv_words, info->inv_chars, info->filename);
+    }
+    pthread_mutex_unlock(&global_lock);
+    if (rc == ERR_SUCCESS) {
+        snprintf(header, sizeof(header), "B %d %lld", sh->ss_id, epoch);
+        rc = inventory_send_lines(sock, header, buf ? buf : "", len);
+    }
+    free(buf);
+    return rc == ERR_SUCCESS ? 0 : -1;
+}
+
+// Control session: one long-lived connection to the NM carrying a heartbeat with the load
+// report every SS_HEARTBEAT_SEC (default 5), so the NM need not probe this server. A lost
+// session is reopened on the next beat, against a standby if the NM is gone; a new NM boot
+// id (a restart or a takeover) or an NM that does not know this server means register again.
+static void* nm_session_loop(void* arg) {
+    NmShard* sh = arg;
+    int interval = get_env_int("SS_HEARTBEAT_SEC", 5);
+    if (interval < 1) interval = 1;
+    int sock = -1;
+    double rtt_ms = 0.0;
+    while (1) {
+        sleep(interval);
+        if (sock < 0) {
+            sock = nm_open(sh);
+            if (sock < 0) continue;
+            struct timeval tv = { 10, 0 };
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        }
+
+        Message m; memset(&m, 0, sizeof(m));
+        m.op_code = OP_SS_HEARTBEAT;
+        pthread_mutex_lock(&global_lock);
+        int len = snprintf(m.data, sizeof(m.data), "%d %s %d %d %d %.3f %lld %lu %llx ", sh->ss_id, ss_ip, nm_port, client_port,
+                           interval, rtt_ms, inv_epoch, inv_version, inv_root(inv_digest));
+        pthread_mutex_unlock(&global_lock);
+        format_load_report(m.data + len, sizeof(m.data) - len);
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (send_message(sock, &m) <= 0 || receive_message(sock, &m) <= 0) {
+            log_message("SS", "WARN", "Lost the NM control session, reconnecting");
+            close(sock);
+            sock = -1;
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        rtt_ms = (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+
+        long long boot_id = 0;
+        int mode = INV_IN_SYNC;
+        unsigned long since = 0;
+        sscanf(m.data, "%lld %d %lu", &boot_id, &mode, &since);
+        if (m.error_code != ERR_SUCCESS || boot_id != sh->boot_id) {
+            log_message("SS", "INFO", "Name Server restarted or lost this server, registering again");
+            if (register_with_nm(sh, sock) != 0) { close(sock); sock = -1; }
+            continue;
+        }
+        pthread_mutex_lock(&nm_addrs_lock);
+        nm_addrs_parse(&sh->addrs, m.data);
+        pthread_mutex_unlock(&nm_addrs_lock);
+
+        if (mode != INV_IN_SYNC && inventory_sync(sh, sock, mode, since) != 0) {
+            log_message("SS", "WARN", "Inventory sync with the NM failed, reconnecting");
+            close(sock);
+            sock = -1;
+        }
+    }
+    return NULL;
+}
 
 void* handle_nm_connection(void* arg) {
     int port = *(int*)arg;
@@ -319,16 +1305,17 @@ void* handle_nm_connection(void* arg) {
                 }
                 case OP_MOVE: {
                     // MOVE from msg.filename to msg.data
-                    char src[MAX_PATH]; snprintf(src, sizeof(src), "%s%s", storage_dir, msg.filename);
-                    char dst[MAX_PATH]; snprintf(dst, sizeof(dst), "%s%s", storage_dir, msg.data);
                     char newpath[MAX_FILENAME]; strncpy(newpath, msg.data, sizeof(newpath)-1); newpath[sizeof(newpath)-1] = '\0';
-                    mkdir_p_for_path(dst);
-                    if (rename(src, dst) == 0) {
+                    write_batch_drain(msg.filename);
+                    if (rename_file_durable(msg.filename, msg.data) == 0) {
                         // Move .meta too (best-effort)
                         char srcm[MAX_PATH]; snprintf(srcm, sizeof(srcm), "%s%s.meta", storage_dir, msg.filename);
                         char dstm[MAX_PATH]; snprintf(dstm, sizeof(dstm), "%s%s.meta", storage_dir, msg.data);
                         mkdir_p_for_path(dstm);
                         rename(srcm, dstm);
+                        inv_note_moved(msg.filename, newpath);
+                        content_cache_invalidate(msg.filename);
+                        index_rename(msg.filename, newpath);
                         // Prepare replication BEFORE overwriting msg.data (need new path)
                         if (!(msg.flags & FLAG_REPL)) {
                             Message rm = msg; rm.op_code = OP_REPL_MOVE; strncpy(rm.data, newpath, sizeof(rm.data)-1); rm.data[sizeof(rm.data)-1]='\0'; replicate_send(&rm);
@@ -354,15 +1341,16 @@ void* handle_nm_connection(void* arg) {
                     break;
                 case OP_REPL_MOVE: {
                     // reuse OP_MOVE logic
-                    char src[MAX_PATH]; snprintf(src, sizeof(src), "%s%s", storage_dir, msg.filename);
-                    char dst[MAX_PATH]; snprintf(dst, sizeof(dst), "%s%s", storage_dir, msg.data);
-                    mkdir_p_for_path(dst);
-                    if (rename(src, dst) == 0) {
+                    write_batch_drain(msg.filename);
+                    if (rename_file_durable(msg.filename, msg.data) == 0) {
                         // Move meta file too
                         char srcm[MAX_PATH]; snprintf(srcm, sizeof(srcm), "%s%s.meta", storage_dir, msg.filename);
                         char dstm[MAX_PATH]; snprintf(dstm, sizeof(dstm), "%s%s.meta", storage_dir, msg.data);
                         mkdir_p_for_path(dstm);
                         rename(srcm, dstm);
+                        inv_note_moved(msg.filename, msg.data);
+                        content_cache_invalidate(msg.filename);
+                        index_rename(msg.filename, msg.data);
                         msg.error_code = ERR_SUCCESS; // Keep destination path in data for potential debugging
                         strncpy(msg.error_msg, "Move successful", sizeof(msg.error_msg)-1);
                     } else { msg.error_code = ERR_SERVER_ERROR; strcpy(msg.error_msg, "Move failed"); }
@@ -376,11 +1364,60 @@ void* handle_nm_connection(void* arg) {
                     break;
                 }
                 case OP_REPL_WRITE: {
-                    // Overwrite content with replicated data
-                    save_file_content(msg.filename, msg.data);
+                    // Overwrite content with replicated data (may be the first copy on this SS)
+                    char path[MAX_PATH + MAX_FILENAME]; snprintf(path, sizeof(path), "%s%s", storage_dir, msg.filename);
+                    mkdir_p_for_path(path);
+                    if (save_file_content(msg.filename, msg.data) != 0) {
+                        msg.error_code = ERR_SERVER_ERROR; strcpy(msg.error_msg, "Failed to persist replicated write");
+                        break;
+                    }
                     msg.error_code = ERR_SUCCESS; strcpy(msg.data, "Replicated");
                     break;
                 }
+                case OP_REPL_CHECKPOINT: {
+                    char* nl = strchr(msg.data, '\n');
+                    if (!nl || nl == msg.data || memchr(msg.data, '/', (size_t)(nl - msg.data))) {
+                        msg.error_code = ERR_INVALID_COMMAND; strcpy(msg.error_msg, "Bad checkpoint");
+                        break;
+                    }
+                    *nl = '\0';
+                    if (nl - msg.data >= MAX_FILENAME) { msg.error_code = ERR_INVALID_COMMAND; strcpy(msg.error_msg, "Bad checkpoint"); break; }
+                    char path[MAX_PATH + 2 * MAX_FILENAME + 16]; snprintf(path, sizeof(path), "%s.checkpoints/%s/%.255s", storage_dir, msg.filename, msg.data);
+                    mkdir_p_for_path(path);
+                    FILE* fp = fopen(path, "w");
+                    if (!fp) { msg.error_code = ERR_SERVER_ERROR; strcpy(msg.error_msg, "Failed to store checkpoint"); break; }
+                    fputs(nl + 1, fp); fclose(fp);
+                    msg.error_code = ERR_SUCCESS; strcpy(msg.data, "Checkpoint stored");
+                    break;
+                }
+                case OP_REPL_UNDO: {
+                    int uidx = get_file_lock_info(msg.filename);
+                    if (uidx < 0) { msg.error_code = ERR_FILE_NOT_FOUND; strcpy(msg.error_msg, "File not found"); break; }
+                    lock_file_mutex(uidx);
+                    memcpy(file_lock_info[uidx].undo_content, msg.data, MAX_CONTENT);
+                    file_lock_info[uidx].undo_content[MAX_CONTENT - 1] = '\0';
+                    file_lock_info[uidx].has_undo = msg.sentence_number != 0;
+                    pthread_mutex_unlock(&file_locks[uidx]);
+                    msg.error_code = ERR_SUCCESS; strcpy(msg.data, "Undo stored");
+                    break;
+                }
+                case OP_SS_STATS:
+                    format_ss_stats(msg.data, sizeof(msg.data));
+                    msg.error_code = ERR_SUCCESS;
+                    break;
+                case OP_HEARTBEAT:
+                    format_load_report(msg.data, sizeof(msg.data));
+                    msg.error_code = ERR_SUCCESS;
+                    break;
+                case OP_SET_REPLICAS:
+                    handle_set_replicas(&msg);
+                    break;
+                case OP_FREEZE:
+                    handle_freeze_file(&msg);
+                    break;
+                case OP_SEARCH:
+                    handle_search(&msg);
+                    break;
                 default:
                     msg.error_code = ERR_INVALID_COMMAND;
                     strcpy(msg.error_msg, "Invalid command from NM");
@@ -396,29 +1433,138 @@ void* handle_nm_connection(void* arg) {
     return NULL;
 }
 
-void* handle_client_request(void* arg) {
-    int port = *(int*)arg;
+// Handle a single client request on a dedicated thread
+static void* serve_client_connection(void* arg) {
+    int client_sock = *(int*)arg;
     free(arg);
     
-    int server_sock = create_socket();
-    if (server_sock < 0) {
-        log_message("SS", "ERROR", "Failed to create client listener socket");
-        return NULL;
-    }
-    
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);
-    int opt = 1;
-    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    
-    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Client bind failed");
-        return NULL;
-    }
-    
-    if (listen(server_sock, 50) < 0) {
+    Message msg;
+    if (receive_message(client_sock, &msg) > 0) {
+        __sync_fetch_and_add(&requests_served, 1);
+        log_request("SS", "client", client_sock, msg.username, "Client operation");
+        
+        switch (msg.op_code) {
+            case OP_READ:
+                if (msg.flags & FLAG_READ_RAW) {
+                    handle_read_raw(client_sock, &msg);
+                    break;
+                }
+                handle_read_file(&msg);
+                send_message(client_sock, &msg);
+                break;
+            case OP_WRITE:
+                handle_write_file(&msg);
+                send_message(client_sock, &msg);
+                break;
+            case OP_STREAM:
+                handle_stream_file(client_sock, &msg);
+                break;
+            case OP_UNDO:
+                handle_undo_file(&msg);
+                send_message(client_sock, &msg);
+                break;
+            case OP_CHECKPOINT: {
+                // data: checkpoint_tag
+                char* content = load_file_content(msg.filename);
+                if (!content) { msg.error_code = ERR_FILE_NOT_FOUND; strcpy(msg.error_msg, "File not found"); send_message(client_sock, &msg); break; }
+                char path[MAX_PATH]; snprintf(path, sizeof(path), "%s.checkpoints/%s/%s", storage_dir, msg.filename, msg.data);
+                mkdir_p_for_path(path);
+                FILE* fp = fopen(path, "w"); if (!fp) { free(content); msg.error_code=ERR_SERVER_ERROR; strcpy(msg.error_msg, "Failed to create checkpoint"); send_message(client_sock,&msg); break; }
+                fprintf(fp, "%s", content); fclose(fp); free(content);
+                msg.error_code = ERR_SUCCESS; strcpy(msg.data, "Checkpoint created"); send_message(client_sock, &msg);
+                break;
+            }
+            case OP_VIEWCHECKPOINT: {
+                // data: checkpoint_tag
+                char path[MAX_PATH]; snprintf(path, sizeof(path), "%s.checkpoints/%s/%s", storage_dir, msg.filename, msg.data);
+                FILE* fp = fopen(path, "r"); if (!fp) { msg.error_code=ERR_FILE_NOT_FOUND; strcpy(msg.error_msg, "Checkpoint not found"); send_message(client_sock,&msg); break; }
+                fseek(fp, 0, SEEK_END); long sz = ftell(fp); fseek(fp, 0, SEEK_SET);
+                char* buf = malloc(sz+1); if (!buf){ fclose(fp); msg.error_code=ERR_SERVER_ERROR; strcpy(msg.error_msg, "OOM"); send_message(client_sock,&msg); break; }
+                fread(buf,1,sz,fp); buf[sz]='\0'; fclose(fp);
+                strncpy(msg.data, buf, sizeof(msg.data)-1); free(buf);
+                msg.error_code = ERR_SUCCESS; send_message(client_sock,&msg);
+                break;
+            }
+            case OP_REVERT: {
+                // data: checkpoint_tag
+                char path[MAX_PATH]; snprintf(path, sizeof(path), "%s.checkpoints/%s/%s", storage_dir, msg.filename, msg.data);
+                FILE* fp = fopen(path, "r"); if (!fp) { msg.error_code=ERR_FILE_NOT_FOUND; strcpy(msg.error_msg, "Checkpoint not found"); send_message(client_sock,&msg); break; }
+                fseek(fp, 0, SEEK_END); long sz = ftell(fp); fseek(fp, 0, SEEK_SET);
+                char* buf = malloc(sz+1); if (!buf){ fclose(fp); msg.error_code=ERR_SERVER_ERROR; strcpy(msg.error_msg, "OOM"); send_message(client_sock,&msg); break; }
+                fread(buf,1,sz,fp); buf[sz]='\0'; fclose(fp);
+                // Let batched edits land first so they cannot overwrite the reverted content
+                int ridx = get_file_lock_info(msg.filename);
+                if (ridx >= 0) {
+                    lock_file_mutex(ridx);
+                    if (reject_if_frozen(ridx, &msg)) { pthread_mutex_unlock(&file_locks[ridx]); free(buf); send_message(client_sock, &msg); break; }
+                    write_batch_wait_idle(ridx);
+                }
+                int rrc = save_file_content(msg.filename, buf);
+                if (ridx >= 0) pthread_mutex_unlock(&file_locks[ridx]);
+                if (rrc != 0) { free(buf); msg.error_code=ERR_SERVER_ERROR; strcpy(msg.error_msg, "Failed to persist revert"); send_message(client_sock,&msg); break; }
+                // Replicate revert as write
+                Message rm = msg; rm.op_code = OP_REPL_WRITE; strncpy(rm.data, buf, sizeof(rm.data)-1);
+                if (!(rm.flags & FLAG_REPL)) report_replication(msg.filename, replicate_send(&rm) == 0 && strlen(buf) < sizeof(rm.data));
+                free(buf);
+                msg.error_code = ERR_SUCCESS; strcpy(msg.data, "Reverted"); send_message(client_sock,&msg);
+                break;
+            }
+            case OP_LISTCHECKPOINTS: {
+                char dirpath[MAX_PATH]; snprintf(dirpath, sizeof(dirpath), "%s.checkpoints/%s", storage_dir, msg.filename);
+                DIR* d = opendir(dirpath);
+                if (!d) { msg.error_code = ERR_SUCCESS; msg.data[0]='\0'; send_message(client_sock,&msg); break; }
+                struct dirent* ent; msg.data[0]='\0';
+                while ((ent = readdir(d)) != NULL) {
+                    if (strcmp(ent->d_name, ".")==0 || strcmp(ent->d_name, "..")==0) continue;
+                    strcat(msg.data, "--> "); strcat(msg.data, ent->d_name); strcat(msg.data, "\n");
+                }
+                closedir(d);
+                msg.error_code = ERR_SUCCESS; send_message(client_sock, &msg);
+                break;
+            }
+            case OP_LOCK_SENTENCE:
+                handle_lock_sentence(&msg);
+                send_message(client_sock, &msg);
+                break;
+            case OP_UNLOCK_SENTENCE:
+                handle_unlock_sentence(&msg);
+                send_message(client_sock, &msg);
+                break;
+            default:
+                msg.error_code = ERR_INVALID_COMMAND;
+                strcpy(msg.error_msg, "Invalid command");
+                send_message(client_sock, &msg);
+                break;
+        }
+    }
+    
+    close(client_sock);
+    return NULL;
+}
+
+void* handle_client_request(void* arg) {
+    int port = *(int*)arg;
+    free(arg);
+    
+    int server_sock = create_socket();
+    if (server_sock < 0) {
+        log_message("SS", "ERROR", "Failed to create client listener socket");
+        return NULL;
+    }
+    
+    struct sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+    int opt = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    
+    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Client bind failed");
+        return NULL;
+    }
+    
+    if (listen(server_sock, 50) < 0) {
         perror("Client listen failed");
         return NULL;
     }
@@ -434,92 +1580,17 @@ void* handle_client_request(void* arg) {
             continue;
         }
         
-        Message msg;
-        if (receive_message(client_sock, &msg) > 0) {
-            log_request("SS", "client", client_sock, msg.username, "Client operation");
-            
-            switch (msg.op_code) {
-                case OP_READ:
-                    handle_read_file(&msg);
-                    send_message(client_sock, &msg);
-                    break;
-                case OP_WRITE:
-                    handle_write_file(&msg);
-                    send_message(client_sock, &msg);
-                    break;
-                case OP_STREAM:
-                    handle_stream_file(client_sock, &msg);
-                    break;
-                case OP_UNDO:
-                    handle_undo_file(&msg);
-                    send_message(client_sock, &msg);
-                    break;
-                case OP_CHECKPOINT: {
-                    // data: checkpoint_tag
-                    char* content = load_file_content(msg.filename);
-                    if (!content) { msg.error_code = ERR_FILE_NOT_FOUND; strcpy(msg.error_msg, "File not found"); send_message(client_sock, &msg); break; }
-                    char path[MAX_PATH]; snprintf(path, sizeof(path), "%s.checkpoints/%s/%s", storage_dir, msg.filename, msg.data);
-                    mkdir_p_for_path(path);
-                    FILE* fp = fopen(path, "w"); if (!fp) { free(content); msg.error_code=ERR_SERVER_ERROR; strcpy(msg.error_msg, "Failed to create checkpoint"); send_message(client_sock,&msg); break; }
-                    fprintf(fp, "%s", content); fclose(fp); free(content);
-                    msg.error_code = ERR_SUCCESS; strcpy(msg.data, "Checkpoint created"); send_message(client_sock, &msg);
-                    break;
-                }
-                case OP_VIEWCHECKPOINT: {
-                    // data: checkpoint_tag
-                    char path[MAX_PATH]; snprintf(path, sizeof(path), "%s.checkpoints/%s/%s", storage_dir, msg.filename, msg.data);
-                    FILE* fp = fopen(path, "r"); if (!fp) { msg.error_code=ERR_FILE_NOT_FOUND; strcpy(msg.error_msg, "Checkpoint not found"); send_message(client_sock,&msg); break; }
-                    fseek(fp, 0, SEEK_END); long sz = ftell(fp); fseek(fp, 0, SEEK_SET);
-                    char* buf = malloc(sz+1); if (!buf){ fclose(fp); msg.error_code=ERR_SERVER_ERROR; strcpy(msg.error_msg, "OOM"); send_message(client_sock,&msg); break; }
-                    fread(buf,1,sz,fp); buf[sz]='\0'; fclose(fp);
-                    strncpy(msg.data, buf, sizeof(msg.data)-1); free(buf);
-                    msg.error_code = ERR_SUCCESS; send_message(client_sock,&msg);
-                    break;
-                }
-                case OP_REVERT: {
-                    // data: checkpoint_tag
-                    char path[MAX_PATH]; snprintf(path, sizeof(path), "%s.checkpoints/%s/%s", storage_dir, msg.filename, msg.data);
-                    FILE* fp = fopen(path, "r"); if (!fp) { msg.error_code=ERR_FILE_NOT_FOUND; strcpy(msg.error_msg, "Checkpoint not found"); send_message(client_sock,&msg); break; }
-                    fseek(fp, 0, SEEK_END); long sz = ftell(fp); fseek(fp, 0, SEEK_SET);
-                    char* buf = malloc(sz+1); if (!buf){ fclose(fp); msg.error_code=ERR_SERVER_ERROR; strcpy(msg.error_msg, "OOM"); send_message(client_sock,&msg); break; }
-                    fread(buf,1,sz,fp); buf[sz]='\0'; fclose(fp);
-                    save_file_content(msg.filename, buf);
-                    // Replicate revert as write
-                    Message rm = msg; rm.op_code = OP_REPL_WRITE; strncpy(rm.data, buf, sizeof(rm.data)-1); if (!(rm.flags & FLAG_REPL)) replicate_send(&rm);
-                    free(buf);
-                    msg.error_code = ERR_SUCCESS; strcpy(msg.data, "Reverted"); send_message(client_sock,&msg);
-                    break;
-                }
-                case OP_LISTCHECKPOINTS: {
-                    char dirpath[MAX_PATH]; snprintf(dirpath, sizeof(dirpath), "%s.checkpoints/%s", storage_dir, msg.filename);
-                    DIR* d = opendir(dirpath);
-                    if (!d) { msg.error_code = ERR_SUCCESS; msg.data[0]='\0'; send_message(client_sock,&msg); break; }
-                    struct dirent* ent; msg.data[0]='\0';
-                    while ((ent = readdir(d)) != NULL) {
-                        if (strcmp(ent->d_name, ".")==0 || strcmp(ent->d_name, "..")==0) continue;
-                        strcat(msg.data, "--> "); strcat(msg.data, ent->d_name); strcat(msg.data, "\n");
-                    }
-                    closedir(d);
-                    msg.error_code = ERR_SUCCESS; send_message(client_sock, &msg);
-                    break;
-                }
-                case OP_LOCK_SENTENCE:
-                    handle_lock_sentence(&msg);
-                    send_message(client_sock, &msg);
-                    break;
-                case OP_UNLOCK_SENTENCE:
-                    handle_unlock_sentence(&msg);
-                    send_message(client_sock, &msg);
-                    break;
-                default:
-                    msg.error_code = ERR_INVALID_COMMAND;
-                    strcpy(msg.error_msg, "Invalid command");
-                    send_message(client_sock, &msg);
-                    break;
-            }
+        // Serve each client connection on its own thread so concurrent edits can be batched
+        int* sock_ptr = malloc(sizeof(int));
+        pthread_t thread;
+        if (sock_ptr == NULL) { close(client_sock); continue; }
+        *sock_ptr = client_sock;
+        if (pthread_create(&thread, NULL, serve_client_connection, sock_ptr) != 0) {
+            close(client_sock);
+            free(sock_ptr);
+        } else {
+            pthread_detach(thread);
         }
-        
-        close(client_sock);
     }
     
     close(server_sock);
@@ -527,33 +1598,39 @@ void* handle_client_request(void* arg) {
 }
 
 void handle_create_file(Message* msg) {
-    char filepath[MAX_PATH];
-    snprintf(filepath, sizeof(filepath), "%s%s", storage_dir, msg->filename);
-    
-    FILE* fp = fopen(filepath, "w");
-    if (fp == NULL) {
+    // The NM names the replicas it placed the file with: data "replica <ip> <nm_port> ..."
+    char replica_ips[MAX_REPLICAS - 1][INET_ADDRSTRLEN];
+    int replica_ports[MAX_REPLICAS - 1];
+    int replicas = (msg->flags & FLAG_REPL) ? 0 : parse_replica_list(msg->data, replica_ips, replica_ports);
+
+    if (save_file_content(msg->filename, "") != 0) {
         msg->error_code = ERR_SERVER_ERROR;
         strcpy(msg->error_msg, "Failed to create file");
         log_message("SS", "ERROR", "Failed to create file: %s", msg->filename);
         return;
     }
     
-    fclose(fp);
-    
     // Create metadata file
     char meta_path[MAX_PATH];
     snprintf(meta_path, sizeof(meta_path), "%s%s.meta", storage_dir, msg->filename);
-    fp = fopen(meta_path, "w");
+    FILE* fp = fopen(meta_path, "w");
     if (fp) {
         fprintf(fp, "created:%ld\n", time(NULL));
+        for (int i = 0; i < replicas; i++) fprintf(fp, "replica:%s %d\n", replica_ips[i], replica_ports[i]);
         fclose(fp);
     }
     
     pthread_mutex_lock(&global_lock);
-    strcpy(file_lock_info[file_lock_count].filename, msg->filename);
-    file_lock_info[file_lock_count].lock_count = 0;
-    file_lock_info[file_lock_count].has_undo = 0;
-    file_lock_count++;
+    int idx = add_file_lock_info_locked(msg->filename);
+    if (idx >= 0) {
+        file_lock_info[idx].has_undo = 0;
+        sentence_cache_store(&file_lock_info[idx], "");
+        file_lock_info[idx].replica_count = replicas;
+        for (int i = 0; i < replicas; i++) {
+            strcpy(file_lock_info[idx].replica_ip[i], replica_ips[i]);
+            file_lock_info[idx].replica_nm_port[i] = replica_ports[i];
+        }
+    }
     pthread_mutex_unlock(&global_lock);
     
     msg->error_code = ERR_SUCCESS;
@@ -567,20 +1644,38 @@ void handle_create_file(Message* msg) {
 }
 
 void handle_delete_file(Message* msg) {
-    char filepath[MAX_PATH];
-    snprintf(filepath, sizeof(filepath), "%s%s", storage_dir, msg->filename);
-    
-    if (unlink(filepath) != 0) {
+    write_batch_drain(msg->filename);
+    if (remove_file_durable(msg->filename) != 0) {
         msg->error_code = ERR_SERVER_ERROR;
         strcpy(msg->error_msg, "Failed to delete file");
         log_message("SS", "ERROR", "Failed to delete file: %s", msg->filename);
         return;
     }
     
+    content_cache_invalidate(msg->filename);
+    index_remove(msg->filename);
+    inv_note_removed(msg->filename);
+
     // Delete metadata
     char meta_path[MAX_PATH];
     snprintf(meta_path, sizeof(meta_path), "%s%s.meta", storage_dir, msg->filename);
     unlink(meta_path);
+
+    // Drop locks, undo and cached sentence count so a re-created file starts clean
+    pthread_mutex_lock(&global_lock);
+    int idx = lock_index_lookup(msg->filename);
+    pthread_mutex_unlock(&global_lock);
+    if (idx >= 0) {
+        lock_file_mutex(idx);
+        lock_table_clear(&file_lock_info[idx]);
+        file_lock_info[idx].has_undo = 0;
+        file_lock_info[idx].frozen = 0;
+        pthread_mutex_lock(&global_lock);
+        file_lock_info[idx].replica_count = 0;
+        sentence_cache_invalidate(&file_lock_info[idx]);
+        pthread_mutex_unlock(&global_lock);
+        pthread_mutex_unlock(&file_locks[idx]);
+    }
     
     msg->error_code = ERR_SUCCESS;
     strcpy(msg->data, "File deleted successfully");
@@ -593,7 +1688,7 @@ void handle_delete_file(Message* msg) {
 }
 
 void handle_read_file(Message* msg) {
-    char* content = load_file_content(msg->filename);
+    ContentBlob* content = content_cache_get(msg->filename);
     
     if (content == NULL) {
         msg->error_code = ERR_FILE_NOT_FOUND;
@@ -601,14 +1696,215 @@ void handle_read_file(Message* msg) {
         return;
     }
     
-    strncpy(msg->data, content, MAX_CONTENT - 1);
-    msg->data[MAX_CONTENT - 1] = '\0';
+    size_t n = content->len < MAX_CONTENT - 1 ? content->len : MAX_CONTENT - 1;
+    memcpy(msg->data, content->data, n);
+    msg->data[n] = '\0';
     msg->error_code = ERR_SUCCESS;
     
-    free(content);
+    content_blob_release(content);
     log_message("SS", "INFO", "File read: %s by %s", msg->filename, msg->username);
 }
 
+// Whole-file READ without the 8 KB Message limit: a RawReadHeader, then the file
+// bytes sendfile()d from the page cache. Saves rename a new file into place, so the
+// descriptor opened here keeps serving one consistent version.
+void handle_read_raw(int client_sock, Message* msg) {
+    RawReadHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+
+    char filepath[MAX_PATH + MAX_FILENAME];
+    snprintf(filepath, sizeof(filepath), "%s%s", storage_dir, msg->filename);
+    int fd = open(filepath, O_RDONLY);
+    struct stat st;
+    // Folders and other non-regular entries have no content to stream
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        hdr.error_code = ERR_FILE_NOT_FOUND;
+        send_all(client_sock, &hdr, sizeof(hdr), 0);
+        return;
+    }
+
+    hdr.error_code = ERR_SUCCESS;
+    hdr.size = (long long)st.st_size;
+    if (send_all(client_sock, &hdr, sizeof(hdr), MSG_MORE) != 0) {
+        close(fd);
+        return;
+    }
+
+    off_t offset = 0;
+    while (offset < st.st_size) {
+        ssize_t sent = sendfile(client_sock, fd, &offset, (size_t)(st.st_size - offset));
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) {
+            log_message("SS", "ERROR", "Raw read of %s aborted after %lld bytes", msg->filename, (long long)offset);
+            break;
+        }
+    }
+    close(fd);
+
+    pthread_mutex_lock(&stats_lock);
+    raw_read_stats.reads++;
+    raw_read_stats.bytes += (unsigned long long)offset;
+    pthread_mutex_unlock(&stats_lock);
+    log_message("SS", "INFO", "File read (raw, %lld bytes): %s by %s", (long long)offset, msg->filename, msg->username);
+}
+
+// ---- Write batching ----
+// Edits to one file are applied to an in-memory copy under the file mutex; the first
+// writer to find no flush running becomes the leader and persists/replicates the copy
+// once for every edit applied so far. The others wait for a flush covering their edit.
+
+// Wait (file mutex held) until no batched edits are pending, so the caller may touch the file directly
+static void write_batch_wait_idle(int lock_index) {
+    FileLockInfo* info = &file_lock_info[lock_index];
+    while (info->flush_active || info->batch_content != NULL) {
+        pthread_cond_wait(&info->batch_cond, &file_locks[lock_index]);
+    }
+}
+
+// Drain pending edits of a file before it is renamed or removed
+static void write_batch_drain(const char* filename) {
+    pthread_mutex_lock(&global_lock);
+    int idx = lock_index_lookup(filename);
+    pthread_mutex_unlock(&global_lock);
+    if (idx < 0) return;
+    lock_file_mutex(idx);
+    write_batch_wait_idle(idx);
+    pthread_mutex_unlock(&file_locks[idx]);
+}
+
+// Tell the NM whether the replicas hold this file's latest content. Only changes are
+// sent; a failed report is retried on the next save. Runs before writers are answered.
+static void report_replication(const char* filename, int in_sync) {
+    pthread_mutex_lock(&global_lock);
+    int idx = lock_index_lookup(filename);
+    int changed = idx >= 0 && file_lock_info[idx].repl_reported != in_sync;
+    pthread_mutex_unlock(&global_lock);
+    if (!changed) return;
+
+    // The NM matches the report against the file's first replica
+    char target_ips[MAX_REPLICAS - 1][INET_ADDRSTRLEN];
+    int target_ports[MAX_REPLICAS - 1];
+    if (replica_targets(filename, target_ips, target_ports) == 0) { strcpy(target_ips[0], "-"); target_ports[0] = 0; }
+
+    Message m;
+    memset(&m, 0, sizeof(m));
+    m.op_code = OP_REPL_STATUS;
+    strncpy(m.filename, filename, sizeof(m.filename) - 1);
+    NmShard* sh = &nm_shards[shard_of(filename, nm_shard_count)];
+    snprintf(m.data, sizeof(m.data), "%d %d %s %d", sh->ss_id, in_sync, target_ips[0], target_ports[0]);
+
+    int ok = 0;
+    int s = nm_open(sh);
+    if (s >= 0) {
+        struct timeval tv = { 2, 0 };
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (send_message(s, &m) > 0 && receive_message(s, &m) > 0 && m.error_code == ERR_SUCCESS) {
+            ok = 1;
+        }
+        close(s);
+    }
+    if (!ok) log_message("SS", "ERROR", "Could not report replication state of %s to NM", filename);
+
+    pthread_mutex_lock(&global_lock);
+    idx = lock_index_lookup(filename);
+    if (idx >= 0) file_lock_info[idx].repl_reported = ok ? in_sync : -1;
+    pthread_mutex_unlock(&global_lock);
+}
+
+// Make edit my_seq durable (file mutex held on entry and exit). Returns 0 once a
+// successful flush covered it, -1 if the flush carrying it failed.
+static int write_batch_commit(int lock_index, unsigned long my_seq) {
+    FileLockInfo* info = &file_lock_info[lock_index];
+    pthread_mutex_t* mutex = &file_locks[lock_index];
+
+    while (info->flushed_seq < my_seq) {
+        if (info->flush_active) {
+            pthread_cond_wait(&info->batch_cond, mutex);
+            continue;
+        }
+        info->flush_active = 1;
+
+        // Only linger when someone else is writing this file; a lone writer pays no delay
+        if (write_batch_ms > 0 && info->writers_inflight > 1) {
+            pthread_mutex_unlock(mutex);
+            usleep(write_batch_ms * 1000);
+            pthread_mutex_lock(mutex);
+        }
+
+        char filename[MAX_FILENAME];
+        strcpy(filename, info->filename);
+        unsigned long seq = info->batch_seq;
+        unsigned long edits = seq - info->flushed_seq;
+        char* snapshot = strdup(info->batch_content);
+        int replicate = info->batch_replicate;
+        info->batch_replicate = 0;
+        pthread_mutex_unlock(mutex);
+
+        int rc = snapshot ? save_file_content(filename, snapshot) : -1;
+        if (rc == 0 && replicate) {
+            // One replication message per batch; its outcome decides whether the replica may serve reads
+            Message rm;
+            memset(&rm, 0, sizeof(rm));
+            rm.op_code = OP_REPL_WRITE;
+            strncpy(rm.filename, filename, sizeof(rm.filename) - 1);
+            strncpy(rm.data, snapshot, sizeof(rm.data) - 1);
+            int acked = replicate_send(&rm) == 0 && strlen(snapshot) < sizeof(rm.data);
+            report_replication(filename, acked);
+        }
+
+        pthread_mutex_lock(mutex);
+        info->flush_active = 0;
+        if (rc == 0) {
+            info->flushed_seq = seq;
+            info->persisted_seq = seq;
+        } else {
+            // Edits applied during the flush were built on the content that failed to
+            // save, so they fail with it: next edits start again from the file on disk
+            info->flushed_seq = info->batch_seq;
+            info->batch_replicate = 0;
+        }
+        if (info->batch_seq == seq || rc != 0) {
+            free(info->batch_content);
+            info->batch_content = NULL;
+            if (rc != 0) {
+                // The count was taken from content that never reached disk: recount from the file
+                pthread_mutex_lock(&global_lock);
+                sentence_cache_invalidate(info);
+                pthread_mutex_unlock(&global_lock);
+            }
+        } else {
+            // Edits applied during the flush are newer than what was just saved
+            pthread_mutex_lock(&global_lock);
+            sentence_cache_store(info, info->batch_content);
+            pthread_mutex_unlock(&global_lock);
+        }
+        pthread_cond_broadcast(&info->batch_cond);
+        free(snapshot);
+
+        pthread_mutex_lock(&stats_lock);
+        write_batch_stats.batches++;
+        write_batch_stats.edits += edits;
+        pthread_mutex_unlock(&stats_lock);
+    }
+    return info->persisted_seq >= my_seq ? 0 : -1;
+}
+
+// File mutex held: refuse a client edit of a file that is being migrated away
+static int reject_if_frozen(int lock_index, Message* msg) {
+    if (!file_lock_info[lock_index].frozen || (msg->flags & FLAG_REPL)) return 0;
+    msg->error_code = ERR_FILE_MOVED;
+    strcpy(msg->error_msg, "File is moving to another storage server; ask the name server again");
+    return 1;
+}
+
+// Leave handle_write_file: drop the file mutex and the in-flight writer count
+static void write_file_unlock(int lock_index) {
+    __sync_fetch_and_sub(&file_lock_info[lock_index].writers_inflight, 1);
+    pthread_mutex_unlock(&file_locks[lock_index]);
+}
+
 void handle_write_file(Message* msg) {
     log_message("SS", "INFO", "WRITE request for %s sentence %d by %s", 
                 msg->filename, msg->sentence_number, msg->username);
@@ -622,12 +1918,16 @@ void handle_write_file(Message* msg) {
         return;
     }
     
-    pthread_mutex_lock(&file_locks[lock_index]);
-    
     FileLockInfo* lock_info = &file_lock_info[lock_index];
+    __sync_fetch_and_add(&lock_info->writers_inflight, 1);
+    lock_file_mutex(lock_index);
+    if (reject_if_frozen(lock_index, msg)) {
+        write_file_unlock(lock_index);
+        return;
+    }
     
-    // Load current content
-    char* content = load_file_content(msg->filename);
+    // Start from the batched content when edits are still being flushed
+    char* content = lock_info->batch_content ? strdup(lock_info->batch_content) : load_file_content(msg->filename);
     int last_has_delim = ends_with_delimiter(content);
     if (content == NULL) {
         log_message("SS", "INFO", "Empty file, creating new content");
@@ -638,7 +1938,7 @@ void handle_write_file(Message* msg) {
         } else {
             msg->error_code = ERR_SERVER_ERROR;
             strcpy(msg->error_msg, "Memory allocation failed");
-            pthread_mutex_unlock(&file_locks[lock_index]);
+            write_file_unlock(lock_index);
             return;
         }
     }
@@ -651,12 +1951,13 @@ void handle_write_file(Message* msg) {
     lock_info->has_undo = 1;
     
     // Parse into sentences (split by sentence delimiters)
-    char (*sentences)[MAX_SENTENCE_LEN] = calloc(1000, sizeof(char[MAX_SENTENCE_LEN]));
+    // (one spare row for an appended sentence)
+    char (*sentences)[MAX_SENTENCE_LEN] = calloc(count_sentences(content) + 1, sizeof(char[MAX_SENTENCE_LEN]));
     if (sentences == NULL) {
         msg->error_code = ERR_SERVER_ERROR;
         strcpy(msg->error_msg, "Memory allocation failed");
         free(content);
-        pthread_mutex_unlock(&file_locks[lock_index]);
+        write_file_unlock(lock_index);
         return;
     }
 
@@ -674,7 +1975,7 @@ void handle_write_file(Message* msg) {
         msg->error_code = ERR_INVALID_INDEX;
         sprintf(msg->error_msg, "Sentence index out of range (0-%d allowed)", sentence_count);
         free(sentences);
-        pthread_mutex_unlock(&file_locks[lock_index]);
+        write_file_unlock(lock_index);
         return;
     }
 
@@ -685,28 +1986,31 @@ void handle_write_file(Message* msg) {
             msg->error_code = ERR_INVALID_INDEX;
             sprintf(msg->error_msg, "Sentence index out of range (0-%d allowed). Terminate previous sentence to add a new one.", sentence_count - 1);
             free(sentences);
-            pthread_mutex_unlock(&file_locks[lock_index]);
+            write_file_unlock(lock_index);
             return;
         }
         sentence_count++;
         sentences[msg->sentence_number][0] = '\0';
     }
 
-    // Verify the sentence is locked by this user
+    // Verify the sentence is write-locked by this user under a live lease; writing renews it
     int has_lock = 0;
-    for (int i = 0; i < lock_info->lock_count; i++) {
-        if (lock_info->sentence_locks[i].sentence_number == msg->sentence_number &&
-            strcmp(lock_info->sentence_locks[i].locked_by, msg->username) == 0) {
+    time_t now = time(NULL);
+    SentenceLock* sl = lock_table_find(lock_info, msg->sentence_number);
+    if (sl && strcmp(sl->writer.username, msg->username) == 0) {
+        if (holder_live(&sl->writer, now)) {
+            sl->writer.lease_expires = now + lock_lease_sec;
             has_lock = 1;
-            break;
+        } else {
+            lock_slot_release_if_idle(lock_info, sl, now);
         }
     }
 
     if (!has_lock) {
         msg->error_code = ERR_SENTENCE_LOCKED;
-        strcpy(msg->error_msg, "Sentence must be locked before writing");
+        strcpy(msg->error_msg, "Sentence must be locked before writing (lock missing or lease expired)");
         free(sentences);
-        pthread_mutex_unlock(&file_locks[lock_index]);
+        write_file_unlock(lock_index);
         log_message("SS", "ERROR", "Write attempt without lock by %s on sentence %d",
                     msg->username, msg->sentence_number);
         return;
@@ -721,7 +2025,7 @@ void handle_write_file(Message* msg) {
         msg->error_code = ERR_SERVER_ERROR;
         strcpy(msg->error_msg, "Memory allocation failed");
         free(sentences);
-        pthread_mutex_unlock(&file_locks[lock_index]);
+        write_file_unlock(lock_index);
         return;
     }
 
@@ -735,7 +2039,7 @@ void handle_write_file(Message* msg) {
             strcpy(msg->error_msg, "Memory allocation failed");
             free(tokens);
             free(sentences);
-            pthread_mutex_unlock(&file_locks[lock_index]);
+            write_file_unlock(lock_index);
             return;
         }
 
@@ -776,7 +2080,7 @@ void handle_write_file(Message* msg) {
         strcpy(msg->error_msg, "Memory allocation failed");
         free(tokens);
         free(sentences);
-        pthread_mutex_unlock(&file_locks[lock_index]);
+        write_file_unlock(lock_index);
         return;
     }
 
@@ -807,7 +2111,7 @@ void handle_write_file(Message* msg) {
             free(data_copy);
             free(tokens);
             free(sentences);
-            pthread_mutex_unlock(&file_locks[lock_index]);
+            write_file_unlock(lock_index);
             return;
         }
 
@@ -817,7 +2121,7 @@ void handle_write_file(Message* msg) {
             free(data_copy);
             free(tokens);
             free(sentences);
-            pthread_mutex_unlock(&file_locks[lock_index]);
+            write_file_unlock(lock_index);
             return;
         }
 
@@ -851,7 +2155,7 @@ void handle_write_file(Message* msg) {
             free(data_copy);
             free(tokens);
             free(sentences);
-            pthread_mutex_unlock(&file_locks[lock_index]);
+            write_file_unlock(lock_index);
             return;
         }
 
@@ -899,41 +2203,43 @@ void handle_write_file(Message* msg) {
         msg->error_code = ERR_SERVER_ERROR;
         strcpy(msg->error_msg, "Memory allocation failed");
         free(sentences);
-        pthread_mutex_unlock(&file_locks[lock_index]);
+        write_file_unlock(lock_index);
         return;
     }
 
     new_content[0] = '\0';
     reconstruct_content(sentences, sentence_count, new_content);
 
-    // Save file
-    save_file_content(msg->filename, new_content);
+    free(sentences);
 
-    log_message("SS", "INFO", "Saved new content, length: %zu", strlen(new_content));
+    // Publish the edit to the file's batch and wait for a flush that covers it
+    free(lock_info->batch_content);
+    lock_info->batch_content = new_content;
+    if (!(msg->flags & FLAG_REPL)) lock_info->batch_replicate = 1;
+    unsigned long my_seq = ++lock_info->batch_seq;
+    pthread_mutex_lock(&global_lock);
+    sentence_cache_store(lock_info, new_content);
+    pthread_mutex_unlock(&global_lock);
 
-    // Replicate write to partner (best-effort)
-    if (!(msg->flags & FLAG_REPL)) {
-        Message rm = *msg; rm.op_code = OP_REPL_WRITE; rm.data[0] = '\0';
-        // Ensure data carries content to write
-        strncpy(rm.data, new_content, sizeof(rm.data)-1);
-        replicate_send(&rm);
+    if (write_batch_commit(lock_index, my_seq) != 0) {
+        msg->error_code = ERR_SERVER_ERROR;
+        strcpy(msg->error_msg, "Failed to persist write");
+        write_file_unlock(lock_index);
+        return;
     }
-
-    free(new_content);
-    free(sentences);
     
     // Note: Sentence remains locked until client explicitly unlocks via ETIRW
     
     msg->error_code = ERR_SUCCESS;
     strcpy(msg->data, "Write successful");
     
-    pthread_mutex_unlock(&file_locks[lock_index]);
+    write_file_unlock(lock_index);
     
     log_message("SS", "INFO", "Write completed successfully for %s", msg->filename);
 }
 
 void handle_stream_file(int client_sock, Message* msg) {
-    char* content = load_file_content(msg->filename);
+    ContentBlob* content = content_cache_get(msg->filename);
     
     if (content == NULL) {
         msg->error_code = ERR_FILE_NOT_FOUND;
@@ -947,14 +2253,18 @@ void handle_stream_file(int client_sock, Message* msg) {
     msg->data[0] = '\0';
     send_message(client_sock, msg);
     
-    // Stream word by word
-    char* word = strtok(content, " \n\t");
-    while (word != NULL) {
+    // Stream word by word straight out of the shared content (not modified in place)
+    const char* p = content->data;
+    while (*p) {
+        size_t skip = strspn(p, " \n\t");
+        p += skip;
+        size_t wlen = strcspn(p, " \n\t");
+        if (wlen == 0) break;
         memset(msg, 0, sizeof(Message));
-        strcpy(msg->data, word);
+        memcpy(msg->data, p, wlen < MAX_CONTENT - 1 ? wlen : MAX_CONTENT - 1);
         send_message(client_sock, msg);
         usleep(100000);  // 0.1 second delay
-        word = strtok(NULL, " \n\t");
+        p += wlen;
     }
     
     // Send stop signal
@@ -962,7 +2272,7 @@ void handle_stream_file(int client_sock, Message* msg) {
     strcpy(msg->data, "STOP");
     send_message(client_sock, msg);
     
-    free(content);
+    content_blob_release(content);
     log_message("SS", "INFO", "File streamed: %s to %s", msg->filename, msg->username);
 }
 
@@ -975,9 +2285,14 @@ void handle_undo_file(Message* msg) {
         return;
     }
     
-    pthread_mutex_lock(&file_locks[lock_index]);
+    lock_file_mutex(lock_index);
+    if (reject_if_frozen(lock_index, msg)) {
+        pthread_mutex_unlock(&file_locks[lock_index]);
+        return;
+    }
     
     FileLockInfo* lock_info = &file_lock_info[lock_index];
+    write_batch_wait_idle(lock_index);
     
     if (!lock_info->has_undo) {
         msg->error_code = ERR_NO_UNDO;
@@ -987,8 +2302,23 @@ void handle_undo_file(Message* msg) {
     }
     
     // Restore from undo
-    save_file_content(msg->filename, lock_info->undo_content);
+    if (save_file_content(msg->filename, lock_info->undo_content) != 0) {
+        msg->error_code = ERR_SERVER_ERROR;
+        strcpy(msg->error_msg, "Failed to persist undo");
+        pthread_mutex_unlock(&file_locks[lock_index]);
+        return;
+    }
     lock_info->has_undo = 0;
+
+    // Replicate the restored content like any other write
+    if (!(msg->flags & FLAG_REPL)) {
+        Message rm;
+        memset(&rm, 0, sizeof(rm));
+        rm.op_code = OP_REPL_WRITE;
+        strncpy(rm.filename, msg->filename, sizeof(rm.filename) - 1);
+        strncpy(rm.data, lock_info->undo_content, sizeof(rm.data) - 1);
+        report_replication(msg->filename, replicate_send(&rm) == 0 && strlen(lock_info->undo_content) < sizeof(rm.data));
+    }
     
     msg->error_code = ERR_SUCCESS;
     strcpy(msg->data, "Undo successful");
@@ -998,8 +2328,141 @@ void handle_undo_file(Message* msg) {
     log_message("SS", "INFO", "File undo: %s by %s", msg->filename, msg->username);
 }
 
+// The NM changed the file's replica set (topology change or migration): remember it and
+// push the current content to every new replica before answering.
+void handle_set_replicas(Message* msg) {
+    char ips[MAX_REPLICAS - 1][INET_ADDRSTRLEN];
+    int ports[MAX_REPLICAS - 1];
+    int n = parse_replica_list(msg->data, ips, ports);
+
+    int lock_index = get_file_lock_info(msg->filename);
+    if (lock_index < 0) {
+        msg->error_code = ERR_FILE_NOT_FOUND;
+        strcpy(msg->error_msg, "File not found");
+        return;
+    }
+
+    // Hold writers off so the pushed copy is the latest one
+    lock_file_mutex(lock_index);
+    write_batch_wait_idle(lock_index);
+
+    pthread_mutex_lock(&global_lock);
+    FileLockInfo* info = &file_lock_info[lock_index];
+    info->replica_count = n;
+    for (int i = 0; i < n; i++) {
+        strcpy(info->replica_ip[i], ips[i]);
+        info->replica_nm_port[i] = ports[i];
+    }
+    info->repl_reported = -1; // the NM must hear about the new set
+    pthread_mutex_unlock(&global_lock);
+    info->frozen = 0;         // only a primary is sent its replica set
+
+    write_meta_replicas(msg->filename, ips, ports, n);
+
+    char* content = load_file_content(msg->filename);
+    int acked = 0;
+    if (content) {
+        Message rm;
+        memset(&rm, 0, sizeof(rm));
+        rm.op_code = OP_REPL_WRITE;
+        strncpy(rm.filename, msg->filename, sizeof(rm.filename) - 1);
+        strncpy(rm.data, content, sizeof(rm.data) - 1);
+        acked = replicate_send(&rm) == 0 && strlen(content) < sizeof(rm.data);
+        free(content);
+    }
+    pthread_mutex_unlock(&file_locks[lock_index]);
+    report_replication(msg->filename, acked);
+
+    msg->error_code = ERR_SUCCESS;
+    snprintf(msg->data, sizeof(msg->data), "%d replicas, %s", n, acked ? "in sync" : "stale");
+    log_message("SS", "INFO", "Replica set of %s changed to %d server(s), %s", msg->filename, n, acked ? "in sync" : "stale");
+}
+
+// File mutex held: copy the file's checkpoints and undo state to its replicas, so the
+// migration target can answer LISTCHECKPOINTS, REVERT and UNDO once it is primary.
+// Returns 0 once every replica stored all of it.
+static int push_file_history(const char* filename, FileLockInfo* info) {
+    int rc = 0;
+    Message rm;
+    char dirpath[MAX_PATH + MAX_FILENAME + 16]; snprintf(dirpath, sizeof(dirpath), "%s.checkpoints/%s", storage_dir, filename);
+    DIR* d = opendir(dirpath);
+    if (d) {
+        struct dirent* ent;
+        while ((ent = readdir(d)) != NULL) {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+            char path[sizeof(dirpath) + 256]; snprintf(path, sizeof(path), "%s/%s", dirpath, ent->d_name);
+            FILE* fp = fopen(path, "r");
+            if (!fp) { rc = -1; continue; }
+            memset(&rm, 0, sizeof(rm));
+            rm.op_code = OP_REPL_CHECKPOINT;
+            strncpy(rm.filename, filename, sizeof(rm.filename) - 1);
+            int used = snprintf(rm.data, sizeof(rm.data), "%s\n", ent->d_name);
+            size_t got = 0;
+            if (used > 0 && (size_t)used < sizeof(rm.data) - 1) {
+                got = fread(rm.data + used, 1, sizeof(rm.data) - 1 - (size_t)used, fp);
+            }
+            // A checkpoint that does not fit in one message cannot be copied whole
+            int whole = (size_t)used < sizeof(rm.data) - 1 && got < sizeof(rm.data) - 1 - (size_t)used;
+            fclose(fp);
+            if (!whole || replicate_send(&rm) != 0) rc = -1;
+        }
+        closedir(d);
+    }
+
+    memset(&rm, 0, sizeof(rm));
+    rm.op_code = OP_REPL_UNDO;
+    strncpy(rm.filename, filename, sizeof(rm.filename) - 1);
+    rm.sentence_number = info->has_undo;
+    if (info->has_undo) memcpy(rm.data, info->undo_content, MAX_CONTENT);
+    if (replicate_send(&rm) != 0) rc = -1;
+    return rc;
+}
+
+// Migration cut-over: stop taking client edits, let batched ones land and push the
+// final content and its history to the replicas (the migration target among them).
+// Answers success only if every replica acknowledged; the NM then flips the file to
+// its new primary.
+void handle_freeze_file(Message* msg) {
+    int lock_index = get_file_lock_info(msg->filename);
+    if (lock_index < 0) {
+        msg->error_code = ERR_FILE_NOT_FOUND;
+        strcpy(msg->error_msg, "File not found");
+        return;
+    }
+
+    lock_file_mutex(lock_index);
+    FileLockInfo* info = &file_lock_info[lock_index];
+    info->frozen = 1;
+    write_batch_wait_idle(lock_index);
+    lock_table_clear(info);   // writers holding sentence locks must reacquire them at the new primary
+
+    char* content = load_file_content(msg->filename);
+    int acked = 0;
+    if (content) {
+        Message rm;
+        memset(&rm, 0, sizeof(rm));
+        rm.op_code = OP_REPL_WRITE;
+        strncpy(rm.filename, msg->filename, sizeof(rm.filename) - 1);
+        strncpy(rm.data, content, sizeof(rm.data) - 1);
+        acked = replicate_send(&rm) == 0 && strlen(content) < sizeof(rm.data);
+        free(content);
+    }
+    if (acked && push_file_history(msg->filename, info) != 0) acked = 0;
+    pthread_mutex_unlock(&file_locks[lock_index]);
+
+    if (!acked) {
+        msg->error_code = ERR_SERVER_ERROR;
+        strcpy(msg->error_msg, "Replicas did not acknowledge the final content or its history");
+        return;
+    }
+    msg->error_code = ERR_SUCCESS;
+    strcpy(msg->data, "Frozen");
+    log_message("SS", "INFO", "File %s frozen for migration", msg->filename);
+}
+
 void handle_lock_sentence(Message* msg) {
-    log_message("SS", "INFO", "LOCK request for %s sentence %d by %s", 
+    int shared = (msg->flags & FLAG_LOCK_SHARED) != 0;
+    log_message("SS", "INFO", "LOCK%s request for %s sentence %d by %s", shared ? " (shared)" : "",
                 msg->filename, msg->sentence_number, msg->username);
     
     int lock_index = get_file_lock_info(msg->filename);
@@ -1011,24 +2474,18 @@ void handle_lock_sentence(Message* msg) {
         return;
     }
     
-    pthread_mutex_lock(&file_locks[lock_index]);
+    lock_file_mutex(lock_index);
+    if (reject_if_frozen(lock_index, msg)) {
+        pthread_mutex_unlock(&file_locks[lock_index]);
+        return;
+    }
     
     // Validate sentence index: must be in [0, current_sentence_count].
     // Allow locking a new sentence by permitting == current_sentence_count,
     // BUT only if existing content ends with a delimiter.
     int current_sentence_count = 0;
     int last_has_delim = 0;
-    {
-        char* content = load_file_content(msg->filename);
-        // Parse existing content to determine current number of sentences
-        char (*sentences)[MAX_SENTENCE_LEN] = calloc(100, sizeof(char[MAX_SENTENCE_LEN]));
-        if (sentences != NULL) {
-            parse_sentences(content ? content : "", sentences, &current_sentence_count);
-            free(sentences);
-        }
-        last_has_delim = ends_with_delimiter(content);
-        if (content) free(content);
-    }
+    sentence_cache_get(lock_index, &current_sentence_count, &last_has_delim);
 
     if (msg->sentence_number < 0 || msg->sentence_number > current_sentence_count) {
         msg->error_code = ERR_INVALID_INDEX;
@@ -1047,51 +2504,95 @@ void handle_lock_sentence(Message* msg) {
     }
 
     FileLockInfo* lock_info = &file_lock_info[lock_index];
-    
-    // Check if sentence is already locked by another user
-    for (int i = 0; i < lock_info->lock_count; i++) {
-        if (lock_info->sentence_locks[i].sentence_number == msg->sentence_number) {
-            if (strcmp(lock_info->sentence_locks[i].locked_by, msg->username) != 0) {
-                log_message("SS", "INFO", "Sentence %d already locked by %s", 
-                            msg->sentence_number, lock_info->sentence_locks[i].locked_by);
+    time_t now = time(NULL);
+    SentenceLock* sl = lock_table_find(lock_info, msg->sentence_number);
+    if (sl) {
+        int reclaimed = lock_slot_prune(sl, now);
+        if (reclaimed > 0) {
+            pthread_mutex_lock(&stats_lock);
+            lock_stats.expired += reclaimed;
+            pthread_mutex_unlock(&stats_lock);
+        }
+    }
+
+    // A live writer excludes everyone else; its own re-lock renews the lease
+    if (sl && sl->writer.username[0] != '\0') {
+        if (strcmp(sl->writer.username, msg->username) != 0) {
+            log_message("SS", "INFO", "Sentence %d already locked by %s", 
+                        msg->sentence_number, sl->writer.username);
+            msg->error_code = ERR_SENTENCE_LOCKED;
+            sprintf(msg->error_msg, "Sentence %d is locked by %s", 
+                    msg->sentence_number, sl->writer.username);
+            pthread_mutex_unlock(&file_locks[lock_index]);
+            record_lock_stat(&lock_stats.conflicts);
+            return;
+        }
+        sl->writer.lease_expires = now + lock_lease_sec;
+        msg->error_code = ERR_SUCCESS;
+        snprintf(msg->data, sizeof(msg->data), "Sentence lock renewed (lease %ds)", lock_lease_sec);
+        pthread_mutex_unlock(&file_locks[lock_index]);
+        record_lock_stat(&lock_stats.renewed);
+        return;
+    }
+
+    // An exclusive lock must wait for other readers to finish (a reader may upgrade itself)
+    if (!shared && sl) {
+        for (int r = 0; r < sl->reader_count; r++) {
+            if (strcmp(sl->readers[r].username, msg->username) != 0) {
                 msg->error_code = ERR_SENTENCE_LOCKED;
-                sprintf(msg->error_msg, "Sentence %d is locked by %s", 
-                        msg->sentence_number, lock_info->sentence_locks[i].locked_by);
-                pthread_mutex_unlock(&file_locks[lock_index]);
-                return;
-            } else {
-                // User already owns this lock, just return success
-                msg->error_code = ERR_SUCCESS;
-                strcpy(msg->data, "Sentence already locked by you");
+                sprintf(msg->error_msg, "Sentence %d is being read by %s",
+                        msg->sentence_number, sl->readers[r].username);
                 pthread_mutex_unlock(&file_locks[lock_index]);
+                record_lock_stat(&lock_stats.conflicts);
                 return;
             }
         }
     }
-    
-    // Add new lock
-    if (lock_info->lock_count >= 100) {
+
+    if (sl == NULL) sl = lock_table_insert(lock_info, msg->sentence_number);
+    if (sl == NULL) {
         msg->error_code = ERR_SERVER_ERROR;
-        strcpy(msg->error_msg, "Too many locks on this file");
+        strcpy(msg->error_msg, "Memory allocation failed");
         pthread_mutex_unlock(&file_locks[lock_index]);
         return;
     }
-    
-    lock_info->sentence_locks[lock_info->lock_count].sentence_number = msg->sentence_number;
-    strcpy(lock_info->sentence_locks[lock_info->lock_count].locked_by, msg->username);
-    lock_info->lock_count++;
+
+    int renewed = 0;
+    if (shared) {
+        LockHolder* h = lock_slot_reader(sl, msg->username);
+        renewed = (h != NULL);
+        if (h == NULL) h = lock_slot_add_reader(sl, msg->username);
+        if (h == NULL) {
+            msg->error_code = ERR_SERVER_ERROR;
+            strcpy(msg->error_msg, "Memory allocation failed");
+            lock_slot_release_if_idle(lock_info, sl, now);
+            pthread_mutex_unlock(&file_locks[lock_index]);
+            return;
+        }
+        h->lease_expires = now + lock_lease_sec;
+    } else {
+        // Upgrade: drop our own shared hold before taking the exclusive one
+        sl->reader_count = 0;
+        strncpy(sl->writer.username, msg->username, MAX_USERNAME - 1);
+        sl->writer.username[MAX_USERNAME - 1] = '\0';
+        sl->writer.lease_expires = now + lock_lease_sec;
+    }
+    int total_locks = lock_info->lock_count;
     
     msg->error_code = ERR_SUCCESS;
-    strcpy(msg->data, "Sentence locked");
+    snprintf(msg->data, sizeof(msg->data), "Sentence %s (lease %ds)",
+             renewed ? "lock renewed" : (shared ? "read-locked" : "locked"), lock_lease_sec);
     
     pthread_mutex_unlock(&file_locks[lock_index]);
+    record_lock_stat(renewed ? &lock_stats.renewed : &lock_stats.acquired);
     
-    log_message("SS", "INFO", "Sentence %d locked by %s (total locks: %d)", 
-                msg->sentence_number, msg->username, lock_info->lock_count);
+    log_message("SS", "INFO", "Sentence %d %slocked by %s (locked sentences: %d)", 
+                msg->sentence_number, shared ? "read-" : "", msg->username, total_locks);
 }
 
 void handle_unlock_sentence(Message* msg) {
-    log_message("SS", "INFO", "UNLOCK request for %s sentence %d by %s", 
+    int shared = (msg->flags & FLAG_LOCK_SHARED) != 0;
+    log_message("SS", "INFO", "UNLOCK%s request for %s sentence %d by %s", shared ? " (shared)" : "",
                 msg->filename, msg->sentence_number, msg->username);
     
     int lock_index = get_file_lock_info(msg->filename);
@@ -1102,39 +2603,38 @@ void handle_unlock_sentence(Message* msg) {
         return;
     }
     
-    pthread_mutex_lock(&file_locks[lock_index]);
+    lock_file_mutex(lock_index);
     
     FileLockInfo* lock_info = &file_lock_info[lock_index];
+    SentenceLock* sl = lock_table_find(lock_info, msg->sentence_number);
     
-    // Find and remove the lock
-    int found = 0;
-    for (int i = 0; i < lock_info->lock_count; i++) {
-        if (lock_info->sentence_locks[i].sentence_number == msg->sentence_number) {
-            if (strcmp(lock_info->sentence_locks[i].locked_by, msg->username) == 0) {
-                // Remove this lock by shifting remaining locks
-                for (int j = i; j < lock_info->lock_count - 1; j++) {
-                    lock_info->sentence_locks[j] = lock_info->sentence_locks[j + 1];
-                }
-                lock_info->lock_count--;
-                found = 1;
-                
-                msg->error_code = ERR_SUCCESS;
-                strcpy(msg->data, "Sentence unlocked");
-                log_message("SS", "INFO", "Sentence %d unlocked by %s (remaining locks: %d)", 
-                            msg->sentence_number, msg->username, lock_info->lock_count);
-                break;
-            } else {
-                msg->error_code = ERR_ACCESS_DENIED;
-                strcpy(msg->error_msg, "You don't own this lock");
-                found = 1;
-                break;
-            }
-        }
-    }
-    
-    if (!found) {
+    if (sl == NULL) {
         msg->error_code = ERR_ACCESS_DENIED;
         strcpy(msg->error_msg, "Sentence is not locked");
+    } else if (shared) {
+        LockHolder* h = lock_slot_reader(sl, msg->username);
+        if (h == NULL) {
+            msg->error_code = ERR_ACCESS_DENIED;
+            strcpy(msg->error_msg, "You don't hold a read lock on this sentence");
+        } else {
+            *h = sl->readers[--sl->reader_count];
+            msg->error_code = ERR_SUCCESS;
+            strcpy(msg->data, "Sentence read lock released");
+        }
+    } else if (strcmp(sl->writer.username, msg->username) == 0) {
+        // Releasing is allowed even after the lease lapsed, as long as nobody took over
+        sl->writer.username[0] = '\0';
+        msg->error_code = ERR_SUCCESS;
+        strcpy(msg->data, "Sentence unlocked");
+    } else {
+        msg->error_code = ERR_ACCESS_DENIED;
+        strcpy(msg->error_msg, sl->writer.username[0] ? "You don't own this lock" : "Sentence is not locked");
+    }
+
+    if (sl) lock_slot_release_if_idle(lock_info, sl, time(NULL));
+    if (msg->error_code == ERR_SUCCESS) {
+        log_message("SS", "INFO", "Sentence %d unlocked by %s (locked sentences: %d)", 
+                    msg->sentence_number, msg->username, lock_info->lock_count);
     }
     
     pthread_mutex_unlock(&file_locks[lock_index]);
@@ -1142,52 +2642,862 @@ void handle_unlock_sentence(Message* msg) {
 
 int get_file_lock_info(const char* filename) {
     // Fast path: existing entry
-    for (int i = 0; i < file_lock_count; i++) {
-        if (strcmp(file_lock_info[i].filename, filename) == 0) {
-            return i;
-        }
-    }
+    pthread_mutex_lock(&global_lock);
+    int idx = lock_index_lookup(filename);
+    pthread_mutex_unlock(&global_lock);
+    if (idx >= 0) return idx;
 
     // Not found. If the file exists on disk (e.g., after SS restart), lazily create lock info.
     char filepath[MAX_PATH];
     snprintf(filepath, sizeof(filepath), "%s%s", storage_dir, filename);
     if (access(filepath, F_OK) == 0) {
         pthread_mutex_lock(&global_lock);
-        // Re-check under lock to avoid races
-        for (int i = 0; i < file_lock_count; i++) {
-            if (strcmp(file_lock_info[i].filename, filename) == 0) {
-                pthread_mutex_unlock(&global_lock);
-                return i;
+        idx = add_file_lock_info_locked(filename);
+        pthread_mutex_unlock(&global_lock);
+        return idx;
+    }
+
+    // File truly unknown
+    return -1;
+}
+
+// ---- Content cache ----
+//
+// Hot documents are kept in memory as reference-counted blobs so READ and STREAM
+// skip the open/seek/read/malloc cycle. Entries are chained in a filename hash and
+// an LRU list, capped at SS_CACHE_MAX_MB in total. save_file_content writes
+// through to cached entries; delete and move drop them. A fill from disk is only
+// installed if no save happened while the file was being read (cache_epoch).
+
+typedef struct CacheEntry {
+    char filename[MAX_FILENAME];
+    ContentBlob* blob;
+    struct CacheEntry* hash_next;
+    struct CacheEntry* lru_prev;   // towards most recently used
+    struct CacheEntry* lru_next;   // towards least recently used
+} CacheEntry;
+
+#define CONTENT_CACHE_BUCKETS 4096
+static CacheEntry* cache_buckets[CONTENT_CACHE_BUCKETS];
+static CacheEntry* cache_lru_head = NULL;
+static CacheEntry* cache_lru_tail = NULL;
+
+static ContentBlob* blob_create(const char* content, size_t len) {
+    ContentBlob* blob = malloc(sizeof(ContentBlob) + len + 1);
+    if (blob == NULL) return NULL;
+    blob->refs = 1;
+    blob->len = len;
+    memcpy(blob->data, content, len);
+    blob->data[len] = '\0';
+    return blob;
+}
+
+static void content_blob_release(ContentBlob* blob) {
+    if (blob && __sync_sub_and_fetch(&blob->refs, 1) == 0) free(blob);
+}
+
+static CacheEntry** cache_slot(const char* filename) {
+    CacheEntry** slot = &cache_buckets[hash_string(filename) % CONTENT_CACHE_BUCKETS];
+    while (*slot && strcmp((*slot)->filename, filename) != 0) slot = &(*slot)->hash_next;
+    return slot;
+}
+
+static void cache_lru_unlink(CacheEntry* e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next; else cache_lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev; else cache_lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void cache_lru_push_front(CacheEntry* e) {
+    e->lru_prev = NULL;
+    e->lru_next = cache_lru_head;
+    if (cache_lru_head) cache_lru_head->lru_prev = e;
+    cache_lru_head = e;
+    if (cache_lru_tail == NULL) cache_lru_tail = e;
+}
+
+// Unlink and free the entry at *slot (cache_lock held)
+static void cache_remove_slot(CacheEntry** slot) {
+    CacheEntry* e = *slot;
+    *slot = e->hash_next;
+    cache_lru_unlink(e);
+    cache_stats.bytes -= e->blob->len;
+    cache_stats.entries--;
+    content_blob_release(e->blob);
+    free(e);
+}
+
+static void cache_evict_to(size_t limit) {
+    while (cache_lru_tail && cache_stats.bytes > limit) {
+        cache_remove_slot(cache_slot(cache_lru_tail->filename));
+        cache_stats.evictions++;
+    }
+}
+
+// Install blob for filename, taking over the caller's reference (cache_lock held)
+static void cache_install(const char* filename, ContentBlob* blob) {
+    CacheEntry** slot = cache_slot(filename);
+    CacheEntry* e = *slot;
+    if (e) {
+        cache_stats.bytes -= e->blob->len;
+        content_blob_release(e->blob);
+        e->blob = blob;
+        cache_lru_unlink(e);
+    } else {
+        e = calloc(1, sizeof(CacheEntry));
+        if (e == NULL) { content_blob_release(blob); return; }
+        strncpy(e->filename, filename, MAX_FILENAME - 1);
+        e->blob = blob;
+        *slot = e;
+        cache_stats.entries++;
+    }
+    cache_stats.bytes += blob->len;
+    cache_lru_push_front(e);
+    cache_evict_to(cache_max_bytes);
+}
+
+// Return the current content of filename with a reference held (release with
+// content_blob_release), or NULL if the file cannot be read.
+static ContentBlob* content_cache_get(const char* filename) {
+    pthread_mutex_lock(&cache_lock);
+    CacheEntry* e = *cache_slot(filename);
+    if (e) {
+        cache_stats.hits++;
+        cache_lru_unlink(e);
+        cache_lru_push_front(e);
+        ContentBlob* blob = e->blob;
+        __sync_add_and_fetch(&blob->refs, 1);
+        pthread_mutex_unlock(&cache_lock);
+        return blob;
+    }
+    cache_stats.misses++;
+    unsigned long epoch = cache_epoch;
+    pthread_mutex_unlock(&cache_lock);
+
+    char* content = load_file_content(filename);
+    if (content == NULL) return NULL;
+    size_t len = strlen(content);
+    ContentBlob* blob = blob_create(content, len);
+    free(content);
+    if (blob == NULL) return NULL;
+
+    if (len <= cache_max_bytes / 8) {
+        pthread_mutex_lock(&cache_lock);
+        if (cache_epoch == epoch && *cache_slot(filename) == NULL) {
+            __sync_add_and_fetch(&blob->refs, 1);
+            cache_install(filename, blob);
+        }
+        pthread_mutex_unlock(&cache_lock);
+    }
+    return blob;
+}
+
+// Write-through after a successful save: refresh the entry if the file is cached
+static void content_cache_update(const char* filename, const char* content, size_t len) {
+    pthread_mutex_lock(&cache_lock);
+    cache_epoch++;
+    if (*cache_slot(filename) != NULL) {
+        ContentBlob* blob = len <= cache_max_bytes / 8 ? blob_create(content, len) : NULL;
+        if (blob) cache_install(filename, blob);
+        else cache_remove_slot(cache_slot(filename));
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static void content_cache_invalidate(const char* filename) {
+    pthread_mutex_lock(&cache_lock);
+    cache_epoch++;
+    CacheEntry** slot = cache_slot(filename);
+    if (*slot) cache_remove_slot(slot);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static void init_content_cache() {
+    int mb = get_env_int("SS_CACHE_MAX_MB", 64);
+    cache_max_bytes = mb > 0 ? (size_t)mb * 1024 * 1024 : 0;
+    log_message("SS", "INFO", "Content cache: %d MB", mb > 0 ? mb : 0);
+}
+
+// ---- Full-text index ----
+//
+// Inverted index over the files stored here: each lowercased word maps to one posting
+// per file holding it, and the posting lists the sentences it occurs in. Files are
+// reindexed whenever save_file_content persists them and dropped or renamed with the
+// file, so OP_SEARCH is answered from memory without reading any content. Each file
+// remembers where its postings sit, which makes removing it cost its own vocabulary
+// rather than the size of the index.
+
+#define INDEX_WORD_MAX 32
+#define INDEX_TERM_BUCKETS 65536
+#define INDEX_DOC_BUCKETS 16384
+
+typedef struct {
+    int sentence;
+    int count;
+} IndexHit;
+
+typedef struct {
+    int doc;
+    int ref;           // position of this posting's back-reference in the doc's refs
+    int tf;
+    IndexHit* hits;    // ascending sentence numbers
+    int hit_count;
+    int hit_cap;
+} IndexPosting;
+
+typedef struct IndexTerm {
+    char word[INDEX_WORD_MAX];
+    IndexPosting* postings;
+    int count;
+    int cap;
+    struct IndexTerm* next;
+} IndexTerm;
+
+typedef struct {
+    IndexTerm* term;
+    int slot;          // index into term->postings
+} IndexRef;
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    IndexRef* refs;
+    int ref_count;
+    int ref_cap;
+    int hash_next;     // name chain while in use, free list once dropped
+} IndexDoc;
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static IndexTerm* index_terms[INDEX_TERM_BUCKETS];
+static int index_doc_heads[INDEX_DOC_BUCKETS];
+static IndexDoc* index_docs = NULL;
+static int index_doc_count = 0;
+static int index_doc_cap = 0;
+static int index_doc_free = -1;
+static int index_heads_ready = 0;
+
+// Split the next word off *p: a run of letters, digits, '_' or non-ASCII bytes,
+// ASCII lowercased and cut at INDEX_WORD_MAX - 1. *sentence advances past every
+// delimiter, matching count_sentences(). Returns 0 at the end of the text.
+static int index_next_word(const char** p, char* word, int* sentence) {
+    const unsigned char* s = (const unsigned char*)*p;
+    while (*s && !(isalnum(*s) || *s == '_' || *s >= 0x80)) {
+        if (sentence && (*s == '.' || *s == '!' || *s == '?')) (*sentence)++;
+        s++;
+    }
+    if (*s == '\0') { *p = (const char*)s; return 0; }
+    int n = 0;
+    while (*s && (isalnum(*s) || *s == '_' || *s >= 0x80)) {
+        if (n < INDEX_WORD_MAX - 1) word[n++] = (char)tolower(*s);
+        s++;
+    }
+    word[n] = '\0';
+    *p = (const char*)s;
+    return 1;
+}
+
+static IndexTerm** index_term_slot(const char* word) {
+    IndexTerm** slot = &index_terms[hash_string(word) % INDEX_TERM_BUCKETS];
+    while (*slot && strcmp((*slot)->word, word) != 0) slot = &(*slot)->next;
+    return slot;
+}
+
+static int index_doc_lookup(const char* filename) {
+    if (!index_heads_ready) return -1;
+    int d = index_doc_heads[hash_string(filename) % INDEX_DOC_BUCKETS];
+    while (d >= 0 && strcmp(index_docs[d].filename, filename) != 0) d = index_docs[d].hash_next;
+    return d;
+}
+
+static void index_doc_link(int d) {
+    unsigned int b = hash_string(index_docs[d].filename) % INDEX_DOC_BUCKETS;
+    index_docs[d].hash_next = index_doc_heads[b];
+    index_doc_heads[b] = d;
+}
+
+static void index_doc_unlink(int d) {
+    int* link = &index_doc_heads[hash_string(index_docs[d].filename) % INDEX_DOC_BUCKETS];
+    while (*link >= 0 && *link != d) link = &index_docs[*link].hash_next;
+    if (*link == d) *link = index_docs[d].hash_next;
+}
+
+static int index_doc_alloc(const char* filename) {
+    int d;
+    if (index_doc_free >= 0) {
+        d = index_doc_free;
+        index_doc_free = index_docs[d].hash_next;
+    } else {
+        if (index_doc_count == index_doc_cap) {
+            int cap = index_doc_cap ? index_doc_cap * 2 : 256;
+            IndexDoc* grown = realloc(index_docs, (size_t)cap * sizeof(IndexDoc));
+            if (grown == NULL) return -1;
+            index_docs = grown;
+            index_doc_cap = cap;
+        }
+        d = index_doc_count++;
+        memset(&index_docs[d], 0, sizeof(IndexDoc));
+    }
+    strncpy(index_docs[d].filename, filename, MAX_FILENAME - 1);
+    index_docs[d].filename[MAX_FILENAME - 1] = '\0';
+    index_docs[d].ref_count = 0;
+    index_doc_link(d);
+    return d;
+}
+
+// Remove every posting of doc d (index_lock held); the doc stays allocated
+static void index_clear_doc_locked(int d) {
+    IndexDoc* doc = &index_docs[d];
+    for (int r = 0; r < doc->ref_count; r++) {
+        IndexTerm* t = doc->refs[r].term;
+        int slot = doc->refs[r].slot;
+        free(t->postings[slot].hits);
+        int last = --t->count;
+        if (slot != last) {
+            t->postings[slot] = t->postings[last];
+            IndexPosting* moved = &t->postings[slot];
+            index_docs[moved->doc].refs[moved->ref].slot = slot;
+        }
+        if (t->count == 0) {
+            IndexTerm** link = index_term_slot(t->word);
+            *link = t->next;
+            free(t->postings);
+            free(t);
+        }
+    }
+    doc->ref_count = 0;
+}
+
+static void index_add_hit(int d, const char* word, int sentence) {
+    IndexTerm** slot = index_term_slot(word);
+    IndexTerm* t = *slot;
+    if (t == NULL) {
+        t = calloc(1, sizeof(IndexTerm));
+        if (t == NULL) return;
+        strcpy(t->word, word);
+        *slot = t;
+    }
+    // The doc is indexed in one pass under index_lock, so its posting is the last one
+    IndexPosting* p = t->count > 0 ? &t->postings[t->count - 1] : NULL;
+    if (p == NULL || p->doc != d) {
+        IndexDoc* doc = &index_docs[d];
+        if (doc->ref_count == doc->ref_cap) {
+            int cap = doc->ref_cap ? doc->ref_cap * 2 : 32;
+            IndexRef* grown = realloc(doc->refs, (size_t)cap * sizeof(IndexRef));
+            if (grown == NULL) return;
+            doc->refs = grown;
+            doc->ref_cap = cap;
+        }
+        if (t->count == t->cap) {
+            int cap = t->cap ? t->cap * 2 : 4;
+            IndexPosting* grown = realloc(t->postings, (size_t)cap * sizeof(IndexPosting));
+            if (grown == NULL) return;
+            t->postings = grown;
+            t->cap = cap;
+        }
+        p = &t->postings[t->count];
+        memset(p, 0, sizeof(*p));
+        p->doc = d;
+        p->ref = doc->ref_count;
+        doc->refs[doc->ref_count].term = t;
+        doc->refs[doc->ref_count].slot = t->count;
+        doc->ref_count++;
+        t->count++;
+    }
+    p->tf++;
+    if (p->hit_count > 0 && p->hits[p->hit_count - 1].sentence == sentence) {
+        p->hits[p->hit_count - 1].count++;
+        return;
+    }
+    if (p->hit_count == p->hit_cap) {
+        int cap = p->hit_cap ? p->hit_cap * 2 : 2;
+        IndexHit* grown = realloc(p->hits, (size_t)cap * sizeof(IndexHit));
+        if (grown == NULL) return;
+        p->hits = grown;
+        p->hit_cap = cap;
+    }
+    p->hits[p->hit_count].sentence = sentence;
+    p->hits[p->hit_count].count = 1;
+    p->hit_count++;
+}
+
+static void index_heads_init_locked(void) {
+    if (index_heads_ready) return;
+    for (int i = 0; i < INDEX_DOC_BUCKETS; i++) index_doc_heads[i] = -1;
+    index_heads_ready = 1;
+}
+
+// (Re)index filename with its current content
+static void index_update(const char* filename, const char* content) {
+    pthread_mutex_lock(&index_lock);
+    index_heads_init_locked();
+    int d = index_doc_lookup(filename);
+    if (d >= 0) index_clear_doc_locked(d);
+    else d = index_doc_alloc(filename);
+    if (d >= 0) {
+        const char* p = content;
+        char word[INDEX_WORD_MAX];
+        int sentence = 0;
+        while (index_next_word(&p, word, &sentence)) index_add_hit(d, word, sentence);
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+static void index_drop_doc_locked(int d) {
+    index_clear_doc_locked(d);
+    index_doc_unlink(d);
+    index_docs[d].hash_next = index_doc_free;
+    index_doc_free = d;
+}
+
+static void index_remove(const char* filename) {
+    pthread_mutex_lock(&index_lock);
+    int d = index_doc_lookup(filename);
+    if (d >= 0) index_drop_doc_locked(d);
+    pthread_mutex_unlock(&index_lock);
+}
+
+static void index_rename(const char* oldname, const char* newname) {
+    pthread_mutex_lock(&index_lock);
+    int d = index_doc_lookup(oldname);
+    if (d >= 0) {
+        index_doc_unlink(d);
+        int stale = index_doc_lookup(newname);   // a copy that the move overwrote
+        if (stale >= 0) index_drop_doc_locked(stale);
+        strncpy(index_docs[d].filename, newname, MAX_FILENAME - 1);
+        index_docs[d].filename[MAX_FILENAME - 1] = '\0';
+        index_doc_link(d);
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+typedef struct {
+    int doc;
+    int matched;       // distinct query words present
+    int tf;            // total occurrences of the query words
+    int sentence;      // first sentence holding any of them
+} SearchResult;
+
+static int search_result_cmp(const void* a, const void* b) {
+    const SearchResult* x = a;
+    const SearchResult* y = b;
+    if (x->matched != y->matched) return y->matched - x->matched;
+    if (x->tf != y->tf) return y->tf - x->tf;
+    return strcmp(index_docs[x->doc].filename, index_docs[y->doc].filename);
+}
+
+// OP_SEARCH: rank the files holding any of the query words (most distinct words, then
+// most occurrences) and reply with as many "<matched> <tf> <sentence> <file>" lines as
+// fit. Access is not checked here; the NM filters the merged results.
+static void handle_search(Message* msg) {
+    char terms[SEARCH_MAX_TERMS][INDEX_WORD_MAX];
+    int nterms = 0;
+    const char* p = msg->data;
+    char word[INDEX_WORD_MAX];
+    while (nterms < SEARCH_MAX_TERMS && index_next_word(&p, word, NULL)) {
+        int dup = 0;
+        for (int i = 0; i < nterms && !dup; i++) dup = strcmp(terms[i], word) == 0;
+        if (!dup) strcpy(terms[nterms++], word);
+    }
+    msg->data[0] = '\0';
+    msg->error_code = ERR_SUCCESS;
+    if (nterms == 0) return;
+
+    pthread_mutex_lock(&index_lock);
+    SearchResult* results = NULL;
+    int nresults = 0;
+    int* slot_of = index_doc_count > 0 ? malloc((size_t)index_doc_count * sizeof(int)) : NULL;
+    if (slot_of) {
+        for (int i = 0; i < index_doc_count; i++) slot_of[i] = -1;
+        int cap = 0;
+        for (int i = 0; i < nterms; i++) {
+            IndexTerm* t = *index_term_slot(terms[i]);
+            if (t == NULL) continue;
+            for (int k = 0; k < t->count; k++) {
+                IndexPosting* post = &t->postings[k];
+                int r = slot_of[post->doc];
+                if (r < 0) {
+                    if (nresults == cap) {
+                        cap = cap ? cap * 2 : 64;
+                        SearchResult* grown = realloc(results, (size_t)cap * sizeof(SearchResult));
+                        if (grown == NULL) break;
+                        results = grown;
+                    }
+                    r = slot_of[post->doc] = nresults++;
+                    results[r].doc = post->doc;
+                    results[r].matched = 0;
+                    results[r].tf = 0;
+                    results[r].sentence = post->hits[0].sentence;
+                }
+                results[r].matched++;
+                results[r].tf += post->tf;
+                if (post->hits[0].sentence < results[r].sentence) results[r].sentence = post->hits[0].sentence;
             }
         }
+        free(slot_of);
+    }
+    if (nresults > 1) qsort(results, nresults, sizeof(SearchResult), search_result_cmp);
+    size_t used = 0;
+    for (int i = 0; i < nresults; i++) {
+        const char* name = index_docs[results[i].doc].filename;
+        char line[MAX_FILENAME + 48];
+        int n = snprintf(line, sizeof(line), "%d %d %d %s\n", results[i].matched, results[i].tf, results[i].sentence, name);
+        if (used + n >= sizeof(msg->data)) break;
+        memcpy(msg->data + used, line, n + 1);
+        used += n;
+    }
+    pthread_mutex_unlock(&index_lock);
+    free(results);
+}
 
-        if (file_lock_count < MAX_FILES) {
-            int idx = file_lock_count;
-            strncpy(file_lock_info[idx].filename, filename, MAX_FILENAME - 1);
-            file_lock_info[idx].filename[MAX_FILENAME - 1] = '\0';
-            file_lock_info[idx].lock_count = 0;
-            file_lock_info[idx].has_undo = 0;
-            file_lock_count++;
-            pthread_mutex_unlock(&global_lock);
-            return idx;
+// ---- Durable file persistence ----
+//
+// Every save writes a temp file next to the target and rename()s it over the
+// original, so readers and crashes only ever see the old or the new content.
+// SS_DURABILITY selects when that becomes durable:
+//   fsync - fsync the temp file and parent directory before returning
+//   group - append the content to a write-ahead log that a commit thread
+//           fdatasync()s every SS_GROUP_COMMIT_MS; writers wait for their batch, then rename.
+//           Deletes and moves are logged the same way, so replay applies every change in order
+//   none  - leave flushing to the OS (survives process crashes only)
+
+static int write_all_fd(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
         }
-        pthread_mutex_unlock(&global_lock);
+        buf += n; len -= (size_t)n;
     }
+    return 0;
+}
 
-    // File truly unknown
-    return -1;
+static unsigned int hash_bytes(const char* buf, size_t len, unsigned int h) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)buf[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void fsync_parent_dir(const char* path) {
+    char dir[MAX_PATH];
+    strncpy(dir, path, sizeof(dir) - 1); dir[sizeof(dir) - 1] = '\0';
+    char* slash = strrchr(dir, '/');
+    if (slash == NULL) strcpy(dir, ".");
+    else if (slash == dir) slash[1] = '\0';
+    else *slash = '\0';
+    int dfd = open(dir, O_RDONLY);
+    if (dfd >= 0) { fsync(dfd); close(dfd); }
+}
+
+// Temp files are dot-prefixed siblings of the target, e.g. "dir/.a.txt.tmp.7"
+static void temp_path_for(const char* filepath, char* out, size_t out_len) {
+    static unsigned long tmp_seq = 0;
+    pthread_mutex_lock(&stats_lock);
+    unsigned long seq = ++tmp_seq;
+    pthread_mutex_unlock(&stats_lock);
+    const char* slash = strrchr(filepath, '/');
+    int dir_len = slash ? (int)(slash - filepath + 1) : 0;
+    snprintf(out, out_len, "%.*s.%s.tmp.%lu", dir_len, filepath, slash ? slash + 1 : filepath, seq);
 }
 
-void save_file_content(const char* filename, const char* content) {
+// temp + (optional fsync) + rename
+static int atomic_replace(const char* filepath, const char* content, size_t len, int do_fsync) {
+    char tmp[MAX_PATH + 32];
+    temp_path_for(filepath, tmp, sizeof(tmp));
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    if (write_all_fd(fd, content, len) != 0 || (do_fsync && fsync(fd) != 0)) {
+        close(fd); unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    if (rename(tmp, filepath) != 0) { unlink(tmp); return -1; }
+    if (do_fsync) fsync_parent_dir(filepath);
+    return 0;
+}
+
+typedef struct {
+    unsigned int magic;
+    unsigned int name_len;
+    unsigned int content_len;
+    unsigned int checksum;
+} WalRecordHeader;
+
+#define WAL_MAGIC 0x57414c31u         // "WAL1": content write, payload = new content
+#define WAL_MAGIC_DELETE 0x57414c44u  // "WALD": file removed, no payload
+#define WAL_MAGIC_RENAME 0x57414c52u  // "WALR": file moved, payload = new name
+
+static unsigned int wal_checksum(const char* name, size_t name_len, const char* content, size_t content_len) {
+    return hash_bytes(content, content_len, hash_bytes(name, name_len, 2166136261u));
+}
+
+// Append one record and block until the commit thread has made it durable; -1 if it
+// could not be logged or its batch failed to sync
+static int wal_commit(unsigned int magic, const char* filename, const char* content, size_t len) {
+    WalRecordHeader hdr;
+    hdr.magic = magic;
+    hdr.name_len = (unsigned int)strlen(filename);
+    hdr.content_len = (unsigned int)len;
+    hdr.checksum = wal_checksum(filename, hdr.name_len, content, len);
+
+    pthread_mutex_lock(&wal_lock);
+    if (wal_fd < 0 || wal_failed ||
+        write_all_fd(wal_fd, (const char*)&hdr, sizeof(hdr)) != 0 ||
+        write_all_fd(wal_fd, filename, hdr.name_len) != 0 ||
+        write_all_fd(wal_fd, content, len) != 0) {
+        pthread_mutex_unlock(&wal_lock);
+        return -1;
+    }
+    wal_bytes += sizeof(hdr) + hdr.name_len + len;
+    unsigned long lsn = ++wal_appended_lsn;
+    wal_unapplied++;
+    while (wal_durable_lsn < lsn) pthread_cond_wait(&wal_durable_cond, &wal_lock);
+    int rc = wal_failed && lsn >= wal_failed_lsn ? -1 : 0;
+    pthread_mutex_unlock(&wal_lock);
+    return rc;
+}
+
+// The write a wal_commit() logged is in place (or failed); the log may be truncated again
+static void wal_applied(void) {
+    pthread_mutex_lock(&wal_lock);
+    wal_unapplied--;
+    pthread_mutex_unlock(&wal_lock);
+}
+
+// wal_lock held: the log can no longer be trusted to be durable. Records from `first_lsn`
+// on fail their writers, and later saves fall back to per-write fsync.
+static void wal_fail(unsigned long first_lsn, const char* what) {
+    if (!wal_failed) {
+        log_message("SS", "ERROR", "Write-ahead log %s failed (%s); falling back to per-write fsync", what, strerror(errno));
+        wal_failed = 1;
+        wal_failed_lsn = first_lsn;
+        durability_mode = DURABILITY_FSYNC;
+    }
+}
+
+// Group commit thread: one fdatasync covers every record appended since the last tick.
+// Once the log outgrows SS_WAL_MAX_BYTES, data files are flushed and the log is truncated.
+static void* group_commit_loop(void* arg) {
+    (void)arg;
+    while (1) {
+        usleep((useconds_t)group_commit_ms * 1000);
+        pthread_mutex_lock(&wal_lock);
+        if (wal_appended_lsn > wal_durable_lsn) {
+            unsigned long target = wal_appended_lsn;
+            pthread_mutex_unlock(&wal_lock);
+            int synced = wal_failed || fdatasync(wal_fd) == 0;
+            pthread_mutex_lock(&wal_lock);
+            if (!synced) wal_fail(wal_durable_lsn + 1, "sync");
+            if (!wal_failed) {
+                durability_stats.group_commits++;
+                durability_stats.group_records += target - wal_durable_lsn;
+            }
+            wal_durable_lsn = target;   // wakes the batch; wal_commit tells it whether it failed
+            pthread_cond_broadcast(&wal_durable_cond);
+        }
+        if (wal_failed && wal_unapplied == 0) {
+            // Records that failed must not be replayed after a restart: flush what did land
+            // and drop the log
+            sync();
+            if (ftruncate(wal_fd, 0) != 0 || fdatasync(wal_fd) != 0) {
+                unlink(wal_path);
+                fsync_parent_dir(wal_path);
+            }
+            close(wal_fd);
+            wal_fd = -1;
+            pthread_mutex_unlock(&wal_lock);
+            return NULL;
+        }
+        if (wal_bytes > (unsigned long)wal_max_bytes && wal_durable_lsn == wal_appended_lsn && wal_unapplied == 0) {
+            // Every logged write has already been renamed into place; flush them and reset the log
+            sync();
+            if (ftruncate(wal_fd, 0) != 0 || fdatasync(wal_fd) != 0) {
+                wal_fail(wal_appended_lsn + 1, "checkpoint");
+            } else {
+                wal_bytes = 0;
+                durability_stats.checkpoints++;
+            }
+        }
+        pthread_mutex_unlock(&wal_lock);
+    }
+    return NULL;
+}
+
+// Remove a stored file; in group mode the removal is logged first so replay cannot bring it back
+static int remove_file_durable(const char* filename) {
+    char filepath[MAX_PATH];
+    snprintf(filepath, sizeof(filepath), "%s%s", storage_dir, filename);
+    if (durability_mode != DURABILITY_GROUP) return unlink(filepath);
+    if (access(filepath, F_OK) != 0) return -1;
+    if (wal_commit(WAL_MAGIC_DELETE, filename, "", 0) != 0) return -1;
+    int rc = unlink(filepath);
+    wal_applied();
+    return rc;
+}
+
+// Move a stored file; in group mode the move is logged first so replay follows it
+static int rename_file_durable(const char* from, const char* to) {
+    char src[MAX_PATH]; snprintf(src, sizeof(src), "%s%s", storage_dir, from);
+    char dst[MAX_PATH]; snprintf(dst, sizeof(dst), "%s%s", storage_dir, to);
+    mkdir_p_for_path(dst);
+    if (durability_mode != DURABILITY_GROUP) return rename(src, dst);
+    if (access(src, F_OK) != 0) return -1;
+    if (wal_commit(WAL_MAGIC_RENAME, from, to, strlen(to)) != 0) return -1;
+    int rc = rename(src, dst);
+    wal_applied();
+    return rc;
+}
+
+// Redo one logged change during recovery; 0 once it is durably in place
+static int wal_replay_record(unsigned int magic, const char* name, const char* payload, size_t len) {
+    char filepath[MAX_PATH];
+    snprintf(filepath, sizeof(filepath), "%s%s", storage_dir, name);
+    if (magic == WAL_MAGIC) {
+        mkdir_p_for_path(filepath);
+        return atomic_replace(filepath, payload, len, 1);
+    }
+    char metapath[MAX_PATH + 8];
+    snprintf(metapath, sizeof(metapath), "%s.meta", filepath);
+    if (magic == WAL_MAGIC_DELETE) {
+        if (unlink(filepath) != 0 && errno != ENOENT) return -1;
+        unlink(metapath);
+        fsync_parent_dir(filepath);
+        return 0;
+    }
+    // Rename: already done if the source is gone
+    char to[MAX_FILENAME];
+    if (len == 0 || len >= sizeof(to)) return -1;
+    memcpy(to, payload, len); to[len] = '\0';
+    char dst[MAX_PATH]; snprintf(dst, sizeof(dst), "%s%s", storage_dir, to);
+    char dstmeta[MAX_PATH + 8]; snprintf(dstmeta, sizeof(dstmeta), "%s.meta", dst);
+    if (access(filepath, F_OK) == 0) {
+        mkdir_p_for_path(dst);
+        if (rename(filepath, dst) != 0) return -1;
+    }
+    if (access(metapath, F_OK) == 0) rename(metapath, dstmeta);
+    fsync_parent_dir(filepath);
+    fsync_parent_dir(dst);
+    return 0;
+}
+
+// Re-apply logged changes left by a crash, in order, then start a fresh log (runs before
+// serving). A change that cannot be redone keeps the log and stops the server.
+static void wal_recover_and_open() {
+    snprintf(wal_path, sizeof(wal_path), "%s.wal", storage_dir);
+    int fd = open(wal_path, O_RDONLY);
+    if (fd >= 0) {
+        int replayed = 0, failed = 0;
+        WalRecordHeader hdr;
+        while (read(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr)) {
+            if ((hdr.magic != WAL_MAGIC && hdr.magic != WAL_MAGIC_DELETE && hdr.magic != WAL_MAGIC_RENAME) || hdr.name_len == 0 || hdr.name_len >= MAX_FILENAME || hdr.content_len > (1u << 30)) break;
+            char name[MAX_FILENAME];
+            char* content = malloc(hdr.content_len + 1);
+            if (content == NULL) break;
+            if (read(fd, name, hdr.name_len) != (ssize_t)hdr.name_len ||
+                read(fd, content, hdr.content_len) != (ssize_t)hdr.content_len ||
+                wal_checksum(name, hdr.name_len, content, hdr.content_len) != hdr.checksum) {
+                free(content);
+                break; // torn tail from a crash mid-append
+            }
+            name[hdr.name_len] = '\0';
+            if (wal_replay_record(hdr.magic, name, content, hdr.content_len) == 0) {
+                replayed++;
+            } else {
+                failed++;
+                log_message("SS", "ERROR", "Cannot redo logged change to %s: %s", name, strerror(errno));
+            }
+            free(content);
+        }
+        close(fd);
+        if (failed > 0) {
+            log_message("SS", "ERROR", "%d logged change(s) could not be redone; keeping %s and refusing to start", failed, wal_path);
+            exit(EXIT_FAILURE);
+        }
+        if (replayed > 0) log_message("SS", "INFO", "Recovered %d logged changes from %s", replayed, wal_path);
+    }
+    wal_fd = open(wal_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (wal_fd < 0) {
+        log_message("SS", "ERROR", "Cannot open write-ahead log %s; falling back to per-write fsync", wal_path);
+        durability_mode = DURABILITY_FSYNC;
+        return;
+    }
+    fdatasync(wal_fd);
+    fsync_parent_dir(wal_path);
+}
+
+static const char* durability_mode_name(int mode) {
+    return mode == DURABILITY_FSYNC ? "fsync" : (mode == DURABILITY_GROUP ? "group" : "none");
+}
+
+// Parse SS_DURABILITY and start the group commit machinery when selected
+static void init_durability() {
+    const char* mode = getenv("SS_DURABILITY");
+    if (mode == NULL || mode[0] == '\0' || strcmp(mode, "fsync") == 0) durability_mode = DURABILITY_FSYNC;
+    else if (strcmp(mode, "group") == 0) durability_mode = DURABILITY_GROUP;
+    else if (strcmp(mode, "none") == 0) durability_mode = DURABILITY_NONE;
+    else {
+        log_message("SS", "WARN", "Unknown SS_DURABILITY '%s', using fsync", mode);
+        durability_mode = DURABILITY_FSYNC;
+    }
+    group_commit_ms = get_env_int("SS_GROUP_COMMIT_MS", 5);
+    if (group_commit_ms <= 0) group_commit_ms = 1;
+    wal_max_bytes = get_env_int("SS_WAL_MAX_BYTES", 8 * 1024 * 1024);
+
+    // Always replay a log left behind, even if this run uses another mode
+    wal_recover_and_open();
+    if (durability_mode != DURABILITY_GROUP && wal_fd >= 0) {
+        close(wal_fd); wal_fd = -1;
+        unlink(wal_path);
+    }
+    if (durability_mode == DURABILITY_GROUP) {
+        pthread_t t; pthread_create(&t, NULL, group_commit_loop, NULL); pthread_detach(t);
+    }
+    log_message("SS", "INFO", "Durability mode: %s", durability_mode_name(durability_mode));
+}
+
+// Persist content atomically according to the configured durability mode. Returns 0 on success.
+int save_file_content(const char* filename, const char* content) {
     char filepath[MAX_PATH];
     snprintf(filepath, sizeof(filepath), "%s%s", storage_dir, filename);
     mkdir_p_for_path(filepath);
-    
-    FILE* fp = fopen(filepath, "w");
-    if (fp) {
-        fprintf(fp, "%s", content);
-        fclose(fp);
+
+    size_t len = strlen(content);
+    int rc;
+    if (durability_mode == DURABILITY_GROUP) {
+        // Log first: the unsynced temp file may only replace the old content once the
+        // record that can redo it is durable
+        rc = wal_commit(WAL_MAGIC, filename, content, len);
+        if (rc == 0) {
+            rc = atomic_replace(filepath, content, len, 0);
+            wal_applied();
+        }
+    } else {
+        rc = atomic_replace(filepath, content, len, durability_mode == DURABILITY_FSYNC);
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    if (rc == 0) durability_stats.saves++; else durability_stats.save_failures++;
+    pthread_mutex_unlock(&stats_lock);
+    if (rc != 0) {
+        log_message("SS", "ERROR", "Failed to persist %s: %s", filename, strerror(errno));
+        return -1;
     }
+
+    content_cache_update(filename, content, len);
+    index_update(filename, content);
+
+    // Keep the sentence count cache and the inventory in step with what is now on disk
+    int words, chars;
+    count_words_chars(content, &words, &chars);
+    pthread_mutex_lock(&global_lock);
+    int idx = add_file_lock_info_locked(filename);
+    if (idx >= 0) {
+        sentence_cache_store(&file_lock_info[idx], content);
+        inv_note_locked(idx, 1, words, chars);
+    }
+    pthread_mutex_unlock(&global_lock);
+    return 0;
 }
 
 char* load_file_content(const char* filename) {
@@ -0,0 +1,52 @@
+#!/bin/bash
+
+# Scripted checks for storage server durability in SS_DURABILITY=group mode:
+#   1. saves, deletes and moves are redone in log order after kill -9
+#   2. a logged change that cannot be redone keeps the log and stops the server
+# Run from FP3/ after make. Exits non-zero if a check fails.
+
+source "$(dirname "$0")/test_lib.sh"
+
+echo "====== Testing storage server durability ======"
+setup_workdir
+
+start_nm
+start_ss 1 SS_DURABILITY=group
+start_ss 2 SS_DURABILITY=group
+
+# ---- 1. Replay follows deletes and moves ----
+run_client alice "CREATE a.txt" "WRITE a.txt 0" "1 Alpha text." "ETIRW" \
+                 "CREATE d.txt" "WRITE d.txt 0" "1 Delete me." "ETIRW" \
+                 "CREATEFOLDER f" "MOVE a.txt f" "DELETE d.txt" > /dev/null
+check "the changes are in the log" test -s ss1/.wal
+kill_ss
+start_ss 1 SS_DURABILITY=group
+start_ss 2 SS_DURABILITY=group
+check "the log was replayed" grep -q "Recovered [0-9]* logged changes" SS.log
+check "a deleted file stays deleted" test ! -e ss1/d.txt
+check "a moved file is not re-created at its old path" test ! -e ss1/a.txt
+check "a moved file keeps its content" grep -q "Alpha text." ss1/f/a.txt
+out=$(run_client alice "READ f/a.txt")
+check "the moved file is served" contains "$out" "Alpha text."
+
+# ---- 2. A change that cannot be redone ----
+kill_ss
+# A logged write below a path that is now a regular file cannot be redone
+touch ss1/x
+python3 - << 'PY'
+import struct
+def fnv(data, h):
+    for c in data:
+        h = ((h ^ c) * 16777619) & 0xffffffff
+    return h
+name, content = b'x/y.txt', b'hello'
+record = struct.pack('<IIII', 0x57414c31, len(name), len(content), fnv(content, fnv(name, 2166136261)))
+open('ss1/.wal', 'wb').write(record + name + content)
+PY
+sum=$(cksum < ss1/.wal)
+SS_DURABILITY=group timeout 10 ./storage_server 9001 9101 ss1/ > ss1_bad.out 2>&1
+check "the server refuses to start" test $? -eq 1
+check "the log is kept" test "$sum" == "$(cksum < ss1/.wal)"
+check "the failure is reported" grep -q "could not be redone" SS.log
+
+finish
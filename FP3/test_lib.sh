@@ -0,0 +1,101 @@
+#!/bin/bash
+
+# Helpers shared by the scripted checks (test_*.sh other than test_write.sh).
+# Each check runs the binaries built in FP3/ from a scratch directory, so
+# nm_data.dat, nm_journal.log, the logs and the storage directories are its own.
+
+SRC_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+FAILED=0
+PASSED=0
+NM_PID=""
+SS_PIDS=""
+
+setup_workdir() {
+    for bin in name_server storage_server client; do
+        if [ ! -x "$SRC_DIR/$bin" ]; then
+            echo "Build first: $bin is missing (run make)"
+            exit 2
+        fi
+    done
+    # Same ports as test_write.sh and the Makefile run_* targets
+    killall -9 name_server storage_server 2>/dev/null
+    WORK_DIR="$(mktemp -d /tmp/dfs_test.XXXXXX)"
+    cp "$SRC_DIR/name_server" "$SRC_DIR/storage_server" "$SRC_DIR/client" "$WORK_DIR/"
+    cd "$WORK_DIR" || exit 2
+    trap teardown EXIT
+}
+
+teardown() {
+    stop_all
+    cd /
+    if [ "$FAILED" -eq 0 ]; then rm -rf "$WORK_DIR"; else echo "Logs kept in $WORK_DIR"; fi
+}
+
+wait_for_port() {
+    for _ in $(seq 1 50); do
+        (echo > "/dev/tcp/127.0.0.1/$1") 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "Port $1 did not open"
+    return 1
+}
+
+# start_nm [VAR=value ...]: start the Name Server with extra environment
+start_nm() {
+    env "$@" ./name_server > nm.out 2>&1 &
+    NM_PID=$!
+    wait_for_port 8080
+}
+
+# start_ss <n> [VAR=value ...]: storage server n on ports 900n/910n, storage in ss<n>/
+start_ss() {
+    local n="$1"; shift
+    env "$@" ./storage_server "900$n" "910$n" "ss$n/" > "ss$n.out" 2>&1 &
+    SS_PIDS="$SS_PIDS $!"
+    wait_for_port "910$n"
+    sleep 1   # registration
+}
+
+# kill_nm: kill -9 the Name Server, as a crash would
+kill_nm() {
+    [ -n "$NM_PID" ] && kill -9 "$NM_PID" 2>/dev/null && wait "$NM_PID" 2>/dev/null
+    NM_PID=""
+}
+
+# kill_ss: kill -9 every storage server
+kill_ss() {
+    for pid in $SS_PIDS; do kill -9 "$pid" 2>/dev/null; wait "$pid" 2>/dev/null; done
+    SS_PIDS=""
+}
+
+stop_all() {
+    kill_nm
+    kill_ss
+}
+
+# run_client <user> <command>...: run one client session, print what it printed after login
+run_client() {
+    local user="$1"; shift
+    printf '%s\n' "$user" "$@" EXIT | timeout 60 ./client 2>&1 | sed -n "/^$user> /,\$p" | sed "s/$user> //g"
+}
+
+check() {
+    local desc="$1"; shift
+    if "$@"; then
+        echo "PASS: $desc"
+        PASSED=$((PASSED + 1))
+    else
+        echo "FAIL: $desc"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+# contains <text> <pattern>: grep -E on a captured output
+contains() { printf '%s\n' "$1" | grep -qE -- "$2"; }
+lacks() { ! contains "$1" "$2"; }
+
+finish() {
+    echo ""
+    echo "====== $PASSED passed, $FAILED failed ======"
+    [ "$FAILED" -eq 0 ]
+}
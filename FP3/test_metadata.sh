@@ -0,0 +1,159 @@
+#!/bin/bash
+
+# Scripted checks for Name Server persistence:
+#   1. journal replay after kill -9, with a torn last record
+#   2. a snapshot of another version stops startup and is left untouched
+#   3. a migrated file's new location is journaled, not written as a snapshot
+#   4. a headerless snapshot from before versioning is upgraded on first start
+#   5. users first seen since the last start keep their grants through journal replay
+#   6. file slot reuse after delete, before and after a restart
+#   7. restart from the mapped snapshot plus the journal written after it
+# Run from FP3/ after make. Exits non-zero if a check fails.
+
+source "$(dirname "$0")/test_lib.sh"
+
+echo "====== Testing Name Server persistence ======"
+setup_workdir
+
+start_nm
+start_ss 1
+start_ss 2
+
+# ---- 1. Journal replay with a torn tail ----
+run_client alice "CREATE j1.txt" "CREATE j2.txt" "CREATE j3.txt" "CREATE j4.txt" "CREATE j5.txt" > /dev/null
+check "creates are journaled" test -s nm_journal.log
+kill_nm
+# Cut the last record (j5.txt) short, as a crash in the middle of its write would
+truncate -s -8 nm_journal.log
+start_nm
+out=$(run_client alice "VIEW -a")
+check "records before the torn one are replayed" contains "$out" "j4\.txt"
+check "the torn record is dropped" lacks "$out" "j5\.txt"
+check "the torn tail is reported and cut" grep -q "trailing bytes after the last good record" NM.log
+out=$(run_client alice "CREATE j5.txt")
+check "a dropped create can be repeated" contains "$out" "File Created Successfully"
+
+# ---- 2. Snapshot of another version ----
+after=$(run_client alice "VIEW -a" | grep -- "-->" | sort)
+kill_nm
+printf '\x04\x00\x00\x00' | dd of=nm_data.dat bs=1 seek=4 conv=notrunc 2> /dev/null
+sums=$(cksum nm_data.dat nm_journal.log)
+timeout 10 ./name_server > nm_old.out 2>&1
+check "the Name Server refuses to start" test $? -eq 1
+check "the version is reported" grep -q "is a version 4 snapshot" NM.log
+check "the snapshot and journal are untouched" test "$sums" == "$(cksum nm_data.dat nm_journal.log)"
+printf '\x05\x00\x00\x00' | dd of=nm_data.dat bs=1 seek=4 conv=notrunc 2> /dev/null
+start_nm
+check "the restored snapshot still loads" test "$after" == "$(run_client alice "VIEW -a" | grep -- "-->" | sort)"
+
+# ---- 3. Migration is journaled ----
+target=0
+contains "$(run_client alice "MIGRATE j1.txt 0")" "already on SS 0" && target=1
+run_client alice "MIGRATE j1.txt $target" > /dev/null
+sums=$(cksum nm_data.dat)
+for _ in $(seq 1 50); do grep -q "Migrated j1.txt" NM.log && break; sleep 0.1; done
+check "the file was migrated" grep -q "Migrated j1.txt: SS [0-9]* -> SS $target" NM.log
+check "the migration did not rewrite the snapshot" test "$sums" == "$(cksum nm_data.dat)"
+kill_nm
+start_nm
+out=$(run_client alice "MIGRATE j1.txt $target")
+check "the new location survives a restart" contains "$out" "already on SS $target"
+
+# ---- 4. Upgrade from a headerless snapshot ----
+# Written in the layout of the original Name Server: int file_count, its 7280-byte records,
+# int ss_count, its 2560036-byte server entries (the name array is left sparse)
+put_bytes() { printf "$2" | dd of=nm_data.dat bs=1 seek="$1" conv=notrunc 2> /dev/null; }
+put_str() { put_bytes "$1" "$2\\0"; }
+put_int() { put_bytes "$1" "$(printf '\\x%02x\\x%02x\\x%02x\\x%02x' $(($2 & 255)) $(($2 >> 8 & 255)) $(($2 >> 16 & 255)) $(($2 >> 24 & 255)))"; }
+stop_all
+rm -rf nm_data.dat* nm_journal.log ss1 ss2
+mkdir ss1
+printf 'hello from the baseline.' > ss1/up1.txt
+rec=4; srv=$((4 + 7280 + 4))
+truncate -s $((srv + 2560036)) nm_data.dat
+put_int 0 1
+put_str $rec up1.txt
+put_str $((rec + 256)) carol
+put_int $((rec + 320)) 0
+put_str $((rec + 324)) 127.0.0.1
+put_int $((rec + 340)) 9001
+put_int $((rec + 344)) -1
+put_str $((rec + 368)) dave
+put_int $((rec + 368 + 64)) 1
+put_int $((rec + 3768)) 1
+put_int $((srv - 4)) 1
+put_int $srv 0
+put_str $((srv + 4)) 127.0.0.1
+put_int $((srv + 20)) 9101
+put_int $((srv + 24)) 9001
+put_int $((srv + 28)) 1
+sums=$(cksum < nm_data.dat)
+: > NM.log
+start_nm
+start_ss 1
+check "the headerless snapshot is read" grep -q "Read 1 file records and 1 storage servers from a headerless snapshot" NM.log
+check "it is rewritten as the current version" grep -q "Upgraded nm_data.dat to a version 5 snapshot" NM.log
+check "the original is kept" test "$sums" == "$(cksum < nm_data.dat.old)"
+out=$(run_client carol "INFO up1.txt")
+check "the owner is carried over" contains "$out" "Owner: carol"
+check "the access list is carried over" contains "$out" "dave \\(R\\)"
+out=$(run_client dave "READ up1.txt")
+check "the file is served from its storage server" contains "$out" "hello from the baseline\\."
+kill_nm
+: > NM.log
+start_nm
+out=$(run_client carol "INFO up1.txt")
+check "the upgraded snapshot is mapped on the next start" grep -qE "Indexed [0-9]+ mapped file records" NM.log
+check "the upgraded metadata survives a restart" contains "$out" "dave \\(R\\)"
+
+# ---- 5. Interned usernames in the journal ----
+run_client erin "VIEW" > /dev/null
+run_client dave "VIEW" > /dev/null
+run_client carol "CREATE u1.txt" "ADDACCESS -R u1.txt erin" "ADDACCESS -W u1.txt dave" > /dev/null
+kill_nm
+start_nm
+out=$(run_client carol "INFO u1.txt")
+check "a user first seen since the last start keeps their grant" contains "$out" "erin \\(R\\)"
+check "grantees keep their own names" contains "$out" "dave \\(RW\\)"
+out=$(run_client erin "READ u1.txt")
+check "the replayed grant is honoured" lacks "$out" "[Aa]ccess denied|ERROR"
+
+# ---- 6. Slot reuse after delete ----
+run_client alice "CREATE r1.txt" "CREATE r2.txt" "CREATE r3.txt" "INFO r2.txt" "DELETE r2.txt" > /dev/null
+run_client bob "CREATE r4.txt" > /dev/null
+out=$(run_client alice "INFO r2.txt")
+check "a deleted file is gone from the lookup cache" contains "$out" "File not found"
+out=$(run_client bob "INFO r4.txt")
+check "a file in a reused slot has its own owner" contains "$out" "Owner: bob"
+out=$(run_client alice "VIEW -a")
+check "listing skips the deleted file" lacks "$out" "r2\.txt"
+check "listing has the file in the reused slot" contains "$out" "r4\.txt"
+kill_nm
+start_nm
+out=$(run_client bob "INFO r4.txt" "INFO r2.txt")
+check "reused slot survives a restart" contains "$out" "Owner: bob"
+check "delete survives a restart" contains "$out" "File not found"
+
+# ---- 7. Mapped snapshot plus journal ----
+kill_nm
+# A small journal limit makes the creates checkpoint part way through
+start_nm NM_JOURNAL_MAX_KB=32
+for i in $(seq 1 300); do echo "CREATE m$i.txt"; done > batch_create.txt
+for i in $(seq 1 300 | awk 'NR % 3 == 0'); do echo "DELETE m$i.txt"; done > batch_delete.txt
+run_client alice "BATCH batch_create.txt" > /dev/null
+run_client alice "BATCH batch_delete.txt" "CREATE late1.txt" "CREATE late2.txt" > /dev/null
+check "a checkpoint was written" test -s nm_data.dat
+check "records after the checkpoint are in the journal" test -s nm_journal.log
+before=$(run_client alice "VIEW -a" | grep -- "-->" | sort)
+kill_nm
+: > NM.log
+start_nm NM_JOURNAL_MAX_KB=32
+after=$(run_client alice "VIEW -a" | grep -- "-->" | sort)
+check "listing is the same after restart" test "$before" == "$after"
+check "listing has the 200 batch files left after the deletes" test "$(printf '%s\n' "$after" | grep -c "m[0-9]*\.txt")" -eq 200
+check "the snapshot was mapped" grep -qE "Indexed [0-9]+ mapped file records" NM.log
+check "the journal was replayed over it" grep -qE "Replayed [0-9]+ journal records" NM.log
+out=$(run_client alice "INFO late2.txt")
+check "a file known only from the journal has its metadata" contains "$out" "Owner: alice"
+
+finish
@@ -0,0 +1,117 @@
+#!/bin/bash
+
+# Scripted checks for the client/NM protocol additions:
+#   1. BATCH with per-item errors
+#   2. pipelined requests (PIPE), whose replies may arrive out of order
+#   3. EXEC limits, exit status and streamed output with flow-control acks
+#   4. VIEW globs, listings that span several pages, and purges of missing files
+#   5. SEARCH ranking and access filtering
+# Run from FP3/ after make. Exits non-zero if a check fails.
+
+source "$(dirname "$0")/test_lib.sh"
+
+echo "====== Testing BATCH, PIPE, EXEC, VIEW and SEARCH ======"
+setup_workdir
+
+start_nm NM_EXEC_WALL_SEC=2 NM_WORKERS=8
+start_ss 1
+start_ss 2
+
+# ---- 1. BATCH with per-item errors ----
+cat > batch1.txt << 'EOF'
+CREATE b1.txt
+CREATE b2.txt
+CREATE b1.txt
+DELETE missing.txt
+ADDACCESS -R b1.txt nobody
+BOGUS line
+DELETE b2.txt
+EOF
+out=$(run_client alice "BATCH batch1.txt")
+check "a duplicate create fails alone" contains "$out" "item 3: error [0-9]+: File already exists"
+check "a missing file fails alone" contains "$out" "item 4: error 1: File not found"
+check "an unknown user fails alone" contains "$out" "item 5: error [0-9]+: User not found"
+check "a malformed line fails alone" contains "$out" "item 6: error [0-9]+: Malformed batch item"
+check "the summary counts every item" contains "$out" "Batch done: 7 items, 4 failed"
+out=$(run_client alice "INFO b1.txt" "INFO b2.txt")
+check "items after a failure are applied" contains "$out" "File: b1.txt"
+check "a delete later in the batch is applied" contains "$out" "File not found"
+
+# ---- 2. Pipelined requests ----
+for i in $(seq 1 40); do echo "CREATE p$i.txt"; done > batch_pipe.txt
+run_client alice "BATCH batch_pipe.txt" > /dev/null
+for i in $(seq 1 40); do echo "INFO p$i.txt"; [ $((i % 10)) -eq 0 ] && echo "VIEW"; done > pipe1.txt
+echo "INFO missing.txt" >> pipe1.txt
+out=$(run_client alice "PIPE pipe1.txt")
+expected=$(for i in $(seq 1 40); do echo "p$i.txt"; done)
+got=$(printf '%s\n' "$out" | sed -n 's/^--> File: \(p[0-9]*\.txt\)$/\1/p')
+check "pipelined replies are printed in request order" test "$expected" == "$got"
+check "every pipelined request is answered" contains "$out" "Pipe done: 45 requests, 1 failed"
+
+# ---- 3. EXEC ----
+run_client alice "CREATE e_seq.txt" "WRITE e_seq.txt 0" "1 seq 1 100000" "ETIRW" \
+                 "CREATE e_big.txt" "WRITE e_big.txt 0" "1 seq 1 400000" "ETIRW" \
+                 "CREATE e_sleep.txt" "WRITE e_sleep.txt 0" "1 sleep 30" "ETIRW" \
+                 "CREATE e_false.txt" "WRITE e_false.txt 0" "1 false" "ETIRW" > /dev/null
+out=$(run_client alice "EXEC e_seq.txt")
+check "streamed output is complete past the ack window" test "$(printf '%s\n' "$out" | grep -cxE '[0-9]+')" -eq 100000
+check "streamed output keeps its order" test "$(printf '%s\n' "$out" | grep -xE '[0-9]+' | tail -1)" == "100000"
+out=$(run_client alice "EXEC e_big.txt")
+check "output past NM_EXEC_MAX_OUTPUT_KB stops the job" contains "$out" "EXEC stopped: output limit"
+start=$(date +%s)
+out=$(run_client alice "EXEC e_sleep.txt")
+check "a job past NM_EXEC_WALL_SEC is stopped" contains "$out" "EXEC stopped: wall-time limit"
+check "the wall-time limit is enforced promptly" test $(( $(date +%s) - start )) -lt 10
+out=$(run_client alice "EXEC e_false.txt")
+check "a non-zero exit status is reported" contains "$out" "exit status 1"
+
+# ---- 4. VIEW globs and paging ----
+run_client alice "CREATE docs/a.txt" "CREATE docs/b.md" "CREATE docs/sub/c.txt" "CREATE docsx.txt" > /dev/null
+out=$(run_client alice "VIEW -a docs/*.txt")
+check "a glob matches in its directory" contains "$out" "--> docs/a.txt"
+check "a glob does not match other extensions" lacks "$out" "docs/b.md"
+check "* does not cross /" lacks "$out" "docs/sub/c.txt"
+out=$(run_client alice "VIEW docs/")
+check "a prefix lists the whole subtree" contains "$out" "--> docs/sub/c.txt"
+check "a prefix stops at its own names" lacks "$out" "docsx.txt"
+for i in $(seq -w 1 400); do echo "CREATE paging/a_rather_long_file_name_for_paging_$i.txt"; done > batch_page.txt
+head -128 batch_page.txt > batch_page1.txt
+sed -n '129,256p' batch_page.txt > batch_page2.txt
+sed -n '257,384p' batch_page.txt > batch_page3.txt
+sed -n '385,400p' batch_page.txt > batch_page4.txt
+run_client alice "BATCH batch_page1.txt" "BATCH batch_page2.txt" "BATCH batch_page3.txt" "BATCH batch_page4.txt" > /dev/null
+out=$(run_client alice "VIEW paging/")
+listed=$(printf '%s\n' "$out" | grep -c -- "--> paging/")
+check "a listing over one message is paged to the end" test "$listed" -eq 400
+check "pages follow each other in name order" test "$(printf '%s\n' "$out" | grep -- "--> paging/")" == "$(printf '%s\n' "$out" | grep -- "--> paging/" | sort)"
+check "no name is repeated across pages" test "$(printf '%s\n' "$out" | grep -- "--> paging/" | sort -u | wc -l)" -eq 400
+
+# A file its servers no longer hold is purged by the listing that finds it gone, and the
+# purge is journaled
+run_client alice "CREATE v_gone.txt" > /dev/null
+kill_ss
+rm -f ss1/v_gone.txt* ss2/v_gone.txt*
+start_ss 1 SS_HEARTBEAT_SEC=1
+start_ss 2 SS_HEARTBEAT_SEC=1
+sleep 3   # heartbeats bring the rebuilt inventories
+records=$(grep -ao "v_gone\.txt" nm_journal.log | wc -l)
+out=$(run_client alice "VIEW -a")
+check "a listing drops a file its servers no longer hold" lacks "$out" "v_gone\.txt"
+check "the purge is journaled" test "$(grep -ao "v_gone\.txt" nm_journal.log | wc -l)" -gt "$records"
+kill_nm
+start_nm NM_EXEC_WALL_SEC=2 NM_WORKERS=8
+out=$(run_client alice "INFO v_gone.txt")
+check "the purge survives a restart" contains "$out" "File not found"
+
+# ---- 5. SEARCH ----
+run_client alice "CREATE s1.txt" "WRITE s1.txt 0" "1 apple banana cherry." "ETIRW" \
+                 "CREATE s2.txt" "WRITE s2.txt 0" "1 apple only here." "ETIRW" > /dev/null
+run_client bob "CREATE s3.txt" "WRITE s3.txt 0" "1 apple banana private." "ETIRW" > /dev/null
+out=$(run_client alice "SEARCH apple banana")
+check "files with more query words rank first" test "$(printf '%s\n' "$out" | grep -- "-->" | head -1 | cut -d' ' -f2)" == "s1.txt"
+check "files with fewer query words are listed too" contains "$out" "--> s2.txt"
+check "files the user cannot read are dropped" lacks "$out" "s3.txt"
+out=$(run_client bob "SEARCH private")
+check "the owner finds their own file" contains "$out" "--> s3.txt"
+
+finish
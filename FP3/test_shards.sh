@@ -0,0 +1,130 @@
+#!/bin/bash
+
+# Scripted checks for a namespace split across two Name Server shards:
+#   1. paths are owned by the shard their first component hashes to; the client routes
+#   2. listings fan out to every shard
+#   3. a MOVE across shards carries the file's record and survives restarts
+#   4. moves left open in nm_moves.log are finished or undone after a restart
+# Run from FP3/ after make. Exits non-zero if a check fails.
+
+source "$(dirname "$0")/test_lib.sh"
+
+SHARDS=127.0.0.1:8080,127.0.0.1:8081
+NM_PIDS=("" "")
+
+# start_shard <k>: Name Server shard k on port 808k, in nm<k>/ (its data and log files are per directory)
+start_shard() {
+    mkdir -p "nm$1"
+    (cd "nm$1" && exec env NM_PORT="808$1" NM_SHARDS=$SHARDS NM_SHARD_ID="$1" ../name_server) > "nm$1.out" 2>&1 &
+    NM_PIDS[$1]=$!
+    wait_for_port "808$1"
+}
+
+kill_shard() {
+    [ -n "${NM_PIDS[$1]}" ] && kill -9 "${NM_PIDS[$1]}" 2>/dev/null && wait "${NM_PIDS[$1]}" 2>/dev/null
+    NM_PIDS[$1]=""
+}
+
+# The shard of a path: FNV-1a of its first component, as shard_of() in common.c
+shard_of() {
+    local s="${1%%/*}" h=2166136261 c i
+    for ((i = 0; i < ${#s}; i++)); do
+        printf -v c '%d' "'${s:i:1}"
+        h=$(( ((h ^ c) * 16777619) & 0xFFFFFFFF ))
+    done
+    echo $((h % 2))
+}
+
+# first_on <shard> <prefix>: the first name <prefix><n> that shard owns
+first_on() {
+    local i
+    for i in $(seq 1 100); do [ "$(shard_of "$2$i")" -eq "$1" ] && { echo "$2$i"; return; }; done
+}
+
+echo "====== Testing Name Server shards ======"
+setup_workdir
+trap 'kill_shard 0; kill_shard 1; teardown' EXIT
+
+start_shard 0
+start_shard 1
+start_ss 1
+start_ss 2
+
+f0=$(first_on 0 f).txt; f1=$(first_on 1 f).txt
+d0=$(first_on 0 dir); d1=$(first_on 1 dir)
+
+# ---- 1. Routing ----
+run_client bob "VIEW" > /dev/null
+out=$(run_client alice "CREATE $f0" "CREATE $f1" "CREATE $d0/a.txt" "CREATE $d1/a.txt" \
+                       "WRITE $f1 0" "1 kept across shards." "ETIRW" "ADDACCESS -R $f1 bob")
+check "every create succeeds" test "$(printf '%s\n' "$out" | grep -c "File Created Successfully")" -eq 4
+check "shard 0 recorded only its own paths" grep -q "$f0" nm0/NM.log
+check "shard 0 did not record the other shard's paths" test "$(grep -c "$f1\|$d1/" nm0/NM.log)" -eq 0
+check "shard 1 did not record the other shard's paths" test "$(grep -c "$f0\|$d0/" nm1/NM.log)" -eq 0
+out=$(run_client bob "READ $f1")
+check "a user is known to every shard" contains "$out" "kept across shards\."
+out=$(NM_ADDRS=127.0.0.1:8081 run_client alice "INFO $f0")
+check "a client started on another shard routes by the map" contains "$out" "File: $f0"
+
+# ---- 2. Fan-out ----
+out=$(run_client alice "VIEW -a")
+check "a listing covers shard 0" contains "$out" "--> $f0"
+check "a listing covers shard 1" contains "$out" "--> $f1"
+out=$(run_client alice "VIEW $d1/")
+check "a directory listing goes to its shard" contains "$out" "--> $d1/a.txt"
+
+# ---- 3. Cross-shard MOVE ----
+out=$(run_client alice "MOVE $f1 $d0")
+check "a move to the other shard succeeds" contains "$out" "Move successful"
+out=$(run_client alice "INFO $d0/$f1" "INFO $f1")
+check "the record moved with the file" contains "$out" "bob \\(R\\)"
+check "the old name is gone" contains "$out" "File not found"
+out=$(run_client bob "READ $d0/$f1")
+check "the content is served under the new name" contains "$out" "kept across shards\."
+check "the intent logs are empty once the move is done" test ! -s nm0/nm_moves.log -a ! -s nm1/nm_moves.log
+g0=$(first_on 0 g).txt
+out=$(run_client alice "CREATE $g0" "CREATE $d1/$g0" "MOVE $g0 $d1" "INFO $g0")
+check "a move onto a name taken on the other shard is refused" contains "$out" "[Aa]lready exists"
+check "a refused move leaves the file in place" contains "$out" "File: $g0"
+kill_shard 0
+kill_shard 1
+start_shard 0
+start_shard 1
+out=$(run_client alice "INFO $d0/$f1" "INFO $f1")
+check "the move survives a restart of both shards" contains "$out" "Owner: alice"
+check "the old name stays gone after a restart" contains "$out" "File not found"
+
+# ---- 4. Recovery from the intent log ----
+# An undecided move (B only) is undone: the destination drops its reservation
+kill_shard 0
+kill_shard 1
+printf 'B 0-1-1 1 %s %s/%s\n' "$f0" "$d1" "$f0" > nm0/nm_moves.log
+printf 'P 0-1-1 %s/%s\n' "$d1" "$f0" > nm1/nm_moves.log
+start_shard 0
+start_shard 1
+for _ in $(seq 1 100); do grep -q "Move 0-1-1 of $f0 aborted" nm0/NM.log && break; sleep 0.1; done
+check "an undecided move is aborted after a restart" grep -q "Move 0-1-1 of $f0 aborted" nm0/NM.log
+out=$(run_client alice "INFO $f0" "CREATE $d1/$f0")
+check "the file keeps its old name" contains "$out" "File: $f0"
+check "the reserved name is free again" contains "$out" "File Created Successfully"
+check "both intent logs are empty again" test ! -s nm0/nm_moves.log -a ! -s nm1/nm_moves.log
+# A decided move (B, C and its record) is finished: the destination records the file, the source drops it
+h0=$(first_on 0 h).txt
+run_client alice "CREATE $h0" "WRITE $h0 0" "1 decided before the crash." "ETIRW" > /dev/null
+kill_shard 0
+kill_shard 1
+for ss in ss1 ss2; do
+    mkdir -p "$ss/$d1"
+    [ -e "$ss/$h0" ] && mv "$ss/$h0" "$ss/$d1/$h0" && { mv "$ss/$h0.meta" "$ss/$d1/$h0.meta" 2>/dev/null; true; }
+done
+printf 'B 0-1-2 1 %s %s/%s\nC 0-1-2\nowner alice\nss 127.0.0.1 9001\nreplica 127.0.0.1 9002\n.\n' "$h0" "$d1" "$h0" > nm0/nm_moves.log
+printf 'P 0-1-2 %s/%s\n' "$d1" "$h0" > nm1/nm_moves.log
+start_shard 0
+start_shard 1
+for _ in $(seq 1 100); do grep -q "Moved $h0 to" nm0/NM.log && break; sleep 0.1; done
+check "a decided move is finished after a restart" grep -q "Moved $h0 to $d1/$h0 on shard 1" nm0/NM.log
+out=$(run_client alice "INFO $h0" "READ $d1/$h0")
+check "the source dropped the old name" contains "$out" "File not found"
+check "the destination serves the new name" contains "$out" "decided before the crash\."
+
+finish